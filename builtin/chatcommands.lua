@@ -616,6 +616,33 @@ minetest.register_chatcommand("shutdown", {
 	end,
 })
 
+minetest.register_chatcommand("pregenerate", {
+	params = "<X1>,<Y1>,<Z1> <X2>,<Y2>,<Z2>",
+	description = "generate an area ahead of time",
+	privs = {server=true},
+	func = function(name, param)
+		local p1, p2 = {}, {}
+		p1.x, p1.y, p1.z, p2.x, p2.y, p2.z = string.match(param,
+			"^([%d.-]+)[, ] *([%d.-]+)[, ] *([%d.-]+) +([%d.-]+)[, ] *([%d.-]+)[, ] *([%d.-]+)$")
+		for _, p in ipairs({p1, p2}) do
+			p.x = tonumber(p.x)
+			p.y = tonumber(p.y)
+			p.z = tonumber(p.z)
+		end
+		if not (p1.x and p1.y and p1.z and p2.x and p2.y and p2.z) then
+			minetest.chat_send_player(name, "Invalid parameters (see /help pregenerate)")
+			return
+		end
+		if not minetest.pregenerate_area(p1, p2) then
+			minetest.chat_send_player(name, "An area is being generated already")
+			return
+		end
+		minetest.log("action", name .. " pregenerates " .. minetest.pos_to_string(p1)
+			.. " - " .. minetest.pos_to_string(p2))
+		minetest.chat_send_player(name, "Generating the area; see the server log for progress")
+	end,
+})
+
 minetest.register_chatcommand("ban", {
 	params = "<name>",
 	description = "ban IP of player",
@@ -15,6 +15,8 @@ minetest.register_item_raw = nil
 --
 
 minetest.registered_abms = {}
+-- Function -> name of the mod that registered it, for diagnostics
+minetest.callback_origins = {}
 minetest.registered_entities = {}
 minetest.registered_items = {}
 minetest.registered_nodes = {}
@@ -74,6 +76,9 @@ end
 function minetest.register_abm(spec)
 	-- Add to minetest.registered_abms
 	minetest.registered_abms[#minetest.registered_abms+1] = spec
+	if spec.action then
+		minetest.callback_origins[spec.action] = minetest.get_current_modname()
+	end
 end
 
 function minetest.register_entity(name, prototype)
@@ -291,13 +296,19 @@ minetest.register_item(":", {
 
 local function make_registration()
 	local t = {}
-	local registerfunc = function(func) table.insert(t, func) end
+	local registerfunc = function(func)
+		table.insert(t, func)
+		minetest.callback_origins[func] = minetest.get_current_modname()
+	end
 	return t, registerfunc
 end
 
 local function make_registration_reverse()
 	local t = {}
-	local registerfunc = function(func) table.insert(t, 1, func) end
+	local registerfunc = function(func)
+		table.insert(t, 1, func)
+		minetest.callback_origins[func] = minetest.get_current_modname()
+	end
 	return t, registerfunc
 end
 
@@ -176,10 +176,14 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("time_send_interval", "5");
 	settings->setDefault("time_speed", "72");
 	settings->setDefault("server_unload_unused_data_timeout", "29");
+	settings->setDefault("map_unload_time_budget", "0.02");
 	settings->setDefault("server_map_save_interval", "5.3");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("dedicated_server_step", "0.1");
 	settings->setDefault("ignore_world_load_errors", "false");
+	settings->setDefault("lua_callback_warn_time", "0");
+	settings->setDefault("lua_callback_abort_time", "0");
+	settings->setDefault("abm_time_budget", "0.2");
 	settings->setDefault("congestion_control_aim_rtt", "0.2");
 	settings->setDefault("congestion_control_max_rate", "400");
 	settings->setDefault("congestion_control_min_rate", "10");
@@ -188,7 +192,10 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("emergequeue_limit_total", "256");
 	settings->setDefault("emergequeue_limit_diskonly", "");
 	settings->setDefault("emergequeue_limit_generate", "");
+	settings->setDefault("emergequeue_limit_prefetch", "");
+	settings->setDefault("block_prefetch_time", "4.0");
 	settings->setDefault("num_emerge_threads", "1");
+	settings->setDefault("mapgen_noise_cache_size", "64");
 	
 	// physics stuff
 	settings->setDefault("movement_acceleration_default", "3");
@@ -207,6 +214,8 @@ void set_default_settings(Settings *settings)
 	//liquid stuff
 	settings->setDefault("liquid_finite", "false");
 	settings->setDefault("liquid_update", "1.0");
+	settings->setDefault("liquid_loop_max", "10000");
+	settings->setDefault("num_liquid_threads", "1");
 	settings->setDefault("liquid_relax", "2");
 	settings->setDefault("liquid_fast_flood", "1");
 	settings->setDefault("underground_springs", "1");
@@ -230,6 +239,7 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("mgv6_np_humidity",       "0.5, 0.5, (500, 500, 500), 72384, 4, 0.66");
 	settings->setDefault("mgv6_np_trees",          "0, 1, (125, 125, 125), 2, 4, 0.66");
 	settings->setDefault("mgv6_np_apple_trees",    "0, 1, (100, 100, 100), 342902, 3, 0.45");
+	settings->setDefault("mgv6_np_cave_3d",        "-2.95, 1, (48, 24, 48), 52534, 3, 0.5");
 
 	settings->setDefault("mgv7_np_terrain",  "10, 12, (350, 350, 350), 82341, 5, 0.6");
 	settings->setDefault("mgv7_np_bgroup",   "0.5, 0.3125, (350, 350, 350), 5923, 2, 0.6");
@@ -20,7 +20,6 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "server.h"
 #include <iostream>
-#include <queue>
 #include "clientserver.h"
 #include "map.h"
 #include "jmutexautolock.h"
@@ -41,6 +40,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapgen_v6.h"
 #include "mapgen_indev.h"
 #include "mapgen_singlenode.h"
+#include "script.h"
 
 
 /////////////////////////////// Emerge Manager ////////////////////////////////
@@ -53,6 +53,7 @@ EmergeManager::EmergeManager(IGameDef *gamedef, BiomeDefManager *bdef) {
 
 	this->biomedef = bdef ? bdef : new BiomeDefManager(gamedef);
 	this->params   = NULL;
+	this->ndef     = NULL;
 	
 	mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
 
@@ -76,6 +77,16 @@ EmergeManager::EmergeManager(IGameDef *gamedef, BiomeDefManager *bdef) {
 	qlimit_generate = g_settings->get("emergequeue_limit_generate").empty() ?
 		nthreads + 1 :
 		g_settings->getU16("emergequeue_limit_generate");
+	qlimit_prefetch = g_settings->get("emergequeue_limit_prefetch").empty() ?
+		nthreads * 2 + 1 :
+		g_settings->getU16("emergequeue_limit_prefetch");
+	
+	// A little farther than GetNextBlocks() asks for blocks
+	stale_dist_diskonly = g_settings->getS16("max_block_send_distance") + 2;
+	stale_dist_generate = g_settings->getS16("max_block_generate_distance") + 2;
+	
+	u16 noisecache_size = g_settings->getU16("mapgen_noise_cache_size");
+	noisecache = noisecache_size ? new NoiseColumnCache(noisecache_size) : NULL;
 	
 	for (int i = 0; i != nthreads; i++)
 		emergethread.push_back(new EmergeThread((Server *)gamedef, i));
@@ -90,20 +101,30 @@ EmergeManager::~EmergeManager() {
 		emergethread[i]->qevent.signal();
 		emergethread[i]->stop();
 		delete emergethread[i];
-		delete mapgen[i];
 	}
+	// Mapgens only exist after initMapgens()
+	for (unsigned int i = 0; i != mapgen.size(); i++)
+		delete mapgen[i];
 	
+	delete noisecache;
 	delete biomedef;
 	delete params;
+	delete ndef;
 }
 
 
-void EmergeManager::initMapgens(MapgenParams *mgparams) {
+void EmergeManager::initMapgens(MapgenParams *mgparams,
+		IWritableNodeDefManager *nodedef) {
 	Mapgen *mg;
 	
 	if (mapgen.size())
 		return;
 	
+	// The mods have registered their nodes by now
+	this->ndef = new NodeDefSnapshot(nodedef);
+	for (unsigned int i = 0; i != ores.size(); i++)
+		ores[i]->resolveNodeNames(ndef);
+	
 	this->params = mgparams;
 	for (unsigned int i = 0; i != emergethread.size(); i++) {
 		mg = createMapgen(params->mg_name, 0, params);
@@ -143,6 +164,20 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 		iter = blocks_enqueued.find(p);
 		if (iter != blocks_enqueued.end()) {
 			bedata = iter->second;
+			if (bedata->flags & BLOCK_EMERGE_PREFETCH) {
+				// Somebody needs the block now; count it as a normal request
+				peer_prefetch_count[bedata->peer_requested]--;
+				peer_queue_count[peer_id] = count + 1;
+				bedata->peer_requested = peer_id;
+				bedata->flags &= ~BLOCK_EMERGE_PREFETCH;
+			} else if (bedata->peer_requested != peer_id &&
+					getRequestDistance(p, peer_id) <
+					getRequestDistance(p, bedata->peer_requested)) {
+				// The request is ordered by the nearest peer that wants it
+				peer_queue_count[bedata->peer_requested]--;
+				peer_queue_count[peer_id] = count + 1;
+				bedata->peer_requested = peer_id;
+			}
 			bedata->flags |= flags;
 			return true;
 		}
@@ -154,19 +189,184 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 		
 		peer_queue_count[peer_id] = count + 1;
 		
-		// insert into the EmergeThread queue with the least items
-		int lowestitems = emergethread[0]->blockqueue.size();
-		for (unsigned int i = 1; i != emergethread.size(); i++) {
-			int nitems = emergethread[i]->blockqueue.size();
-			if (nitems < lowestitems) {
-				idx = i;
-				lowestitems = nitems;
+		idx = pushToEmergeThread(p);
+	}
+	emergethread[idx]->qevent.signal();
+	
+	return true;
+}
+
+
+/*
+	Queues a block to be loaded from disk, if it exists there, before
+	anybody asks for it. These have their own per-peer limit so that
+	they don't use up the room of the blocks that are actually needed.
+*/
+bool EmergeManager::enqueueBlockPrefetch(u16 peer_id, v3s16 p) {
+	BlockEmergeData *bedata;
+	u16 count;
+	int idx;
+
+	{
+		JMutexAutoLock queuelock(queuemutex);
+
+		if (blocks_enqueued.size() >= qlimit_total)
+			return false;
+
+		count = peer_prefetch_count[peer_id];
+		if (count >= qlimit_prefetch)
+			return false;
+
+		// Already coming, one way or another
+		if (blocks_enqueued.find(p) != blocks_enqueued.end())
+			return true;
+
+		bedata = new BlockEmergeData;
+		bedata->flags = BLOCK_EMERGE_PREFETCH;
+		bedata->peer_requested = peer_id;
+		blocks_enqueued.insert(std::make_pair(p, bedata));
+
+		peer_prefetch_count[peer_id] = count + 1;
+
+		idx = pushToEmergeThread(p);
+	}
+	emergethread[idx]->qevent.signal();
+
+	return true;
+}
+
+
+// Call with queuemutex locked
+int EmergeManager::pushToEmergeThread(v3s16 p) {
+	// insert into the EmergeThread queue with the least items
+	int idx = 0;
+	int lowestitems = emergethread[0]->blockqueue.size();
+	for (unsigned int i = 1; i != emergethread.size(); i++) {
+		int nitems = emergethread[i]->blockqueue.size();
+		if (nitems < lowestitems) {
+			idx = i;
+			lowestitems = nitems;
+		}
+	}
+	
+	emergethread[idx]->blockqueue.push_back(p);
+	return idx;
+}
+
+
+void EmergeManager::setPeerPosition(u16 peer_id, v3s16 blockpos) {
+	JMutexAutoLock queuelock(queuemutex);
+	peer_positions[peer_id] = blockpos;
+}
+
+
+// Forgets a peer that has left, and drops what it has asked for
+void EmergeManager::removePeer(u16 peer_id) {
+	JMutexAutoLock queuelock(queuemutex);
+	
+	peer_positions.erase(peer_id);
+	
+	for (unsigned int i = 0; i != emergethread.size(); i++) {
+		std::list<v3s16> &queue = emergethread[i]->blockqueue;
+		for (std::list<v3s16>::iterator it = queue.begin(); it != queue.end();) {
+			std::map<v3s16, BlockEmergeData *>::iterator
+				iter = blocks_enqueued.find(*it);
+			if (iter != blocks_enqueued.end() &&
+					iter->second->peer_requested == peer_id) {
+				dropRequest(iter);
+				it = queue.erase(it);
+			} else {
+				++it;
 			}
 		}
+	}
+	
+	peer_queue_count.erase(peer_id);
+	peer_prefetch_count.erase(peer_id);
+}
+
+
+// Call with queuemutex locked.
+// Distance in blocks from the peer, or 0 if its position is not known.
+s32 EmergeManager::getRequestDistance(v3s16 p, u16 peer_id) {
+	std::map<u16, v3s16>::const_iterator iter = peer_positions.find(peer_id);
+	if (iter == peer_positions.end())
+		return 0;
+	
+	v3s16 d = p - iter->second;
+	return MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z));
+}
+
+
+// Call with queuemutex locked. Doesn't touch the thread queues.
+void EmergeManager::dropRequest(std::map<v3s16, BlockEmergeData *>::iterator iter) {
+	BlockEmergeData *bedata = iter->second;
+	
+	if (bedata->flags & BLOCK_EMERGE_PREFETCH)
+		peer_prefetch_count[bedata->peer_requested]--;
+	else
+		peer_queue_count[bedata->peer_requested]--;
+	
+	delete bedata;
+	blocks_enqueued.erase(iter);
+}
+
+
+/*
+	Call with queuemutex locked.
+	Takes the request nearest to its peer out of a thread queue. Prefetches
+	come after the other requests of players, and requests that don't come
+	from a player (like those of the map pregenerator) after everything
+	else, in the order they were made. Requests of peers that have moved
+	far away are dropped; if the peer comes back, it asks for the block
+	again.
+*/
+bool EmergeManager::popBlockEmerge(std::list<v3s16> &queue, v3s16 *pos, u8 *flags) {
+	std::list<v3s16>::iterator best = queue.end();
+	s32 best_priority = 0;
+	
+	for (std::list<v3s16>::iterator it = queue.begin(); it != queue.end();) {
+		std::map<v3s16, BlockEmergeData *>::iterator
+			iter = blocks_enqueued.find(*it);
+		if (iter == blocks_enqueued.end()) {
+			//uh oh, queue and map out of sync!!
+			it = queue.erase(it);
+			continue;
+		}
 		
-		emergethread[idx]->blockqueue.push(p);
+		BlockEmergeData *bedata = iter->second;
+		s32 d = getRequestDistance(*it, bedata->peer_requested);
+		s32 d_stale = (bedata->flags & BLOCK_EMERGE_ALLOWGEN) ?
+			stale_dist_generate : stale_dist_diskonly;
+		if (d > d_stale) {
+			g_profiler->add("EmergeManager: stale requests dropped", 1);
+			dropRequest(iter);
+			it = queue.erase(it);
+			continue;
+		}
+		
+		s32 priority = d;
+		if (bedata->peer_requested == PEER_ID_INEXISTENT)
+			priority = 2 * MAP_GENERATION_LIMIT;
+		else if (bedata->flags & BLOCK_EMERGE_PREFETCH)
+			priority += MAP_GENERATION_LIMIT;
+		if (best == queue.end() || priority < best_priority) {
+			best = it;
+			best_priority = priority;
+		}
+		++it;
 	}
-	emergethread[idx]->qevent.signal();
+	
+	if (best == queue.end())
+		return false;
+	
+	v3s16 p = *best;
+	queue.erase(best);
+	
+	std::map<v3s16, BlockEmergeData *>::iterator iter = blocks_enqueued.find(p);
+	*pos = p;
+	*flags = iter->second->flags;
+	dropRequest(iter);
 	
 	return true;
 }
@@ -272,28 +472,24 @@ void EmergeManager::registerMapgen(std::string mgname, MapgenFactory *mgfactory)
 ////////////////////////////// Emerge Thread ////////////////////////////////// 
 
 bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags) {
-	std::map<v3s16, BlockEmergeData *>::iterator iter;
 	JMutexAutoLock queuelock(emerge->queuemutex);
 
-	if (blockqueue.empty())
-		return false;
-	v3s16 p = blockqueue.front();
-	blockqueue.pop();
-	
-	*pos = p;
-	
-	iter = emerge->blocks_enqueued.find(p);
-	if (iter == emerge->blocks_enqueued.end()) 
-		return false; //uh oh, queue and map out of sync!!
+	if (emerge->popBlockEmerge(blockqueue, pos, flags))
+		return true;
 
-	BlockEmergeData *bedata = iter->second;
-	*flags = bedata->flags;
-	
-	emerge->peer_queue_count[bedata->peer_requested]--;
+	// Nothing to do here; help the thread with the longest queue
+	EmergeThread *busiest = NULL;
+	for (unsigned int i = 0; i != emerge->emergethread.size(); i++) {
+		EmergeThread *thread = emerge->emergethread[i];
+		if (!busiest || thread->blockqueue.size() > busiest->blockqueue.size())
+			busiest = thread;
+	}
+	if (busiest == this || busiest->blockqueue.empty())
+		return false;
 
-	delete bedata;
-	emerge->blocks_enqueued.erase(iter);
-	
+	if (!emerge->popBlockEmerge(busiest->blockqueue, pos, flags))
+		return false;
+	g_profiler->add("EmergeThread: requests stolen", 1);
 	return true;
 }
 
@@ -328,6 +524,23 @@ bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
 }
 
 
+/*
+	Lights a chunk again after the mapgen scripts have changed it.
+	The light coming in from the neighbouring chunks is kept.
+*/
+static void relightChunk(Mapgen *mapgen, v3s16 nmin, v3s16 nmax) {
+	ManualMapVoxelManipulator *vm = mapgen->vm;
+	for (s16 z = nmin.Z; z <= nmax.Z; z++) {
+		for (s16 y = nmin.Y; y <= nmax.Y; y++) {
+			u32 i = vm->m_area.index(nmin.X, y, z);
+			for (s16 x = nmin.X; x <= nmax.X; x++, i++)
+				vm->m_data[i].param1 = 0;
+		}
+	}
+	mapgen->calcLighting(nmin, nmax);
+}
+
+
 void *EmergeThread::Thread() {
 	ThreadStarted();
 	log_register_thread("EmergeThread" + id);
@@ -342,6 +555,17 @@ void *EmergeThread::Thread() {
 	emerge = m_server->m_emerge;
 	mapgen = emerge->mapgen[id];
 	enable_mapgen_debug_info = emerge->mapgen_debug_info;
+
+	if (!emerge->mapgen_scripts.empty()) {
+		m_lua = scriptapi_mapgen_init(emerge->ndef,
+				emerge->params->seed, emerge->mapgen_scripts);
+		if (!m_lua) {
+			m_server->setAsyncFatalError("Failed to load mapgen scripts. "
+					"See debug.txt.");
+			log_deregister_thread();
+			return NULL;
+		}
+	}
 	
 	while (getRun())
 	try {
@@ -376,6 +600,18 @@ void *EmergeThread::Thread() {
 					t.stop(true); // Hide output
 			}
 
+			v3s16 minp = data.blockpos_min * MAP_BLOCKSIZE;
+			v3s16 maxp = data.blockpos_max * MAP_BLOCKSIZE +
+						 v3s16(1,1,1) * (MAP_BLOCKSIZE - 1);
+
+			// Mapgen scripts work on the vmanip, without the envlock
+			if (m_lua) {
+				ScopeProfiler sp(g_profiler, "EmergeThread: mapgen scripts", SPT_AVG);
+				if (scriptapi_mapgen_on_generated(m_lua, data.vmanip,
+						minp, maxp, emerge->getBlockSeed(minp)))
+					relightChunk(mapgen, minp, maxp);
+			}
+
 			{
 				//envlock: usually 0ms, but can take either 30 or 400ms to acquire
 				JMutexAutoLock envlock(m_server->m_env_mutex); 
@@ -389,10 +625,6 @@ void *EmergeThread::Thread() {
 					/*
 						Do some post-generate stuff
 					*/
-					v3s16 minp = data.blockpos_min * MAP_BLOCKSIZE;
-					v3s16 maxp = data.blockpos_max * MAP_BLOCKSIZE +
-								 v3s16(1,1,1) * (MAP_BLOCKSIZE - 1);
-
 					// Ignore map edit events, they will not need to be sent
 					// to anybody because the block hasn't been sent to anybody
 					MapEditEventAreaIgnorer 
@@ -410,6 +642,13 @@ void *EmergeThread::Thread() {
 			}
 		}
 
+		/*
+			A prefetched block was only loaded from disk; nothing in it
+			changed, and GetNextBlocks() will find it in memory
+		*/
+		if (flags & BLOCK_EMERGE_PREFETCH)
+			continue;
+
 		/*
 			Set sent status of modified blocks on clients
 		*/
@@ -450,8 +689,15 @@ void *EmergeThread::Thread() {
 		err << "You can ignore this using [ignore_world_load_errors = true]."<<std::endl;
 		m_server->setAsyncFatalError(err.str());
 	}
+	catch (LuaError &e) {
+		m_server->setAsyncFatalError(e.what());
+	}
 	
 	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+	if (m_lua) {
+		script_deinit(m_lua);
+		m_lua = NULL;
+	}
 	log_deregister_thread();
 	return NULL;
 }
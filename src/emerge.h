@@ -2,10 +2,13 @@
 #define EMERGE_HEADER
 
 #include <map>
-#include <queue>
+#include <list>
 #include "util/thread.h"
+#include "scriptapi_mapgen.h"
 
 #define BLOCK_EMERGE_ALLOWGEN (1<<0)
+// Queued ahead of a moving player; counted against qlimit_prefetch
+#define BLOCK_EMERGE_PREFETCH (1<<1)
 
 #define EMERGE_DBG_OUT(x) \
 	{ if (enable_mapgen_debug_info) \
@@ -18,6 +21,9 @@ class Biome;
 class BiomeDefManager;
 class EmergeThread;
 class ManualMapVoxelManipulator;
+class NoiseColumnCache;
+class NodeDefSnapshot;
+class IWritableNodeDefManager;
 
 #include "server.h"
 
@@ -28,7 +34,10 @@ struct BlockMakeData {
 	v3s16 blockpos_max;
 	v3s16 blockpos_requested;
 	UniqueQueue<v3s16> transforming_liquid;
-	INodeDefManager *nodedef;
+	NodeDefSnapshot *nodedef;
+	// Lowest ground level of every block column of the chunk, ordered
+	// by block Z, then X; set by the mapgens that know it
+	std::vector<s16> ground_levels;
 
 	BlockMakeData():
 		vmanip(NULL),
@@ -57,24 +66,41 @@ class EmergeManager {
 	u16 qlimit_total;
 	u16 qlimit_diskonly;
 	u16 qlimit_generate;
+	u16 qlimit_prefetch;
+	// Requests farther than these (in blocks) from their peer are dropped
+	s16 stale_dist_diskonly;
+	s16 stale_dist_generate;
 	
 	//block emerge queue data structures
 	JMutex queuemutex;
 	std::map<v3s16, BlockEmergeData *> blocks_enqueued;
 	std::map<u16, u16> peer_queue_count;
+	std::map<u16, u16> peer_prefetch_count;
+	// Positions of the players in blocks, for ordering the queues
+	std::map<u16, v3s16> peer_positions;
 
 	//Mapgen-related structures
+	// Node definitions of the mapgens; NULL until initMapgens()
+	NodeDefSnapshot *ndef;
 	BiomeDefManager *biomedef;
 	std::vector<Ore *> ores;
+	// 2D noise of chunk columns; NULL if disabled
+	NoiseColumnCache *noisecache;
+	// Run in a Lua state of every emerge thread
+	std::vector<MapgenScript> mapgen_scripts;
 
 	EmergeManager(IGameDef *gamedef, BiomeDefManager *bdef);
 	~EmergeManager();
 
-	void initMapgens(MapgenParams *mgparams);
+	void initMapgens(MapgenParams *mgparams, IWritableNodeDefManager *nodedef);
 	Mapgen *createMapgen(std::string mgname, int mgid,
 						MapgenParams *mgparams);
 	MapgenParams *createMapgenParams(std::string mgname);
 	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate);
+	bool enqueueBlockPrefetch(u16 peer_id, v3s16 p);
+	void setPeerPosition(u16 peer_id, v3s16 blockpos);
+	void removePeer(u16 peer_id);
+	bool popBlockEmerge(std::list<v3s16> &queue, v3s16 *pos, u8 *flags);
 	
 	void registerMapgen(std::string name, MapgenFactory *mgfactory);
 	MapgenParams *getParamsFromSettings(Settings *settings);
@@ -85,6 +111,11 @@ class EmergeManager {
 	int getGroundLevelAtPoint(v2s16 p);
 	bool isBlockUnderground(v3s16 blockpos);
 	u32 getBlockSeed(v3s16 p);
+
+private:
+	int pushToEmergeThread(v3s16 p);
+	s32 getRequestDistance(v3s16 p, u16 peer_id);
+	void dropRequest(std::map<v3s16, BlockEmergeData *>::iterator iter);
 };
 
 class EmergeThread : public SimpleThread
@@ -95,10 +126,11 @@ class EmergeThread : public SimpleThread
 	Mapgen *mapgen;
 	bool enable_mapgen_debug_info;
 	int id;
+	lua_State *m_lua;
 	
 public:
 	Event qevent;
-	std::queue<v3s16> blockqueue;
+	std::list<v3s16> blockqueue;
 	
 	EmergeThread(Server *server, int ethreadid):
 		SimpleThread(),
@@ -106,7 +138,8 @@ class EmergeThread : public SimpleThread
 		map(NULL),
 		emerge(NULL),
 		mapgen(NULL),
-		id(ethreadid)
+		id(ethreadid),
+		m_lua(NULL)
 	{
 	}
 
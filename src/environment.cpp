@@ -37,6 +37,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodemetadata.h"
 #include "main.h" // For g_settings, g_profiler
 #include "gamedef.h"
+#include "treegen.h"
 #ifndef SERVER
 #include "clientmap.h"
 #include "localplayer.h"
@@ -247,6 +248,170 @@ ABMWithState::ABMWithState(ActiveBlockModifier *abm_):
 	timer = myrand_range(minval, maxval);
 }
 
+/*
+	ABMHandler
+*/
+
+struct ActiveABM
+{
+	ActiveBlockModifier *abm;
+	int chance;
+	std::set<content_t> required_neighbors;
+};
+
+class ABMHandler
+{
+private:
+	ServerEnvironment *m_env;
+	std::map<content_t, std::list<ActiveABM> > m_aabms;
+public:
+	ABMHandler(std::list<ABMWithState> &abms,
+			float dtime_s, ServerEnvironment *env,
+			bool use_timers):
+		m_env(env)
+	{
+		if(dtime_s < 0.001)
+			return;
+		INodeDefManager *ndef = env->getGameDef()->ndef();
+		for(std::list<ABMWithState>::iterator
+				i = abms.begin(); i != abms.end(); ++i){
+			ActiveBlockModifier *abm = i->abm;
+			float trigger_interval = abm->getTriggerInterval();
+			if(trigger_interval < 0.001)
+				trigger_interval = 0.001;
+			float actual_interval = dtime_s;
+			if(use_timers){
+				i->timer += dtime_s;
+				if(i->timer < trigger_interval)
+					continue;
+				i->timer -= trigger_interval;
+				actual_interval = trigger_interval;
+			}
+			float intervals = actual_interval / trigger_interval;
+			if(intervals == 0)
+				continue;
+			float chance = abm->getTriggerChance();
+			if(chance == 0)
+				chance = 1;
+			ActiveABM aabm;
+			aabm.abm = abm;
+			aabm.chance = chance / intervals;
+			if(aabm.chance == 0)
+				aabm.chance = 1;
+			// Trigger neighbors
+			std::set<std::string> required_neighbors_s
+					= abm->getRequiredNeighbors();
+			for(std::set<std::string>::iterator
+					i = required_neighbors_s.begin();
+					i != required_neighbors_s.end(); i++)
+			{
+				ndef->getIds(*i, aabm.required_neighbors);
+			}
+			// Trigger contents
+			std::set<std::string> contents_s = abm->getTriggerContents();
+			for(std::set<std::string>::iterator
+					i = contents_s.begin(); i != contents_s.end(); i++)
+			{
+				std::set<content_t> ids;
+				ndef->getIds(*i, ids);
+				for(std::set<content_t>::const_iterator k = ids.begin();
+						k != ids.end(); k++)
+				{
+					content_t c = *k;
+					std::map<content_t, std::list<ActiveABM> >::iterator j;
+					j = m_aabms.find(c);
+					if(j == m_aabms.end()){
+						std::list<ActiveABM> aabmlist;
+						m_aabms[c] = aabmlist;
+						j = m_aabms.find(c);
+					}
+					j->second.push_back(aabm);
+				}
+			}
+		}
+	}
+	void apply(MapBlock *block)
+	{
+		if(m_aabms.empty())
+			return;
+
+		ServerMap *map = &m_env->getServerMap();
+
+		v3s16 p0;
+		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+		{
+			MapNode n = block->getNodeNoEx(p0);
+			content_t c = n.getContent();
+			v3s16 p = p0 + block->getPosRelative();
+
+			std::map<content_t, std::list<ActiveABM> >::iterator j;
+			j = m_aabms.find(c);
+			if(j == m_aabms.end())
+				continue;
+
+			for(std::list<ActiveABM>::iterator
+					i = j->second.begin(); i != j->second.end(); i++)
+			{
+				if(myrand() % i->chance != 0)
+					continue;
+
+				// Check neighbors
+				if(!i->required_neighbors.empty())
+				{
+					v3s16 p1;
+					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
+					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
+					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
+					{
+						if(p1 == p)
+							continue;
+						MapNode n = map->getNodeNoEx(p1);
+						content_t c = n.getContent();
+						std::set<content_t>::const_iterator k;
+						k = i->required_neighbors.find(c);
+						if(k != i->required_neighbors.end()){
+							goto neighbor_found;
+						}
+					}
+					// No required neighbor found
+					continue;
+				}
+neighbor_found:
+
+				// Find out how many objects the block contains
+				u32 active_object_count = block->m_static_objects.m_active.size();
+				// Find out how many objects this and all the neighbors contain
+				u32 active_object_count_wider = 0;
+				u32 wider_unknown_count = 0;
+				for(s16 x=-1; x<=1; x++)
+				for(s16 y=-1; y<=1; y++)
+				for(s16 z=-1; z<=1; z++)
+				{
+					MapBlock *block2 = map->getBlockNoCreateNoEx(
+							block->getPos() + v3s16(x,y,z));
+					if(block2==NULL){
+						wider_unknown_count = 0;
+						continue;
+					}
+					active_object_count_wider +=
+							block2->m_static_objects.m_active.size()
+							+ block2->m_static_objects.m_stored.size();
+				}
+				// Extrapolate
+				u32 wider_known_count = 3*3*3 - wider_unknown_count;
+				active_object_count_wider += wider_unknown_count * active_object_count_wider / wider_known_count;
+				
+				// Call all the trigger variations
+				i->abm->trigger(m_env, p, n);
+				i->abm->trigger(m_env, p, n,
+						active_object_count, active_object_count_wider);
+			}
+		}
+	}
+};
+
 /*
 	ActiveBlockList
 */
@@ -329,6 +494,8 @@ ServerEnvironment::ServerEnvironment(ServerMap *map, lua_State *L,
 	m_random_spawn_timer(3),
 	m_send_recommended_timer(0),
 	m_active_block_interval_overload_skip(0),
+	m_abm_handler(NULL),
+	m_tree_spawner(NULL),
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
 	m_recommended_send_interval(0.1)
@@ -337,6 +504,9 @@ ServerEnvironment::ServerEnvironment(ServerMap *map, lua_State *L,
 
 ServerEnvironment::~ServerEnvironment()
 {
+	// The trees can't be placed anymore
+	delete m_tree_spawner;
+
 	// Clear active block list.
 	// This makes the next one delete all active objects.
 	m_active_blocks.clear();
@@ -347,6 +517,8 @@ ServerEnvironment::~ServerEnvironment()
 	// Drop/delete map
 	m_map->drop();
 
+	delete m_abm_handler;
+
 	// Delete ActiveBlockModifiers
 	for(std::list<ABMWithState>::iterator
 			i = m_abms.begin(); i != m_abms.end(); ++i){
@@ -612,166 +784,6 @@ void ServerEnvironment::loadMeta(const std::string &savedir)
 	}
 }
 
-struct ActiveABM
-{
-	ActiveBlockModifier *abm;
-	int chance;
-	std::set<content_t> required_neighbors;
-};
-
-class ABMHandler
-{
-private:
-	ServerEnvironment *m_env;
-	std::map<content_t, std::list<ActiveABM> > m_aabms;
-public:
-	ABMHandler(std::list<ABMWithState> &abms,
-			float dtime_s, ServerEnvironment *env,
-			bool use_timers):
-		m_env(env)
-	{
-		if(dtime_s < 0.001)
-			return;
-		INodeDefManager *ndef = env->getGameDef()->ndef();
-		for(std::list<ABMWithState>::iterator
-				i = abms.begin(); i != abms.end(); ++i){
-			ActiveBlockModifier *abm = i->abm;
-			float trigger_interval = abm->getTriggerInterval();
-			if(trigger_interval < 0.001)
-				trigger_interval = 0.001;
-			float actual_interval = dtime_s;
-			if(use_timers){
-				i->timer += dtime_s;
-				if(i->timer < trigger_interval)
-					continue;
-				i->timer -= trigger_interval;
-				actual_interval = trigger_interval;
-			}
-			float intervals = actual_interval / trigger_interval;
-			if(intervals == 0)
-				continue;
-			float chance = abm->getTriggerChance();
-			if(chance == 0)
-				chance = 1;
-			ActiveABM aabm;
-			aabm.abm = abm;
-			aabm.chance = chance / intervals;
-			if(aabm.chance == 0)
-				aabm.chance = 1;
-			// Trigger neighbors
-			std::set<std::string> required_neighbors_s
-					= abm->getRequiredNeighbors();
-			for(std::set<std::string>::iterator
-					i = required_neighbors_s.begin();
-					i != required_neighbors_s.end(); i++)
-			{
-				ndef->getIds(*i, aabm.required_neighbors);
-			}
-			// Trigger contents
-			std::set<std::string> contents_s = abm->getTriggerContents();
-			for(std::set<std::string>::iterator
-					i = contents_s.begin(); i != contents_s.end(); i++)
-			{
-				std::set<content_t> ids;
-				ndef->getIds(*i, ids);
-				for(std::set<content_t>::const_iterator k = ids.begin();
-						k != ids.end(); k++)
-				{
-					content_t c = *k;
-					std::map<content_t, std::list<ActiveABM> >::iterator j;
-					j = m_aabms.find(c);
-					if(j == m_aabms.end()){
-						std::list<ActiveABM> aabmlist;
-						m_aabms[c] = aabmlist;
-						j = m_aabms.find(c);
-					}
-					j->second.push_back(aabm);
-				}
-			}
-		}
-	}
-	void apply(MapBlock *block)
-	{
-		if(m_aabms.empty())
-			return;
-
-		ServerMap *map = &m_env->getServerMap();
-
-		v3s16 p0;
-		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
-		{
-			MapNode n = block->getNodeNoEx(p0);
-			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
-
-			std::map<content_t, std::list<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
-				continue;
-
-			for(std::list<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++)
-			{
-				if(myrand() % i->chance != 0)
-					continue;
-
-				// Check neighbors
-				if(!i->required_neighbors.empty())
-				{
-					v3s16 p1;
-					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
-					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
-					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
-					{
-						if(p1 == p)
-							continue;
-						MapNode n = map->getNodeNoEx(p1);
-						content_t c = n.getContent();
-						std::set<content_t>::const_iterator k;
-						k = i->required_neighbors.find(c);
-						if(k != i->required_neighbors.end()){
-							goto neighbor_found;
-						}
-					}
-					// No required neighbor found
-					continue;
-				}
-neighbor_found:
-
-				// Find out how many objects the block contains
-				u32 active_object_count = block->m_static_objects.m_active.size();
-				// Find out how many objects this and all the neighbors contain
-				u32 active_object_count_wider = 0;
-				u32 wider_unknown_count = 0;
-				for(s16 x=-1; x<=1; x++)
-				for(s16 y=-1; y<=1; y++)
-				for(s16 z=-1; z<=1; z++)
-				{
-					MapBlock *block2 = map->getBlockNoCreateNoEx(
-							block->getPos() + v3s16(x,y,z));
-					if(block2==NULL){
-						wider_unknown_count = 0;
-						continue;
-					}
-					active_object_count_wider +=
-							block2->m_static_objects.m_active.size()
-							+ block2->m_static_objects.m_stored.size();
-				}
-				// Extrapolate
-				u32 wider_known_count = 3*3*3 - wider_unknown_count;
-				active_object_count_wider += wider_unknown_count * active_object_count_wider / wider_known_count;
-				
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider);
-			}
-		}
-	}
-};
-
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 {
 	// Get time difference
@@ -874,6 +886,200 @@ std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 	return objects;
 }
 
+/*
+	Finds where the ray start + t*dir, 0 <= t <= 1, enters box.
+	A ray starting inside the box doesn't count as hitting it.
+*/
+static bool ray_box_intersection(v3f start, v3f dir, const aabb3f &box,
+		f32 &t, v3s16 &normal)
+{
+	f32 s[3] = {start.X, start.Y, start.Z};
+	f32 d[3] = {dir.X, dir.Y, dir.Z};
+	f32 lo[3] = {box.MinEdge.X, box.MinEdge.Y, box.MinEdge.Z};
+	f32 hi[3] = {box.MaxEdge.X, box.MaxEdge.Y, box.MaxEdge.Z};
+	f32 tmin = 0;
+	f32 tmax = 1;
+	int axis = -1;
+	s16 side = 0;
+	for(int i = 0; i < 3; i++){
+		if(fabs(d[i]) < 0.000001){
+			if(s[i] < lo[i] || s[i] > hi[i])
+				return false;
+			continue;
+		}
+		f32 t1 = (lo[i] - s[i]) / d[i];
+		f32 t2 = (hi[i] - s[i]) / d[i];
+		s16 n = -1;
+		if(t1 > t2){
+			f32 tmp = t1; t1 = t2; t2 = tmp;
+			n = 1;
+		}
+		if(t1 > tmin || (t1 == tmin && axis == -1)){
+			tmin = t1;
+			axis = i;
+			side = n;
+		}
+		if(t2 < tmax)
+			tmax = t2;
+		if(tmin > tmax)
+			return false;
+	}
+	// The start point is inside the box
+	if(axis == -1)
+		return false;
+	t = tmin;
+	normal = v3s16(0,0,0);
+	if(axis == 0) normal.X = side;
+	else if(axis == 1) normal.Y = side;
+	else normal.Z = side;
+	return true;
+}
+
+bool ServerEnvironment::raycast(v3f from, v3f to, bool objects,
+		RaycastHit &hit)
+{
+	INodeDefManager *ndef = m_gamedef->ndef();
+	// The search is done in node units
+	v3f start = from / BS;
+	v3f dir = (to - from) / BS;
+	// Anything further than this has been beaten by an earlier hit
+	f32 best_t = 2;
+
+	if(objects){
+		v3f middle = (from + to) / 2;
+		// Objects can be quite a bit larger than a node
+		f32 radius = from.getDistanceFrom(to) / 2 + 5 * BS;
+		std::set<u16> ids = getObjectsInsideRadius(middle, radius);
+		for(std::set<u16>::iterator
+				i = ids.begin(); i != ids.end(); i++)
+		{
+			ServerActiveObject *obj = getActiveObject(*i);
+			ObjectProperties *prop = obj->accessObjectProperties();
+			if(prop == NULL)
+				continue;
+			v3f pos = obj->getBasePosition() / BS;
+			aabb3f box(prop->collisionbox.MinEdge + pos,
+					prop->collisionbox.MaxEdge + pos);
+			if(box.isPointInside(start))
+				continue;
+			f32 t;
+			v3s16 normal;
+			if(ray_box_intersection(start, dir, box, t, normal) && t < best_t){
+				best_t = t;
+				hit.type = RAYCAST_HIT_OBJECT;
+				hit.object_id = *i;
+				hit.point = (start + dir * t) * BS;
+				hit.normal = normal;
+			}
+		}
+	}
+
+	/*
+		Walk through the nodes on the line (3D DDA). Node p covers
+		p-0.5 to p+0.5; t is the fraction of the line passed.
+	*/
+	v3s16 p = floatToInt(from, BS);
+	v3s16 last = floatToInt(to, BS);
+	s16 step[3];
+	f32 t_max[3];
+	f32 t_delta[3];
+	{
+		f32 s[3] = {start.X, start.Y, start.Z};
+		f32 d[3] = {dir.X, dir.Y, dir.Z};
+		s16 c[3] = {p.X, p.Y, p.Z};
+		for(int i = 0; i < 3; i++){
+			if(d[i] > 0){
+				step[i] = 1;
+				t_delta[i] = 1.0 / d[i];
+				t_max[i] = (c[i] + 0.5 - s[i]) / d[i];
+			} else if(d[i] < 0){
+				step[i] = -1;
+				t_delta[i] = -1.0 / d[i];
+				t_max[i] = (c[i] - 0.5 - s[i]) / d[i];
+			} else {
+				step[i] = 0;
+				t_delta[i] = 0;
+				t_max[i] = 2; // Never crossed
+			}
+		}
+	}
+
+	MapBlock *block = NULL;
+	v3s16 blockpos;
+	f32 t_enter = 0;
+	v3s16 entry_normal(0,0,0);
+	for(;;)
+	{
+		if(t_enter > best_t)
+			break;
+
+		v3s16 bp = getNodeBlockPos(p);
+		if(block == NULL || bp != blockpos){
+			blockpos = bp;
+			block = m_map->getBlockNoCreateNoEx(bp);
+		}
+		if(block == NULL || block->isDummy()){
+			hit.type = RAYCAST_HIT_NODE;
+			hit.node_pos = p;
+			hit.node = MapNode(CONTENT_IGNORE);
+			hit.point = (start + dir * t_enter) * BS;
+			hit.normal = entry_normal;
+			return true;
+		}
+		MapNode n = block->getNodeNoCheck(p - bp * MAP_BLOCKSIZE);
+		const ContentFeatures &f = ndef->get(n);
+		if(f.walkable){
+			bool found = false;
+			std::vector<aabb3f> boxes = n.getNodeBoxes(ndef);
+			for(std::vector<aabb3f>::iterator
+					i = boxes.begin(); i != boxes.end(); i++)
+			{
+				aabb3f box(i->MinEdge / BS + intToFloat(p, 1),
+						i->MaxEdge / BS + intToFloat(p, 1));
+				f32 t;
+				v3s16 normal;
+				if(ray_box_intersection(start, dir, box, t, normal)
+						&& t < best_t){
+					best_t = t;
+					hit.type = RAYCAST_HIT_NODE;
+					hit.node_pos = p;
+					hit.node = n;
+					hit.point = (start + dir * t) * BS;
+					hit.normal = normal;
+					found = true;
+				}
+			}
+			if(found)
+				return true;
+		}
+
+		if(p == last)
+			break;
+		// Step into the next node
+		int axis = 0;
+		if(t_max[1] < t_max[axis])
+			axis = 1;
+		if(t_max[2] < t_max[axis])
+			axis = 2;
+		if(t_max[axis] > 1)
+			break;
+		t_enter = t_max[axis];
+		t_max[axis] += t_delta[axis];
+		entry_normal = v3s16(0,0,0);
+		if(axis == 0){
+			p.X += step[0];
+			entry_normal.X = -step[0];
+		} else if(axis == 1){
+			p.Y += step[1];
+			entry_normal.Y = -step[1];
+		} else {
+			p.Z += step[2];
+			entry_normal.Z = -step[2];
+		}
+	}
+	return best_t <= 1;
+}
+
 void ServerEnvironment::clearAllObjects()
 {
 	infostream<<"ServerEnvironment::clearAllObjects(): "
@@ -971,6 +1177,18 @@ void ServerEnvironment::clearAllObjects()
 			<<" in "<<num_blocks_cleared<<" blocks"<<std::endl;
 }
 
+void ServerEnvironment::spawnTreeAsync(v3s16 p0,
+		const treegen::TreeDef &tree_definition)
+{
+	if(m_tree_spawner == NULL)
+	{
+		m_tree_spawner = new treegen::TreeSpawner();
+		m_tree_spawner->Start();
+	}
+	MapNode dirtnode(m_gamedef->ndef()->getId("mapgen_dirt"));
+	m_tree_spawner->queue(p0, tree_definition, dirtnode);
+}
+
 void ServerEnvironment::step(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -1147,29 +1365,50 @@ void ServerEnvironment::step(float dtime)
 		}
 	}
 	
+	/*
+		Handle ActiveBlockModifiers. If a run goes over the time budget,
+		the rest of the blocks are handled on the next steps and the next
+		run starts only after that.
+	*/
 	const float abm_interval = 1.0;
-	if(m_active_block_modifier_interval.step(dtime, abm_interval))
+	if(!m_abm_pending_blocks.empty() ||
+			m_active_block_modifier_interval.step(dtime, abm_interval))
 	do{ // breakable
-		if(m_active_block_interval_overload_skip > 0){
-			ScopeProfiler sp(g_profiler, "SEnv: ABM overload skips");
-			m_active_block_interval_overload_skip--;
-			break;
+		if(m_abm_pending_blocks.empty()){
+			if(m_active_block_interval_overload_skip > 0){
+				ScopeProfiler sp(g_profiler, "SEnv: ABM overload skips");
+				m_active_block_interval_overload_skip--;
+				break;
+			}
+			// Initialize handling of ActiveBlockModifiers
+			delete m_abm_handler;
+			m_abm_handler = new ABMHandler(m_abms, abm_interval, this, true);
+			m_abm_pending_blocks.insert(m_abm_pending_blocks.end(),
+					m_active_blocks.m_list.begin(),
+					m_active_blocks.m_list.end());
 		}
+
 		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
 		TimeTaker timer("modify in active blocks");
-		
-		// Initialize handling of ActiveBlockModifiers
-		ABMHandler abmhandler(m_abms, abm_interval, this, true);
+		u32 budget_ms = g_settings->getFloat("abm_time_budget") * 1000;
 
-		for(std::set<v3s16>::iterator
-				i = m_active_blocks.m_list.begin();
-				i != m_active_blocks.m_list.end(); ++i)
+		while(!m_abm_pending_blocks.empty())
 		{
-			v3s16 p = *i;
-			
+			if(budget_ms != 0 && timer.getTimerTime() >= budget_ms){
+				g_profiler->add("SEnv: ABM runs over budget", 1);
+				break;
+			}
+
+			v3s16 p = m_abm_pending_blocks.front();
+			m_abm_pending_blocks.pop_front();
+
 			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
 					<<") being handled"<<std::endl;*/
 
+			// The block may have been deactivated while the run was pending
+			if(!m_active_blocks.contains(p))
+				continue;
+
 			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
 			if(block==NULL)
 				continue;
@@ -1178,12 +1417,13 @@ void ServerEnvironment::step(float dtime)
 			block->setTimestampNoChangedFlag(m_game_time);
 
 			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
+			m_abm_handler->apply(block);
 		}
 
 		u32 time_ms = timer.stop(true);
+		// Without a budget, skip whole runs after an overlong one instead
 		u32 max_time_ms = 200;
-		if(time_ms > max_time_ms){
+		if(budget_ms == 0 && time_ms > max_time_ms){
 			infostream<<"WARNING: active block modifiers took "
 					<<time_ms<<"ms (longer than "
 					<<max_time_ms<<"ms)"<<std::endl;
@@ -1196,6 +1436,15 @@ void ServerEnvironment::step(float dtime)
 	*/
 	scriptapi_environment_step(m_lua, dtime);
 
+	/*
+		Place the trees grown by spawnTreeAsync()
+	*/
+	if(m_tree_spawner)
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: place async trees avg", SPT_AVG);
+		m_tree_spawner->placeReady(m_map);
+	}
+
 	/*
 		Step active objects
 	*/
@@ -50,6 +50,10 @@ class IGameDef;
 class Map;
 class ServerMap;
 class ClientMap;
+namespace treegen {
+	struct TreeDef;
+	class TreeSpawner;
+}
 
 class Environment
 {
@@ -142,6 +146,32 @@ class ActiveBlockModifier
 			u32 active_object_count, u32 active_object_count_wider){};
 };
 
+class ABMHandler;
+
+/*
+	Result of ServerEnvironment::raycast()
+*/
+
+enum RaycastHitType
+{
+	RAYCAST_HIT_NODE,
+	RAYCAST_HIT_OBJECT
+};
+
+struct RaycastHit
+{
+	RaycastHitType type;
+	// RAYCAST_HIT_NODE: the node that was hit (CONTENT_IGNORE if the ray
+	// ran into an area that is not loaded)
+	v3s16 node_pos;
+	MapNode node;
+	// RAYCAST_HIT_OBJECT
+	u16 object_id;
+	// Where the ray hit (in BS units) and the normal of the face it hit
+	v3f point;
+	v3s16 normal;
+};
+
 struct ABMWithState
 {
 	ActiveBlockModifier *abm;
@@ -291,9 +321,24 @@ class ServerEnvironment : public Environment
 	
 	// Find all active objects inside a radius around a point
 	std::set<u16> getObjectsInsideRadius(v3f pos, float radius);
+
+	/*
+		Find the first walkable node (tested against its node boxes) or,
+		if objects is true, the first active object on the line from
+		"from" to "to" (in BS units). Nodes and objects that contain
+		"from" are ignored so that an object can look out of itself.
+		Returns false if the line is clear.
+	*/
+	bool raycast(v3f from, v3f to, bool objects, RaycastHit &hit);
 	
 	// Clear all objects, loading and going through every MapBlock
 	void clearAllObjects();
+
+	/*
+		Grow an L-system tree on the tree spawner thread; it is placed
+		in a later step(), together with the other trees done by then
+	*/
+	void spawnTreeAsync(v3s16 p0, const treegen::TreeDef &tree_definition);
 	
 	// This makes stuff happen
 	void step(f32 dtime);
@@ -364,6 +409,11 @@ class ServerEnvironment : public Environment
 	IntervalLimiter m_active_block_modifier_interval;
 	IntervalLimiter m_active_blocks_nodemetadata_interval;
 	int m_active_block_interval_overload_skip;
+	// An ABM run that went over abm_time_budget, continued on the next steps
+	ABMHandler *m_abm_handler;
+	std::list<v3s16> m_abm_pending_blocks;
+	// Started by the first spawnTreeAsync()
+	treegen::TreeSpawner *m_tree_spawner;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
 	u32 m_game_time;
@@ -23,6 +23,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string.h>
 #include "log.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
 namespace fs
 {
 
@@ -207,6 +213,57 @@ bool DeleteSingleFileOrEmptyDirectory(std::string path)
 	}
 }
 
+bool GetFileInfo(std::string path, u64 &size, u64 &mtime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if(!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &attr))
+		return false;
+	if(attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		return false;
+	size = ((u64)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+	mtime = ((u64)attr.ftLastWriteTime.dwHighDateTime << 32) |
+			attr.ftLastWriteTime.dwLowDateTime;
+	return true;
+}
+
+std::string TempPath()
+{
+	char buf[MAX_PATH + 1];
+	DWORD len = GetTempPath(sizeof(buf), buf);
+	if(len == 0 || len > sizeof(buf))
+		return ".";
+	std::string path(buf, len);
+	// Ends with a backslash
+	if(path[path.size() - 1] == '\\')
+		path.erase(path.size() - 1);
+	return path;
+}
+
+FileLock::FileLock():
+	m_handle(NULL)
+{
+}
+
+bool FileLock::lock(const std::string &path)
+{
+	unlock();
+	// Opening the file without sharing fails while another has it open
+	HANDLE file = CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0,
+			NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+	m_handle = file;
+	return true;
+}
+
+void FileLock::unlock()
+{
+	if(m_handle == NULL)
+		return;
+	CloseHandle((HANDLE)m_handle);
+	m_handle = NULL;
+}
+
 #else // POSIX
 
 #include <sys/types.h>
@@ -215,6 +272,7 @@ bool DeleteSingleFileOrEmptyDirectory(std::string path)
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <stdlib.h>
 
 std::vector<DirListNode> GetDirListing(std::string pathstring)
 {
@@ -364,8 +422,62 @@ bool DeleteSingleFileOrEmptyDirectory(std::string path)
 	}
 }
 
+bool GetFileInfo(std::string path, u64 &size, u64 &mtime)
+{
+	struct stat st;
+	if(stat(path.c_str(), &st) != 0)
+		return false;
+	if(!S_ISREG(st.st_mode))
+		return false;
+	size = st.st_size;
+	mtime = st.st_mtime;
+	return true;
+}
+
+std::string TempPath()
+{
+	const char *dir = getenv("TMPDIR");
+	if(dir == NULL || dir[0] == 0)
+		return "/tmp";
+	return dir;
+}
+
+FileLock::FileLock():
+	m_fd(-1)
+{
+}
+
+bool FileLock::lock(const std::string &path)
+{
+	unlock();
+	int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if(fd == -1)
+		return false;
+	// Released by the system if the process dies
+	if(flock(fd, LOCK_EX | LOCK_NB) != 0){
+		close(fd);
+		return false;
+	}
+	m_fd = fd;
+	return true;
+}
+
+void FileLock::unlock()
+{
+	if(m_fd == -1)
+		return;
+	flock(m_fd, LOCK_UN);
+	close(m_fd);
+	m_fd = -1;
+}
+
 #endif
 
+FileLock::~FileLock()
+{
+	unlock();
+}
+
 void GetRecursiveSubPaths(std::string path, std::vector<std::string> &dst)
 {
 	std::vector<DirListNode> content = GetDirListing(path);
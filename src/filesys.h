@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string>
 #include <vector>
 #include "exceptions.h"
+#include "irrlichttypes.h"
 
 #ifdef _WIN32 // WINDOWS
 #define DIR_DELIM "\\"
@@ -55,6 +56,40 @@ bool RecursiveDelete(std::string path);
 
 bool DeleteSingleFileOrEmptyDirectory(std::string path);
 
+// Gets the size and modification time of a file. False on error.
+// The modification time is only meant to be compared for equality.
+bool GetFileInfo(std::string path, u64 &size, u64 &mtime);
+
+// Directory for temporary files, without a trailing separator
+std::string TempPath();
+
+/*
+	Exclusive lock on a file, held until unlock(), destruction or the
+	end of the process. Used for keeping two processes from working on
+	the same world at once.
+*/
+class FileLock
+{
+public:
+	FileLock();
+	~FileLock();
+
+	// Creates the file if needed. False if another process has it locked.
+	bool lock(const std::string &path);
+	void unlock();
+
+private:
+	// Not copyable
+	FileLock(const FileLock &);
+	FileLock& operator=(const FileLock &);
+
+#ifdef _WIN32
+	void *m_handle;
+#else
+	int m_fd;
+#endif
+};
+
 /* Multiplatform */
 
 // The path itself not included
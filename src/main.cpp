@@ -73,9 +73,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "xCGUITTFont.h"
 #endif
 #include "util/string.h"
+#include "util/container.h"
 #include "subgame.h"
 #include "quicktune.h"
 #include "serverlist.h"
+#include "mapmigration.h"
+#include "mapgenbench.h"
 
 /*
 	Settings.
@@ -802,6 +805,52 @@ void SpeedTests()
 		}
 	}
 
+	{
+		/*
+			Liquid-like workload: every position is pushed twice, once
+			directly and once as the neighbor of the previous one
+		*/
+		const s16 ii = 64;
+		u32 pops = 0;
+		{
+			TimeTaker timer("Testing std::map + std::list unique queue speed");
+			std::map<v3s16, u8> queued;
+			std::list<v3s16> queue;
+			for(s16 z=0; z<ii; z++)
+			for(s16 y=0; y<ii; y++)
+			for(s16 x=0; x<ii; x++){
+				v3s16 ps[2] = {v3s16(x,y,z), v3s16(x+1,y,z)};
+				for(u32 i=0; i<2; i++){
+					if(queued.find(ps[i]) != queued.end())
+						continue;
+					queued[ps[i]] = 0;
+					queue.push_back(ps[i]);
+				}
+			}
+			while(!queue.empty()){
+				queued.erase(queue.front());
+				queue.pop_front();
+				pops++;
+			}
+		}
+		{
+			TimeTaker timer("Testing UniqueQueue speed");
+			UniqueQueue<v3s16> queue;
+			for(s16 z=0; z<ii; z++)
+			for(s16 y=0; y<ii; y++)
+			for(s16 x=0; x<ii; x++){
+				queue.push_back(v3s16(x,y,z));
+				queue.push_back(v3s16(x+1,y,z));
+			}
+			while(queue.size() != 0){
+				queue.pop_front();
+				pops--;
+			}
+		}
+		// Both should have seen the same values
+		assert(pops == 0);
+	}
+
 	{
 		infostream<<"Around 5000/ms should do well here."<<std::endl;
 		TimeTaker timer("Testing mutex speed");
@@ -899,6 +948,12 @@ int main(int argc, char *argv[])
 			_("Set logfile path ('' = no logging)"))));
 	allowed_options.insert(std::make_pair("gameid", ValueSpec(VALUETYPE_STRING,
 			_("Set gameid (\"--gameid list\" prints available ones)"))));
+	allowed_options.insert(std::make_pair("migrate", ValueSpec(VALUETYPE_FLAG,
+			_("Convert the map of the world to the latest format and exit"))));
+	allowed_options.insert(std::make_pair("pregenerate", ValueSpec(VALUETYPE_STRING,
+			_("Generate the area \"(x1,y1,z1) (x2,y2,z2)\" of the world and exit"))));
+	allowed_options.insert(std::make_pair("mapgen-benchmark", ValueSpec(VALUETYPE_STRING,
+			_("Time a mapgen (\"all\" = every one), check its output and exit"))));
 #ifndef SERVER
 	allowed_options.insert(std::make_pair("speedtests", ValueSpec(VALUETYPE_FLAG,
 			_("Run speed tests"))));
@@ -1104,6 +1159,17 @@ int main(int argc, char *argv[])
 		run_tests();
 	}
 	
+	/*
+		Run the mapgen benchmark
+	*/
+
+	if(cmd_args.exists("mapgen-benchmark"))
+	{
+		bool success = run_mapgen_benchmark(
+				cmd_args.get("mapgen-benchmark"), dstream);
+		return success ? 0 : 1;
+	}
+
 	/*
 		Game parameters
 	*/
@@ -1258,6 +1324,15 @@ int main(int argc, char *argv[])
 		}
 		verbosestream<<_("Using world path")<<" ["<<world_path<<"]"<<std::endl;
 
+		// Convert the map and exit
+		if(cmd_args.getFlag("migrate")){
+			MapMigrationStats stats;
+			// Commit every 10000 blocks
+			bool success = migrateMap(world_path,
+					porting::getNumberOfProcessors(), 10000, &stats);
+			return (success && stats.blocks_failed == 0) ? 0 : 1;
+		}
+
 		// We need a gamespec.
 		SubgameSpec gamespec;
 		verbosestream<<_("Determining gameid/gamespec")<<std::endl;
@@ -1303,6 +1378,22 @@ int main(int argc, char *argv[])
 
 		// Create server
 		Server server(world_path, configpath, gamespec, false);
+
+		// Generate an area and exit, without letting anybody in
+		if(cmd_args.exists("pregenerate")){
+			v3s16 p1, p2;
+			if(sscanf(cmd_args.get("pregenerate").c_str(),
+					" ( %hd , %hd , %hd ) ( %hd , %hd , %hd )",
+					&p1.X, &p1.Y, &p1.Z, &p2.X, &p2.Y, &p2.Z) != 6){
+				errorstream<<"Invalid area \""<<cmd_args.get("pregenerate")
+						<<"\"; use \"(x1,y1,z1) (x2,y2,z2)\""<<std::endl;
+				return 1;
+			}
+			server.startPregeneration(p1, p2);
+			pregeneration_loop(server, kill);
+			return 0;
+		}
+
 		server.start(port);
 		
 		// Run server
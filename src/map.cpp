@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "main.h"
 #include "filesys.h"
 #include "voxel.h"
+#include "voxelalgorithms.h"
 #include "porting.h"
 #include "mapgen.h"
 #include "nodemetadata.h"
@@ -32,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodedef.h"
 #include "gamedef.h"
 #include "util/directiontables.h"
+#include "util/thread.h"
 #include "rollback_interface.h"
 #include "emerge.h"
 #include "mapgen_v6.h"
@@ -63,7 +65,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 Map::Map(std::ostream &dout, IGameDef *gamedef):
 	m_dout(dout),
 	m_gamedef(gamedef),
-	m_sector_cache(NULL)
+	m_sector_cache(NULL),
+	m_usage_clock(0),
+	m_usage_first(NULL),
+	m_usage_last(NULL),
+	m_liquid_workers_started(false)
 {
 	/*m_sector_mutex.Init();
 	assert(m_sector_mutex.IsInitialized());*/
@@ -71,6 +77,8 @@ Map::Map(std::ostream &dout, IGameDef *gamedef):
 
 Map::~Map()
 {
+	stopLiquidWorkers();
+
 	/*
 		Free all MapSectors
 	*/
@@ -138,12 +146,7 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
-	return block;
+	return m_block_index.get(p3d);
 }
 
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
@@ -216,7 +219,7 @@ void Map::setNode(v3s16 p, MapNode & n)
 
 
 /*
-	Goes recursively through the neighbours of the node.
+	Goes through the neighbours of the nodes, breadth first.
 
 	Alters only transparent nodes.
 
@@ -231,172 +234,26 @@ void Map::setNode(v3s16 p, MapNode & n)
 	light_sources to re-light the area without the removed light.
 
 	values of from_nodes are lighting values.
+
+	The work is done by voxalgo::BlockLightSpreader.
 */
 void Map::unspreadLight(enum LightBank bank,
 		std::map<v3s16, u8> & from_nodes,
 		std::set<v3s16> & light_sources,
 		std::map<v3s16, MapBlock*>  & modified_blocks)
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
 	if(from_nodes.size() == 0)
 		return;
 
-	u32 blockchangecount = 0;
-
-	std::map<v3s16, u8> unlighted_nodes;
-
-	/*
-		Initialize block cache
-	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
+	voxalgo::BlockLightSpreader spreader(this, m_gamedef->ndef(), bank);
 
 	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
 		j != from_nodes.end(); ++j)
-	{
-		v3s16 pos = j->first;
-		v3s16 blockpos = getNodeBlockPos(pos);
+		spreader.addUnlight(j->first, j->second);
 
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
-
-		if(block->isDummy())
-			continue;
-
-		// Calculate relative position in block
-		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
-
-		u8 oldlight = j->second;
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++)
-		{
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos = getNodeBlockPos(n2pos);
-
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
-
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
-
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
-
-				bool changed = false;
-
-				//TODO: Optimize output by optimizing light_sources?
-
-				/*
-					If the neighbor is dimmer than what was specified
-					as oldlight (the light of the previous node)
-				*/
-				if(n2.getLight(bank, nodemgr) < oldlight)
-				{
-					/*
-						And the neighbor is transparent and it has some light
-					*/
-					if(nodemgr->get(n2).light_propagates
-							&& n2.getLight(bank, nodemgr) != 0)
-					{
-						/*
-							Set light to 0 and add to queue
-						*/
-
-						u8 current_light = n2.getLight(bank, nodemgr);
-						n2.setLight(bank, 0, nodemgr);
-						block->setNode(relpos, n2);
-
-						unlighted_nodes[n2pos] = current_light;
-						changed = true;
-
-						/*
-							Remove from light_sources if it is there
-							NOTE: This doesn't happen nearly at all
-						*/
-						/*if(light_sources.find(n2pos))
-						{
-							infostream<<"Removed from light_sources"<<std::endl;
-							light_sources.remove(n2pos);
-						}*/
-					}
-
-					/*// DEBUG
-					if(light_sources.find(n2pos) != NULL)
-						light_sources.remove(n2pos);*/
-				}
-				else{
-					light_sources.insert(n2pos);
-				}
-
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == modified_blocks.end())
-					{
-						modified_blocks[blockpos] = block;
-					}
-					block_checked_in_modified = true;
-				}
-			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
-			}
-		}
-	}
-
-	/*infostream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
+	spreader.unspread();
+	spreader.getSources(light_sources);
+	spreader.finish(modified_blocks);
 }
 
 /*
@@ -415,151 +272,23 @@ void Map::unLightNeighbors(enum LightBank bank,
 
 /*
 	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	goes on breadth first until nothing changes.
 */
 void Map::spreadLight(enum LightBank bank,
 		std::set<v3s16> & from_nodes,
 		std::map<v3s16, MapBlock*> & modified_blocks)
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
 	if(from_nodes.size() == 0)
 		return;
 
-	u32 blockchangecount = 0;
-
-	std::set<v3s16> lighted_nodes;
-
-	/*
-		Initialize block cache
-	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
+	voxalgo::BlockLightSpreader spreader(this, m_gamedef->ndef(), bank);
 
 	for(std::set<v3s16>::iterator j = from_nodes.begin();
 		j != from_nodes.end(); ++j)
-	{
-		v3s16 pos = *j;
-		v3s16 blockpos = getNodeBlockPos(pos);
-
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		spreader.addSource(*j);
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
-
-		if(block->isDummy())
-			continue;
-
-		// Calculate relative position in block
-		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
-
-		u8 oldlight = n.getLight(bank, nodemgr);
-		u8 newlight = diminish_light(oldlight);
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++){
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos = getNodeBlockPos(n2pos);
-
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
-
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
-
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
-
-				bool changed = false;
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
-				{
-					lighted_nodes.insert(n2pos);
-					changed = true;
-				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(n2.getLight(bank, nodemgr) < newlight)
-				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						block->setNode(relpos, n2);
-						lighted_nodes.insert(n2pos);
-						changed = true;
-					}
-				}
-
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == modified_blocks.end())
-					{
-						modified_blocks[blockpos] = block;
-					}
-					block_checked_in_modified = true;
-				}
-			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
-			}
-		}
-	}
-
-	/*infostream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, modified_blocks);
+	spreader.spread();
+	spreader.finish(modified_blocks);
 }
 
 /*
@@ -680,9 +409,10 @@ void Map::updateLighting(enum LightBank bank,
 
 	std::map<v3s16, MapBlock*> blocks_to_update;
 
-	std::set<v3s16> light_sources;
+	voxalgo::BlockLightSpreader spreader(this, nodemgr, bank);
 
-	std::map<v3s16, u8> unlight_from;
+	// Sunlit nodes from MapBlock::propagateSunlight
+	std::vector<v3s16> light_sources;
 
 	int num_bottom_invalid = 0;
 
@@ -708,44 +438,31 @@ void Map::updateLighting(enum LightBank bank,
 			/*
 				Clear all light from block
 			*/
+			MapNode *data = block->getData();
+			u32 index = 0;
 			for(s16 z=0; z<MAP_BLOCKSIZE; z++)
-			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(s16 x=0; x<MAP_BLOCKSIZE; x++, index++)
 			{
-
-				try{
-					v3s16 p(x,y,z);
-					MapNode n = block->getNode(p);
-					u8 oldlight = n.getLight(bank, nodemgr);
-					n.setLight(bank, 0, nodemgr);
-					block->setNode(p, n);
-
-					// If node sources light, add to list
-					u8 source = nodemgr->get(n).light_source;
-					if(source != 0)
-						light_sources.insert(p + posnodes);
-
-					// Collect borders for unlighting
-					if((x==0 || x == MAP_BLOCKSIZE-1
-					|| y==0 || y == MAP_BLOCKSIZE-1
-					|| z==0 || z == MAP_BLOCKSIZE-1)
-					&& oldlight != 0)
-					{
-						v3s16 p_map = p + posnodes;
-						unlight_from[p_map] = oldlight;
-					}
-				}
-				catch(InvalidPositionException &e)
+				MapNode &n = data[index];
+				u8 oldlight = n.getLight(bank, nodemgr);
+				n.setLight(bank, 0, nodemgr);
+
+				// If node sources light, add to list
+				u8 source = nodemgr->get(n).light_source;
+				if(source != 0)
+					spreader.addSource(v3s16(x,y,z) + posnodes);
+
+				// Collect borders for unlighting
+				if((x==0 || x == MAP_BLOCKSIZE-1
+				|| y==0 || y == MAP_BLOCKSIZE-1
+				|| z==0 || z == MAP_BLOCKSIZE-1)
+				&& oldlight != 0)
 				{
-					/*
-						This would happen when dealing with a
-						dummy block.
-					*/
-					//assert(0);
-					infostream<<"updateLighting(): InvalidPositionException"
-							<<std::endl;
+					spreader.addUnlight(v3s16(x,y,z) + posnodes, oldlight);
 				}
 			}
+			block->raiseModified(MOD_STATE_WRITE_NEEDED, "updateLighting");
 
 			if(bank == LIGHTBANK_DAY)
 			{
@@ -809,9 +526,12 @@ void Map::updateLighting(enum LightBank bank,
 #endif
 
 #if 1
+	for(u32 i=0; i<light_sources.size(); i++)
+		spreader.addSource(light_sources[i]);
+
 	{
 		//TimeTaker timer("unspreadLight");
-		unspreadLight(bank, unlight_from, light_sources, modified_blocks);
+		spreader.unspread();
 	}
 
 	/*if(debug)
@@ -823,9 +543,11 @@ void Map::updateLighting(enum LightBank bank,
 
 	{
 		//TimeTaker timer("spreadLight");
-		spreadLight(bank, light_sources, modified_blocks);
+		spreader.spread();
 	}
 
+	spreader.finish(modified_blocks);
+
 	/*if(debug)
 	{
 		u32 diff = modified_blocks.size() - count_was;
@@ -1424,73 +1146,138 @@ bool Map::getDayNightDiff(v3s16 blockpos)
 /*
 	Updates usage timers
 */
+void Map::insertedBlock(MapBlock *block)
+{
+	m_block_index.insert(block->getPos(), block);
+	block->m_usage_stamp = m_usage_clock;
+	usageAppend(block);
+}
+
+void Map::removedBlock(MapBlock *block)
+{
+	m_block_index.remove(block->getPos());
+	usageUnlink(block);
+}
+
+void Map::touchBlock(MapBlock *block)
+{
+	block->m_usage_stamp = m_usage_clock;
+	if(block == m_usage_last)
+		return;
+	usageUnlink(block);
+	usageAppend(block);
+}
+
+void Map::usageUnlink(MapBlock *block)
+{
+	if(block->m_usage_prev)
+		block->m_usage_prev->m_usage_next = block->m_usage_next;
+	else if(m_usage_first == block)
+		m_usage_first = block->m_usage_next;
+	if(block->m_usage_next)
+		block->m_usage_next->m_usage_prev = block->m_usage_prev;
+	else if(m_usage_last == block)
+		m_usage_last = block->m_usage_prev;
+	block->m_usage_prev = NULL;
+	block->m_usage_next = NULL;
+}
+
+void Map::usageAppend(MapBlock *block)
+{
+	block->m_usage_prev = m_usage_last;
+	block->m_usage_next = NULL;
+	if(m_usage_last)
+		m_usage_last->m_usage_next = block;
+	else
+		m_usage_first = block;
+	m_usage_last = block;
+}
+
 void Map::timerUpdate(float dtime, float unload_timeout,
 		std::list<v3s16> *unloaded_blocks)
 {
 	bool save_before_unloading = (mapType() == MAPTYPE_SERVER);
 
+	m_usage_clock += dtime;
+
+	u32 time_budget_ms = 1000 * g_settings->getFloat("map_unload_time_budget");
+	u32 start_ms = porting::getTimeMs();
+
 	// Profile modified reasons
 	Profiler modprofiler;
 
-	std::list<v2s16> sector_deletion_queue;
+	std::set<v2s16> emptied_sectors;
 	u32 deleted_blocks_count = 0;
 	u32 saved_blocks_count = 0;
-	u32 block_count_all = 0;
+	bool saving = false;
 
-	beginSave();
-	for(std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
-		si != m_sectors.end(); ++si)
+	/*
+		The usage list is ordered by the time of last use, so only the
+		blocks at its front can have timed out. Blocks that are still
+		referenced are treated as used. Visit each block at most once.
+	*/
+	u32 visits_left = m_block_index.size();
+	while(m_usage_first != NULL && visits_left != 0)
 	{
-		MapSector *sector = si->second;
-
-		bool all_blocks_deleted = true;
-
-		std::list<MapBlock*> blocks;
-		sector->getBlocks(blocks);
-
-		for(std::list<MapBlock*>::iterator i = blocks.begin();
-				i != blocks.end(); ++i)
-		{
-			MapBlock *block = (*i);
+		MapBlock *block = m_usage_first;
+		visits_left--;
 
-			block->incrementUsageTimer(dtime);
-
-			if(block->refGet() == 0 && block->getUsageTimer() > unload_timeout)
-			{
-				v3s16 p = block->getPos();
+		if(m_usage_clock - block->m_usage_stamp <= unload_timeout)
+			break;
 
-				// Save if modified
-				if(block->getModified() != MOD_STATE_CLEAN
-						&& save_before_unloading)
-				{
-					modprofiler.add(block->getModifiedReason(), 1);
-					saveBlock(block);
-					saved_blocks_count++;
-				}
+		if(block->refGet() != 0){
+			touchBlock(block);
+			continue;
+		}
 
-				// Delete from memory
-				sector->deleteBlock(block);
+		// The rest is left for the next call
+		if(time_budget_ms != 0 &&
+				porting::getTimeMs() - start_ms >= time_budget_ms){
+			g_profiler->add("Map: unload runs over budget", 1);
+			break;
+		}
 
-				if(unloaded_blocks)
-					unloaded_blocks->push_back(p);
+		v3s16 p = block->getPos();
 
-				deleted_blocks_count++;
-			}
-			else
-			{
-				all_blocks_deleted = false;
-				block_count_all++;
+		// Save if modified
+		if(block->getModified() != MOD_STATE_CLEAN
+				&& save_before_unloading)
+		{
+			if(!saving){
+				beginSave();
+				saving = true;
 			}
+			modprofiler.add(block->getModifiedReason(), 1);
+			saveBlock(block);
+			saved_blocks_count++;
 		}
 
-		if(all_blocks_deleted)
-		{
-			sector_deletion_queue.push_back(si->first);
-		}
+		// Delete from memory
+		v2s16 p2d(p.X, p.Z);
+		MapSector *sector = getSectorNoGenerateNoEx(p2d);
+		assert(sector);
+		sector->deleteBlock(block);
+		if(sector->empty())
+			emptied_sectors.insert(p2d);
+
+		if(unloaded_blocks)
+			unloaded_blocks->push_back(p);
+
+		deleted_blocks_count++;
 	}
-	endSave();
+	if(saving)
+		endSave();
 
 	// Finally delete the empty sectors
+	std::list<v2s16> sector_deletion_queue;
+	for(std::set<v2s16>::iterator i = emptied_sectors.begin();
+			i != emptied_sectors.end(); ++i)
+	{
+		// A block may have been added back after it was emptied
+		MapSector *sector = getSectorNoGenerateNoEx(*i);
+		if(sector && sector->empty())
+			sector_deletion_queue.push_back(*i);
+	}
 	deleteSectors(sector_deletion_queue);
 
 	if(deleted_blocks_count != 0)
@@ -1500,7 +1287,7 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 				<<" blocks from memory";
 		if(save_before_unloading)
 			infostream<<", of which "<<saved_blocks_count<<" were written";
-		infostream<<", "<<block_count_all<<" blocks in memory";
+		infostream<<", "<<m_block_index.size()<<" blocks in memory";
 		infostream<<"."<<std::endl;
 		if(saved_blocks_count != 0){
 			PrintInfo(infostream); // ServerMap/ClientMap:
@@ -1626,7 +1413,7 @@ const v3s16 g_7dirs[7] =
 #define D_TOP 6
 #define D_SELF 1
 
-void Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
+u32 Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
@@ -1959,280 +1746,478 @@ void Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 	while (must_reflow_second.size() > 0)
 		m_transforming_liquid.push_back(must_reflow_second.pop_front());
 	updateLighting(lighting_modified_blocks, modified_blocks);
+	return loopcount;
 }
 
-void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
-{
-
-	if (g_settings->getBool("liquid_finite"))
-		return Map::transformLiquidsFinite(modified_blocks);
+/*
+	Liquid transformation
+
+	Each run takes a batch of positions from m_transforming_liquid. With
+	one thread, or for small batches, the nodes are updated one by one in
+	queue order, each seeing the nodes updated before it.
+
+	With num_liquid_threads > 1, the new state of every node of a larger
+	batch is computed from the map as it was at the start of the run.
+	This computation only reads the map, so the batch is split by MapBlock
+	between the worker threads. The results are then applied to the map
+	in queue order on the calling thread. Nodes don't see the changes of
+	their neighbors made in the same run, so liquids can spread somewhat
+	differently than with one thread.
+*/
 
-	INodeDefManager *nodemgr = m_gamedef->ndef();
+// Maximum number of neighbors one node can enqueue
+#define LIQUID_MAX_PUSHES 12
 
-	DSTACK(__FUNCTION_NAME);
-	//TimeTaker timer("transformLiquids()");
+struct LiquidUpdate
+{
+	v3s16 p;
+	// Whether n differs from the current node
+	bool changed;
+	// Whether the node has to be looked at again next run due to viscosity
+	bool reflow;
+	MapNode n;
+	u8 num_pushes;
+	v3s16 pushes[LIQUID_MAX_PUSHES];
+};
 
-	u32 loopcount = 0;
-	u32 initial_size = m_transforming_liquid.size();
+class LiquidWorker : public SimpleThread
+{
+public:
+	LiquidWorker(Map *map):
+		SimpleThread(),
+		m_map(map),
+		m_updates(NULL)
+	{
+	}
 
-	/*if(initial_size != 0)
-		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
+	void *Thread()
+	{
+		ThreadStarted();
+		log_register_thread("LiquidWorker");
+		DSTACK(__FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		for(;;){
+			m_start.wait();
+			if(!getRun())
+				break;
+			computeAll();
+			m_done.signal();
+		}
 
-	// list of nodes that due to viscosity have not reached their max level height
-	UniqueQueue<v3s16> must_reflow;
+		END_DEBUG_EXCEPTION_HANDLER(errorstream)
+		log_deregister_thread();
+		return NULL;
+	}
 
-	// List of MapBlocks that will require a lighting update (due to lava)
-	std::map<v3s16, MapBlock*> lighting_modified_blocks;
+	// Computes the updates at the given indices
+	void computeAll()
+	{
+		for(std::vector<u32>::iterator i = m_indices.begin();
+				i != m_indices.end(); ++i)
+			m_map->computeLiquidUpdate((*m_updates)[*i]);
+	}
 
-	while(m_transforming_liquid.size() != 0)
+	void shutdown()
 	{
-		// This should be done here so that it is done when continue is used
-		if(loopcount >= initial_size || loopcount >= 10000)
-			break;
-		loopcount++;
+		setRun(false);
+		m_start.signal();
+		stop();
+	}
 
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.pop_front();
+	Map *m_map;
+	std::vector<LiquidUpdate> *m_updates;
+	std::vector<u32> m_indices;
+	Event m_start;
+	Event m_done;
+};
+
+void Map::computeLiquidUpdate(LiquidUpdate &u)
+{
+	INodeDefManager *nodemgr = m_gamedef->ndef();
+	v3s16 p0 = u.p;
+	u.changed = false;
+	u.reflow = false;
+	u.num_pushes = 0;
 
-		MapNode n0 = getNodeNoEx(p0);
+	MapNode n0 = getNodeNoEx(p0);
 
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		content_t liquid_kind = CONTENT_IGNORE;
-		LiquidType liquid_type = nodemgr->get(n0).liquid_type;
-		switch (liquid_type) {
-			case LIQUID_SOURCE:
-				liquid_level = LIQUID_LEVEL_SOURCE;
-				liquid_kind = nodemgr->getId(nodemgr->get(n0).liquid_alternative_flowing);
+	/*
+		Collect information about current node
+	 */
+	s8 liquid_level = -1;
+	content_t liquid_kind = CONTENT_IGNORE;
+	LiquidType liquid_type = nodemgr->get(n0).liquid_type;
+	switch (liquid_type) {
+		case LIQUID_SOURCE:
+			liquid_level = LIQUID_LEVEL_SOURCE;
+			liquid_kind = nodemgr->getId(nodemgr->get(n0).liquid_alternative_flowing);
+			break;
+		case LIQUID_FLOWING:
+			liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+			liquid_kind = n0.getContent();
+			break;
+		case LIQUID_NONE:
+			// if this is an air node, it *could* be transformed into a liquid. otherwise,
+			// continue with the next node.
+			if (n0.getContent() != CONTENT_AIR)
+				return;
+			liquid_kind = CONTENT_AIR;
+			break;
+	}
+
+	/*
+		Collect information about the environment
+	 */
+	const v3s16 *dirs = g_6dirs;
+	NodeNeighbor sources[6]; // surrounding sources
+	int num_sources = 0;
+	NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+	int num_flows = 0;
+	NodeNeighbor airs[6]; // surrounding air
+	int num_airs = 0;
+	NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
+	int num_neutrals = 0;
+	bool flowing_down = false;
+	for (u16 i = 0; i < 6; i++) {
+		NeighborType nt = NEIGHBOR_SAME_LEVEL;
+		switch (i) {
+			case 1:
+				nt = NEIGHBOR_UPPER;
 				break;
-			case LIQUID_FLOWING:
-				liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-				liquid_kind = n0.getContent();
+			case 4:
+				nt = NEIGHBOR_LOWER;
 				break;
+		}
+		v3s16 npos = p0 + dirs[i];
+		NodeNeighbor nb = {getNodeNoEx(npos), nt, npos};
+		switch (nodemgr->get(nb.n.getContent()).liquid_type) {
 			case LIQUID_NONE:
-				// if this is an air node, it *could* be transformed into a liquid. otherwise,
-				// continue with the next node.
-				if (n0.getContent() != CONTENT_AIR)
-					continue;
-				liquid_kind = CONTENT_AIR;
+				if (nb.n.getContent() == CONTENT_AIR) {
+					airs[num_airs++] = nb;
+					// if the current node is a water source the neighbor
+					// should be enqueded for transformation regardless of whether the
+					// current node changes or not.
+					if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+						u.pushes[u.num_pushes++] = npos;
+					// if the current node happens to be a flowing node, it will start to flow down here.
+					if (nb.t == NEIGHBOR_LOWER) {
+						flowing_down = true;
+					}
+				} else {
+					neutrals[num_neutrals++] = nb;
+				}
+				break;
+			case LIQUID_SOURCE:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
+				if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					// Do not count bottom source, it will screw things up
+					if(dirs[i].Y != -1)
+						sources[num_sources++] = nb;
+				}
+				break;
+			case LIQUID_FLOWING:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
+				if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					flows[num_flows++] = nb;
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				}
 				break;
 		}
+	}
 
-		/*
-			Collect information about the environment
-		 */
-		const v3s16 *dirs = g_6dirs;
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		for (u16 i = 0; i < 6; i++) {
-			NeighborType nt = NEIGHBOR_SAME_LEVEL;
-			switch (i) {
-				case 1:
-					nt = NEIGHBOR_UPPER;
-					break;
-				case 4:
-					nt = NEIGHBOR_LOWER;
-					break;
-			}
-			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb = {getNodeNoEx(npos), nt, npos};
-			switch (nodemgr->get(nb.n.getContent()).liquid_type) {
-				case LIQUID_NONE:
-					if (nb.n.getContent() == CONTENT_AIR) {
-						airs[num_airs++] = nb;
-						// if the current node is a water source the neighbor
-						// should be enqueded for transformation regardless of whether the
-						// current node changes or not.
-						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
-						// if the current node happens to be a flowing node, it will start to flow down here.
-						if (nb.t == NEIGHBOR_LOWER) {
-							flowing_down = true;
-						}
-					} else {
-						neutrals[num_neutrals++] = nb;
-					}
+	/*
+		decide on the type (and possibly level) of the current node
+	 */
+	content_t new_node_content;
+	s8 new_node_level = -1;
+	s8 max_node_level = -1;
+	if ((num_sources >= 2 && nodemgr->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
+		// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+		// or the flowing alternative of the first of the surrounding sources (if it's air), so
+		// it's perfectly safe to use liquid_kind here to determine the new node content.
+		new_node_content = nodemgr->getId(nodemgr->get(liquid_kind).liquid_alternative_source);
+	} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
+		// liquid_kind is set properly, see above
+		new_node_content = liquid_kind;
+		max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+	} else {
+		// no surrounding sources, so get the maximum level that can flow into this node
+		for (u16 i = 0; i < num_flows; i++) {
+			u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
+			switch (flows[i].t) {
+				case NEIGHBOR_UPPER:
+					if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
+						max_node_level = LIQUID_LEVEL_MAX;
+						if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
+							max_node_level = nb_liquid_level + WATER_DROP_BOOST;
+					} else if (nb_liquid_level > max_node_level)
+						max_node_level = nb_liquid_level;
 					break;
-				case LIQUID_SOURCE:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
-					if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						// Do not count bottom source, it will screw things up
-						if(dirs[i].Y != -1)
-							sources[num_sources++] = nb;
-					}
+				case NEIGHBOR_LOWER:
 					break;
-				case LIQUID_FLOWING:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
-					if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						flows[num_flows++] = nb;
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
+				case NEIGHBOR_SAME_LEVEL:
+					if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
+						nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
+						max_node_level = nb_liquid_level - 1;
 					}
 					break;
 			}
 		}
 
-		/*
-			decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-		if ((num_sources >= 2 && nodemgr->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
-			// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-			// or the flowing alternative of the first of the surrounding sources (if it's air), so
-			// it's perfectly safe to use liquid_kind here to determine the new node content.
-			new_node_content = nodemgr->getId(nodemgr->get(liquid_kind).liquid_alternative_source);
-		} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
-			// liquid_kind is set properly, see above
+		u8 viscosity = nodemgr->get(liquid_kind).liquid_viscosity;
+		if (viscosity > 1 && max_node_level != liquid_level) {
+			// amount to gain, limited by viscosity
+			// must be at least 1 in absolute value
+			s8 level_inc = max_node_level - liquid_level;
+			if (level_inc < -viscosity || level_inc > viscosity)
+				new_node_level = liquid_level + level_inc/viscosity;
+			else if (level_inc < 0)
+				new_node_level = liquid_level - 1;
+			else if (level_inc > 0)
+				new_node_level = liquid_level + 1;
+			if (new_node_level != max_node_level)
+				u.reflow = true;
+		} else
+			new_node_level = max_node_level;
+
+		if (new_node_level >= 0)
 			new_node_content = liquid_kind;
-			max_node_level = new_node_level = LIQUID_LEVEL_MAX;
-		} else {
-			// no surrounding sources, so get the maximum level that can flow into this node
-			for (u16 i = 0; i < num_flows; i++) {
-				u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
-				switch (flows[i].t) {
-					case NEIGHBOR_UPPER:
-						if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
-							max_node_level = LIQUID_LEVEL_MAX;
-							if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
-								max_node_level = nb_liquid_level + WATER_DROP_BOOST;
-						} else if (nb_liquid_level > max_node_level)
-							max_node_level = nb_liquid_level;
-						break;
-					case NEIGHBOR_LOWER:
-						break;
-					case NEIGHBOR_SAME_LEVEL:
-						if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
-							nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
-							max_node_level = nb_liquid_level - 1;
-						}
-						break;
-				}
-			}
+		else
+			new_node_content = CONTENT_AIR;
 
-			u8 viscosity = nodemgr->get(liquid_kind).liquid_viscosity;
-			if (viscosity > 1 && max_node_level != liquid_level) {
-				// amount to gain, limited by viscosity
-				// must be at least 1 in absolute value
-				s8 level_inc = max_node_level - liquid_level;
-				if (level_inc < -viscosity || level_inc > viscosity)
-					new_node_level = liquid_level + level_inc/viscosity;
-				else if (level_inc < 0)
-					new_node_level = liquid_level - 1;
-				else if (level_inc > 0)
-					new_node_level = liquid_level + 1;
-				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
-			} else
-				new_node_level = max_node_level;
+	}
 
-			if (new_node_level >= 0)
-				new_node_content = liquid_kind;
-			else
-				new_node_content = CONTENT_AIR;
+	/*
+		check if anything has changed. if not, just continue with the next node.
+	 */
+	if (new_node_content == n0.getContent() && (nodemgr->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
+									 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+									 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+									 == flowing_down)))
+		return;
 
-		}
+	/*
+		update the current node
+	 */
+	//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
+	if (nodemgr->get(new_node_content).liquid_type == LIQUID_FLOWING) {
+		// set level to last 3 bits, flowing down bit to 4th bit
+		n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+	} else {
+		// set the liquid level and flow bit to 0
+		n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+	}
+	n0.setContent(new_node_content);
+	u.changed = true;
+	u.n = n0;
 
-		/*
-			check if anything has changed. if not, just continue with the next node.
-		 */
-		if (new_node_content == n0.getContent() && (nodemgr->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-										 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-										 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-										 == flowing_down)))
-			continue;
+	/*
+		enqueue neighbors for update if neccessary
+	 */
+	switch (nodemgr->get(n0.getContent()).liquid_type) {
+		case LIQUID_SOURCE:
+		case LIQUID_FLOWING:
+			// make sure source flows into all neighboring nodes
+			for (u16 i = 0; i < num_flows; i++)
+				if (flows[i].t != NEIGHBOR_UPPER)
+					u.pushes[u.num_pushes++] = flows[i].p;
+			for (u16 i = 0; i < num_airs; i++)
+				if (airs[i].t != NEIGHBOR_UPPER)
+					u.pushes[u.num_pushes++] = airs[i].p;
+			break;
+		case LIQUID_NONE:
+			// this flow has turned to air; neighboring flows might need to do the same
+			for (u16 i = 0; i < num_flows; i++)
+				u.pushes[u.num_pushes++] = flows[i].p;
+			break;
+	}
+}
 
+u32 Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
+{
 
-		/*
-			update the current node
-		 */
-		//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
-		if (nodemgr->get(new_node_content).liquid_type == LIQUID_FLOWING) {
-			// set level to last 3 bits, flowing down bit to 4th bit
-			n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		} else {
-			// set the liquid level and flow bit to 0
-			n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
-		}
-		n0.setContent(new_node_content);
+	if (g_settings->getBool("liquid_finite"))
+		return Map::transformLiquidsFinite(modified_blocks);
 
-		// Find out whether there is a suspect for this action
-		std::string suspect;
-		if(m_gamedef->rollback()){
-			suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
-		}
+	DSTACK(__FUNCTION_NAME);
+	//TimeTaker timer("transformLiquids()");
 
-		if(!suspect.empty()){
-			// Blame suspect
-			RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
-			// Get old node for rollback
-			RollbackNode rollback_oldnode(this, p0, m_gamedef);
-			// Set node
-			setNode(p0, n0);
-			// Report
-			RollbackNode rollback_newnode(this, p0, m_gamedef);
-			RollbackAction action;
-			action.setSetNode(p0, rollback_oldnode, rollback_newnode);
-			m_gamedef->rollback()->reportAction(action);
-		} else {
-			// Set node
-			setNode(p0, n0);
-		}
+	/*
+		Take a batch of queued transforming liquid nodes
+	*/
+	s32 loop_max = g_settings->getS32("liquid_loop_max");
+	u32 count = MYMIN(m_transforming_liquid.size(), (u32)MYMAX(loop_max, 1));
+	if(count == 0)
+		return 0;
 
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
-		if(block != NULL) {
-			modified_blocks[blockpos] =  block;
-			// If node emits light, MapBlock requires lighting update
-			if(nodemgr->get(n0).light_source != 0)
-				lighting_modified_blocks[block->getPos()] = block;
-		}
+	// List of MapBlocks that will require a lighting update (due to lava)
+	std::map<v3s16, MapBlock*> lighting_modified_blocks;
 
+	startLiquidWorkers();
+	u32 num_workers = m_liquid_workers.size();
+	if(num_workers == 0 || count < 100)
+	{
 		/*
-			enqueue neighbors for update if neccessary
-		 */
-		switch (nodemgr->get(n0.getContent()).liquid_type) {
-			case LIQUID_SOURCE:
-			case LIQUID_FLOWING:
-				// make sure source flows into all neighboring nodes
-				for (u16 i = 0; i < num_flows; i++)
-					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
-				for (u16 i = 0; i < num_airs; i++)
-					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
-				break;
-			case LIQUID_NONE:
-				// this flow has turned to air; neighboring flows might need to do the same
-				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
-				break;
+			Update the nodes one by one, so that each node sees the new
+			state of the nodes updated before it
+		*/
+		std::vector<v3s16> must_reflow;
+		for(u32 i = 0; i < count; i++)
+		{
+			LiquidUpdate u;
+			u.p = m_transforming_liquid.pop_front();
+			computeLiquidUpdate(u);
+			applyLiquidUpdate(u, modified_blocks, lighting_modified_blocks);
+			if(u.reflow)
+				must_reflow.push_back(u.p);
 		}
+		// Nodes that due to viscosity have not reached their max level height
+		for(u32 i = 0; i < must_reflow.size(); i++)
+			m_transforming_liquid.push_back(must_reflow[i]);
+
+		updateLighting(lighting_modified_blocks, modified_blocks);
+		return count;
 	}
-	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
-	while (must_reflow.size() > 0)
-		m_transforming_liquid.push_back(must_reflow.pop_front());
+
+	/*
+		Compute the new nodes of the whole batch in parallel, from the map
+		as it was before the batch
+	*/
+	std::vector<LiquidUpdate> updates(count);
+	for(u32 i = 0; i < count; i++)
+		updates[i].p = m_transforming_liquid.pop_front();
+
+	// Partition by MapBlock so that each thread works on its own area
+	std::map<v3s16, std::vector<u32> > by_block;
+	for(u32 i = 0; i < count; i++)
+		by_block[getNodeBlockPos(updates[i].p)].push_back(i);
+
+	// The calling thread takes a share of its own
+	std::vector<u32> own_indices;
+	u32 share = count / (num_workers + 1) + 1;
+	u32 w = 0;
+	std::vector<u32> *dst = &own_indices;
+	for(u32 j = 0; j < num_workers; j++)
+		m_liquid_workers[j]->m_indices.clear();
+	for(std::map<v3s16, std::vector<u32> >::iterator
+			i = by_block.begin(); i != by_block.end(); ++i){
+		if(dst->size() >= share && w < num_workers)
+			dst = &m_liquid_workers[w++]->m_indices;
+		dst->insert(dst->end(), i->second.begin(), i->second.end());
+	}
+
+	for(u32 j = 0; j < num_workers; j++){
+		m_liquid_workers[j]->m_updates = &updates;
+		m_liquid_workers[j]->m_start.signal();
+	}
+	for(std::vector<u32>::iterator i = own_indices.begin();
+			i != own_indices.end(); ++i)
+		computeLiquidUpdate(updates[*i]);
+	for(u32 j = 0; j < num_workers; j++)
+		m_liquid_workers[j]->m_done.wait();
+
+	/*
+		Apply the results in queue order
+	*/
+	for(u32 i = 0; i < count; i++)
+		applyLiquidUpdate(updates[i], modified_blocks,
+				lighting_modified_blocks);
+
+	// Nodes that due to viscosity have not reached their max level height
+	for(u32 i = 0; i < count; i++)
+		if(updates[i].reflow)
+			m_transforming_liquid.push_back(updates[i].p);
+
 	updateLighting(lighting_modified_blocks, modified_blocks);
+	return count;
+}
+
+void Map::applyLiquidUpdate(const LiquidUpdate &u,
+		std::map<v3s16, MapBlock*> &modified_blocks,
+		std::map<v3s16, MapBlock*> &lighting_modified_blocks)
+{
+	INodeDefManager *nodemgr = m_gamedef->ndef();
+	v3s16 p0 = u.p;
+
+	for(u8 j = 0; j < u.num_pushes; j++)
+		m_transforming_liquid.push_back(u.pushes[j]);
+
+	if(!u.changed)
+		return;
+
+	MapNode n0 = u.n;
+
+	// Find out whether there is a suspect for this action
+	std::string suspect;
+	if(m_gamedef->rollback()){
+		suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
+	}
+
+	if(!suspect.empty()){
+		// Blame suspect
+		RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
+		// Get old node for rollback
+		RollbackNode rollback_oldnode(this, p0, m_gamedef);
+		// Set node
+		setNode(p0, n0);
+		// Report
+		RollbackNode rollback_newnode(this, p0, m_gamedef);
+		RollbackAction action;
+		action.setSetNode(p0, rollback_oldnode, rollback_newnode);
+		m_gamedef->rollback()->reportAction(action);
+	} else {
+		// Set node
+		setNode(p0, n0);
+	}
+
+	v3s16 blockpos = getNodeBlockPos(p0);
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block != NULL) {
+		modified_blocks[blockpos] =  block;
+		// If node emits light, MapBlock requires lighting update
+		if(nodemgr->get(n0).light_source != 0)
+			lighting_modified_blocks[block->getPos()] = block;
+	}
+}
+
+void Map::startLiquidWorkers()
+{
+	if(m_liquid_workers_started)
+		return;
+	m_liquid_workers_started = true;
+
+	int nthreads;
+	if(g_settings->get("num_liquid_threads").empty()){
+		int nprocs = porting::getNumberOfProcessors();
+		nthreads = (nprocs > 2) ? nprocs - 2 : 1;
+	} else {
+		nthreads = g_settings->getU16("num_liquid_threads");
+	}
+	// The calling thread counts as one
+	for(int i = 1; i < nthreads; i++){
+		LiquidWorker *worker = new LiquidWorker(this);
+		worker->Start();
+		m_liquid_workers.push_back(worker);
+	}
+}
+
+void Map::stopLiquidWorkers()
+{
+	for(u32 i = 0; i < m_liquid_workers.size(); i++){
+		m_liquid_workers[i]->shutdown();
+		delete m_liquid_workers[i];
+	}
+	m_liquid_workers.clear();
 }
 
 NodeMetadata* Map::getNodeMetadata(v3s16 p)
@@ -2517,7 +2502,7 @@ bool ServerMap::initBlockMake(BlockMakeData *data, v3s16 blockpos)
 	data->blockpos_min = blockpos_min;
 	data->blockpos_max = blockpos_max;
 	data->blockpos_requested = blockpos;
-	data->nodedef = m_gamedef->ndef();
+	data->nodedef = m_emerge->ndef;
 
 	/*
 		Create the whole area of this and the neighboring blocks
@@ -2633,6 +2618,25 @@ MapBlock* ServerMap::finishBlockMake(BlockMakeData *data,
 		emergeBlock(p, false);
 	}
 
+	/*
+		Blocks that are all below the ground level computed by the
+		mapgen are underground
+	*/
+	s16 blocks_x = blockpos_max.X - blockpos_min.X + 1;
+	s16 blocks_z = blockpos_max.Z - blockpos_min.Z + 1;
+	if(data->ground_levels.size() == (u32)(blocks_x * blocks_z))
+	{
+		for(s16 z=blockpos_min.Z; z<=blockpos_max.Z; z++)
+		for(s16 x=blockpos_min.X; x<=blockpos_max.X; x++)
+		{
+			s16 ground_level = data->ground_levels[
+					(z - blockpos_min.Z) * blocks_x + (x - blockpos_min.X)];
+			for(s16 y=blockpos_min.Y; y<=blockpos_max.Y &&
+					(y + 1) * MAP_BLOCKSIZE <= ground_level; y++)
+				getBlockNoCreateNoEx(v3s16(x, y, z))->setIsUnderground(true);
+		}
+	}
+
 	/*
 		Blit generated stuff to map
 		NOTE: blitBackAll adds nearly everything to changed_blocks
@@ -2723,6 +2727,10 @@ MapBlock* ServerMap::finishBlockMake(BlockMakeData *data,
 		*/
 		block->raiseModified(MOD_STATE_WRITE_NEEDED,
 				"finishBlockMake expireDayNightDiff");
+		/*
+			Blitting made it a full node array
+		*/
+		block->compact();
 	}
 
 	/*
@@ -3329,6 +3337,9 @@ void ServerMap::save(ModifiedState save_level)
 				saveBlock(block);
 				block_count++;
 
+				// Edits may have switched it to a full node array
+				block->compact();
+
 				/*infostream<<"ServerMap: Written block ("
 						<<block->getPos().X<<","
 						<<block->getPos().Y<<","
@@ -3403,6 +3414,46 @@ void ServerMap::listAllLoadableBlocks(std::list<v3s16> &dst)
 	}
 }
 
+bool ServerMap::listLoadableBlocks(std::vector<v3s16> &dst,
+		sqlite3_int64 &cursor, u32 max_count)
+{
+	verifyDatabase();
+
+	sqlite3_stmt *stmt = NULL;
+	if(sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks` WHERE "
+			"`pos`>? ORDER BY `pos` LIMIT ?", -1, &stmt, NULL) != SQLITE_OK){
+		errorstream<<"ServerMap::listLoadableBlocks(): "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		return false;
+	}
+	sqlite3_bind_int64(stmt, 1, cursor);
+	sqlite3_bind_int(stmt, 2, max_count);
+	u32 count = 0;
+	while(sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		cursor = sqlite3_column_int64(stmt, 0);
+		dst.push_back(getIntegerAsBlock(cursor));
+		count++;
+	}
+	sqlite3_finalize(stmt);
+	return count != 0;
+}
+
+u32 ServerMap::countLoadableBlocks()
+{
+	verifyDatabase();
+
+	sqlite3_stmt *stmt = NULL;
+	if(sqlite3_prepare(m_database, "SELECT COUNT(*) FROM `blocks`", -1,
+			&stmt, NULL) != SQLITE_OK)
+		return 0;
+	u32 count = 0;
+	if(sqlite3_step(stmt) == SQLITE_ROW)
+		count = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return count;
+}
+
 void ServerMap::saveMapMeta()
 {
 	DSTACK(__FUNCTION_NAME);
@@ -3705,24 +3756,32 @@ void ServerMap::saveBlock(MapBlock *block)
 
 	verifyDatabase();
 
-	std::ostringstream o(std::ios_base::binary);
+	BufferWriter &o = m_save_buffer;
+	o.clear();
 
-	o.write((char*)&version, 1);
+	writeU8(o, version);
 
 	// Write basic data
 	block->serialize(o, version, true);
 
 	// Write block to database
+	bool success = saveBlockData(p3d, o.data(), o.size());
+
+	// We just wrote it to the disk so clear modified flag
+	if (success)
+		block->resetModified();
+}
 
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
+bool ServerMap::saveBlockData(v3s16 p3d, const u8 *data, u32 size)
+{
+	verifyDatabase();
 
 	bool success = true;
 	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK) {
 		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
 		success = false;
 	}
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) { // TODO this mught not be the right length
+	if(sqlite3_bind_blob(m_database_write, 2, (const void *)data, size, NULL) != SQLITE_OK) {
 		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
 		success = false;
 	}
@@ -3734,10 +3793,25 @@ void ServerMap::saveBlock(MapBlock *block)
 	}
 	// Make ready for later reuse
 	sqlite3_reset(m_database_write);
+	return success;
+}
 
-	// We just wrote it to the disk so clear modified flag
-	if (success)
-		block->resetModified();
+bool ServerMap::loadBlockData(v3s16 p3d, std::string *data)
+{
+	verifyDatabase();
+
+	if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind block position for load: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	bool found = false;
+	if(sqlite3_step(m_database_read) == SQLITE_ROW) {
+		const char *blob = (const char *)sqlite3_column_blob(m_database_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_read, 0);
+		data->assign(blob, len);
+		found = true;
+	}
+	sqlite3_reset(m_database_read);
+	return found;
 }
 
 void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load)
@@ -3817,18 +3891,21 @@ void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSecto
 }
 
 void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load)
+{
+	loadBlock((const u8*)blob->data(), blob->size(), p3d, sector, save_after_load);
+}
+
+void ServerMap::loadBlock(const u8 *data, u32 size, v3s16 p3d, MapSector *sector, bool save_after_load)
 {
 	DSTACK(__FUNCTION_NAME);
 
 	try {
-		std::istringstream is(*blob, std::ios_base::binary);
+		BufferReader is(data, size);
 
-		u8 version = SER_FMT_VER_INVALID;
-		is.read((char*)&version, 1);
-
-		if(is.fail())
+		if(is.remaining() < 1)
 			throw SerializationError("ServerMap::loadBlock(): Failed"
 					" to read MapBlock version");
+		u8 version = readU8(is);
 
 		/*u32 block_size = MapBlock::serializedLength(version);
 		SharedBuffer<u8> data(block_size);
@@ -3906,12 +3983,11 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 			/*
 				Load block
 			*/
-			const char * data = (const char *)sqlite3_column_blob(m_database_read, 0);
+			const u8 *data = (const u8 *)sqlite3_column_blob(m_database_read, 0);
 			size_t len = sqlite3_column_bytes(m_database_read, 0);
 
-			std::string datastr(data, len);
-
-			loadBlock(&datastr, blockpos, sector, false);
+			// The blob stays valid until the statement is stepped again
+			loadBlock(data, len, blockpos, sector, false);
 
 			sqlite3_step(m_database_read);
 			// We should never get more than 1 row, so ok to reset
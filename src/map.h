@@ -28,6 +28,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <map>
 #include <list>
+#include <vector>
 
 #include "irrlichttypes_bloated.h"
 #include "mapnode.h"
@@ -36,7 +37,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapgen.h" //for BlockMakeData and EmergeManager
 #include "modifiedstate.h"
 #include "util/container.h"
+#include "util/serialize.h"
 #include "nodetimer.h"
+#include "mapblockindex.h"
 
 extern "C" {
 	#include "sqlite3.h"
@@ -51,6 +54,8 @@ class IGameDef;
 class IRollbackReportSink;
 class EmergeManager;
 struct BlockMakeData;
+class LiquidWorker;
+struct LiquidUpdate;
 
 
 /*
@@ -273,7 +278,8 @@ class Map /*: public NodeContainer*/
 	virtual void saveBlock(MapBlock *block){};
 
 	/*
-		Updates usage timers and unloads unused blocks and sectors.
+		Advances the usage clock and unloads unused blocks and sectors,
+		least recently used first, for at most map_unload_time_budget.
 		Saves modified blocks before unloading on MAPTYPE_SERVER.
 	*/
 	void timerUpdate(float dtime, float unload_timeout,
@@ -297,8 +303,15 @@ class Map /*: public NodeContainer*/
 	// For debug printing. Prints "Map: ", "ServerMap: " or "ClientMap: "
 	virtual void PrintInfo(std::ostream &out);
 
-	void transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks);
-	void transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks);
+	// Return the number of queued nodes that were looked at
+	u32 transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks);
+	u32 transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks);
+	// Only reads the map; safe to call from several threads at once
+	void computeLiquidUpdate(LiquidUpdate &u);
+	// Sets the new node and enqueues its neighbors
+	void applyLiquidUpdate(const LiquidUpdate &u,
+			std::map<v3s16, MapBlock*> &modified_blocks,
+			std::map<v3s16, MapBlock*> &lighting_modified_blocks);
 
 	/*
 		Node metadata
@@ -323,6 +336,15 @@ class Map /*: public NodeContainer*/
 	*/
 	std::map<v2s16, MapSector*> *getSectorsPtr(){return &m_sectors;}
 
+	// Called by MapSector when blocks are added to or removed from it
+	void insertedBlock(MapBlock *block);
+	void removedBlock(MapBlock *block);
+
+	// Called by MapBlock::resetUsageTimer()
+	void touchBlock(MapBlock *block);
+	// Sum of the dtimes given to timerUpdate()
+	double getUsageClock(){return m_usage_clock;}
+
 	/*
 		Variables
 	*/
@@ -344,8 +366,24 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
+	// All blocks of all sectors, for fast lookups by position
+	MapBlockIndex m_block_index;
+
+	// All blocks of all sectors in order of last use, least recent first
+	double m_usage_clock;
+	MapBlock *m_usage_first;
+	MapBlock *m_usage_last;
+	void usageUnlink(MapBlock *block);
+	void usageAppend(MapBlock *block);
+
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
+
+	// Threads that help computing liquid updates; created on first use
+	void startLiquidWorkers();
+	void stopLiquidWorkers();
+	bool m_liquid_workers_started;
+	std::vector<LiquidWorker*> m_liquid_workers;
 };
 
 /*
@@ -354,6 +392,9 @@ class Map /*: public NodeContainer*/
 	This is the only map class that is able to generate map.
 */
 
+// Smaller than the key of any block
+#define BLOCK_LIST_START (-((sqlite3_int64)1 << 62))
+
 class ServerMap : public Map
 {
 public:
@@ -435,6 +476,16 @@ class ServerMap : public Map
 	void save(ModifiedState save_level);
 	//void loadAll();
 	void listAllLoadableBlocks(std::list<v3s16> &dst);
+	/*
+		For going through a large database without listing it all at
+		once: lists the positions of at most max_count blocks in the
+		order of their keys, starting after the key in cursor, and
+		advances cursor. Start with cursor = BLOCK_LIST_START. Returns
+		false when there are no more blocks.
+	*/
+	bool listLoadableBlocks(std::vector<v3s16> &dst,
+			sqlite3_int64 &cursor, u32 max_count);
+	u32 countLoadableBlocks();
 	// Saves map seed and possibly other stuff
 	void saveMapMeta();
 	void loadMapMeta();
@@ -459,11 +510,19 @@ class ServerMap : public Map
 	//bool deFlushSector(v2s16 p2d);
 
 	void saveBlock(MapBlock *block);
+	/*
+		Raw access to the block database, for processing serialized
+		blocks without loading them. The data starts with the
+		serialization version.
+	*/
+	bool loadBlockData(v3s16 p, std::string *data);
+	bool saveBlockData(v3s16 p, const u8 *data, u32 size);
 	// This will generate a sector with getSector if not found.
 	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
 	MapBlock* loadBlock(v3s16 p);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
+	void loadBlock(const u8 *data, u32 size, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
@@ -507,6 +566,10 @@ class ServerMap : public Map
 	sqlite3_stmt *m_database_read;
 	sqlite3_stmt *m_database_write;
 	sqlite3_stmt *m_database_list;
+
+	// Blocks are serialized into this in saveBlock(); it keeps its
+	// allocation between saves
+	BufferWriter m_save_buffer;
 };
 
 #define VMANIP_BLOCK_DATA_INEXIST     1
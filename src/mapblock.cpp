@@ -20,6 +20,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <iterator> // istreambuf_iterator
+#include <cstring> // memcpy
 #include "map.h"
 // For g_settings
 #include "main.h"
@@ -57,10 +59,16 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_generated(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_disk_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
-		m_usage_timer(0),
+		m_usage_stamp(0),
+		m_usage_prev(NULL),
+		m_usage_next(NULL),
 		m_refcount(0)
 {
 	data = NULL;
+	m_palette = NULL;
+	m_palette_size = 0;
+	m_index_bits = 0;
+	m_indices = NULL;
 	if(dummy == false)
 		reallocate();
 	
@@ -84,8 +92,226 @@ MapBlock::~MapBlock()
 	}
 #endif
 
-	if(data)
-		delete[] data;
+	freeNodes();
+}
+
+void MapBlock::reallocate()
+{
+	freeNodes();
+	m_palette = new MapNode[1];
+	m_palette[0] = MapNode(CONTENT_IGNORE);
+	m_palette_size = 1;
+	m_index_bits = 0;
+	m_contents.reset();
+	m_contents.set(CONTENT_IGNORE);
+	raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
+}
+
+void MapBlock::freeNodes()
+{
+	delete[] data;
+	data = NULL;
+	delete[] m_palette;
+	m_palette = NULL;
+	m_palette_size = 0;
+	delete[] m_indices;
+	m_indices = NULL;
+	m_index_bits = 0;
+}
+
+void MapBlock::copyNodesTo(MapNode *dst, u32 first, u32 count)
+{
+	if(data != NULL){
+		memcpy(dst, &data[first], count * sizeof(MapNode));
+	} else if(m_index_bits == 0){
+		for(u32 i=0; i<count; i++)
+			dst[i] = m_palette[0];
+	} else if(m_index_bits == 4){
+		for(u32 i=0, j=first; i<count; i++, j++)
+			dst[i] = m_palette[(m_indices[j >> 1] >> ((j & 1) << 2)) & 0x0f];
+	} else {
+		for(u32 i=0; i<count; i++)
+			dst[i] = m_palette[m_indices[first + i]];
+	}
+}
+
+void MapBlock::expand()
+{
+	assert(m_palette != NULL);
+	MapNode *nodes = new MapNode[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	copyNodesTo(nodes, 0, MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE);
+	freeNodes();
+	data = nodes;
+}
+
+// The node as a single integer, for comparing and hashing
+static inline u32 packNode(const MapNode &n)
+{
+	return ((u32)n.param0 << 16) | ((u32)n.param1 << 8) | n.param2;
+}
+
+bool MapBlock::compact()
+{
+	if(data == NULL)
+		return (m_palette != NULL);
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	/*
+		Collect the distinct nodes into a small open addressing
+		table, giving up once there are too many of them
+	*/
+	const u32 table_size = 512;
+	u32 table_keys[table_size];
+	s16 table_values[table_size];
+	for(u32 i=0; i<table_size; i++)
+		table_values[i] = -1;
+	MapNode palette[256];
+	u16 palette_size = 0;
+	u8 *indices = new u8[nodecount];
+
+	u32 last_key = packNode(data[0]);
+	s16 last_index = -1;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		u32 key = packNode(data[i]);
+		// Runs of the same node are common
+		if(key != last_key || last_index < 0)
+		{
+			u32 slot = (key * 2654435761U) >> 23;
+			while(table_values[slot] >= 0 && table_keys[slot] != key)
+				slot = (slot + 1) & (table_size - 1);
+			if(table_values[slot] < 0)
+			{
+				if(palette_size == 256)
+				{
+					delete[] indices;
+					return false;
+				}
+				table_keys[slot] = key;
+				table_values[slot] = palette_size;
+				palette[palette_size++] = data[i];
+			}
+			last_key = key;
+			last_index = table_values[slot];
+		}
+		indices[i] = last_index;
+	}
+
+	delete[] data;
+	data = NULL;
+
+	if(palette_size == 1)
+	{
+		m_index_bits = 0;
+		m_palette = new MapNode[1];
+		delete[] indices;
+	}
+	else if(palette_size <= 16)
+	{
+		m_index_bits = 4;
+		m_palette = new MapNode[16];
+		m_indices = new u8[nodecount / 2];
+		for(u32 i=0; i<nodecount; i+=2)
+			m_indices[i >> 1] = indices[i] | (indices[i+1] << 4);
+		delete[] indices;
+	}
+	else
+	{
+		m_index_bits = 8;
+		m_palette = new MapNode[256];
+		m_indices = indices;
+	}
+	for(u16 i=0; i<palette_size; i++)
+		m_palette[i] = palette[i];
+	m_palette_size = palette_size;
+	return true;
+}
+
+void MapBlock::setNodeCompact(u32 i, const MapNode &n)
+{
+	u32 key = packNode(n);
+	u16 index = 0;
+	while(index < m_palette_size && packNode(m_palette[index]) != key)
+		index++;
+
+	if(index == m_palette_size)
+	{
+		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+		u16 capacity = m_index_bits == 0 ? 1 : (1 << m_index_bits);
+		if(m_palette_size == capacity)
+		{
+			// Out of palette space; move to wider indexes
+			if(m_index_bits == 8)
+			{
+				expand();
+				data[i] = n;
+				return;
+			}
+			MapNode *palette = new MapNode[m_index_bits == 0 ? 16 : 256];
+			for(u16 j=0; j<m_palette_size; j++)
+				palette[j] = m_palette[j];
+			delete[] m_palette;
+			m_palette = palette;
+			if(m_index_bits == 0)
+			{
+				m_indices = new u8[nodecount / 2];
+				memset(m_indices, 0, nodecount / 2);
+				m_index_bits = 4;
+			}
+			else
+			{
+				u8 *indices = new u8[nodecount];
+				for(u32 j=0; j<nodecount; j++)
+					indices[j] = (m_indices[j >> 1] >> ((j & 1) << 2)) & 0x0f;
+				delete[] m_indices;
+				m_indices = indices;
+				m_index_bits = 8;
+			}
+		}
+		m_palette[m_palette_size++] = n;
+	}
+
+	if(m_index_bits == 0)
+	{
+		// Still the single value
+	}
+	else if(m_index_bits == 4)
+	{
+		u8 shift = (i & 1) << 2;
+		m_indices[i >> 1] = (m_indices[i >> 1] & ~(0x0f << shift))
+				| (index << shift);
+	}
+	else
+	{
+		m_indices[i] = index;
+	}
+}
+
+u32 MapBlock::getNodeStorageSize()
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(data != NULL)
+		return nodecount * sizeof(MapNode);
+	if(m_palette == NULL)
+		return 0;
+	if(m_index_bits == 0)
+		return sizeof(MapNode);
+	return (1 << m_index_bits) * sizeof(MapNode)
+			+ nodecount * m_index_bits / 8;
+}
+
+void MapBlock::resetUsageTimer()
+{
+	if(m_parent)
+		m_parent->touchBlock(this);
+}
+
+float MapBlock::getUsageTimer()
+{
+	if(m_parent == NULL)
+		return 0;
+	return m_parent->getUsageClock() - m_usage_stamp;
 }
 
 bool MapBlock::isValidPositionParent(v3s16 p)
@@ -107,9 +333,7 @@ MapNode MapBlock::getNodeParent(v3s16 p)
 	}
 	else
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		return getNodeNoCheck(p);
 	}
 }
 
@@ -121,9 +345,8 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 	}
 	else
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		setNodeAt(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X, n);
+		addContent(n.getContent());
 	}
 }
 
@@ -141,11 +364,11 @@ MapNode MapBlock::getNodeParentNoEx(v3s16 p)
 	}
 	else
 	{
-		if(data == NULL)
+		if(isDummy())
 		{
 			return MapNode(CONTENT_IGNORE);
 		}
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		return getNodeNoCheck(p);
 	}
 }
 
@@ -168,7 +391,7 @@ MapNode MapBlock::getNodeParentNoEx(v3s16 p)
 	if black_air_left!=NULL, it is set to true if non-sunlighted
 	air is left in block.
 */
-bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
+bool MapBlock::propagateSunlight(std::vector<v3s16> & light_sources,
 		bool remove_light, bool *black_air_left)
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
@@ -177,6 +400,16 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 	bool block_below_is_valid = true;
 	
 	v3s16 pos_relative = getPosRelative();
+
+	// Look up the neighbors once instead of once per column
+	MapBlock *block_above = m_parent->getBlockNoCreateNoEx(
+			m_pos + v3s16(0,1,0));
+	if(block_above != NULL && block_above->isDummy())
+		block_above = NULL;
+	MapBlock *block_below = m_parent->getBlockNoCreateNoEx(
+			m_pos + v3s16(0,-1,0));
+	if(block_below != NULL && block_below->isDummy())
+		block_below = NULL;
 	
 	for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 	{
@@ -186,8 +419,9 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 			bool no_sunlight = false;
 			bool no_top_block = false;
 			// Check if node above block has sunlight
-			try{
-				MapNode n = getNodeParent(v3s16(x, MAP_BLOCKSIZE, z));
+			if(block_above != NULL)
+			{
+				MapNode n = block_above->getNodeNoCheck(x, 0, z);
 				if(n.getContent() == CONTENT_IGNORE)
 				{
 					// Trust heuristics
@@ -198,7 +432,7 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 					no_sunlight = true;
 				}
 			}
-			catch(InvalidPositionException &e)
+			else
 			{
 				no_top_block = true;
 				
@@ -287,7 +521,7 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 				
 				if(diminish_light(current_light) != 0)
 				{
-					light_sources.insert(pos_relative + pos);
+					light_sources.push_back(pos_relative + pos);
 				}
 
 				if(current_light == 0 && stopped_to_solid_object)
@@ -310,11 +544,10 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 				
 				Ignore non-transparent nodes as they always have no light
 			*/
-			try
+			// If there is no block below, there is no need to panic.
+			if(block_below_is_valid && block_below != NULL)
 			{
-			if(block_below_is_valid)
-			{
-				MapNode n = getNodeParent(v3s16(x, -1, z));
+				MapNode n = block_below->getNodeNoCheck(x, MAP_BLOCKSIZE-1, z);
 				if(nodemgr->get(n).light_propagates)
 				{
 					if(n.getLight(LIGHTBANK_DAY, nodemgr) == LIGHT_SUN
@@ -324,13 +557,6 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 							&& sunlight_should_go_down == true)
 						block_below_is_valid = false;
 				}
-			}//if
-			}//try
-			catch(InvalidPositionException &e)
-			{
-				/*std::cout<<"InvalidBlockException for bottom block node"
-						<<std::endl;*/
-				// Just no block below, no need to panic.
 			}
 		}
 	}
@@ -345,8 +571,24 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
 	// Copy from data to VoxelManipulator
-	dst.copyFrom(data, data_area, v3s16(0,0,0),
-			getPosRelative(), data_size);
+	if(data != NULL)
+	{
+		dst.copyFrom(data, data_area, v3s16(0,0,0),
+				getPosRelative(), data_size);
+		return;
+	}
+	// Decode compact storage straight into the VoxelManipulator, a row
+	// at a time, without switching to a full array
+	v3s16 p0 = getPosRelative();
+	for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+	for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+	{
+		s32 i_local = dst.m_area.index(p0.X, p0.Y+y, p0.Z+z);
+		copyNodesTo(&dst.m_data[i_local],
+				z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE,
+				MAP_BLOCKSIZE);
+		memset(&dst.m_flags[i_local], 0, MAP_BLOCKSIZE);
+	}
 }
 
 void MapBlock::copyFrom(VoxelManipulator &dst)
@@ -355,8 +597,24 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
 	// Copy from VoxelManipulator to data
-	dst.copyTo(data, data_area, v3s16(0,0,0),
+	dst.copyTo(getData(), data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	updateContentIndex();
+}
+
+void MapBlock::updateContentIndex()
+{
+	m_contents.reset();
+	if(data == NULL)
+	{
+		// Unused palette entries only make this less exact
+		for(u16 i=0; i<m_palette_size; i++)
+			addContent(m_palette[i].getContent());
+		return;
+	}
+	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+		addContent(data[i].getContent());
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -365,20 +623,29 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	// Running this function un-expires m_day_night_differs
 	m_day_night_differs_expired = false;
 
-	if(data == NULL)
+	if(isDummy())
 	{
 		m_day_night_differs = false;
 		return;
 	}
 
+	// Compact blocks only need their palette checked
+	MapNode *nodes = data;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(nodes == NULL)
+	{
+		nodes = m_palette;
+		nodecount = m_palette_size;
+	}
+
 	bool differs = false;
 
 	/*
 		Check if any lighting value differs
 	*/
-	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	for(u32 i=0; i<nodecount; i++)
 	{
-		MapNode &n = data[i];
+		MapNode &n = nodes[i];
 		if(n.getLight(LIGHTBANK_DAY, nodemgr) != n.getLight(LIGHTBANK_NIGHT, nodemgr))
 		{
 			differs = true;
@@ -393,9 +660,9 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	if(differs)
 	{
 		bool only_air = true;
-		for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+		for(u32 i=0; i<nodecount; i++)
 		{
-			MapNode &n = data[i];
+			MapNode &n = nodes[i];
 			if(n.getContent() != CONTENT_AIR)
 			{
 				only_air = false;
@@ -414,7 +681,7 @@ void MapBlock::expireDayNightDiff()
 {
 	//INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if(data == NULL){
+	if(isDummy()){
 		m_day_night_differs = false;
 		m_day_night_differs_expired = false;
 		return;
@@ -432,7 +699,7 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			MapNode n = getNodeNoCheck(p2d.X, y, p2d.Y);
 			if(m_gamedef->ndef()->get(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -508,25 +775,41 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	// correct ids.
 	std::set<content_t> unnamed_contents;
 	std::set<std::string> unallocatable_contents;
+	// Each local id is looked up by name only once; ids that can't be
+	// translated map to themselves
+	std::map<content_t, content_t> translation;
+	content_t last_local_id = CONTENT_IGNORE;
+	content_t last_global_id = CONTENT_IGNORE;
+	bool have_last = false;
 	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
 	{
 		content_t local_id = nodes[i].getContent();
-		std::string name;
-		bool found = nimap->getName(local_id, name);
-		if(!found){
-			unnamed_contents.insert(local_id);
+		if(have_last && local_id == last_local_id){
+			nodes[i].setContent(last_global_id);
 			continue;
 		}
-		content_t global_id;
-		found = nodedef->getId(name, global_id);
-		if(!found){
-			global_id = gamedef->allocateUnknownNodeId(name);
-			if(global_id == CONTENT_IGNORE){
-				unallocatable_contents.insert(name);
-				continue;
+		content_t global_id = local_id;
+		std::map<content_t, content_t>::iterator j = translation.find(local_id);
+		if(j != translation.end()){
+			global_id = j->second;
+		} else {
+			std::string name;
+			bool found = nimap->getName(local_id, name);
+			if(!found){
+				unnamed_contents.insert(local_id);
+			} else if(!nodedef->getId(name, global_id)){
+				global_id = gamedef->allocateUnknownNodeId(name);
+				if(global_id == CONTENT_IGNORE){
+					unallocatable_contents.insert(name);
+					global_id = local_id;
+				}
 			}
+			translation[local_id] = global_id;
 		}
 		nodes[i].setContent(global_id);
+		last_local_id = local_id;
+		last_global_id = global_id;
+		have_last = true;
 	}
 	for(std::set<content_t>::const_iterator
 			i = unnamed_contents.begin();
@@ -544,12 +827,12 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	}
 }
 
-void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
+void MapBlock::serialize(BufferWriter &os, u8 version, bool disk)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 	
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -580,8 +863,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	if(disk)
 	{
 		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
+		copyNodesTo(tmp_nodes, 0, nodecount);
 		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
 
 		u8 content_width = 2;
@@ -598,16 +880,27 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		u8 params_width = 2;
 		writeU8(os, content_width);
 		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
-				content_width, params_width, true);
+		if(data != NULL)
+		{
+			MapNode::serializeBulk(os, version, data, nodecount,
+					content_width, params_width, true);
+		}
+		else
+		{
+			MapNode *tmp_nodes = new MapNode[nodecount];
+			copyNodesTo(tmp_nodes, 0, nodecount);
+			MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
+					content_width, params_width, true);
+			delete[] tmp_nodes;
+		}
 	}
 	
 	/*
 		Node metadata
 	*/
-	std::ostringstream oss(std::ios_base::binary);
-	m_node_metadata.serialize(oss);
-	compressZlib(oss.str(), os);
+	BufferWriter metadata;
+	m_node_metadata.serialize(metadata);
+	compress(metadata.data(), metadata.size(), os, version);
 
 	/*
 		Data that goes to disk, but not the network
@@ -635,21 +928,35 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	}
 }
 
-void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
+void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
+{
+	BufferWriter buf;
+	serialize(buf, version, disk);
+	os.write((const char*)buf.data(), buf.size());
+}
+
+void MapBlock::deSerialize(BufferReader &is, u8 version, bool disk)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 	
-	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
-
-	m_day_night_differs_expired = false;
-
 	if(version <= 21)
 	{
-		deSerialize_pre22(is, version, disk);
+		// The legacy format is only read from streams
+		BufferReaderStreamBuf sb(is);
+		std::istream legacy_is(&sb);
+		deSerialize(legacy_is, version, disk);
+		sb.finish();
 		return;
 	}
 
+	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
+
+	m_day_night_differs_expired = false;
+
+	// Nodes are read into a full array and compacted afterwards
+	getData();
+
 	u8 flags = readU8(is);
 	is_underground = (flags & 0x01) ? true : false;
 	m_day_night_differs = (flags & 0x02) ? true : false;
@@ -678,15 +985,21 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 			<<": Node metadata"<<std::endl);
 	// Ignore errors
 	try{
-		std::ostringstream oss(std::ios_base::binary);
-		decompressZlib(is, oss);
-		std::istringstream iss(oss.str(), std::ios_base::binary);
+		BufferWriter metadata;
+		decompress(is, metadata, version);
+		BufferReader metadata_is(metadata.data(), metadata.size());
 		if(version >= 23)
-			m_node_metadata.deSerialize(iss, m_gamedef);
+		{
+			m_node_metadata.deSerialize(metadata_is, m_gamedef);
+		}
 		else
-			content_nodemeta_deserialize_legacy(iss,
+		{
+			BufferReaderStreamBuf sb(metadata_is);
+			std::istream legacy_is(&sb);
+			content_nodemeta_deserialize_legacy(legacy_is,
 					&m_node_metadata, &m_node_timers,
 					m_gamedef);
+		}
 	}
 	catch(SerializationError &e)
 	{
@@ -735,11 +1048,43 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 			m_node_timers.deSerialize(is, version);
 		}
 	}
+
+	compact();
+	updateContentIndex();
 		
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 			<<": Done."<<std::endl);
 }
 
+void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
+{
+	if(!ser_ver_supported(version))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+
+	if(version <= 21)
+	{
+		TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
+		m_day_night_differs_expired = false;
+		getData();
+		deSerialize_pre22(is, version, disk);
+		compact();
+		updateContentIndex();
+		return;
+	}
+
+	// The length isn't known up front, so take the rest of the stream
+	// and give back what wasn't used
+	std::string data((std::istreambuf_iterator<char>(is)),
+			std::istreambuf_iterator<char>());
+	BufferReader reader((const u8*)data.data(), data.size());
+	deSerialize(reader, version, disk);
+	if(reader.remaining() != 0)
+	{
+		is.clear();
+		is.seekg(-(std::streamoff)reader.remaining(), std::ios_base::cur);
+	}
+}
+
 /*
 	Legacy serialization
 */
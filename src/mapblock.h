@@ -24,6 +24,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <jmutexautolock.h>
 #include <exception>
 #include <set>
+#include <vector>
+#include <bitset>
 #include "debug.h"
 #include "irrlichttypes.h"
 #include "irr_v3d.h"
@@ -46,6 +48,9 @@ class MapBlockMesh;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
+// One bit per content id, see MapBlock::mayContainAny()
+typedef std::bitset<MAX_CONTENT+1> ContentBitset;
+
 /*// Named by looking towards z+
 enum{
 	FACE_BACK=0,
@@ -123,18 +128,8 @@ class MapBlock /*: public NodeContainer*/
 		return m_parent;
 	}
 
-	void reallocate()
-	{
-		if(data != NULL)
-			delete[] data;
-		u32 l = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
-		data = new MapNode[l];
-		for(u32 i=0; i<l; i++){
-			//data[i] = MapNode();
-			data[i] = MapNode(CONTENT_IGNORE);
-		}
-		raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
-	}
+	// Fills the block with CONTENT_IGNORE (stored as a single value)
+	void reallocate();
 
 	/*
 		Flags
@@ -142,7 +137,7 @@ class MapBlock /*: public NodeContainer*/
 
 	bool isDummy()
 	{
-		return (data == NULL);
+		return (data == NULL && m_palette == NULL);
 	}
 	void unDummify()
 	{
@@ -226,7 +221,7 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(m_lighting_expired)
 			return false;
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return true;
 	}
@@ -259,7 +254,7 @@ class MapBlock /*: public NodeContainer*/
 	
 	bool isValidPosition(v3s16 p)
 	{
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return (p.X >= 0 && p.X < MAP_BLOCKSIZE
 				&& p.Y >= 0 && p.Y < MAP_BLOCKSIZE
@@ -268,12 +263,10 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNode(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return getNodeNoCheck(x, y, z);
 	}
 	
 	MapNode getNode(v3s16 p)
@@ -292,12 +285,11 @@ class MapBlock /*: public NodeContainer*/
 	
 	void setNode(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		setNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
+		addContent(n.getContent());
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
 	}
 	
@@ -312,9 +304,7 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNodeNoCheck(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return getNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 	
 	MapNode getNodeNoCheck(v3s16 p)
@@ -324,9 +314,8 @@ class MapBlock /*: public NodeContainer*/
 	
 	void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		setNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
+		addContent(n.getContent());
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -335,6 +324,37 @@ class MapBlock /*: public NodeContainer*/
 		setNodeNoCheck(p.X, p.Y, p.Z, n);
 	}
 
+	/*
+		Raw node array for bulk operations like lighting, indexed as
+		z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x.
+		NULL for dummy blocks. Switches compact blocks to a full array,
+		so readers should use getNodeNoCheck() or copyTo() instead.
+		Writers must not change node contents (the content index is
+		not updated) and must call raiseModified() themselves.
+	*/
+	MapNode * getData()
+	{
+		if(data == NULL && m_palette != NULL)
+			expand();
+		return data;
+	}
+
+	/*
+		Compact node storage.
+		A block with at most 256 distinct nodes can be kept as a palette
+		of them plus a 0 (single value), 4 or 8 bit index per node
+		instead of a full 16 KB array. setNode() moves to wider indexes
+		or to a full array as needed; getData() always makes it full.
+	*/
+	// Switches to the smallest representation. Returns true if compact.
+	bool compact();
+	bool isCompact()
+	{
+		return (m_palette != NULL);
+	}
+	// Bytes used for node storage
+	u32 getNodeStorageSize();
+
 	/*
 		These functions consult the parent container if the position
 		is not valid on this MapBlock.
@@ -353,7 +373,7 @@ class MapBlock /*: public NodeContainer*/
 	}
 
 	// See comments in mapblock.cpp
-	bool propagateSunlight(std::set<v3s16> & light_sources,
+	bool propagateSunlight(std::vector<v3s16> & light_sources,
 			bool remove_light=false, bool *black_air_left=NULL);
 	
 	// Copies data to VoxelManipulator to getPosRelative()
@@ -380,6 +400,22 @@ class MapBlock /*: public NodeContainer*/
 		return m_day_night_differs;
 	}
 
+	/*
+		Content presence index.
+		Bits are set when a content is written into the block and
+		only cleared when the whole block is rewritten (deSerialize,
+		copyFrom), so a set bit means "may be present" and a cleared
+		bit means "certainly not present".
+	*/
+	bool mayContainAny(const ContentBitset &contents)
+	{
+		if(isDummy())
+			return contents.test(CONTENT_IGNORE);
+		return (m_contents & contents).any();
+	}
+	// Rebuilds the index from the node data
+	void updateContentIndex();
+
 	/*
 		Miscellaneous stuff
 	*/
@@ -417,20 +453,11 @@ class MapBlock /*: public NodeContainer*/
 	}
 	
 	/*
-		See m_usage_timer
+		See m_usage_stamp
 	*/
-	void resetUsageTimer()
-	{
-		m_usage_timer = 0;
-	}
-	void incrementUsageTimer(float dtime)
-	{
-		m_usage_timer += dtime;
-	}
-	u32 getUsageTimer()
-	{
-		return m_usage_timer;
-	}
+	void resetUsageTimer();
+	// Seconds since the last resetUsageTimer()
+	float getUsageTimer();
 
 	/*
 		See m_refcount
@@ -474,9 +501,12 @@ class MapBlock /*: public NodeContainer*/
 	
 	// These don't write or read version by itself
 	// Set disk to true for on-disk format, false for over-the-network format
+	void serialize(BufferWriter &os, u8 version, bool disk);
 	void serialize(std::ostream &os, u8 version, bool disk);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
+	void deSerialize(BufferReader &is, u8 version, bool disk);
+	// Reads the rest of the stream and leaves it after the block data
 	void deSerialize(std::istream &is, u8 version, bool disk);
 
 private:
@@ -492,11 +522,11 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode & getNodeRef(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
+		if(getData() == NULL)
+			throw InvalidPositionException();
 		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
 	}
 	MapNode & getNodeRef(v3s16 &p)
@@ -504,6 +534,46 @@ class MapBlock /*: public NodeContainer*/
 		return getNodeRef(p.X, p.Y, p.Z);
 	}
 
+	/*
+		Node storage access by index, whatever the representation
+	*/
+
+	MapNode getNodeAt(u32 i)
+	{
+		if(data != NULL)
+			return data[i];
+		if(m_palette == NULL)
+			throw InvalidPositionException();
+		if(m_index_bits == 0)
+			return m_palette[0];
+		if(m_index_bits == 4)
+			return m_palette[(m_indices[i >> 1] >> ((i & 1) << 2)) & 0x0f];
+		return m_palette[m_indices[i]];
+	}
+	void setNodeAt(u32 i, const MapNode &n)
+	{
+		if(data != NULL)
+			data[i] = n;
+		else if(m_palette != NULL)
+			setNodeCompact(i, n);
+		else
+			throw InvalidPositionException();
+	}
+	void setNodeCompact(u32 i, const MapNode &n);
+	// Decodes count nodes starting from index first into dst
+	void copyNodesTo(MapNode *dst, u32 first, u32 count);
+	// Switches a compact block to a full array
+	void expand();
+	void freeNodes();
+
+	void addContent(content_t c)
+	{
+		// Ids above MAX_CONTENT can't be registered and thus never
+		// match any lookup
+		if(c <= MAX_CONTENT)
+			m_contents.set(c);
+	}
+
 public:
 	/*
 		Public member variables
@@ -531,10 +601,20 @@ class MapBlock /*: public NodeContainer*/
 	IGameDef *m_gamedef;
 	
 	/*
-		If NULL, block is a dummy block.
+		Node storage; data is used if non-NULL, otherwise the compact
+		storage (m_palette, m_indices) is used if m_palette is non-NULL.
+		If both are NULL, block is a dummy block.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
 	MapNode * data;
+	MapNode * m_palette;
+	u16 m_palette_size;
+	// 0: all nodes are m_palette[0], 4 or 8: bits per node in m_indices
+	u8 m_index_bits;
+	u8 * m_indices;
+
+	// See mayContainAny()
+	ContentBitset m_contents;
 
 	/*
 		- On the server, this is used for telling whether the
@@ -579,10 +659,15 @@ class MapBlock /*: public NodeContainer*/
 	u32 m_disk_timestamp;
 
 	/*
-		When the block is accessed, this is set to 0.
-		Map will unload the block when this reaches a timeout.
+		When the block is accessed, this is set to the parent Map's usage
+		clock. Map will unload the block when it has not been accessed for
+		a timeout.
 	*/
-	float m_usage_timer;
+	double m_usage_stamp;
+	// Links in the parent Map's list of blocks in order of last use
+	MapBlock *m_usage_prev;
+	MapBlock *m_usage_next;
+	friend class Map;
 
 	/*
 		Reference count; currently used for determining if this block is in
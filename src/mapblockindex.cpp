@@ -0,0 +1,225 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "mapblockindex.h"
+#include "debug.h"
+#include <string.h>
+
+/*
+	Per-thread cache of recently used blocks.
+
+	Each thread remembers the last few blocks it looked up in one
+	index. Deleting a block from any index bumps a global generation
+	counter, which makes every thread drop its cached pointers before
+	their next use. Failed lookups are not cached, so insertions need
+	no invalidation.
+*/
+
+#ifdef _MSC_VER
+	#define MAPBLOCK_THREAD_LOCAL __declspec(thread)
+#else
+	#define MAPBLOCK_THREAD_LOCAL __thread
+#endif
+
+#define BLOCK_CACHE_SIZE 4
+
+struct ThreadBlockCache
+{
+	const MapBlockIndex *index;
+	u32 generation;
+	u32 count;
+	u64 keys[BLOCK_CACHE_SIZE];
+	MapBlock *blocks[BLOCK_CACHE_SIZE];
+};
+
+static MAPBLOCK_THREAD_LOCAL ThreadBlockCache g_block_cache;
+static volatile u32 g_block_cache_generation = 1;
+
+#define MIN_CAPACITY 64
+
+MapBlockIndex::MapBlockIndex():
+	m_keys(NULL),
+	m_blocks(NULL),
+	m_capacity(0),
+	m_mask(0),
+	m_count(0)
+{
+	resize(MIN_CAPACITY);
+}
+
+MapBlockIndex::~MapBlockIndex()
+{
+	clear();
+	delete[] m_keys;
+	delete[] m_blocks;
+}
+
+MapBlock * MapBlockIndex::get(v3s16 p)
+{
+	u64 key = packPos(p);
+	ThreadBlockCache &cache = g_block_cache;
+
+	if(cache.index != this || cache.generation != g_block_cache_generation){
+		cache.index = this;
+		cache.generation = g_block_cache_generation;
+		cache.count = 0;
+	}
+
+	for(u32 i=0; i<cache.count; i++){
+		if(cache.keys[i] != key)
+			continue;
+		MapBlock *block = cache.blocks[i];
+		// Move to front
+		for(u32 j=i; j>0; j--){
+			cache.keys[j] = cache.keys[j-1];
+			cache.blocks[j] = cache.blocks[j-1];
+		}
+		cache.keys[0] = key;
+		cache.blocks[0] = block;
+		return block;
+	}
+
+	MapBlock *block = find(key);
+	if(block == NULL)
+		return NULL;
+
+	// Put in front, dropping the least recently used one if full
+	if(cache.count < BLOCK_CACHE_SIZE)
+		cache.count++;
+	for(u32 j=cache.count-1; j>0; j--){
+		cache.keys[j] = cache.keys[j-1];
+		cache.blocks[j] = cache.blocks[j-1];
+	}
+	cache.keys[0] = key;
+	cache.blocks[0] = block;
+	return block;
+}
+
+void MapBlockIndex::insert(v3s16 p, MapBlock *block)
+{
+	assert(block != NULL);
+
+	// Keep the load factor at most 1/2 so that probe chains stay short
+	if((m_count + 1) * 2 > m_capacity)
+		resize(m_capacity * 2);
+
+	u64 key = packPos(p);
+	u32 i = slotOf(key);
+	while(m_blocks[i] != NULL){
+		if(m_keys[i] == key){
+			// Replacing; the old pointer may be cached somewhere
+			m_blocks[i] = block;
+			invalidateCaches();
+			return;
+		}
+		i = (i + 1) & m_mask;
+	}
+	m_keys[i] = key;
+	m_blocks[i] = block;
+	m_count++;
+}
+
+void MapBlockIndex::remove(v3s16 p)
+{
+	u64 key = packPos(p);
+	u32 i = slotOf(key);
+	for(;;){
+		if(m_blocks[i] == NULL)
+			return;
+		if(m_keys[i] == key)
+			break;
+		i = (i + 1) & m_mask;
+	}
+
+	invalidateCaches();
+	m_blocks[i] = NULL;
+	m_count--;
+
+	/*
+		Shift following entries of the probe chain back so that no
+		tombstones are needed. An entry can fill the hole at i unless
+		its home slot lies cyclically in (i, j].
+	*/
+	u32 j = i;
+	for(;;){
+		j = (j + 1) & m_mask;
+		if(m_blocks[j] == NULL)
+			break;
+		u32 home = slotOf(m_keys[j]);
+		bool in_range = (i < j) ? (home > i && home <= j) :
+				(home > i || home <= j);
+		if(in_range)
+			continue;
+		m_keys[i] = m_keys[j];
+		m_blocks[i] = m_blocks[j];
+		m_blocks[j] = NULL;
+		i = j;
+	}
+}
+
+void MapBlockIndex::clear()
+{
+	invalidateCaches();
+	memset(m_blocks, 0, m_capacity * sizeof(MapBlock*));
+	m_count = 0;
+}
+
+MapBlock * MapBlockIndex::find(u64 key) const
+{
+	u32 i = slotOf(key);
+	for(;;){
+		MapBlock *block = m_blocks[i];
+		if(block == NULL || m_keys[i] == key)
+			return block;
+		i = (i + 1) & m_mask;
+	}
+}
+
+void MapBlockIndex::resize(u32 capacity)
+{
+	u64 *old_keys = m_keys;
+	MapBlock **old_blocks = m_blocks;
+	u32 old_capacity = m_capacity;
+
+	m_keys = new u64[capacity];
+	m_blocks = new MapBlock*[capacity];
+	memset(m_blocks, 0, capacity * sizeof(MapBlock*));
+	m_capacity = capacity;
+	m_mask = capacity - 1;
+
+	for(u32 i=0; i<old_capacity; i++){
+		if(old_blocks[i] == NULL)
+			continue;
+		u32 j = slotOf(old_keys[i]);
+		while(m_blocks[j] != NULL)
+			j = (j + 1) & m_mask;
+		m_keys[j] = old_keys[i];
+		m_blocks[j] = old_blocks[i];
+	}
+
+	delete[] old_keys;
+	delete[] old_blocks;
+}
+
+void MapBlockIndex::invalidateCaches()
+{
+	g_block_cache_generation++;
+}
+
@@ -0,0 +1,81 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MAPBLOCKINDEX_HEADER
+#define MAPBLOCKINDEX_HEADER
+
+#include "irrlichttypes_bloated.h"
+
+class MapBlock;
+
+/*
+	Flat index of all loaded MapBlocks of a Map, keyed by block position.
+
+	This is an open-addressing hash table with linear probing. Lookups
+	first go through a small per-thread cache of recently used blocks.
+
+	The MapSectors still own the blocks; they keep the index up to date
+	when blocks are inserted and deleted.
+*/
+class MapBlockIndex
+{
+public:
+	MapBlockIndex();
+	~MapBlockIndex();
+
+	// Returns NULL if not found
+	MapBlock * get(v3s16 p);
+	// The position must not be in the index yet
+	void insert(v3s16 p, MapBlock *block);
+	void remove(v3s16 p);
+	void clear();
+
+	u32 size() const
+	{ return m_count; }
+
+private:
+	// Not copyable
+	MapBlockIndex(const MapBlockIndex &);
+	MapBlockIndex& operator=(const MapBlockIndex &);
+
+	static inline u64 packPos(v3s16 p)
+	{
+		return (u64)(u16)p.X | ((u64)(u16)p.Y << 16) | ((u64)(u16)p.Z << 32);
+	}
+	inline u32 slotOf(u64 key) const
+	{
+		// Fibonacci hashing; the high bits are the best mixed
+		return (u32)((key * 0x9E3779B97F4A7C15ULL) >> 32) & m_mask;
+	}
+	MapBlock * find(u64 key) const;
+	void resize(u32 capacity);
+	// Drops cached pointers in every thread
+	static void invalidateCaches();
+
+	u64 *m_keys;
+	// NULL marks a free slot
+	MapBlock **m_blocks;
+	u32 m_capacity;
+	u32 m_mask;
+	u32 m_count;
+};
+
+#endif
+
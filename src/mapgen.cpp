@@ -34,6 +34,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "main.h" // For g_profiler
 #include "treegen.h"
 #include "mapgen_v6.h"
+#include <jmutexautolock.h>
 
 FlagDesc flagdesc_mapgen[] = {
 	{"trees",          MG_TREES},
@@ -42,6 +43,7 @@ FlagDesc flagdesc_mapgen[] = {
 	{"v6_jungles",     MGV6_JUNGLES},
 	{"v6_biome_blend", MGV6_BIOME_BLEND},
 	{"flat",           MG_FLAT},
+	{"v6_noise_caves", MGV6_NOISECAVES},
 	{NULL,             0}
 };
 
@@ -126,6 +128,13 @@ void OreScatter::generate(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax) {
 	int orechance = (csize * csize * csize) / clust_num_ores;
 	int nclusters = volume / clust_scarcity;
 
+	// Clusters are inside the chunk, so the nodes of a cluster are
+	// reached by stepping through the voxel area
+	v3s16 em = vm->m_area.getExtent();
+	u32 ystride = em.X;
+	u32 zstride = em.X * em.Y;
+	MapNode *data = vm->m_data;
+
 	for (int i = 0; i != nclusters; i++) {
 		int x0 = pr.range(nmin.X, nmax.X - csize + 1);
 		int y0 = pr.range(ymin,   ymax   - csize + 1);
@@ -134,15 +143,17 @@ void OreScatter::generate(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax) {
 		if (np && (NoisePerlin3D(np, x0, y0, z0, mg->seed) < nthresh))
 			continue;
 		
-		for (int z1 = 0; z1 != csize; z1++)
-		for (int y1 = 0; y1 != csize; y1++)
-		for (int x1 = 0; x1 != csize; x1++) {
-			if (pr.range(1, orechance) != 1)
-				continue;
-			
-			u32 i = vm->m_area.index(x0 + x1, y0 + y1, z0 + z1);
-			if (vm->m_data[i].getContent() == wherein)
-				vm->m_data[i] = n_ore;
+		u32 zi = vm->m_area.index(x0, y0, z0);
+		for (int z1 = 0; z1 != csize; z1++, zi += zstride) {
+			u32 yi = zi;
+			for (int y1 = 0; y1 != csize; y1++, yi += ystride) {
+				u32 vi = yi;
+				for (int x1 = 0; x1 != csize; x1++, vi++) {
+					if (pr.range(1, orechance) == 1 &&
+						data[vi].getContent() == wherein)
+						data[vi] = n_ore;
+				}
+			}
 		}
 	}
 }
@@ -184,6 +195,8 @@ void OreSheet::generate(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax) {
 	int max_height = clust_size;
 	int y_start = pr.range(ymin, ymax - max_height);
 	
+	// The noise map is computed once for the whole chunk
+	Noise *&noise = mg->ore_noises[this];
 	if (!noise) {
 		int sx = nmax.X - nmin.X + 1;
 		int sz = nmax.Z - nmin.Z + 1;
@@ -192,6 +205,11 @@ void OreSheet::generate(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax) {
 	noise->seed = mg->seed + y_start;
 	noise->perlinMap2D(x0, z0);
 	
+	v3s16 em = vm->m_area.getExtent();
+	s16 area_ymin = vm->m_area.MinEdge.Y;
+	s16 area_ymax = vm->m_area.MaxEdge.Y;
+	MapNode *data = vm->m_data;
+
 	int index = 0;
 	for (int z = z0; z != z1; z++)
 	for (int x = x0; x != x1; x++) {
@@ -202,18 +220,108 @@ void OreSheet::generate(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax) {
 		int height = max_height * (1. / pr.range(1, 3));
 		int y0 = y_start + np->scale * noiseval; //pr.range(1, 3) - 1;
 		int y1 = y0 + height;
-		for (int y = y0; y != y1; y++) {
-			u32 i = vm->m_area.index(x, y, z);
-			if (!vm->m_area.contains(i))
-				continue;
-				
-			if (vm->m_data[i].getContent() == wherein)
-				vm->m_data[i] = n_ore;
+
+		// Only the part of the sheet inside the voxel area
+		y0 = MYMAX(y0, area_ymin);
+		y1 = MYMIN(y1, area_ymax + 1);
+		if (y0 >= y1)
+			continue;
+
+		u32 i = vm->m_area.index(x, y0, z);
+		for (int y = y0; y != y1; y++, i += em.X) {
+			if (data[i].getContent() == wherein)
+				data[i] = n_ore;
 		}
 	}
 }
 
 
+Mapgen::~Mapgen() {
+	for (std::map<const Ore *, Noise *>::iterator it = ore_noises.begin();
+			it != ore_noises.end(); ++it)
+		delete it->second;
+}
+
+
+void Mapgen::placeOres(const std::vector<Ore *> &ores, u32 blockseed,
+		v3s16 nmin, v3s16 nmax) {
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen ores", SPT_AVG);
+
+	for (unsigned int i = 0; i != ores.size(); i++)
+		ores[i]->generate(this, blockseed + i, nmin, nmax);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+NoiseColumnCache::NoiseColumnCache(u32 limit) {
+	m_mutex.Init();
+	m_limit = limit;
+}
+
+
+bool NoiseColumnCache::getMaps(v2s16 column, Noise **noises, u32 count) {
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<v2s16, Entry>::iterator it = m_columns.find(column);
+	if (it == m_columns.end())
+		return false;
+
+	Entry &e = it->second;
+	u32 size = 0;
+	for (u32 i = 0; i != count; i++)
+		size += noises[i]->sx * noises[i]->sy * noises[i]->sz;
+	if (size != e.maps.size())
+		return false;
+
+	const float *src = &e.maps[0];
+	for (u32 i = 0; i != count; i++) {
+		u32 n = noises[i]->sx * noises[i]->sy * noises[i]->sz;
+		memcpy(noises[i]->result, src, n * sizeof(float));
+		src += n;
+	}
+
+	m_lru.splice(m_lru.begin(), m_lru, e.lru_pos);
+	return true;
+}
+
+
+void NoiseColumnCache::putMaps(v2s16 column, Noise **noises, u32 count) {
+	if (m_limit == 0)
+		return;
+
+	u32 size = 0;
+	for (u32 i = 0; i != count; i++)
+		size += noises[i]->sx * noises[i]->sy * noises[i]->sz;
+
+	JMutexAutoLock lock(m_mutex);
+
+	// Another thread may have generated the same column meanwhile
+	std::map<v2s16, Entry>::iterator it = m_columns.find(column);
+	if (it != m_columns.end()) {
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru_pos);
+		return;
+	}
+
+	if (m_columns.size() >= m_limit) {
+		m_columns.erase(m_lru.back());
+		m_lru.pop_back();
+	}
+
+	Entry &e = m_columns[column];
+	e.maps.resize(size);
+	float *dst = &e.maps[0];
+	for (u32 i = 0; i != count; i++) {
+		u32 n = noises[i]->sx * noises[i]->sy * noises[i]->sz;
+		memcpy(dst, noises[i]->result, n * sizeof(float));
+		dst += n;
+	}
+	m_lru.push_front(column);
+	e.lru_pos = m_lru.begin();
+}
+
+
 void Mapgen::updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nmax) {
 	bool isliquid, wasliquid;
 	v3s16 em  = vm->m_area.getExtent();
@@ -224,7 +332,8 @@ void Mapgen::updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nm
 			
 			u32 i = vm->m_area.index(x, nmax.Y, z);
 			for (s16 y = nmax.Y; y >= nmin.Y; y--) {
-				isliquid = ndef->get(vm->m_data[i]).isLiquid();
+				isliquid = ndef->liquidType(vm->m_data[i].getContent()) !=
+					LIQUID_NONE;
 				
 				// there was a change between liquid and nonliquid, add to queue
 				if (isliquid != wasliquid)
@@ -253,26 +362,57 @@ void Mapgen::setLighting(v3s16 nmin, v3s16 nmax, u8 light) {
 }
 
 
-void Mapgen::lightSpread(VoxelArea &a, v3s16 p, u8 light) {
-	if (light <= 1 || !a.contains(p))
-		return;
-		
-	u32 vi = vm->m_area.index(p);
-	MapNode &nn = vm->m_data[vi];
+struct LightQueueEntry {
+	u32 i;
+	v3s16 p;
 
-	light--;
-	// should probably compare masked, but doesn't seem to make a difference
-	if (light <= nn.param1 || !ndef->get(nn).light_propagates)
-		return;
-	
-	nn.param1 = light;
-	
-	lightSpread(a, p + v3s16(0, 0, 1), light);
-	lightSpread(a, p + v3s16(0, 1, 0), light);
-	lightSpread(a, p + v3s16(1, 0, 0), light);
-	lightSpread(a, p - v3s16(0, 0, 1), light);
-	lightSpread(a, p - v3s16(0, 1, 0), light);
-	lightSpread(a, p - v3s16(1, 0, 0), light);
+	LightQueueEntry(u32 i_, v3s16 p_) {
+		i = i_;
+		p = p_;
+	}
+};
+
+
+/*
+	Spreads the light of the nodes in the queue, and of the nodes they
+	light up in turn, until it runs out. A node only takes light brighter
+	than what it has, so the result doesn't depend on the order.
+*/
+static void spread_light(ManualMapVoxelManipulator *vm, VoxelArea &a,
+		NodeDefSnapshot *ndef, std::vector<LightQueueEntry> &queue) {
+	v3s16 em = vm->m_area.getExtent();
+	const v3s16 dirs[6] = {
+		v3s16(0, 0, 1), v3s16(0, 1, 0), v3s16(1, 0, 0),
+		v3s16(0, 0, -1), v3s16(0, -1, 0), v3s16(-1, 0, 0)
+	};
+	const s32 offsets[6] = {
+		em.X * em.Y, em.X, 1,
+		-em.X * em.Y, -em.X, -1
+	};
+
+	for (u32 head = 0; head != queue.size(); head++) {
+		LightQueueEntry e = queue[head];
+		u8 light = vm->m_data[e.i].param1 & 0x0F;
+		if (light <= 1)
+			continue;
+		light--;
+
+		for (u32 d = 0; d != 6; d++) {
+			v3s16 p = e.p + dirs[d];
+			if (!a.contains(p))
+				continue;
+
+			u32 i = e.i + offsets[d];
+			MapNode &n = vm->m_data[i];
+			// should probably compare masked, but doesn't seem to make a difference
+			if (light <= n.param1 || !ndef->lightPropagates(n.getContent()))
+				continue;
+
+			n.param1 = light;
+			queue.push_back(LightQueueEntry(i, p));
+		}
+	}
+	queue.clear();
 }
 
 
@@ -300,41 +440,40 @@ void Mapgen::calcLighting(v3s16 nmin, v3s16 nmax) {
 
 			for (int y = a.MaxEdge.Y; y >= a.MinEdge.Y; y--) {
 				MapNode &n = vm->m_data[i];
-				if (!ndef->get(n).sunlight_propagates)
+				if (!ndef->sunlightPropagates(n.getContent()))
 					break;
 				n.param1 = LIGHT_SUN;
 				vm->m_area.add_y(em, i, -1);
 			}
 		}
 	}
-	
-	// now spread the sunlight and light up any sources
+
+	// now spread the sunlight and light up any sources, one node after
+	// another, as sources may be dimmer than the sunlight spread to them
+	std::vector<LightQueueEntry> queue;
 	for (int z = a.MinEdge.Z; z <= a.MaxEdge.Z; z++) {
 		for (int y = a.MinEdge.Y; y <= a.MaxEdge.Y; y++) {
 			u32 i = vm->m_area.index(a.MinEdge.X, y, z);
 			for (int x = a.MinEdge.X; x <= a.MaxEdge.X; x++, i++) {
 				MapNode &n = vm->m_data[i];
-				if (n.getContent() == CONTENT_IGNORE ||
-					!ndef->get(n).light_propagates)
+				content_t c = n.getContent();
+				if (c == CONTENT_IGNORE)
 					continue;
-				
-				u8 light_produced = ndef->get(n).light_source & 0x0F;
+				if (!ndef->lightPropagates(c))
+					continue;
+
+				u8 light_produced = ndef->lightSource(c) & 0x0F;
 				if (light_produced)
 					n.param1 = light_produced;
-				
-				u8 light = n.param1 & 0x0F;
-				if (light) {
-					lightSpread(a, v3s16(x,     y,     z + 1), light);
-					lightSpread(a, v3s16(x,     y + 1, z    ), light);
-					lightSpread(a, v3s16(x + 1, y,     z    ), light);
-					lightSpread(a, v3s16(x,     y,     z - 1), light);
-					lightSpread(a, v3s16(x,     y - 1, z    ), light);
-					lightSpread(a, v3s16(x - 1, y,     z    ), light);
+
+				if ((n.param1 & 0x0F) > 1) {
+					queue.push_back(LightQueueEntry(i, v3s16(x, y, z)));
+					spread_light(vm, a, ndef, queue);
 				}
 			}
 		}
 	}
-	
+
 	//printf("updateLighting: %dms\n", t.stop());
 }
 
@@ -381,12 +520,15 @@ bool MapgenV6Params::readParams(Settings *settings) {
 	np_humidity       = settings->getNoiseParams("mgv6_np_humidity");
 	np_trees          = settings->getNoiseParams("mgv6_np_trees");
 	np_apple_trees    = settings->getNoiseParams("mgv6_np_apple_trees");
+	// Not in the worlds from before it was added
+	np_cave_3d        = settings->exists("mgv6_np_cave_3d") ?
+		settings->getNoiseParams("mgv6_np_cave_3d") : &nparams_v6_def_cave_3d;
 
 	bool success =
 		np_terrain_base  && np_terrain_higher && np_steepness &&
 		np_height_select && np_trees          && np_mud       &&
 		np_beach         && np_biome          && np_cave      &&
-		np_humidity      && np_apple_trees;
+		np_humidity      && np_apple_trees    && np_cave_3d;
 	return success;
 }
 
@@ -406,6 +548,7 @@ void MapgenV6Params::writeParams(Settings *settings) {
 	settings->setNoiseParams("mgv6_np_humidity",       np_humidity);
 	settings->setNoiseParams("mgv6_np_trees",          np_trees);
 	settings->setNoiseParams("mgv6_np_apple_trees",    np_apple_trees);
+	settings->setNoiseParams("mgv6_np_cave_3d",        np_cave_3d);
 }
 
 
@@ -26,7 +26,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapnode.h"
 #include "noise.h"
 #include "settings.h"
+#include <jmutex.h>
 #include <map>
+#include <list>
+#include <vector>
 
 /////////////////// Mapgen flags
 #define MG_TREES         0x01
@@ -35,6 +38,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MGV6_JUNGLES     0x08
 #define MGV6_BIOME_BLEND 0x10
 #define MG_FLAT          0x20
+#define MGV6_NOISECAVES  0x40
 
 /////////////////// Ore generation flags
 // Use absolute value of height to determine ore placement
@@ -55,8 +59,10 @@ class MapBlock;
 class ManualMapVoxelManipulator;
 class VoxelManipulator;
 class INodeDefManager;
+class NodeDefSnapshot;
 struct BlockMakeData;
 class VoxelArea;
+class Ore;
 
 struct MapgenParams {
 	std::string mg_name;
@@ -84,13 +90,21 @@ class Mapgen {
 	bool generating;
 	int id;
 	ManualMapVoxelManipulator *vm;
-	INodeDefManager *ndef;
+	NodeDefSnapshot *ndef;
+	// Noise maps of the ores that use them. Each mapgen has its own, as
+	// the mapgens of the emerge threads run at the same time.
+	std::map<const Ore *, Noise *> ore_noises;
+
+	virtual ~Mapgen();
+
 
 	void updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nmax);
 	void setLighting(v3s16 nmin, v3s16 nmax, u8 light);
-	void lightSpread(VoxelArea &a, v3s16 p, u8 light);
 	void calcLighting(v3s16 nmin, v3s16 nmax);
 	void calcLightingOld(v3s16 nmin, v3s16 nmax);
+	// Places the ores in order; blockseed + i seeds the i:th ore
+	void placeOres(const std::vector<Ore *> &ores, u32 blockseed,
+		v3s16 nmin, v3s16 nmax);
 
 	virtual void makeChunk(BlockMakeData *data) {};
 	virtual int getGroundLevelAtPoint(v2s16 p) = 0;
@@ -101,6 +115,35 @@ class Mapgen {
 	static s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision);
 };
 
+/*
+	2D noise maps of chunk columns, shared by the mapgens of all emerge
+	threads. Chunks stacked on top of each other use the same maps, so
+	they only need to be computed once per column. Columns are keyed by
+	the X and Z of the minimum node of the chunk; the least recently
+	used one is dropped when the cache is full.
+*/
+class NoiseColumnCache {
+public:
+	NoiseColumnCache(u32 limit);
+
+	// Copies the cached maps of a column to the results of the noises.
+	// Returns false if the column is not cached.
+	bool getMaps(v2s16 column, Noise **noises, u32 count);
+	void putMaps(v2s16 column, Noise **noises, u32 count);
+
+private:
+	struct Entry {
+		std::vector<float> maps;
+		std::list<v2s16>::iterator lru_pos;
+	};
+
+	JMutex m_mutex;
+	u32 m_limit;
+	std::map<v2s16, Entry> m_columns;
+	// Most recently used first
+	std::list<v2s16> m_lru;
+};
+
 struct MapgenFactory {
 	virtual Mapgen *createMapgen(int mgid, MapgenParams *params,
 								 EmergeManager *emerge) = 0;
@@ -131,13 +174,11 @@ class Ore {
 	u32 flags;          // attributes for this ore
 	float nthresh;      // threshhold for noise at which an ore is placed 
 	NoiseParams *np;    // noise for distribution of clusters (NULL for uniform scattering)
-	Noise *noise;
 	
 	Ore() {
 		ore     = CONTENT_IGNORE;
 		wherein = CONTENT_IGNORE;
 		np      = NULL;
-		noise   = NULL;
 	}
 	
 	void resolveNodeNames(INodeDefManager *ndef);
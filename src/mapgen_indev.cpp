@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "main.h"
 #include "log.h"
+#include "emerge.h"
 
 /////////////////// Mapgen Indev perlin noise (default values - not used, from config or defaultsettings)
 
@@ -114,27 +115,59 @@ void MapgenIndev::calculateNoise() {
 	int x = node_min.X;
 	int y = node_min.Y;
 	int z = node_min.Z;
+
+	// The far scale transformations depend on the height of the chunk,
+	// so only the untransformed maps of the column are cached
+	v2s16 column(x, z);
+	Noise *noises[] = {
+		noiseindev_terrain_base, noiseindev_terrain_higher,
+		noiseindev_steepness, noise_height_select,
+		noiseindev_float_islands3, noise_beach, noise_biome
+	};
+	NoiseColumnCache *noisecache = emerge->noisecache;
+	bool cached = noisecache && noisecache->getMaps(column, noises, 7);
+
 	// Need to adjust for the original implementation's +.5 offset...
+	if (!cached) {
+		if (!(flags & MG_FLAT)) {
+			noiseindev_terrain_base->perlinMap2D(
+				x + 0.5 * noiseindev_terrain_base->npindev->spread.X * farscale(noiseindev_terrain_base->npindev->farspread, x, z),
+				z + 0.5 * noiseindev_terrain_base->npindev->spread.Z * farscale(noiseindev_terrain_base->npindev->farspread, x, z));
+
+			noiseindev_terrain_higher->perlinMap2D(
+				x + 0.5 * noiseindev_terrain_higher->npindev->spread.X * farscale(noiseindev_terrain_higher->npindev->farspread, x, z),
+				z + 0.5 * noiseindev_terrain_higher->npindev->spread.Z * farscale(noiseindev_terrain_higher->npindev->farspread, x, z));
+
+			noiseindev_steepness->perlinMap2D(
+				x + 0.5 * noiseindev_steepness->npindev->spread.X * farscale(noiseindev_steepness->npindev->farspread, x, z),
+				z + 0.5 * noiseindev_steepness->npindev->spread.Z * farscale(noiseindev_steepness->npindev->farspread, x, z));
+
+			noise_height_select->perlinMap2D(
+				x + 0.5 * noise_height_select->np->spread.X,
+				z + 0.5 * noise_height_select->np->spread.Z);
+
+			noiseindev_float_islands3->perlinMap2D(
+				x + 0.5 * noiseindev_float_islands3->npindev->spread.X * farscale(noiseindev_float_islands3->npindev->farspread, x, z),
+				z + 0.5 * noiseindev_float_islands3->npindev->spread.Z * farscale(noiseindev_float_islands3->npindev->farspread, x, z));
+		}
+
+		noise_beach->perlinMap2D(
+			x + 0.2 * noise_beach->np->spread.X,
+			z + 0.7 * noise_beach->np->spread.Z);
+
+		noise_biome->perlinMap2D(
+			x + 0.6 * noiseindev_biome->npindev->spread.X * farscale(noiseindev_biome->npindev->farspread, x, z),
+			z + 0.2 * noiseindev_biome->npindev->spread.Z * farscale(noiseindev_biome->npindev->farspread, x, z));
+
+		if (noisecache)
+			noisecache->putMaps(column, noises, 7);
+	}
+
 	if (!(flags & MG_FLAT)) {
-		noiseindev_terrain_base->perlinMap2D(
-			x + 0.5 * noiseindev_terrain_base->npindev->spread.X * farscale(noiseindev_terrain_base->npindev->farspread, x, z),
-			z + 0.5 * noiseindev_terrain_base->npindev->spread.Z * farscale(noiseindev_terrain_base->npindev->farspread, x, z));
 		noiseindev_terrain_base->transformNoiseMapFarScale(x, y, z);
-
-		noiseindev_terrain_higher->perlinMap2D(
-			x + 0.5 * noiseindev_terrain_higher->npindev->spread.X * farscale(noiseindev_terrain_higher->npindev->farspread, x, z),
-			z + 0.5 * noiseindev_terrain_higher->npindev->spread.Z * farscale(noiseindev_terrain_higher->npindev->farspread, x, z));
 		noiseindev_terrain_higher->transformNoiseMapFarScale(x, y, z);
-
-		noiseindev_steepness->perlinMap2D(
-			x + 0.5 * noiseindev_steepness->npindev->spread.X * farscale(noiseindev_steepness->npindev->farspread, x, z),
-			z + 0.5 * noiseindev_steepness->npindev->spread.Z * farscale(noiseindev_steepness->npindev->farspread, x, z));
 		noiseindev_steepness->transformNoiseMapFarScale(x, y, z);
 
-		noise_height_select->perlinMap2D(
-			x + 0.5 * noise_height_select->np->spread.X,
-			z + 0.5 * noise_height_select->np->spread.Z);
-
 		noiseindev_float_islands1->perlinMap3D(
 			x + 0.33 * noiseindev_float_islands1->npindev->spread.X * farscale(noiseindev_float_islands1->npindev->farspread, x, y, z),
 			y + 0.33 * noiseindev_float_islands1->npindev->spread.Y * farscale(noiseindev_float_islands1->npindev->farspread, x, y, z),
@@ -149,26 +182,13 @@ void MapgenIndev::calculateNoise() {
 		);
 		noiseindev_float_islands2->transformNoiseMapFarScale(x, y, z);
 
-		noiseindev_float_islands3->perlinMap2D(
-			x + 0.5 * noiseindev_float_islands3->npindev->spread.X * farscale(noiseindev_float_islands3->npindev->farspread, x, z),
-			z + 0.5 * noiseindev_float_islands3->npindev->spread.Z * farscale(noiseindev_float_islands3->npindev->farspread, x, z));
 		noiseindev_float_islands3->transformNoiseMapFarScale(x, y, z);
 
-	}
-	
-	if (!(flags & MG_FLAT)) {
 		noiseindev_mud->perlinMap2D(
 			x + 0.5 * noiseindev_mud->npindev->spread.X * farscale(noiseindev_mud->npindev->farspread, x, y, z),
 			z + 0.5 * noiseindev_mud->npindev->spread.Z * farscale(noiseindev_mud->npindev->farspread, x, y, z));
 		noiseindev_mud->transformNoiseMapFarScale(x, y, z);
 	}
-	noise_beach->perlinMap2D(
-		x + 0.2 * noise_beach->np->spread.X,
-		z + 0.7 * noise_beach->np->spread.Z);
-
-	noise_biome->perlinMap2D(
-		x + 0.6 * noiseindev_biome->npindev->spread.X * farscale(noiseindev_biome->npindev->farspread, x, z),
-		z + 0.2 * noiseindev_biome->npindev->spread.Z * farscale(noiseindev_biome->npindev->farspread, x, z));
 }
 
 bool MapgenIndevParams::readParams(Settings *settings) {
@@ -184,6 +204,8 @@ bool MapgenIndevParams::readParams(Settings *settings) {
         np_beach          = settings->getNoiseParams("mgv6_np_beach");
         npindev_biome     = settings->getNoiseIndevParams("mgindev_np_biome");
         np_cave           = settings->getNoiseParams("mgv6_np_cave");
+        np_cave_3d        = settings->exists("mgv6_np_cave_3d") ?
+                settings->getNoiseParams("mgv6_np_cave_3d") : &nparams_v6_def_cave_3d;
         npindev_float_islands1  = settings->getNoiseIndevParams("mgindev_np_float_islands1");
         npindev_float_islands2  = settings->getNoiseIndevParams("mgindev_np_float_islands2");
         npindev_float_islands3  = settings->getNoiseIndevParams("mgindev_np_float_islands3");
@@ -191,7 +213,7 @@ bool MapgenIndevParams::readParams(Settings *settings) {
         bool success =
                 npindev_terrain_base  && npindev_terrain_higher && npindev_steepness &&
                 np_height_select && np_trees          && npindev_mud       &&
-                np_beach         && np_biome          && np_cave &&
+                np_beach         && np_biome          && np_cave && np_cave_3d &&
                 npindev_float_islands1 && npindev_float_islands2 && npindev_float_islands3;
         return success;
 }
@@ -209,6 +231,7 @@ void MapgenIndevParams::writeParams(Settings *settings) {
         settings->setNoiseParams("mgv6_np_beach",          np_beach);
         settings->setNoiseIndevParams("mgindev_np_biome",          npindev_biome);
         settings->setNoiseParams("mgv6_np_cave",           np_cave);
+        settings->setNoiseParams("mgv6_np_cave_3d",        np_cave_3d);
         settings->setNoiseIndevParams("mgindev_np_float_islands1",  npindev_float_islands1);
         settings->setNoiseIndevParams("mgindev_np_float_islands2",  npindev_float_islands2);
         settings->setNoiseIndevParams("mgindev_np_float_islands3",  npindev_float_islands3);
@@ -59,6 +59,10 @@ NoiseParams nparams_v6_def_trees =
 	{0.0, 1.0, v3f(125.0, 125.0, 125.0), 2, 4, 0.66};
 NoiseParams nparams_v6_def_apple_trees =
 	{0.0, 1.0, v3f(100.0, 100.0, 100.0), 342902, 3, 0.45};
+// The offset is for noise3d() as compiled by GCC with optimization, which
+// drops its mask after the overflow; it carves about 4% of the stone
+NoiseParams nparams_v6_def_cave_3d =
+	{-2.95, 1.0, v3f(48.0, 24.0, 48.0), 52534, 3, 0.5};
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -68,6 +72,7 @@ MapgenV6::MapgenV6(int mapgenid, MapgenV6Params *params, EmergeManager *emerge)
 	this->generating  = false;
 	this->id       = mapgenid;
 	this->emerge   = emerge;
+	this->ndef     = NULL;
 
 	this->seed     = (int)params->seed;
 	this->water_level = params->water_level;
@@ -91,6 +96,10 @@ MapgenV6::MapgenV6(int mapgenid, MapgenV6Params *params, EmergeManager *emerge)
 	noise_mud            = new Noise(params->np_mud,            seed, csize.X, csize.Y);
 	noise_beach          = new Noise(params->np_beach,          seed, csize.X, csize.Y);
 	noise_biome          = new Noise(params->np_biome,          seed, csize.X, csize.Y);
+
+	noise_cave_3d = NULL;
+	if (flags & MGV6_NOISECAVES)
+		noise_cave_3d = new Noise(params->np_cave_3d, seed, csize.X, csize.Y, csize.Z);
 }
 
 
@@ -102,6 +111,7 @@ MapgenV6::~MapgenV6() {
 	delete noise_mud;
 	delete noise_beach;
 	delete noise_biome;
+	delete noise_cave_3d;
 }
 
 
@@ -117,7 +127,7 @@ s16 MapgenV6::find_ground_level(v2s16 p2d) {
 	
 	for (y = y_nodes_max; y >= y_nodes_min; y--) {
 		MapNode &n = vm->m_data[i];
-		if(ndef->get(n).walkable)
+		if(ndef->walkable(n.getContent()))
 			break;
 
 		vm->m_area.add_y(em, i, -1);
@@ -368,7 +378,26 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 			
 	this->generating = true;
 	this->vm   = data->vmanip;	
-	this->ndef = data->nodedef;
+
+	// The node definitions don't change, so the ids only need to be
+	// looked up for the first chunk
+	if (this->ndef != data->nodedef) {
+		this->ndef = data->nodedef;
+		c_stone           = ndef->getId("mapgen_stone");
+		c_dirt            = ndef->getId("mapgen_dirt");
+		c_dirt_with_grass = ndef->getId("mapgen_dirt_with_grass");
+		c_sand            = ndef->getId("mapgen_sand");
+		c_water_source    = ndef->getId("mapgen_water_source");
+		c_lava_source     = ndef->getId("mapgen_lava_source");
+		c_gravel          = ndef->getId("mapgen_gravel");
+		c_cobble          = ndef->getId("mapgen_cobble");
+		c_desert_sand     = ndef->getId("mapgen_desert_sand");
+		c_desert_stone    = ndef->getId("mapgen_desert_stone");
+		if (c_desert_sand == CONTENT_IGNORE)
+			c_desert_sand = c_sand;
+		if (c_desert_stone == CONTENT_IGNORE)
+			c_desert_stone = c_stone;
+	}
 	
 	// Hack: use minimum block coords for old code that assumes a single block
 	v3s16 blockpos = data->blockpos_requested;
@@ -399,32 +428,30 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 	blockseed = get_blockseed(data->seed, full_node_min);
 
 	// Make some noise
-	calculateNoise();
-
-	c_stone           = ndef->getId("mapgen_stone");
-	c_dirt            = ndef->getId("mapgen_dirt");
-	c_dirt_with_grass = ndef->getId("mapgen_dirt_with_grass");
-	c_sand            = ndef->getId("mapgen_sand");
-	c_water_source    = ndef->getId("mapgen_water_source");
-	c_lava_source     = ndef->getId("mapgen_lava_source");
-	c_gravel          = ndef->getId("mapgen_gravel");
-	c_cobble          = ndef->getId("mapgen_cobble");
-	c_desert_sand     = ndef->getId("mapgen_desert_sand");
-	c_desert_stone    = ndef->getId("mapgen_desert_stone");
-	if (c_desert_sand == CONTENT_IGNORE)
-		c_desert_sand = c_sand;
-	if (c_desert_stone == CONTENT_IGNORE)
-		c_desert_stone = c_stone;
+	{
+		ScopeProfiler sp(g_profiler, "EmergeThread: mapgen noise", SPT_AVG);
+		calculateNoise();
+	}
+	data->ground_levels = getBlockGroundLevels();
 
 	// Maximum height of the stone surface and obstacles.
 	// This is used to guide the cave generation
 	s16 stone_surface_max_y;
 
 	// Generate general ground level to full area
-	stone_surface_max_y = generateGround();
+	{
+		ScopeProfiler sp(g_profiler, "EmergeThread: mapgen ground", SPT_AVG);
+		stone_surface_max_y = generateGround();
+	}
 
 	generateSomething();
 
+	// The noise caves are carved only once, unlike the tunnels
+	if ((flags & MG_CAVES) && noise_cave_3d) {
+		ScopeProfiler sp(g_profiler, "EmergeThread: mapgen caves", SPT_AVG);
+		carveNoiseCaves(stone_surface_max_y);
+	}
+
 	const s16 max_spread_amount = MAP_BLOCKSIZE;
 	// Limit dirt flow area by 1 because mud is flown into neighbors.
 	s16 mudflow_minpos = -max_spread_amount + 1;
@@ -434,8 +461,10 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 	const u32 age_loops = 2;
 	for (u32 i_age = 0; i_age < age_loops; i_age++) { // Aging loop
 		// Make caves (this code is relatively horrible)
-		if (flags & MG_CAVES)
+		if ((flags & MG_CAVES) && !noise_cave_3d) {
+			ScopeProfiler sp(g_profiler, "EmergeThread: mapgen caves", SPT_AVG);
 			generateCaves(stone_surface_max_y);
+		}
 
 		// Add mud to the central chunk
 		addMud();
@@ -465,10 +494,7 @@ void MapgenV6::makeChunk(BlockMakeData *data) {
 		placeTreesAndJungleGrass();
 
 	// Generate the registered ores
-	for (unsigned int i = 0; i != emerge->ores.size(); i++) {
-		Ore *ore = emerge->ores[i];
-		ore->generate(this, blockseed + i, node_min, node_max);
-	}
+	placeOres(emerge->ores, blockseed, node_min, node_max);
 
 	// Calculate lighting
 	calcLighting(node_min, node_max);
@@ -481,6 +507,16 @@ void MapgenV6::calculateNoise() {
 	int x = node_min.X;
 	int z = node_min.Z;
 
+	// All of these only depend on the column of the chunk
+	v2s16 column(x, z);
+	Noise *noises[] = {
+		noise_terrain_base, noise_terrain_higher, noise_steepness,
+		noise_height_select, noise_mud, noise_beach, noise_biome
+	};
+	NoiseColumnCache *noisecache = emerge->noisecache;
+	if (noisecache && noisecache->getMaps(column, noises, 7))
+		return;
+
 	// Need to adjust for the original implementation's +.5 offset...
 	if (!(flags & MG_FLAT)) {
 		noise_terrain_base->perlinMap2D(
@@ -515,6 +551,31 @@ void MapgenV6::calculateNoise() {
 	noise_biome->perlinMap2D(
 		x + 0.6 * noise_biome->np->spread.X,
 		z + 0.2 * noise_biome->np->spread.Z);
+
+	if (noisecache)
+		noisecache->putMaps(column, noises, 7);
+}
+
+
+std::vector<s16> MapgenV6::getBlockGroundLevels() {
+	int blocks = central_area_size.X / MAP_BLOCKSIZE;
+	std::vector<s16> levels(blocks * blocks);
+
+	for (int bz = 0; bz != blocks; bz++)
+	for (int bx = 0; bx != blocks; bx++) {
+		s16 level = MAP_GENERATION_LIMIT;
+		for (int z = bz * MAP_BLOCKSIZE; z != (bz + 1) * MAP_BLOCKSIZE; z++) {
+			int index = z * ystride + bx * MAP_BLOCKSIZE;
+			for (int x = 0; x != MAP_BLOCKSIZE; x++, index++) {
+				s16 surface_y = (s16)baseTerrainLevelFromMap(index);
+				if (surface_y < level)
+					level = surface_y;
+			}
+		}
+		levels[bz * blocks + bx] = level;
+	}
+
+	return levels;
 }
 
 
@@ -693,7 +754,7 @@ void MapgenV6::flowMud(s16 &mudflow_minpos, s16 &mudflow_maxpos) {
 				u32 i3 = i;
 				vm->m_area.add_y(em, i3, 1);
 				if (vm->m_area.contains(i3) == true &&
-					ndef->get(vm->m_data[i3]).walkable)
+					ndef->walkable(vm->m_data[i3].getContent()))
 					continue;
 
 				// Drop mud on side
@@ -707,14 +768,14 @@ void MapgenV6::flowMud(s16 &mudflow_minpos, s16 &mudflow_maxpos) {
 						continue;
 					// Check that side is air
 					MapNode *n2 = &vm->m_data[i2];
-					if (ndef->get(*n2).walkable)
+					if (ndef->walkable(n2->getContent()))
 						continue;
 					// Check that under side is air
 					vm->m_area.add_y(em, i2, -1);
 					if (vm->m_area.contains(i2) == false)
 						continue;
 					n2 = &vm->m_data[i2];
-					if (ndef->get(*n2).walkable)
+					if (ndef->walkable(n2->getContent()))
 						continue;
 					// Loop further down until not air
 					bool dropped_to_unknown = false;
@@ -727,7 +788,7 @@ void MapgenV6::flowMud(s16 &mudflow_minpos, s16 &mudflow_maxpos) {
 							dropped_to_unknown = true;
 							break;
 						}
-					} while (ndef->get(*n2).walkable == false);
+					} while (ndef->walkable(n2->getContent()) == false);
 					// Loop one up so that we're in air
 					vm->m_area.add_y(em, i2, 1);
 					n2 = &vm->m_data[i2];
@@ -910,8 +971,8 @@ void MapgenV6::growGrass() {
 			// Go to ground level
 			for (y = node_max.Y; y >= full_node_min.Y; y--) {
 				MapNode &n = vm->m_data[i];
-				if (ndef->get(n).param_type != CPT_LIGHT ||
-					ndef->get(n).liquid_type != LIQUID_NONE)
+				if (ndef->paramType(n.getContent()) != CPT_LIGHT ||
+					ndef->liquidType(n.getContent()) != LIQUID_NONE)
 					break;
 				vm->m_area.add_y(em, i, -1);
 			}
@@ -945,6 +1006,43 @@ void MapgenV6::defineCave(Cave &cave, PseudoRandom ps,
 }
 
 
+/*
+	Carves caves where the 3D cave noise is above 0, instead of walking
+	tunnels around. The noise of the whole chunk is computed at once and
+	the chunk is gone through in the order of the voxel manipulator.
+*/
+void MapgenV6::carveNoiseCaves(int max_stone_y) {
+	// Nothing to carve above the stone
+	s16 y_max = MYMIN(node_max.Y, max_stone_y);
+	if (y_max < node_min.Y)
+		return;
+
+	noise_cave_3d->perlinMap3D(node_min.X, node_min.Y, node_min.Z);
+	noise_cave_3d->transformNoiseMap();
+	float *cave = noise_cave_3d->result;
+
+	MapNode airnode(CONTENT_AIR);
+	for (s16 z = node_min.Z; z <= node_max.Z; z++)
+	for (s16 y = node_min.Y; y <= y_max; y++) {
+		u32 i = vm->m_area.index(node_min.X, y, z);
+		u32 index = ((z - node_min.Z) * csize.Y + (y - node_min.Y)) * csize.X;
+		for (s16 x = node_min.X; x <= node_max.X; x++, i++, index++) {
+			if (cave[index] <= 0.0)
+				continue;
+
+			// Don't replace air or water or lava or ignore
+			content_t c = vm->m_data[i].getContent();
+			if (c == CONTENT_IGNORE || c == CONTENT_AIR ||
+				c == c_water_source || c == c_lava_source)
+				continue;
+
+			vm->m_data[i] = airnode;
+			vm->m_flags[i] |= VMANIP_FLAG_CAVE;
+		}
+	}
+}
+
+
 void MapgenV6::generateCaves(int max_stone_y) {
 	// 24ms @cs=8
 	//TimeTaker timer1("caves");
@@ -42,6 +42,7 @@ extern NoiseParams nparams_v6_def_cave;
 extern NoiseParams nparams_v6_def_humidity;
 extern NoiseParams nparams_v6_def_trees;
 extern NoiseParams nparams_v6_def_apple_trees;
+extern NoiseParams nparams_v6_def_cave_3d;
 
 struct Cave {
 	s16 min_tunnel_diameter;
@@ -67,6 +68,7 @@ struct MapgenV6Params : public MapgenParams {
 	NoiseParams *np_humidity;
 	NoiseParams *np_trees;
 	NoiseParams *np_apple_trees;
+	NoiseParams *np_cave_3d;
 	
 	MapgenV6Params() {
 		freq_desert       = 0.45;
@@ -82,7 +84,7 @@ struct MapgenV6Params : public MapgenParams {
 		np_humidity       = &nparams_v6_def_humidity;
 		np_trees          = &nparams_v6_def_trees;
 		np_apple_trees    = &nparams_v6_def_apple_trees;
-
+		np_cave_3d        = &nparams_v6_def_cave_3d;
 	}
 	
 	bool readParams(Settings *settings);
@@ -112,6 +114,8 @@ class MapgenV6 : public Mapgen {
 	Noise *noise_mud;
 	Noise *noise_beach;
 	Noise *noise_biome;
+	// Only with MGV6_NOISECAVES
+	Noise *noise_cave_3d;
 	NoiseParams *np_cave;
 	NoiseParams *np_humidity;
 	NoiseParams *np_trees;
@@ -160,6 +164,8 @@ class MapgenV6 : public Mapgen {
 	u32 get_blockseed(u64 seed, v3s16 p);
 	
 	virtual void calculateNoise();
+	// Lowest surface level of each block column of the chunk
+	std::vector<s16> getBlockGroundLevels();
 	int generateGround();
 	void addMud();
 	void flowMud(s16 &mudflow_minpos, s16 &mudflow_maxpos);
@@ -169,6 +175,7 @@ class MapgenV6 : public Mapgen {
 	virtual void defineCave(Cave &cave, PseudoRandom ps,
 							v3s16 node_min, bool large_cave);
 	void generateCaves(int max_stone_y);
+	void carveNoiseCaves(int max_stone_y);
 	virtual void generateSomething() {}; //for next mapgen
 };
 
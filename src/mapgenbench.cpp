@@ -0,0 +1,377 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapgenbench.h"
+#include "map.h"
+#include "mapblock.h"
+#include "emerge.h"
+#include "mapgen.h"
+#include "gamedef.h"
+#include "nodedef.h"
+#include "itemdef.h"
+#include "voxel.h"
+#include "light.h"
+#include "settings.h"
+#include "defaultsettings.h"
+#include "filesys.h"
+#include "profiler.h"
+#include "main.h" // For g_profiler
+#include "log.h"
+#include "util/timetaker.h"
+#include "util/numeric.h"
+#include <fstream>
+#include <iomanip>
+
+// The stages timed by the mapgens, by profiler name
+static const char *mapgen_stages[][2] = {
+	{"noise",    "EmergeThread: mapgen noise"},
+	{"ground",   "EmergeThread: mapgen ground"},
+	{"caves",    "EmergeThread: mapgen caves"},
+	{"ores",     "EmergeThread: mapgen ores"},
+	{"lighting", "EmergeThread: mapgen lighting update"},
+	{NULL, NULL}
+};
+
+/*
+	The mapgens and the hashes of what they are known to generate in the
+	benchmark. If a mapgen is changed on purpose, update its hash from the
+	output of the benchmark.
+*/
+static const struct {
+	const char *name;
+	u32 hash;
+} mapgen_benchmark_mapgens[] = {
+	{"v6",         0x84f83fd8},
+	{"indev",      0xf3eac105},
+	{"singlenode", 0x98479b7d},
+	{NULL, 0}
+};
+
+/*
+	Game definitions for generating without a game: the nodes the
+	mapgens use, under their mapgen_* alias names
+*/
+class MapgenBenchmarkGameDef : public IGameDef
+{
+public:
+	MapgenBenchmarkGameDef()
+	{
+		m_itemdef = createItemDefManager();
+		m_nodedef = createNodeDefManager();
+
+		const char *solids[] = {"mapgen_stone", "mapgen_dirt",
+			"mapgen_dirt_with_grass", "mapgen_sand", "mapgen_gravel",
+			"mapgen_cobble", "mapgen_mossycobble", "mapgen_stair_cobble",
+			"mapgen_desert_sand", "mapgen_desert_stone", "mapgen_clay",
+			"mapgen_tree", "mapgen_jungletree", "mapgen_stone_with_coal",
+			"mapgen_stone_with_iron", "mapgen_mese", NULL};
+		for(u32 i = 0; solids[i]; i++)
+			defineNode(solids[i], true, false, 0, LIQUID_NONE);
+		defineNode("mapgen_leaves", false, false, 0, LIQUID_NONE);
+		defineNode("mapgen_jungleleaves", false, false, 0, LIQUID_NONE);
+		defineNode("mapgen_apple", false, true, 0, LIQUID_NONE);
+		defineNode("mapgen_junglegrass", false, true, 0, LIQUID_NONE);
+		defineNode("mapgen_water_source", false, false, 0, LIQUID_SOURCE);
+		defineNode("mapgen_lava_source", false, false, LIGHT_MAX - 1,
+				LIQUID_SOURCE);
+	}
+
+	~MapgenBenchmarkGameDef()
+	{
+		delete m_itemdef;
+		delete m_nodedef;
+	}
+
+	IItemDefManager* getItemDefManager(){ return m_itemdef; }
+	INodeDefManager* getNodeDefManager(){ return m_nodedef; }
+	IWritableNodeDefManager* getWritableNodeDefManager(){ return m_nodedef; }
+	ICraftDefManager* getCraftDefManager(){ return NULL; }
+	ITextureSource* getTextureSource(){ return NULL; }
+	IShaderSource* getShaderSource(){ return NULL; }
+	u16 allocateUnknownNodeId(const std::string &name)
+	{ return m_nodedef->allocateDummy(name); }
+	ISoundManager* getSoundManager(){ return NULL; }
+	MtEventManager* getEventManager(){ return NULL; }
+
+private:
+	void defineNode(const char *name, bool solid, bool sunlight_propagates,
+			u8 light_source, LiquidType liquid_type)
+	{
+		ContentFeatures f;
+		f.name = name;
+		f.walkable = solid && liquid_type == LIQUID_NONE;
+		f.is_ground_content = true;
+		f.param_type = solid ? CPT_NONE : CPT_LIGHT;
+		f.light_propagates = !solid;
+		f.sunlight_propagates = sunlight_propagates;
+		f.light_source = light_source;
+		f.liquid_type = liquid_type;
+		m_nodedef->set(name, f);
+	}
+
+	IWritableItemDefManager *m_itemdef;
+	IWritableNodeDefManager *m_nodedef;
+};
+
+// The scatter ores of the default game
+static void register_default_ores(EmergeManager *emerge)
+{
+	struct {
+		const char *ore;
+		u32 clust_scarcity;
+		s16 height_min;
+		s16 height_max;
+	} ores[] = {
+		{"mapgen_stone_with_coal", 8*8*8,    -31000, 64},
+		{"mapgen_stone_with_iron", 16*16*16, -5,     7},
+		{"mapgen_stone_with_iron", 12*12*12, -16,    -5},
+		{"mapgen_stone_with_iron", 9*9*9,    -31000, -17},
+		{NULL, 0, 0, 0}
+	};
+	for(u32 i = 0; ores[i].ore; i++){
+		Ore *ore = createOre(ORE_SCATTER);
+		ore->ore_name       = ores[i].ore;
+		ore->wherein_name   = "mapgen_stone";
+		ore->clust_scarcity = ores[i].clust_scarcity;
+		ore->clust_num_ores = 5;
+		ore->clust_size     = 3;
+		ore->height_min     = ores[i].height_min;
+		ore->height_max     = ores[i].height_max;
+		ore->flags          = 0;
+		ore->nthresh        = 0;
+		emerge->ores.push_back(ore);
+	}
+}
+
+static void hash_nodes(u32 &hash, ManualMapVoxelManipulator *vm,
+		v3s16 node_min, v3s16 node_max)
+{
+	for(s16 z = node_min.Z; z <= node_max.Z; z++)
+	for(s16 y = node_min.Y; y <= node_max.Y; y++)
+	{
+		u32 i = vm->m_area.index(node_min.X, y, z);
+		for(s16 x = node_min.X; x <= node_max.X; x++, i++)
+		{
+			const MapNode &n = vm->m_data[i];
+			u8 bytes[4] = {(u8)(n.getContent() >> 8),
+					(u8)(n.getContent() & 0xff), n.param1, n.param2};
+			for(u32 j = 0; j < 4; j++)
+				hash = (hash ^ bytes[j]) * 16777619;
+		}
+	}
+}
+
+static void hash_underground(u32 &hash, Map *map,
+		v3s16 blockpos_min, v3s16 blockpos_max)
+{
+	for(s16 z = blockpos_min.Z; z <= blockpos_max.Z; z++)
+	for(s16 y = blockpos_min.Y; y <= blockpos_max.Y; y++)
+	for(s16 x = blockpos_min.X; x <= blockpos_max.X; x++)
+	{
+		MapBlock *block = map->getBlockNoCreateNoEx(v3s16(x, y, z));
+		u8 underground = block && block->getIsUnderground();
+		hash = (hash ^ underground) * 16777619;
+	}
+}
+
+bool benchmark_mapgen(const std::string &mgname, u64 seed,
+		v3s16 chunkpos_min, v3s16 chunkpos_max, bool noise_cache,
+		const std::string &worlddir, MapgenBenchmarkResult &result)
+{
+	MapgenBenchmarkGameDef gamedef;
+	EmergeManager *emerge = new EmergeManager(&gamedef, NULL);
+
+	MapgenParams *mgparams = emerge->createMapgenParams(mgname);
+	if(!mgparams){
+		delete emerge;
+		return false;
+	}
+	// The default parameters, whatever is configured
+	Settings defaults;
+	set_default_settings(&defaults);
+	if(!mgparams->readParams(&defaults)){
+		errorstream<<"Mapgen benchmark: invalid parameters for mapgen "
+				<<mgname<<std::endl;
+		delete mgparams;
+		delete emerge;
+		return false;
+	}
+	mgparams->mg_name = mgname;
+	mgparams->seed = seed;
+
+	if(noise_cache && !emerge->noisecache)
+		emerge->noisecache = new NoiseColumnCache(64);
+	if(!noise_cache && emerge->noisecache){
+		delete emerge->noisecache;
+		emerge->noisecache = NULL;
+	}
+	register_default_ores(emerge);
+
+	/*
+		Start from an empty world with the fixed mapgen parameters
+	*/
+	fs::RecursiveDelete(worlddir);
+	if(!fs::CreateAllDirs(worlddir)){
+		errorstream<<"Mapgen benchmark: can't create "<<worlddir<<std::endl;
+		delete mgparams;
+		delete emerge;
+		return false;
+	}
+	{
+		Settings meta;
+		emerge->params = mgparams;
+		emerge->setParamsToSettings(&meta);
+		emerge->params = NULL;
+		delete mgparams;
+
+		std::string path = worlddir + DIR_DELIM + "map_meta.txt";
+		std::ofstream os(path.c_str(), std::ios_base::binary);
+		meta.writeLines(os);
+		os<<"[end_of_params]\n";
+	}
+	ServerMap *map = new ServerMap(worlddir, &gamedef, emerge);
+	emerge->initMapgens(map->getMapgenParams(),
+			gamedef.getWritableNodeDefManager());
+	Mapgen *mapgen = emerge->mapgen[0];
+	s16 chunksize = emerge->params->chunksize;
+	s16 coffset = -chunksize / 2;
+	v3s16 chunk_offset(coffset, coffset, coffset);
+
+	// Mapgen v6 places trees and dirt blobs with the global random
+	// number generator
+	mysrand(seed);
+	g_profiler->clear();
+	// Most stages take less than a few milliseconds
+	TimePrecision precision = g_profiler->getPrecision();
+	g_profiler->setPrecision(PRECISION_MICRO);
+	result = MapgenBenchmarkResult();
+	result.hash = 2166136261u;
+
+	std::map<v3s16, MapBlock*> modified_blocks;
+	for(s16 z = chunkpos_min.Z; z <= chunkpos_max.Z; z++)
+	for(s16 y = chunkpos_min.Y; y <= chunkpos_max.Y; y++)
+	for(s16 x = chunkpos_min.X; x <= chunkpos_max.X; x++)
+	{
+		v3s16 blockpos = v3s16(x, y, z) * chunksize + chunk_offset;
+		BlockMakeData data;
+		if(!map->initBlockMake(&data, blockpos))
+			continue;
+		{
+			u32 time_us = 0;
+			TimeTaker timer("Mapgen::makeChunk", &time_us, PRECISION_MICRO);
+			mapgen->makeChunk(&data);
+			timer.stop(true);
+			result.time_us += time_us;
+		}
+		hash_nodes(result.hash, data.vmanip,
+				data.blockpos_min * MAP_BLOCKSIZE,
+				(data.blockpos_max + v3s16(1,1,1)) * MAP_BLOCKSIZE
+				- v3s16(1,1,1));
+		map->finishBlockMake(&data, modified_blocks);
+		hash_underground(result.hash, map,
+				data.blockpos_min, data.blockpos_max);
+		result.chunks++;
+	}
+
+	for(u32 i = 0; mapgen_stages[i][0]; i++)
+		result.stages[mapgen_stages[i][0]] =
+				g_profiler->getValue(mapgen_stages[i][1]) * 1000.0;
+	g_profiler->setPrecision(precision);
+
+	for(u32 i = 0; i < emerge->ores.size(); i++)
+		delete emerge->ores[i];
+	emerge->ores.clear();
+	delete map;
+	delete emerge;
+	fs::RecursiveDelete(worlddir);
+	return true;
+}
+
+static void print_benchmark_result(std::ostream &o, const std::string &mgname,
+		bool noise_cache, const MapgenBenchmarkResult &result)
+{
+	o<<std::setw(10)<<std::left<<mgname<<std::right
+			<<" cache="<<(noise_cache ? "on " : "off")
+			<<" chunks="<<result.chunks
+			<<" hash="<<std::hex<<std::setw(8)<<std::setfill('0')
+			<<result.hash<<std::dec<<std::setfill(' ')
+			<<" ms/chunk="<<std::fixed<<std::setprecision(2)
+			<<(result.chunks ? result.time_us / 1000.0 / result.chunks : 0);
+	for(std::map<std::string, float>::const_iterator
+			i = result.stages.begin(); i != result.stages.end(); ++i)
+		o<<" "<<i->first<<"="<<i->second;
+	o<<std::endl;
+}
+
+bool run_mapgen_benchmark(const std::string &mgname, std::ostream &o)
+{
+	// The surface and the caves below it around the origin
+	v3s16 chunkpos_min(-1, -1, -1);
+	v3s16 chunkpos_max(1, 0, 1);
+	std::string worlddir = fs::TempPath() + DIR_DELIM
+			+ "minetest_mapgen_benchmark";
+
+	o<<"Mapgen benchmark: seed "<<MAPGEN_BENCHMARK_SEED<<", chunks ("
+			<<chunkpos_min.X<<","<<chunkpos_min.Y<<","<<chunkpos_min.Z<<") - ("
+			<<chunkpos_max.X<<","<<chunkpos_max.Y<<","<<chunkpos_max.Z<<")"
+			<<"; stage times are ms per call"<<std::endl;
+
+	bool success = true;
+	u32 found = 0;
+	for(u32 i = 0; mapgen_benchmark_mapgens[i].name; i++)
+	{
+		std::string name = mapgen_benchmark_mapgens[i].name;
+		if(mgname != "all" && mgname != name)
+			continue;
+		found++;
+
+		MapgenBenchmarkResult result_cached, result_uncached;
+		if(!benchmark_mapgen(name, MAPGEN_BENCHMARK_SEED, chunkpos_min,
+				chunkpos_max, true, worlddir, result_cached) ||
+				!benchmark_mapgen(name, MAPGEN_BENCHMARK_SEED, chunkpos_min,
+				chunkpos_max, false, worlddir, result_uncached)){
+			errorstream<<"Mapgen benchmark: "<<name<<" failed"<<std::endl;
+			success = false;
+			continue;
+		}
+		print_benchmark_result(o, name, true, result_cached);
+		print_benchmark_result(o, name, false, result_uncached);
+
+		if(result_cached.hash != result_uncached.hash){
+			errorstream<<"Mapgen benchmark: "<<name<<" generates different "
+					<<"nodes with the noise cache"<<std::endl;
+			success = false;
+		}
+		else if(result_cached.hash != mapgen_benchmark_mapgens[i].hash){
+			errorstream<<"Mapgen benchmark: "<<name<<" doesn't generate "
+					<<"what it is known to generate (hash "<<std::hex
+					<<std::setw(8)<<std::setfill('0')
+					<<mapgen_benchmark_mapgens[i].hash<<std::dec
+					<<std::setfill(' ')<<")"<<std::endl;
+			success = false;
+		}
+	}
+	if(found == 0){
+		errorstream<<"Mapgen benchmark: unknown mapgen \""<<mgname
+				<<"\""<<std::endl;
+		return false;
+	}
+	return success;
+}
+
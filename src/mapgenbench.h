@@ -0,0 +1,76 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPGENBENCH_HEADER
+#define MAPGENBENCH_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include <string>
+#include <map>
+#include <ostream>
+
+// Seed of the benchmark worlds
+#define MAPGEN_BENCHMARK_SEED 1234567890
+
+struct MapgenBenchmarkResult
+{
+	u32 chunks;
+	// FNV-1a hash of the nodes and the underground flags of the blocks
+	// of the generated chunks, in generation order; changes whenever the
+	// output of the mapgen changes
+	u32 hash;
+	// Time spent in Mapgen::makeChunk
+	u32 time_us;
+	// Average time of a call to each mapgen stage, in milliseconds
+	std::map<std::string, float> stages;
+
+	MapgenBenchmarkResult():
+		chunks(0),
+		hash(0),
+		time_us(0)
+	{}
+};
+
+/*
+	Generates the chunks from chunkpos_min to chunkpos_max (in chunks,
+	X innermost) with the mapgen mgname in an empty world at worlddir,
+	which is removed afterwards. The mapgen stages are timed in
+	microseconds while it runs. The nodes are defined by the benchmark,
+	and the default ores are registered.
+
+	Returns false if the mapgen doesn't exist or worlddir can't be
+	created.
+*/
+bool benchmark_mapgen(const std::string &mgname, u64 seed,
+		v3s16 chunkpos_min, v3s16 chunkpos_max, bool noise_cache,
+		const std::string &worlddir, MapgenBenchmarkResult &result);
+
+/*
+	Runs the mapgen mgname ("all" = every built-in one) over a fixed set
+	of chunks with and without the noise cache and prints the timings of
+	the stages and the hash of the output (minetestserver
+	--mapgen-benchmark).
+
+	Returns false if a mapgen fails, if the noise cache changes its
+	output, or if the output isn't what the mapgen is known to generate.
+*/
+bool run_mapgen_benchmark(const std::string &mgname, std::ostream &o);
+
+#endif
+
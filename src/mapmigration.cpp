@@ -0,0 +1,397 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapmigration.h"
+#include "map.h"
+#include "mapblock.h"
+#include "emerge.h"
+#include "gamedef.h"
+#include "nodedef.h"
+#include "itemdef.h"
+#include "serialization.h"
+#include "filesys.h"
+#include "porting.h"
+#include "subgame.h" // WORLD_LOCK_FILE
+#include "main.h" // For g_settings
+#include "log.h"
+#include "util/serialize.h"
+#include "util/thread.h"
+#include <vector>
+
+/*
+	Every worker gets its own definition managers. Nodes are only
+	looked up by name and unknown ones get dummy ids, which are
+	written back under the same names, so nothing needs to be shared
+	between threads.
+*/
+class MigrationGameDef : public IGameDef
+{
+public:
+	MigrationGameDef():
+		m_itemdef(createItemDefManager()),
+		m_nodedef(createNodeDefManager())
+	{
+	}
+	~MigrationGameDef()
+	{
+		delete m_itemdef;
+		delete m_nodedef;
+	}
+	IItemDefManager* getItemDefManager() { return m_itemdef; }
+	INodeDefManager* getNodeDefManager() { return m_nodedef; }
+	ICraftDefManager* getCraftDefManager() { return NULL; }
+	ITextureSource* getTextureSource() { return NULL; }
+	IShaderSource* getShaderSource() { return NULL; }
+	u16 allocateUnknownNodeId(const std::string &name)
+	{
+		return m_nodedef->allocateDummy(name);
+	}
+	ISoundManager* getSoundManager() { return NULL; }
+	MtEventManager* getEventManager() { return NULL; }
+private:
+	IWritableItemDefManager *m_itemdef;
+	IWritableNodeDefManager *m_nodedef;
+};
+
+enum MigrationResult
+{
+	MIGRATION_CONVERTED,
+	MIGRATION_CURRENT,
+	MIGRATION_SKIPPED,
+	MIGRATION_FAILED
+};
+
+struct MigrationBlock
+{
+	v3s16 pos;
+	// Serialized block, version byte first; replaced when converted
+	std::string data;
+	u32 size_in;
+	MigrationResult result;
+};
+
+class MigrationThread : public SimpleThread
+{
+public:
+	MigrationThread(u32 index, u32 count):
+		SimpleThread(),
+		m_index(index),
+		m_count(count),
+		m_batch(NULL)
+	{
+	}
+
+	// Converts every m_count'th block of the batch, starting at m_index
+	void convert(std::vector<MigrationBlock> *batch)
+	{
+		m_batch = batch;
+		m_start.signal();
+	}
+
+	// Waits until the batch passed to convert() is done. Every worker
+	// has its own event, as signals of an auto-reset event can merge.
+	void waitDone()
+	{
+		m_done.wait();
+	}
+
+	void quit()
+	{
+		setRun(false);
+		m_start.signal();
+		stop();
+	}
+
+	void * Thread()
+	{
+		ThreadStarted();
+		log_register_thread("MigrationThread");
+		DSTACK(__FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		for(;;)
+		{
+			m_start.wait();
+			if(!getRun())
+				break;
+			std::vector<MigrationBlock> &batch = *m_batch;
+			for(u32 i=m_index; i<batch.size(); i+=m_count)
+				convertBlock(batch[i]);
+			m_done.signal();
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER(errorstream)
+		return NULL;
+	}
+
+private:
+	void convertBlock(MigrationBlock &b)
+	{
+		b.size_in = b.data.size();
+		if(b.data.empty()){
+			b.result = MIGRATION_SKIPPED;
+			return;
+		}
+		u8 version = b.data[0];
+		if(version == SER_FMT_VER_HIGHEST){
+			b.result = MIGRATION_CURRENT;
+			return;
+		}
+		if(version < 22 || !ser_ver_supported(version)){
+			b.result = MIGRATION_SKIPPED;
+			return;
+		}
+		try{
+			MapBlock block(NULL, b.pos, &m_gamedef);
+			BufferReader is((const u8*)b.data.data() + 1, b.data.size() - 1);
+			block.deSerialize(is, version, true);
+
+			m_buffer.clear();
+			writeU8(m_buffer, SER_FMT_VER_HIGHEST);
+			block.serialize(m_buffer, SER_FMT_VER_HIGHEST, true);
+			b.data.assign((const char*)m_buffer.data(), m_buffer.size());
+			b.result = MIGRATION_CONVERTED;
+		}
+		catch(SerializationError &e)
+		{
+			errorstream<<"Map migration: Invalid block data at ("
+					<<b.pos.X<<","<<b.pos.Y<<","<<b.pos.Z<<"): "
+					<<e.what()<<std::endl;
+			b.result = MIGRATION_FAILED;
+		}
+	}
+
+	u32 m_index;
+	u32 m_count;
+	Event m_start;
+	Event m_done;
+	std::vector<MigrationBlock> *m_batch;
+	MigrationGameDef m_gamedef;
+	BufferWriter m_buffer;
+};
+
+/*
+	Goes through the block positions of the database a batch of keys at
+	a time, so that the positions of a huge world are never all in
+	memory at once
+*/
+class BlockLister
+{
+public:
+	BlockLister(ServerMap *map, u32 batch_size):
+		m_map(map),
+		m_batch_size(batch_size),
+		m_cursor(BLOCK_LIST_START),
+		m_next(0),
+		m_end(false)
+	{
+	}
+
+	// False when all blocks have been listed
+	bool next(v3s16 &p)
+	{
+		if(m_next == m_positions.size()){
+			m_positions.clear();
+			m_next = 0;
+			if(m_end || !m_map->listLoadableBlocks(m_positions, m_cursor,
+					m_batch_size)){
+				m_end = true;
+				return false;
+			}
+		}
+		p = m_positions[m_next++];
+		return true;
+	}
+
+private:
+	ServerMap *m_map;
+	u32 m_batch_size;
+	sqlite3_int64 m_cursor;
+	std::vector<v3s16> m_positions;
+	size_t m_next;
+	bool m_end;
+};
+
+// Reads up to batch_size of the next blocks
+static void readBatch(ServerMap *map, BlockLister &lister, u32 batch_size,
+		std::vector<MigrationBlock> &batch)
+{
+	batch.clear();
+	v3s16 p;
+	while(batch.size() < batch_size && lister.next(p))
+	{
+		MigrationBlock b;
+		b.pos = p;
+		b.size_in = 0;
+		b.result = MIGRATION_SKIPPED;
+		batch.push_back(b);
+		if(!map->loadBlockData(b.pos, &batch.back().data))
+			batch.pop_back();
+	}
+}
+
+static void writeBatch(ServerMap *map, std::vector<MigrationBlock> &batch,
+		MapMigrationStats *stats)
+{
+	for(u32 i=0; i<batch.size(); i++)
+	{
+		MigrationBlock &b = batch[i];
+		stats->bytes_in += b.size_in;
+		switch(b.result){
+		case MIGRATION_CONVERTED:
+			if(map->saveBlockData(b.pos, (const u8*)b.data.data(),
+					b.data.size())){
+				stats->blocks_converted++;
+				stats->bytes_out += b.data.size();
+			} else {
+				stats->blocks_failed++;
+			}
+			break;
+		case MIGRATION_CURRENT:
+			stats->blocks_current++;
+			stats->bytes_out += b.size_in;
+			break;
+		case MIGRATION_SKIPPED:
+			stats->blocks_skipped++;
+			stats->bytes_out += b.size_in;
+			break;
+		case MIGRATION_FAILED:
+			stats->blocks_failed++;
+			stats->bytes_out += b.size_in;
+			break;
+		}
+	}
+}
+
+static void reportProgress(const MapMigrationStats &stats, u32 done,
+		u32 time_ms)
+{
+	float s = time_ms / 1000.0;
+	if(s < 0.001)
+		s = 0.001;
+	actionstream<<"Map migration: "<<done<<"/"<<stats.blocks_total
+			<<" blocks ("<<(stats.blocks_total ?
+					(u64)done * 100 / stats.blocks_total : 100)<<"%), "
+			<<(u32)(done / s)<<" blocks/s, "
+			<<(u32)(stats.bytes_in / s / 1024)<<" KiB/s read, "
+			<<(u32)(stats.bytes_out / s / 1024)<<" KiB/s written"
+			<<std::endl;
+}
+
+bool migrateMap(const std::string &world_path, u32 num_threads,
+		u32 batch_size, MapMigrationStats *stats)
+{
+	if(!fs::PathExists(world_path + DIR_DELIM + "map.sqlite")){
+		errorstream<<"Map migration: No map database in "<<world_path
+				<<std::endl;
+		return false;
+	}
+	// A server running on the world would overwrite the converted blocks
+	// or read them half written
+	fs::FileLock lock;
+	if(!lock.lock(world_path + DIR_DELIM + WORLD_LOCK_FILE)){
+		errorstream<<"Map migration: "<<world_path<<" is in use by "
+				<<"another process; stop the server first"<<std::endl;
+		return false;
+	}
+	if(num_threads < 1)
+		num_threads = 1;
+	if(batch_size < 1)
+		batch_size = 1;
+
+	MigrationGameDef gamedef;
+	EmergeManager emerge(&gamedef, NULL);
+	ServerMap map(world_path, &gamedef, &emerge);
+	// Needed for writing map_meta.txt back on destruction, like Server does
+	emerge.params = map.getMapgenParams();
+
+	// Only for reporting progress
+	stats->blocks_total = map.countLoadableBlocks();
+	actionstream<<"Map migration: Converting "<<stats->blocks_total
+			<<" blocks to format "<<(int)SER_FMT_VER_HIGHEST<<" using "
+			<<num_threads<<" threads"<<std::endl;
+
+	std::vector<MigrationThread*> threads;
+	for(u32 i=0; i<num_threads; i++){
+		threads.push_back(new MigrationThread(i, num_threads));
+		threads.back()->Start();
+	}
+
+	/*
+		While the workers convert one batch, the previous one is
+		written and the next one read in the same transaction
+	*/
+	u32 start_ms = porting::getTimeMs();
+	u32 last_report_ms = start_ms;
+	std::vector<MigrationBlock> batches[2];
+	u32 cur = 0;
+	bool have_converted = false;
+	u32 blocks_done = 0;
+	BlockLister lister(&map, batch_size);
+
+	map.beginSave();
+	readBatch(&map, lister, batch_size, batches[cur]);
+	map.endSave();
+
+	while(!batches[cur].empty())
+	{
+		for(u32 i=0; i<threads.size(); i++)
+			threads[i]->convert(&batches[cur]);
+
+		u32 other = 1 - cur;
+		map.beginSave();
+		if(have_converted){
+			writeBatch(&map, batches[other], stats);
+			blocks_done += batches[other].size();
+		}
+		readBatch(&map, lister, batch_size, batches[other]);
+		map.endSave();
+
+		for(u32 i=0; i<threads.size(); i++)
+			threads[i]->waitDone();
+		have_converted = true;
+		cur = other;
+
+		u32 now_ms = porting::getTimeMs();
+		if(now_ms - last_report_ms >= 5000){
+			reportProgress(*stats, blocks_done, now_ms - start_ms);
+			last_report_ms = now_ms;
+		}
+	}
+	if(have_converted){
+		map.beginSave();
+		writeBatch(&map, batches[1 - cur], stats);
+		map.endSave();
+		blocks_done += batches[1 - cur].size();
+	}
+
+	for(u32 i=0; i<threads.size(); i++){
+		threads[i]->quit();
+		delete threads[i];
+	}
+
+	reportProgress(*stats, blocks_done, porting::getTimeMs() - start_ms);
+	actionstream<<"Map migration: "<<stats->blocks_converted<<" converted, "
+			<<stats->blocks_current<<" already current, "
+			<<stats->blocks_skipped<<" skipped, "
+			<<stats->blocks_failed<<" failed; "
+			<<(stats->bytes_in / 1024 / 1024)<<" MiB -> "
+			<<(stats->bytes_out / 1024 / 1024)<<" MiB"<<std::endl;
+	return true;
+}
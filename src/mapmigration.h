@@ -0,0 +1,70 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPMIGRATION_HEADER
+#define MAPMIGRATION_HEADER
+
+#include "irrlichttypes.h"
+#include <string>
+
+struct MapMigrationStats
+{
+	u32 blocks_total;
+	// Rewritten in the latest format
+	u32 blocks_converted;
+	// Already in the latest format
+	u32 blocks_current;
+	// Too old to convert without node definitions, or unreadable
+	u32 blocks_skipped;
+	u32 blocks_failed;
+	u64 bytes_in;
+	u64 bytes_out;
+
+	MapMigrationStats():
+		blocks_total(0),
+		blocks_converted(0),
+		blocks_current(0),
+		blocks_skipped(0),
+		blocks_failed(0),
+		bytes_in(0),
+		bytes_out(0)
+	{}
+};
+
+/*
+	Rewrites every block in the map database of a world in the latest
+	serialization format (minetestserver --migrate).
+
+	Blocks are read and written by the calling thread in transactions
+	of batch_size blocks while num_threads worker threads convert the
+	previous batch. Node names are kept as they are; no game or mods
+	are needed. Blocks older than format 22 are left alone, because
+	converting them needs the node definitions; the server converts
+	them when it loads them.
+
+	The world is locked (WORLD_LOCK_FILE) for the duration, like a
+	running server locks it.
+
+	Returns false if the world has no map database or is in use.
+*/
+bool migrateMap(const std::string &world_path, u32 num_threads,
+		u32 batch_size, MapMigrationStats *stats);
+
+#endif
+
@@ -382,7 +382,7 @@ void MapNode::deSerialize(u8 *source, u8 version)
 		}
 	}
 }
-void MapNode::serializeBulk(std::ostream &os, int version,
+void MapNode::serializeBulk(BufferWriter &os, int version,
 		const MapNode *nodes, u32 nodecount,
 		u8 content_width, u8 params_width, bool compressed)
 {
@@ -398,7 +398,10 @@ void MapNode::serializeBulk(std::ostream &os, int version,
 		throw SerializationError("MapNode::serializeBulk: serialization to "
 				"version < 24 not possible");
 
-	SharedBuffer<u8> databuf(nodecount * (content_width + params_width));
+	// Uncompressed data is written directly to the output
+	u32 len = nodecount * (content_width + params_width);
+	Buffer<u8> tmpbuf(compressed ? len : 0);
+	u8 *databuf = compressed ? *tmpbuf : os.grow(len);
 
 	// Serialize content
 	for(u32 i=0; i<nodecount; i++)
@@ -415,21 +418,15 @@ void MapNode::serializeBulk(std::ostream &os, int version,
 		writeU8(&databuf[start2 + i], nodes[i].param2);
 
 	/*
-		Compress data to output stream
+		Compress data to output
 	*/
 
 	if(compressed)
-	{
-		compressZlib(databuf, os);
-	}
-	else
-	{
-		os.write((const char*) &databuf[0], databuf.getSize());
-	}
+		compress(databuf, len, os, version);
 }
 
 // Deserialize bulk node data
-void MapNode::deSerializeBulk(std::istream &is, int version,
+void MapNode::deSerializeBulk(BufferReader &is, int version,
 		MapNode *nodes, u32 nodecount,
 		u8 content_width, u8 params_width, bool compressed)
 {
@@ -442,23 +439,23 @@ void MapNode::deSerializeBulk(std::istream &is, int version,
 
 	// Uncompress or read data
 	u32 len = nodecount * (content_width + params_width);
-	SharedBuffer<u8> databuf(len);
+	BufferWriter decompressed;
+	const u8 *databuf;
 	if(compressed)
 	{
-		std::ostringstream os(std::ios_base::binary);
-		decompressZlib(is, os);
-		std::string s = os.str();
-		if(s.size() != len)
+		decompressed.reserve(len);
+		decompress(is, decompressed, version);
+		if(decompressed.size() != len)
 			throw SerializationError("deSerializeBulkNodes: "
 					"decompress resulted in invalid size");
-		memcpy(&databuf[0], s.c_str(), len);
+		databuf = decompressed.data();
 	}
 	else
 	{
-		is.read((char*) &databuf[0], len);
-		if(is.eof() || is.fail())
+		if(is.remaining() < len)
 			throw SerializationError("deSerializeBulkNodes: "
 					"failed to read bulk node data");
+		databuf = is.read(len);
 	}
 
 	// Deserialize content
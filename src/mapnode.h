@@ -27,6 +27,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <vector>
 
 class INodeDefManager;
+class BufferWriter;
+class BufferReader;
 
 /*
 	Naming scheme:
@@ -207,11 +209,11 @@ struct MapNode
 	//   version = serialization version. Must be >= 22
 	//   content_width = the number of bytes of content per node
 	//   params_width = the number of bytes of params per node
-	//   compressed = true to zlib-compress output
-	static void serializeBulk(std::ostream &os, int version,
+	//   compressed = true to compress output (see compress())
+	static void serializeBulk(BufferWriter &os, int version,
 			const MapNode *nodes, u32 nodecount,
 			u8 content_width, u8 params_width, bool compressed);
-	static void deSerializeBulk(std::istream &is, int version,
+	static void deSerializeBulk(BufferReader &is, int version,
 			MapNode *nodes, u32 nodecount,
 			u8 content_width, u8 params_width, bool compressed);
 
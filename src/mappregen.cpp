@@ -0,0 +1,138 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mappregen.h"
+#include "map.h"
+#include "mapblock.h"
+#include "emerge.h"
+#include "mapgen.h"
+#include "connection.h" // PEER_ID_INEXISTENT
+#include "porting.h"
+#include "log.h"
+
+// Finished chunks are saved in one transaction this many at a time
+#define PREGEN_SAVE_BATCH 64
+// Chunks that haven't shown up in this many seconds are queued again
+#define PREGEN_REQUEUE_TIME 30.0
+
+MapPregenerator::MapPregenerator(EmergeManager *emerge, ServerMap *map,
+		v3s16 blockpos_min, v3s16 blockpos_max):
+	m_emerge(emerge),
+	m_map(map),
+	m_chunks_done(0),
+	m_next(0),
+	m_unsaved(0),
+	m_report_timer(0)
+{
+	// Same division into chunks as ServerMap::initBlockMake()
+	m_chunksize = m_map->getMapgenParams()->chunksize;
+	s16 coffset = -m_chunksize / 2;
+	v3s16 chunk_offset(coffset, coffset, coffset);
+	m_chunk_min = getContainerPos(blockpos_min - chunk_offset, m_chunksize);
+	v3s16 chunk_max = getContainerPos(blockpos_max - chunk_offset, m_chunksize);
+	m_chunk_count = chunk_max - m_chunk_min + v3s16(1,1,1);
+	m_chunks_total = (u32)m_chunk_count.X * m_chunk_count.Y * m_chunk_count.Z;
+
+	m_start_ms = porting::getTimeMs();
+	actionstream<<"Pregeneration: Generating "<<m_chunks_total<<" chunks from "
+			<<PP(blockpos_min * MAP_BLOCKSIZE)<<" to "
+			<<PP((blockpos_max + v3s16(1,1,1)) * MAP_BLOCKSIZE - v3s16(1,1,1))
+			<<std::endl;
+}
+
+// The lowest block of chunk i; Y changes fastest
+v3s16 MapPregenerator::getChunkBlockPos(u32 i)
+{
+	v3s16 c;
+	c.Y = i % m_chunk_count.Y;
+	i /= m_chunk_count.Y;
+	c.X = i % m_chunk_count.X;
+	c.Z = i / m_chunk_count.X;
+	s16 coffset = -m_chunksize / 2;
+	return (m_chunk_min + c) * m_chunksize + v3s16(coffset, coffset, coffset);
+}
+
+void MapPregenerator::step(float dtime)
+{
+	// Look for the chunks that are done
+	for(std::map<v3s16, float>::iterator i = m_pending.begin();
+			i != m_pending.end();)
+	{
+		MapBlock *block = m_map->getBlockNoCreateNoEx(i->first);
+		if(block && block->isGenerated()){
+			m_pending.erase(i++);
+			m_chunks_done++;
+			m_unsaved++;
+			continue;
+		}
+		i->second += dtime;
+		if(i->second >= PREGEN_REQUEUE_TIME){
+			// Dropped somewhere; being queued already doesn't hurt
+			if(m_emerge->enqueueBlockEmerge(PEER_ID_INEXISTENT, i->first, true))
+				i->second = 0;
+		}
+		++i;
+	}
+
+	// Queue as many as the emerge threads take
+	while(m_next < m_chunks_total)
+	{
+		v3s16 p = getChunkBlockPos(m_next);
+		v3s16 p_max = p + v3s16(1,1,1) * (m_chunksize - 1);
+		// Not generated at all, like in initBlockMake()
+		if(blockpos_over_limit(p - v3s16(1,1,1)) ||
+				blockpos_over_limit(p_max + v3s16(1,1,1))){
+			m_next++;
+			m_chunks_done++;
+			continue;
+		}
+		if(!m_emerge->enqueueBlockEmerge(PEER_ID_INEXISTENT, p, true))
+			break;
+		m_pending[p] = 0;
+		m_next++;
+	}
+
+	if(m_unsaved >= PREGEN_SAVE_BATCH || (isDone() && m_unsaved != 0)){
+		m_map->save(MOD_STATE_WRITE_NEEDED);
+		m_unsaved = 0;
+	}
+
+	m_report_timer += dtime;
+	if(m_report_timer >= 5.0 || isDone()){
+		m_report_timer = 0;
+		reportProgress();
+	}
+}
+
+void MapPregenerator::reportProgress()
+{
+	float s = (porting::getTimeMs() - m_start_ms) / 1000.0;
+	if(s < 0.001)
+		s = 0.001;
+	float rate = m_chunks_done / s;
+	actionstream<<"Pregeneration: "<<m_chunks_done<<"/"<<m_chunks_total
+			<<" chunks ("<<(m_chunks_total ?
+					(u64)m_chunks_done * 100 / m_chunks_total : 100)<<"%), "
+			<<rate<<" chunks/s";
+	if(!isDone() && rate > 0){
+		u32 eta = (m_chunks_total - m_chunks_done) / rate;
+		actionstream<<", ETA "<<(eta / 60)<<"m"<<(eta % 60)<<"s";
+	}
+	actionstream<<std::endl;
+}
@@ -0,0 +1,77 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPPREGEN_HEADER
+#define MAPPREGEN_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include <map>
+
+class EmergeManager;
+class ServerMap;
+
+/*
+	Generates an area ahead of time (minetestserver --pregenerate,
+	/pregenerate).
+
+	The chunks of the area are queued to the emerge threads as fast as
+	they take them, a column of chunks after another so that the 2D
+	noise of the columns can be reused. Finished chunks are saved in
+	batches. Chunks that exist already are only loaded. The emerge
+	threads take the requests of players first.
+*/
+class MapPregenerator
+{
+public:
+	// The area is extended to whole chunks
+	MapPregenerator(EmergeManager *emerge, ServerMap *map,
+			v3s16 blockpos_min, v3s16 blockpos_max);
+
+	// Call with the environment locked
+	void step(float dtime);
+
+	bool isDone()
+	{ return m_chunks_done == m_chunks_total; }
+	u32 getChunksTotal()
+	{ return m_chunks_total; }
+	u32 getChunksDone()
+	{ return m_chunks_done; }
+
+private:
+	v3s16 getChunkBlockPos(u32 i);
+	void reportProgress();
+
+	EmergeManager *m_emerge;
+	ServerMap *m_map;
+	s16 m_chunksize;
+	v3s16 m_chunk_min;
+	v3s16 m_chunk_count;
+	u32 m_chunks_total;
+	u32 m_chunks_done;
+	// Index of the next chunk to queue
+	u32 m_next;
+	// Queued chunks by a block in them, with the time they have waited
+	std::map<v3s16, float> m_pending;
+	u32 m_unsaved;
+	float m_report_timer;
+	u32 m_start_ms;
+};
+
+#endif
+
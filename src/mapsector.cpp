@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #endif
 #include "exceptions.h"
 #include "mapblock.h"
+#include "map.h"
 
 MapSector::MapSector(Map *parent, v2s16 pos, IGameDef *gamedef):
 		differs_from_disk(false),
@@ -48,6 +49,8 @@ void MapSector::deleteBlocks()
 	for(std::map<s16, MapBlock*>::iterator i = m_blocks.begin();
 		i != m_blocks.end(); ++i)
 	{
+		if(m_parent)
+			m_parent->removedBlock(i->second);
 		delete i->second;
 	}
 
@@ -102,6 +105,8 @@ MapBlock * MapSector::createBlankBlock(s16 y)
 	MapBlock *block = createBlankBlockNoInsert(y);
 	
 	m_blocks[y] = block;
+	if(m_parent)
+		m_parent->insertedBlock(block);
 
 	return block;
 }
@@ -120,6 +125,8 @@ void MapSector::insertBlock(MapBlock *block)
 	
 	// Insert into container
 	m_blocks[block_y] = block;
+	if(m_parent)
+		m_parent->insertedBlock(block);
 }
 
 void MapSector::deleteBlock(MapBlock *block)
@@ -131,6 +138,8 @@ void MapSector::deleteBlock(MapBlock *block)
 	
 	// Remove from container
 	m_blocks.erase(block_y);
+	if(m_parent)
+		m_parent->removedBlock(block);
 
 	// Delete
 	delete block;
@@ -63,6 +63,11 @@ class MapSector
 	void deleteBlock(MapBlock *block);
 	
 	void getBlocks(std::list<MapBlock*> &dest);
+
+	bool empty()
+	{
+		return m_blocks.empty();
+	}
 	
 	// Always false at the moment, because sector contains no metadata.
 	bool differs_from_disk;
@@ -20,7 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nameidmapping.h"
 #include "util/serialize.h"
 
-void NameIdMapping::serialize(std::ostream &os) const
+void NameIdMapping::serialize(BufferWriter &os) const
 {
 	writeU8(os, 0); // version
 	writeU16(os, m_id_to_name.size());
@@ -28,7 +28,23 @@ void NameIdMapping::serialize(std::ostream &os) const
 			i = m_id_to_name.begin();
 			i != m_id_to_name.end(); i++){
 		writeU16(os, i->first);
-		os<<serializeString(i->second);
+		serializeString(os, i->second);
+	}
+}
+
+void NameIdMapping::deSerialize(BufferReader &is)
+{
+	int version = readU8(is);
+	if(version != 0)
+		throw SerializationError("unsupported NameIdMapping version");
+	u32 count = readU16(is);
+	m_id_to_name.clear();
+	m_name_to_id.clear();
+	for(u32 i=0; i<count; i++){
+		u16 id = readU16(is);
+		std::string name = deSerializeString(is);
+		m_id_to_name[id] = name;
+		m_name_to_id[name] = id;
 	}
 }
 
@@ -26,10 +26,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <map>
 #include "irrlichttypes_bloated.h"
 
+class BufferWriter;
+class BufferReader;
+
 class NameIdMapping
 {
 public:
-	void serialize(std::ostream &os) const;
+	void serialize(BufferWriter &os) const;
+	void deSerialize(BufferReader &is);
+	// For the pre-22 MapBlock format, which is read from a stream
 	void deSerialize(std::istream &is);
 	
 	void clear(){
@@ -419,11 +419,9 @@ class CNodeDefManager: public IWritableNodeDefManager
 	}
 	virtual IWritableNodeDefManager* clone()
 	{
+		// Copies the aliases and groups too, which set() wouldn't
 		CNodeDefManager *mgr = new CNodeDefManager();
-		for(u16 i=0; i<=MAX_CONTENT; i++)
-		{
-			mgr->set(i, get(i));
-		}
+		*mgr = *this;
 		return mgr;
 	}
 	virtual const ContentFeatures& get(content_t c) const
@@ -831,6 +829,32 @@ IWritableNodeDefManager* createNodeDefManager()
 	return new CNodeDefManager();
 }
 
+/*
+	NodeDefSnapshot
+*/
+
+NodeDefSnapshot::NodeDefSnapshot(IWritableNodeDefManager *ndef)
+{
+	m_ndef = ndef->clone();
+
+	for(u32 i=0; i<=MAX_CONTENT; i++)
+	{
+		const ContentFeatures &f = m_ndef->get(i);
+		m_walkable[i] = f.walkable;
+		m_light_propagates[i] = f.light_propagates;
+		m_sunlight_propagates[i] = f.sunlight_propagates;
+		m_light_source[i] = f.light_source;
+		m_param_type[i] = f.param_type;
+		m_liquid_type[i] = f.liquid_type;
+		m_drawtype[i] = f.drawtype;
+	}
+}
+
+NodeDefSnapshot::~NodeDefSnapshot()
+{
+	delete m_ndef;
+}
+
 /*
 	Serialization of old ContentFeatures formats
 */
@@ -318,5 +318,67 @@ class IWritableNodeDefManager : public INodeDefManager
 
 IWritableNodeDefManager* createNodeDefManager();
 
+/*
+	Read-only copy of the node definitions, taken once the mods have been
+	loaded. The emerge threads use it instead of the node definition
+	manager of the server, which gets nodes added to it when blocks with
+	unknown nodes are loaded; nothing changes the copy, so any thread can
+	read it without locking. Ids allocated after the copy was taken have
+	the default definition in it.
+
+	The flags the mapgens check for every node are also kept in flat
+	arrays indexed by content, so they don't need to go through the whole
+	ContentFeatures.
+*/
+class NodeDefSnapshot : public INodeDefManager
+{
+public:
+	NodeDefSnapshot(IWritableNodeDefManager *ndef);
+	~NodeDefSnapshot();
+
+	const ContentFeatures& get(content_t c) const
+	{ return m_ndef->get(c); }
+	const ContentFeatures& get(const MapNode &n) const
+	{ return m_ndef->get(n); }
+	bool getId(const std::string &name, content_t &result) const
+	{ return m_ndef->getId(name, result); }
+	content_t getId(const std::string &name) const
+	{ return m_ndef->getId(name); }
+	void getIds(const std::string &name, std::set<content_t> &result) const
+	{ m_ndef->getIds(name, result); }
+	const ContentFeatures& get(const std::string &name) const
+	{ return m_ndef->get(name); }
+
+	void serialize(std::ostream &os, u16 protocol_version)
+	{ m_ndef->serialize(os, protocol_version); }
+
+	// The flags of a content; c must be at most MAX_CONTENT
+	bool walkable(content_t c) const
+	{ return m_walkable[c]; }
+	bool lightPropagates(content_t c) const
+	{ return m_light_propagates[c]; }
+	bool sunlightPropagates(content_t c) const
+	{ return m_sunlight_propagates[c]; }
+	u8 lightSource(content_t c) const
+	{ return m_light_source[c]; }
+	ContentParamType paramType(content_t c) const
+	{ return (ContentParamType)m_param_type[c]; }
+	LiquidType liquidType(content_t c) const
+	{ return (LiquidType)m_liquid_type[c]; }
+	NodeDrawType drawType(content_t c) const
+	{ return (NodeDrawType)m_drawtype[c]; }
+
+private:
+	IWritableNodeDefManager *m_ndef;
+
+	bool m_walkable[MAX_CONTENT+1];
+	bool m_light_propagates[MAX_CONTENT+1];
+	bool m_sunlight_propagates[MAX_CONTENT+1];
+	u8 m_light_source[MAX_CONTENT+1];
+	u8 m_param_type[MAX_CONTENT+1];
+	u8 m_liquid_type[MAX_CONTENT+1];
+	u8 m_drawtype[MAX_CONTENT+1];
+};
+
 #endif
 
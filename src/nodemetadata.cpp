@@ -41,20 +41,23 @@ NodeMetadata::~NodeMetadata()
 	delete m_inventory;
 }
 
-void NodeMetadata::serialize(std::ostream &os) const
+void NodeMetadata::serialize(BufferWriter &os) const
 {
 	int num_vars = m_stringvars.size();
 	writeU32(os, num_vars);
 	for(std::map<std::string, std::string>::const_iterator
 			i = m_stringvars.begin(); i != m_stringvars.end(); i++){
-		os<<serializeString(i->first);
-		os<<serializeLongString(i->second);
+		serializeString(os, i->first);
+		serializeLongString(os, i->second);
 	}
 
-	m_inventory->serialize(os);
+	// Inventory only knows streams; write through one straight into os
+	BufferWriterStreamBuf sb(os);
+	std::ostream inv_os(&sb);
+	m_inventory->serialize(inv_os);
 }
 
-void NodeMetadata::deSerialize(std::istream &is)
+void NodeMetadata::deSerialize(BufferReader &is)
 {
 	m_stringvars.clear();
 	int num_vars = readU32(is);
@@ -64,7 +67,10 @@ void NodeMetadata::deSerialize(std::istream &is)
 		m_stringvars[name] = var;
 	}
 
-	m_inventory->deSerialize(is);
+	BufferReaderStreamBuf sb(is);
+	std::istream inv_is(&sb);
+	m_inventory->deSerialize(inv_is);
+	sb.finish();
 }
 
 void NodeMetadata::clear()
@@ -77,7 +83,7 @@ void NodeMetadata::clear()
 	NodeMetadataList
 */
 
-void NodeMetadataList::serialize(std::ostream &os) const
+void NodeMetadataList::serialize(BufferWriter &os) const
 {
 	/*
 		Version 0 is a placeholder for "nothing to see here; go away."
@@ -107,7 +113,7 @@ void NodeMetadataList::serialize(std::ostream &os) const
 	}
 }
 
-void NodeMetadataList::deSerialize(std::istream &is, IGameDef *gamedef)
+void NodeMetadataList::deSerialize(BufferReader &is, IGameDef *gamedef)
 {
 	m_data.clear();
 
@@ -36,6 +36,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 class Inventory;
 class IGameDef;
+class BufferWriter;
+class BufferReader;
 
 class NodeMetadata
 {
@@ -43,8 +45,8 @@ class NodeMetadata
 	NodeMetadata(IGameDef *gamedef);
 	~NodeMetadata();
 	
-	void serialize(std::ostream &os) const;
-	void deSerialize(std::istream &is);
+	void serialize(BufferWriter &os) const;
+	void deSerialize(BufferReader &is);
 	
 	void clear();
 
@@ -97,8 +99,8 @@ class NodeMetadataList
 public:
 	~NodeMetadataList();
 
-	void serialize(std::ostream &os) const;
-	void deSerialize(std::istream &is, IGameDef *gamedef);
+	void serialize(BufferWriter &os) const;
+	void deSerialize(BufferReader &is, IGameDef *gamedef);
 	
 	// Get pointer to data
 	NodeMetadata* get(v3s16 p);
@@ -26,13 +26,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	NodeTimer
 */
 
-void NodeTimer::serialize(std::ostream &os) const
+void NodeTimer::serialize(BufferWriter &os) const
 {
 	writeF1000(os, timeout);
 	writeF1000(os, elapsed);
 }
 
-void NodeTimer::deSerialize(std::istream &is)
+void NodeTimer::deSerialize(BufferReader &is)
 {
 	timeout = readF1000(is);
 	elapsed = readF1000(is);
@@ -42,7 +42,7 @@ void NodeTimer::deSerialize(std::istream &is)
 	NodeTimerList
 */
 
-void NodeTimerList::serialize(std::ostream &os, u8 map_format_version) const
+void NodeTimerList::serialize(BufferWriter &os, u8 map_format_version) const
 {
 	if(map_format_version == 24){
 		// Version 0 is a placeholder for "nothing to see here; go away."
@@ -71,7 +71,7 @@ void NodeTimerList::serialize(std::ostream &os, u8 map_format_version) const
 	}
 }
 
-void NodeTimerList::deSerialize(std::istream &is, u8 map_format_version)
+void NodeTimerList::deSerialize(BufferReader &is, u8 map_format_version)
 {
 	m_data.clear();
 	
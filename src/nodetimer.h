@@ -24,6 +24,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <iostream>
 #include <map>
 
+class BufferWriter;
+class BufferReader;
+
 /*
 	NodeTimer provides per-node timed callback functionality.
 	Can be used for:
@@ -40,8 +43,8 @@ class NodeTimer
 		timeout(timeout_), elapsed(elapsed_) {}
 	~NodeTimer() {}
 	
-	void serialize(std::ostream &os) const;
-	void deSerialize(std::istream &is);
+	void serialize(BufferWriter &os) const;
+	void deSerialize(BufferReader &is);
 	
 	f32 timeout;
 	f32 elapsed;
@@ -57,8 +60,8 @@ class NodeTimerList
 	NodeTimerList() {}
 	~NodeTimerList() {}
 	
-	void serialize(std::ostream &os, u8 map_format_version) const;
-	void deSerialize(std::istream &is, u8 map_format_version);
+	void serialize(BufferWriter &os, u8 map_format_version) const;
+	void deSerialize(BufferReader &is, u8 map_format_version);
 	
 	// Get timer
 	NodeTimer get(v3s16 p){
@@ -35,11 +35,26 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 class Profiler
 {
 public:
-	Profiler()
+	Profiler():
+		m_precision(PRECISION_MILLI)
 	{
 		m_mutex.Init();
 	}
 
+	// Precision of the timers of ScopeProfilers. The microsecond clock
+	// wraps around after about 71 minutes, so it is only for short runs
+	// like benchmarks.
+	void setPrecision(TimePrecision precision)
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_precision = precision;
+	}
+	TimePrecision getPrecision()
+	{
+		JMutexAutoLock lock(m_mutex);
+		return m_precision;
+	}
+
 	void add(const std::string &name, float value)
 	{
 		JMutexAutoLock lock(m_mutex);
@@ -85,6 +100,22 @@ class Profiler
 		}
 	}
 
+	// Returns the average for values added with avg()
+	float getValue(const std::string &name)
+	{
+		JMutexAutoLock lock(m_mutex);
+		std::map<std::string, float>::iterator i = m_data.find(name);
+		if(i == m_data.end())
+			return 0;
+		int avgcount = 1;
+		std::map<std::string, int>::iterator n = m_avgcounts.find(name);
+		if(n != m_avgcounts.end()){
+			if(n->second >= 1)
+				avgcount = n->second;
+		}
+		return i->second / avgcount;
+	}
+
 	void clear()
 	{
 		JMutexAutoLock lock(m_mutex);
@@ -169,6 +200,7 @@ class Profiler
 	std::map<std::string, float> m_data;
 	std::map<std::string, int> m_avgcounts;
 	std::map<std::string, float> m_graphvalues;
+	TimePrecision m_precision;
 };
 
 enum ScopeProfilerType{
@@ -185,10 +217,13 @@ class ScopeProfiler
 		m_profiler(profiler),
 		m_name(name),
 		m_timer(NULL),
+		m_precision(PRECISION_MILLI),
 		m_type(type)
 	{
-		if(m_profiler)
-			m_timer = new TimeTaker(m_name.c_str());
+		if(m_profiler){
+			m_precision = m_profiler->getPrecision();
+			m_timer = new TimeTaker(m_name.c_str(), NULL, m_precision);
+		}
 	}
 	// name is copied
 	ScopeProfiler(Profiler *profiler, const char *name,
@@ -196,17 +231,23 @@ class ScopeProfiler
 		m_profiler(profiler),
 		m_name(name),
 		m_timer(NULL),
+		m_precision(PRECISION_MILLI),
 		m_type(type)
 	{
-		if(m_profiler)
-			m_timer = new TimeTaker(m_name.c_str());
+		if(m_profiler){
+			m_precision = m_profiler->getPrecision();
+			m_timer = new TimeTaker(m_name.c_str(), NULL, m_precision);
+		}
 	}
 	~ScopeProfiler()
 	{
 		if(m_timer)
 		{
-			float duration_ms = m_timer->stop(true);
-			float duration = duration_ms / 1000.0;
+			float duration = m_timer->stop(true);
+			if(m_precision == PRECISION_MICRO)
+				duration /= 1000000.0;
+			else
+				duration /= 1000.0;
 			if(m_profiler){
 				switch(m_type){
 				case SPT_ADD:
@@ -227,6 +268,7 @@ class ScopeProfiler
 	Profiler *m_profiler;
 	std::string m_name;
 	TimeTaker *m_timer;
+	TimePrecision m_precision;
 	enum ScopeProfilerType m_type;
 };
 
@@ -43,7 +43,7 @@ RollbackNode::RollbackNode(Map *map, v3s16 p, IGameDef *gamedef)
 	param2 = n.param2;
 	NodeMetadata *metap = map->getNodeMetadata(p);
 	if(metap){
-		std::ostringstream os(std::ios::binary);
+		BufferWriter os;
 		metap->serialize(os);
 		meta = os.str();
 	}
@@ -342,7 +342,8 @@ bool RollbackAction::applyRevert(Map *map, InventoryManager *imgr, IGameDef *gam
 						meta = new NodeMetadata(gamedef);
 						map->setNodeMetadata(p, meta);
 					}
-					std::istringstream is(n_old.meta, std::ios::binary);
+					BufferReader is((const u8*)n_old.meta.data(),
+							n_old.meta.size());
 					meta->deSerialize(is);
 				} else {
 					map->removeNodeMetadata(p);
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <cstdio>
 #include <cstdlib>
 #include "log.h"
+#include "porting.h"
 #include <iostream>
 
 extern "C" {
@@ -111,6 +112,159 @@ bool script_load(lua_State *L, const char *path)
 	return true;
 }
 
+/*
+	ScriptCallBudget
+*/
+
+// How many VM instructions run between checks of the clock
+#define SCRIPT_BUDGET_HOOK_COUNT 10000
+
+static u32 g_script_budget_warn_ms = 0;
+static u32 g_script_budget_abort_ms = 0;
+
+// Address used as registry key for the active budget of a state
+static char g_script_budget_key;
+
+void script_set_call_budget(u32 warn_ms, u32 abort_ms)
+{
+	g_script_budget_warn_ms = warn_ms;
+	g_script_budget_abort_ms = abort_ms;
+}
+
+ScriptCallBudget::ScriptCallBudget(lua_State *L, const char *what):
+	m_lua(L),
+	m_what(what),
+	m_active(false),
+	m_start_ms(0),
+	m_warned(false),
+	m_aborted(false)
+{
+	if(g_script_budget_warn_ms == 0 && g_script_budget_abort_ms == 0)
+		return;
+
+	lua_pushlightuserdata(L, &g_script_budget_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	bool nested = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	if(nested)
+		return;
+
+	lua_pushlightuserdata(L, &g_script_budget_key);
+	lua_pushlightuserdata(L, this);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	lua_sethook(L, hook, LUA_MASKCOUNT, SCRIPT_BUDGET_HOOK_COUNT);
+	m_start_ms = porting::getTimeMs();
+	m_active = true;
+}
+
+ScriptCallBudget::~ScriptCallBudget()
+{
+	if(!m_active)
+		return;
+	lua_State *L = m_lua;
+	lua_sethook(L, NULL, 0, 0);
+	lua_pushlightuserdata(L, &g_script_budget_key);
+	lua_pushnil(L);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+bool ScriptCallBudget::aborted()
+{
+	if(m_active)
+		return m_aborted;
+	lua_State *L = m_lua;
+	lua_pushlightuserdata(L, &g_script_budget_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	ScriptCallBudget *outer = (ScriptCallBudget*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return outer && outer->m_aborted;
+}
+
+void ScriptCallBudget::hook(lua_State *L, lua_Debug *ar)
+{
+	lua_pushlightuserdata(L, &g_script_budget_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	ScriptCallBudget *budget = (ScriptCallBudget*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if(budget)
+		budget->check();
+}
+
+void ScriptCallBudget::check()
+{
+	lua_State *L = m_lua;
+	u32 time_ms = porting::getTimeMs() - m_start_ms;
+
+	if(g_script_budget_warn_ms != 0 && time_ms >= g_script_budget_warn_ms
+			&& !m_warned){
+		m_warned = true;
+		errorstream<<"Lua "<<m_what<<" from "<<getOrigin()
+				<<" has been running for "<<time_ms<<"ms"<<std::endl;
+		errorstream<<script_get_backtrace(L)<<std::endl;
+	}
+
+	if(m_aborted){
+		// Still running, so the error has been caught by a pcall in
+		// the script; keep raising it until the call has unwound
+		luaL_error(L, "%s aborted", m_what);
+	}
+
+	if(g_script_budget_abort_ms != 0 && time_ms >= g_script_budget_abort_ms){
+		m_aborted = true;
+		errorstream<<"Lua "<<m_what<<" from "<<getOrigin()
+				<<" aborted after running for "<<time_ms<<"ms"<<std::endl;
+		errorstream<<script_get_backtrace(L)<<std::endl;
+		luaL_error(L, "%s aborted", m_what);
+	}
+}
+
+int script_pcall(lua_State *L, int nargs, int nresults, const char *what)
+{
+	ScriptCallBudget budget(L, what);
+	int ret = lua_pcall(L, nargs, nresults, 0);
+	if(ret != 0 && budget.aborted()){
+		// Already logged; the result of the call is just dropped
+		lua_pop(L, 1);
+		for(int i = 0; i < nresults; i++)
+			lua_pushnil(L);
+		return 0;
+	}
+	return ret;
+}
+
+/*
+	Returns the mod that registered the function at the bottom of the
+	call stack, or the file it was defined in if it wasn't registered
+	through one of the minetest.register_* functions.
+*/
+std::string ScriptCallBudget::getOrigin()
+{
+	lua_State *L = m_lua;
+	lua_Debug ar;
+	int level = 0;
+	while(lua_getstack(L, level + 1, &ar))
+		level++;
+	if(!lua_getstack(L, level, &ar))
+		return "??";
+	lua_getinfo(L, "Sf", &ar);
+	std::string origin = std::string("\"") + ar.short_src + "\"";
+
+	lua_getglobal(L, "minetest");
+	if(lua_istable(L, -1)){
+		lua_getfield(L, -1, "callback_origins");
+		if(lua_istable(L, -1)){
+			lua_pushvalue(L, -3); // The function
+			lua_rawget(L, -2);
+			if(lua_isstring(L, -1))
+				origin = std::string("mod \"") + lua_tostring(L, -1) + "\"";
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2); // minetest, the function
+	return origin;
+}
+
 lua_State* script_init()
 {
 	lua_State *L = luaL_newstate();
@@ -22,8 +22,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <exception>
 #include <string>
+#include "irrlichttypes.h"
 
 typedef struct lua_State lua_State;
+struct lua_Debug;
 
 class LuaError : public std::exception
 {
@@ -45,5 +47,44 @@ std::string script_get_backtrace(lua_State *L);
 void script_error(lua_State *L, const char *fmt, ...);
 bool script_load(lua_State *L, const char *path);
 
+/*
+	Watchdog for a single call into Lua.
+
+	While an instance exists, a count hook checks how long the call has
+	been running. Past the warning time the offender is logged once with
+	its mod and a backtrace; past the abort time the call is logged again
+	and made to unwind with a Lua error, which script_pcall() drops
+	instead of reporting it as a script error. Nested instances on the
+	same state do nothing; the outermost one covers the whole call.
+*/
+class ScriptCallBudget
+{
+public:
+	ScriptCallBudget(lua_State *L, const char *what);
+	~ScriptCallBudget();
+
+	// Whether the call, or the outermost one it is nested in, was
+	// aborted for running too long
+	bool aborted();
+
+private:
+	static void hook(lua_State *L, lua_Debug *ar);
+	void check();
+	std::string getOrigin();
+
+	lua_State *m_lua;
+	const char *m_what;
+	bool m_active;
+	u32 m_start_ms;
+	bool m_warned;
+	bool m_aborted;
+};
+
+// Sets the limits used by ScriptCallBudget, in milliseconds (0 = off)
+void script_set_call_budget(u32 warn_ms, u32 abort_ms);
+// lua_pcall() watched by a ScriptCallBudget. An aborted call counts as
+// successful and leaves nresults nils on the stack.
+int script_pcall(lua_State *L, int nargs, int nresults, const char *what);
+
 #endif
 
@@ -33,6 +33,7 @@ extern "C" {
 #include "emerge.h"
 #include "script.h"
 #include "rollback.h"
+#include "filesys.h"
 
 #include "scriptapi_types.h"
 #include "scriptapi_env.h"
@@ -46,6 +47,7 @@ extern "C" {
 #include "scriptapi_content.h"
 #include "scriptapi_craft.h"
 #include "scriptapi_particles.h"
+#include "scriptapi_serialize.h"
 
 /*****************************************************************************/
 /* Mod related                                                               */
@@ -363,7 +365,7 @@ void scriptapi_run_callbacks(lua_State *L, int nargs,
 		// Call function
 		for(int i = 0; i < nargs; i++)
 			lua_pushvalue(L, arg+i);
-		if(lua_pcall(L, nargs, 1, 0))
+		if(script_pcall(L, nargs, 1, "callback"))
 			script_error(L, "error: %s", lua_tostring(L, -1));
 
 		// Move return value to designated space in stack
@@ -609,6 +611,15 @@ static int l_request_shutdown(lua_State *L)
 	return 0;
 }
 
+// pregenerate_area(minp, maxp)
+static int l_pregenerate_area(lua_State *L)
+{
+	v3s16 minp = read_v3s16(L, 1);
+	v3s16 maxp = read_v3s16(L, 2);
+	lua_pushboolean(L, get_server(L)->startPregeneration(minp, maxp));
+	return 1;
+}
+
 // get_server_status()
 static int l_get_server_status(lua_State *L)
 {
@@ -724,8 +735,6 @@ static int l_register_ore(lua_State *L)
 	ore->np = read_noiseparams(L, -1);
 	lua_pop(L, 1);
 	
-	ore->noise = NULL;
-	
 	if (ore->clust_scarcity <= 0 || ore->clust_num_ores <= 0) {
 		errorstream << "register_ore: clust_scarcity and clust_num_ores"
 			" must be greater than 0" << std::endl;
@@ -740,6 +749,26 @@ static int l_register_ore(lua_State *L)
 	return 0;
 }
 
+// register_mapgen_script(path)
+// The script is run in a separate Lua state in every emerge thread
+static int l_register_mapgen_script(lua_State *L)
+{
+	std::string path = luaL_checkstring(L, 1);
+	if(!fs::PathExists(path))
+		script_error(L, "register_mapgen_script: \"%s\" does not exist",
+				path.c_str());
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "minetest_current_modname");
+	std::string modname = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+	lua_pop(L, 1);
+
+	EmergeManager *emerge = get_server(L)->getEmergeManager();
+	emerge->mapgen_scripts.push_back(MapgenScript(modname, path));
+
+	verbosestream << "register_mapgen_script: " << path << std::endl;
+	return 0;
+}
+
 
 // setting_set(name, value)
 static int l_setting_set(lua_State *L)
@@ -1108,6 +1137,7 @@ static const struct luaL_Reg minetest_f [] = {
 	{"debug", l_debug},
 	{"log", l_log},
 	{"request_shutdown", l_request_shutdown},
+	{"pregenerate_area", l_pregenerate_area},
 	{"get_server_status", l_get_server_status},
 	{"register_item_raw", l_register_item_raw},
 	{"register_alias_raw", l_register_alias_raw},
@@ -1115,6 +1145,7 @@ static const struct luaL_Reg minetest_f [] = {
 	{"register_biome", l_register_biome},
 	{"register_biome_groups", l_register_biome_groups},
 	{"register_ore", l_register_ore},
+	{"register_mapgen_script", l_register_mapgen_script},
 	{"setting_set", l_setting_set},
 	{"setting_get", l_setting_get},
 	{"setting_getbool", l_setting_getbool},
@@ -1138,6 +1169,9 @@ static const struct luaL_Reg minetest_f [] = {
 	{"sound_play", l_sound_play},
 	{"sound_stop", l_sound_stop},
 	{"is_singleplayer", l_is_singleplayer},
+	{"serialize", l_serialize},
+	{"serialize_binary", l_serialize_binary},
+	{"deserialize", l_deserialize},
 	{"get_password_hash", l_get_password_hash},
 	{"notify_authentication_modified", l_notify_authentication_modified},
 	{"get_craft_result", l_get_craft_result},
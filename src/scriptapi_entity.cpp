@@ -233,7 +233,7 @@ void scriptapi_luaentity_step(lua_State *L, u16 id, float dtime)
 	lua_pushvalue(L, object); // self
 	lua_pushnumber(L, dtime); // dtime
 	// Call with 2 arguments, 0 results
-	if(lua_pcall(L, 2, 0, 0))
+	if(script_pcall(L, 2, 0, "entity on_step"))
 		script_error(L, "error running function 'on_step': %s\n", lua_tostring(L, -1));
 }
 
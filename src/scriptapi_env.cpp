@@ -110,7 +110,7 @@ class LuaABM : public ActiveBlockModifier
 		pushnode(L, n, env->getGameDef()->ndef());
 		lua_pushnumber(L, active_object_count);
 		lua_pushnumber(L, active_object_count_wider);
-		if(lua_pcall(L, 4, 0, 0))
+		if(script_pcall(L, 4, 0, "ABM action"))
 			script_error(L, "error: %s", lua_tostring(L, -1));
 	}
 };
@@ -506,6 +506,93 @@ int EnvRef::l_get_timeofday(lua_State *L)
 }
 
 
+/*
+	Matches node contents against a set of wanted contents, skipping
+	whole MapBlocks whose content index shows they can't contain any of
+	them. The last looked up block is cached.
+*/
+class NodeContentFilter
+{
+public:
+	NodeContentFilter(Map *map, const std::set<content_t> &contents):
+		m_map(map),
+		m_block(NULL),
+		m_block_can_match(false),
+		m_block_valid(false)
+	{
+		for(std::set<content_t>::const_iterator
+				i = contents.begin(); i != contents.end(); i++){
+			if(*i <= MAX_CONTENT)
+				m_contents.set(*i);
+		}
+	}
+
+	// Selects the block to match nodes in.
+	// Returns false if no node in the block can match.
+	bool selectBlock(v3s16 blockpos)
+	{
+		if(m_block_valid && blockpos == m_blockpos)
+			return m_block_can_match;
+		m_blockpos = blockpos;
+		m_block_valid = true;
+		m_block = m_map->getBlockNoCreateNoEx(blockpos);
+		if(m_block != NULL && m_block->isDummy())
+			m_block = NULL;
+		if(m_block == NULL){
+			// Every node of a missing block reads as CONTENT_IGNORE
+			m_block_can_match = m_contents.test(CONTENT_IGNORE);
+		} else {
+			m_block_can_match = m_block->mayContainAny(m_contents);
+		}
+		return m_block_can_match;
+	}
+
+	// Matches a node of the selected block by block-relative position
+	bool matchesInBlock(v3s16 relpos)
+	{
+		if(!m_block_can_match)
+			return false;
+		if(m_block == NULL)
+			return true;
+		content_t c = m_block->getNodeNoCheck(relpos).getContent();
+		return (c <= MAX_CONTENT && m_contents.test(c));
+	}
+
+	bool matches(v3s16 p)
+	{
+		v3s16 blockpos = getNodeBlockPos(p);
+		if(!selectBlock(blockpos))
+			return false;
+		return matchesInBlock(p - blockpos * MAP_BLOCKSIZE);
+	}
+
+private:
+	Map *m_map;
+	ContentBitset m_contents;
+	v3s16 m_blockpos;
+	MapBlock *m_block;
+	bool m_block_can_match;
+	bool m_block_valid;
+};
+
+// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
+static void read_content_ids(lua_State *L, int index, INodeDefManager *ndef,
+		std::set<content_t> &result)
+{
+	if(lua_istable(L, index)){
+		lua_pushnil(L);
+		while(lua_next(L, index) != 0){
+			// key at index -2 and value at index -1
+			luaL_checktype(L, -1, LUA_TSTRING);
+			ndef->getIds(lua_tostring(L, -1), result);
+			// removes value, keeps key for next iteration
+			lua_pop(L, 1);
+		}
+	} else if(lua_isstring(L, index)){
+		ndef->getIds(lua_tostring(L, index), result);
+	}
+}
+
 // EnvRef:find_node_near(pos, radius, nodenames) -> pos or nil
 // nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 int EnvRef::l_find_node_near(lua_State *L)
@@ -516,29 +603,18 @@ int EnvRef::l_find_node_near(lua_State *L)
 	INodeDefManager *ndef = get_server(L)->ndef();
 	v3s16 pos = read_v3s16(L, 2);
 	int radius = luaL_checkinteger(L, 3);
-	std::set<content_t> filter;
-	if(lua_istable(L, 4)){
-		int table = 4;
-		lua_pushnil(L);
-		while(lua_next(L, table) != 0){
-			// key at index -2 and value at index -1
-			luaL_checktype(L, -1, LUA_TSTRING);
-			ndef->getIds(lua_tostring(L, -1), filter);
-			// removes value, keeps key for next iteration
-			lua_pop(L, 1);
-		}
-	} else if(lua_isstring(L, 4)){
-		ndef->getIds(lua_tostring(L, 4), filter);
-	}
+	std::set<content_t> ids;
+	read_content_ids(L, 4, ndef, ids);
+	NodeContentFilter filter(&env->getMap(), ids);
 
+	std::vector<v3s16> list;
 	for(int d=1; d<=radius; d++){
-		std::list<v3s16> list;
+		list.clear();
 		getFacePositions(list, d);
-		for(std::list<v3s16>::iterator i = list.begin();
+		for(std::vector<v3s16>::iterator i = list.begin();
 				i != list.end(); ++i){
 			v3s16 p = pos + (*i);
-			content_t c = env->getMap().getNodeNoEx(p).getContent();
-			if(filter.count(c) != 0){
+			if(filter.matches(p)){
 				push_v3s16(L, p);
 				return 1;
 			}
@@ -557,45 +633,111 @@ int EnvRef::l_find_nodes_in_area(lua_State *L)
 	INodeDefManager *ndef = get_server(L)->ndef();
 	v3s16 minp = read_v3s16(L, 2);
 	v3s16 maxp = read_v3s16(L, 3);
-	std::set<content_t> filter;
-	if(lua_istable(L, 4)){
-		int table = 4;
-		lua_pushnil(L);
-		while(lua_next(L, table) != 0){
-			// key at index -2 and value at index -1
-			luaL_checktype(L, -1, LUA_TSTRING);
-			ndef->getIds(lua_tostring(L, -1), filter);
-			// removes value, keeps key for next iteration
-			lua_pop(L, 1);
-		}
-	} else if(lua_isstring(L, 4)){
-		ndef->getIds(lua_tostring(L, 4), filter);
-	}
-
-	// Get the table insert function
-	lua_getglobal(L, "table");
-	lua_getfield(L, -1, "insert");
-	int table_insert = lua_gettop(L);
+	std::set<content_t> ids;
+	read_content_ids(L, 4, ndef, ids);
+	NodeContentFilter filter(&env->getMap(), ids);
 
 	lua_newtable(L);
 	int table = lua_gettop(L);
-	for(s16 x=minp.X; x<=maxp.X; x++)
-	for(s16 y=minp.Y; y<=maxp.Y; y++)
-	for(s16 z=minp.Z; z<=maxp.Z; z++)
+	int count = 0;
+
+	// Go through the area block by block, so that blocks which can't
+	// contain any of the wanted nodes are skipped as a whole
+	v3s16 blockpos_min = getNodeBlockPos(minp);
+	v3s16 blockpos_max = getNodeBlockPos(maxp);
+	v3s16 bp;
+	for(bp.X=blockpos_min.X; bp.X<=blockpos_max.X; bp.X++)
+	for(bp.Y=blockpos_min.Y; bp.Y<=blockpos_max.Y; bp.Y++)
+	for(bp.Z=blockpos_min.Z; bp.Z<=blockpos_max.Z; bp.Z++)
 	{
-		v3s16 p(x,y,z);
-		content_t c = env->getMap().getNodeNoEx(p).getContent();
-		if(filter.count(c) != 0){
-			lua_pushvalue(L, table_insert);
-			lua_pushvalue(L, table);
-			push_v3s16(L, p);
-			if(lua_pcall(L, 2, 0, 0))
-				script_error(L, "error: %s", lua_tostring(L, -1));
+		if(!filter.selectBlock(bp))
+			continue;
+		v3s16 blockpos_nodes = bp * MAP_BLOCKSIZE;
+		// The part of the area that is inside this block
+		v3s16 relmin(
+			MYMAX(minp.X - blockpos_nodes.X, 0),
+			MYMAX(minp.Y - blockpos_nodes.Y, 0),
+			MYMAX(minp.Z - blockpos_nodes.Z, 0));
+		v3s16 relmax(
+			MYMIN(maxp.X - blockpos_nodes.X, MAP_BLOCKSIZE-1),
+			MYMIN(maxp.Y - blockpos_nodes.Y, MAP_BLOCKSIZE-1),
+			MYMIN(maxp.Z - blockpos_nodes.Z, MAP_BLOCKSIZE-1));
+		v3s16 relpos;
+		for(relpos.X=relmin.X; relpos.X<=relmax.X; relpos.X++)
+		for(relpos.Y=relmin.Y; relpos.Y<=relmax.Y; relpos.Y++)
+		for(relpos.Z=relmin.Z; relpos.Z<=relmax.Z; relpos.Z++)
+		{
+			if(filter.matchesInBlock(relpos)){
+				push_v3s16(L, blockpos_nodes + relpos);
+				lua_rawseti(L, table, ++count);
+			}
 		}
 	}
 	return 1;
 }
 
+// EnvRef:raycast(pos1, pos2, objects) -> hit or nil
+// hit = {type="node", under=pos, above=pos, node=node,
+//        intersection_point=pos, intersection_normal=dir}
+//    or {type="object", ref=ObjectRef,
+//        intersection_point=pos, intersection_normal=dir}
+int EnvRef::l_raycast(lua_State *L)
+{
+	EnvRef *o = checkobject(L, 1);
+	ServerEnvironment *env = o->m_env;
+	if(env == NULL) return 0;
+	INodeDefManager *ndef = get_server(L)->ndef();
+	v3f pos1 = checkFloatPos(L, 2);
+	v3f pos2 = checkFloatPos(L, 3);
+	bool objects = lua_toboolean(L, 4);
+
+	RaycastHit hit;
+	if(!env->raycast(pos1, pos2, objects, hit)){
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_newtable(L);
+	if(hit.type == RAYCAST_HIT_NODE){
+		lua_pushstring(L, "node");
+		lua_setfield(L, -2, "type");
+		push_v3s16(L, hit.node_pos);
+		lua_setfield(L, -2, "under");
+		push_v3s16(L, hit.node_pos + hit.normal);
+		lua_setfield(L, -2, "above");
+		pushnode(L, hit.node, ndef);
+		lua_setfield(L, -2, "node");
+	} else {
+		lua_pushstring(L, "object");
+		lua_setfield(L, -2, "type");
+		objectref_get_or_create(L, env->getActiveObject(hit.object_id));
+		lua_setfield(L, -2, "ref");
+	}
+	pushFloatPos(L, hit.point);
+	lua_setfield(L, -2, "intersection_point");
+	push_v3s16(L, hit.normal);
+	lua_setfield(L, -2, "intersection_normal");
+	return 1;
+}
+
+// EnvRef:line_of_sight(pos1, pos2) -> true or false, blocking node pos
+int EnvRef::l_line_of_sight(lua_State *L)
+{
+	EnvRef *o = checkobject(L, 1);
+	ServerEnvironment *env = o->m_env;
+	if(env == NULL) return 0;
+	v3f pos1 = checkFloatPos(L, 2);
+	v3f pos2 = checkFloatPos(L, 3);
+
+	RaycastHit hit;
+	if(!env->raycast(pos1, pos2, false, hit)){
+		lua_pushboolean(L, true);
+		return 1;
+	}
+	lua_pushboolean(L, false);
+	push_v3s16(L, hit.node_pos);
+	return 2;
+}
+
 //	EnvRef:get_perlin(seeddiff, octaves, persistence, scale)
 //  returns world-specific PerlinNoise
 int EnvRef::l_get_perlin(lua_State *L)
@@ -647,6 +789,48 @@ int EnvRef::l_clear_objects(lua_State *L)
 	return 0;
 }
 
+// Reads the tree definition table of spawn_tree; returns false if there
+// is none
+static bool read_tree_def(lua_State *L, int index, INodeDefManager *ndef,
+		treegen::TreeDef &tree_def)
+{
+	std::string trunk,leaves,fruit;
+
+	if(!lua_istable(L, index))
+		return false;
+
+	getstringfield(L, index, "axiom", tree_def.initial_axiom);
+	getstringfield(L, index, "rules_a", tree_def.rules_a);
+	getstringfield(L, index, "rules_b", tree_def.rules_b);
+	getstringfield(L, index, "rules_c", tree_def.rules_c);
+	getstringfield(L, index, "rules_d", tree_def.rules_d);
+	getstringfield(L, index, "trunk", trunk);
+	tree_def.trunknode=ndef->getId(trunk);
+	getstringfield(L, index, "leaves", leaves);
+	tree_def.leavesnode=ndef->getId(leaves);
+	tree_def.leaves2_chance=0;
+	getstringfield(L, index, "leaves2", leaves);
+	if (leaves !="")
+	{
+		tree_def.leaves2node=ndef->getId(leaves);
+		getintfield(L, index, "leaves2_chance", tree_def.leaves2_chance);
+	}
+	getintfield(L, index, "angle", tree_def.angle);
+	getintfield(L, index, "iterations", tree_def.iterations);
+	getintfield(L, index, "random_level", tree_def.iterations_random_level);
+	getstringfield(L, index, "trunk_type", tree_def.trunk_type);
+	getboolfield(L, index, "thin_branches", tree_def.thin_branches);
+	tree_def.fruit_chance=0;
+	getstringfield(L, index, "fruit", fruit);
+	if (fruit != "")
+	{
+		tree_def.fruitnode=ndef->getId(fruit);
+		getintfield(L, index, "fruit_chance",tree_def.fruit_chance);
+	}
+	getintfield(L, index, "seed", tree_def.seed);
+	return true;
+}
+
 int EnvRef::l_spawn_tree(lua_State *L)
 {
 	EnvRef *o = checkobject(L, 1);
@@ -655,47 +839,29 @@ int EnvRef::l_spawn_tree(lua_State *L)
 	v3s16 p0 = read_v3s16(L, 2);
 
 	treegen::TreeDef tree_def;
-	std::string trunk,leaves,fruit;
 	INodeDefManager *ndef = env->getGameDef()->ndef();
-
-	if(lua_istable(L, 3))
-	{
-		getstringfield(L, 3, "axiom", tree_def.initial_axiom);
-		getstringfield(L, 3, "rules_a", tree_def.rules_a);
-		getstringfield(L, 3, "rules_b", tree_def.rules_b);
-		getstringfield(L, 3, "rules_c", tree_def.rules_c);
-		getstringfield(L, 3, "rules_d", tree_def.rules_d);
-		getstringfield(L, 3, "trunk", trunk);
-		tree_def.trunknode=ndef->getId(trunk);
-		getstringfield(L, 3, "leaves", leaves);
-		tree_def.leavesnode=ndef->getId(leaves);
-		tree_def.leaves2_chance=0;
-		getstringfield(L, 3, "leaves2", leaves);
-		if (leaves !="")
-		{
-			tree_def.leaves2node=ndef->getId(leaves);
-			getintfield(L, 3, "leaves2_chance", tree_def.leaves2_chance);
-		}
-		getintfield(L, 3, "angle", tree_def.angle);
-		getintfield(L, 3, "iterations", tree_def.iterations);
-		getintfield(L, 3, "random_level", tree_def.iterations_random_level);
-		getstringfield(L, 3, "trunk_type", tree_def.trunk_type);
-		getboolfield(L, 3, "thin_branches", tree_def.thin_branches);
-		tree_def.fruit_chance=0;
-		getstringfield(L, 3, "fruit", fruit);
-		if (fruit != "")
-		{
-			tree_def.fruitnode=ndef->getId(fruit);
-			getintfield(L, 3, "fruit_chance",tree_def.fruit_chance);
-		}
-		getintfield(L, 3, "seed", tree_def.seed);
-	}
-	else
+	if(!read_tree_def(L, 3, ndef, tree_def))
 		return 0;
 	treegen::spawn_ltree (env, p0, ndef, tree_def);
 	return 1;
 }
 
+// EnvRef:spawn_tree_async(pos, treedef)
+// like spawn_tree, but the tree is grown on another thread
+int EnvRef::l_spawn_tree_async(lua_State *L)
+{
+	EnvRef *o = checkobject(L, 1);
+	ServerEnvironment *env = o->m_env;
+	if(env == NULL) return 0;
+	v3s16 p0 = read_v3s16(L, 2);
+
+	treegen::TreeDef tree_def;
+	if(!read_tree_def(L, 3, env->getGameDef()->ndef(), tree_def))
+		return 0;
+	env->spawnTreeAsync(p0, tree_def);
+	return 1;
+}
+
 
 EnvRef::EnvRef(ServerEnvironment *env):
 	m_env(env)
@@ -776,10 +942,13 @@ const luaL_reg EnvRef::methods[] = {
 	luamethod(EnvRef, get_timeofday),
 	luamethod(EnvRef, find_node_near),
 	luamethod(EnvRef, find_nodes_in_area),
+	luamethod(EnvRef, raycast),
+	luamethod(EnvRef, line_of_sight),
 	luamethod(EnvRef, get_perlin),
 	luamethod(EnvRef, get_perlin_map),
 	luamethod(EnvRef, clear_objects),
 	luamethod(EnvRef, spawn_tree),
+	luamethod(EnvRef, spawn_tree_async),
 	{0,0}
 };
 
@@ -123,6 +123,12 @@ class EnvRef
 	// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 	static int l_find_nodes_in_area(lua_State *L);
 
+	// EnvRef:raycast(pos1, pos2, objects) -> hit or nil
+	static int l_raycast(lua_State *L);
+
+	// EnvRef:line_of_sight(pos1, pos2) -> true or false, blocking node pos
+	static int l_line_of_sight(lua_State *L);
+
 	//	EnvRef:get_perlin(seeddiff, octaves, persistence, scale)
 	//  returns world-specific PerlinNoise
 	static int l_get_perlin(lua_State *L);
@@ -137,6 +143,10 @@ class EnvRef
 
 	static int l_spawn_tree(lua_State *L);
 
+	// EnvRef:spawn_tree_async(pos, treedef)
+	// like spawn_tree, but the tree is grown on another thread
+	static int l_spawn_tree_async(lua_State *L);
+
 public:
 	EnvRef(ServerEnvironment *env);
 
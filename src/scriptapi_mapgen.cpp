@@ -0,0 +1,504 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "scriptapi_mapgen.h"
+
+#include <algorithm>
+
+extern "C" {
+#include <lualib.h>
+}
+
+#include "scriptapi.h"
+#include "scriptapi_types.h"
+#include "scriptapi_common.h"
+#include "scriptapi_noise.h"
+#include "scriptapi_serialize.h"
+#include "script.h"
+#include "map.h"
+#include "nodedef.h"
+#include "log.h"
+
+static INodeDefManager* get_mapgen_ndef(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "minetest_mapgen_ndef");
+	INodeDefManager *ndef = (INodeDefManager*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return ndef;
+}
+
+/*
+	LuaVoxelManip
+*/
+
+int LuaVoxelManip::gc_object(lua_State *L)
+{
+	LuaVoxelManip *o = *(LuaVoxelManip **)(lua_touserdata(L, 1));
+	delete o;
+	return 0;
+}
+
+// get_emerged_area() -> minp, maxp of the whole vmanip
+int LuaVoxelManip::l_get_emerged_area(lua_State *L)
+{
+	ManualMapVoxelManipulator *vm = checkvmanip(L, 1);
+	push_v3s16(L, vm->m_area.MinEdge);
+	push_v3s16(L, vm->m_area.MaxEdge);
+	return 2;
+}
+
+// index(x, y, z) -> index of the node in the data tables, or nil
+int LuaVoxelManip::l_index(lua_State *L)
+{
+	ManualMapVoxelManipulator *vm = checkvmanip(L, 1);
+	v3s16 p(luaL_checkint(L, 2), luaL_checkint(L, 3), luaL_checkint(L, 4));
+	if(!vm->m_area.contains(p))
+		return 0;
+	lua_pushinteger(L, vm->m_area.index(p) + 1);
+	return 1;
+}
+
+// get_data() -> table of content ids, z, y, x order from index 1
+int LuaVoxelManip::l_get_data(lua_State *L)
+{
+	ManualMapVoxelManipulator *vm = checkvmanip(L, 1);
+	s32 volume = vm->m_area.getVolume();
+	lua_createtable(L, volume, 0);
+	for(s32 i=0; i<volume; i++){
+		lua_pushinteger(L, vm->m_data[i].getContent());
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+// set_data(data) -- entries that are not numbers are left as they are
+int LuaVoxelManip::l_set_data(lua_State *L)
+{
+	luaL_checktype(L, 2, LUA_TTABLE);
+	ManualMapVoxelManipulator *vm = checkvmanip_write(L, 1);
+	s32 volume = vm->m_area.getVolume();
+	for(s32 i=0; i<volume; i++){
+		lua_rawgeti(L, 2, i + 1);
+		if(lua_isnumber(L, -1)){
+			lua_Integer c = lua_tointeger(L, -1);
+			if(c < 0 || c > MAX_CONTENT)
+				return luaL_error(L, "set_data(): Invalid content id %d"
+						" at index %d", (int)c, i + 1);
+			vm->m_data[i].setContent(c);
+		}
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+// get_param2_data() -> table of param2 values, in the order of get_data()
+int LuaVoxelManip::l_get_param2_data(lua_State *L)
+{
+	ManualMapVoxelManipulator *vm = checkvmanip(L, 1);
+	s32 volume = vm->m_area.getVolume();
+	lua_createtable(L, volume, 0);
+	for(s32 i=0; i<volume; i++){
+		lua_pushinteger(L, vm->m_data[i].param2);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+// set_param2_data(data)
+int LuaVoxelManip::l_set_param2_data(lua_State *L)
+{
+	luaL_checktype(L, 2, LUA_TTABLE);
+	ManualMapVoxelManipulator *vm = checkvmanip_write(L, 1);
+	s32 volume = vm->m_area.getVolume();
+	for(s32 i=0; i<volume; i++){
+		lua_rawgeti(L, 2, i + 1);
+		if(lua_isnumber(L, -1))
+			vm->m_data[i].param2 = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+// get_node_at(pos) -> node; {name="ignore"} outside of the vmanip
+int LuaVoxelManip::l_get_node_at(lua_State *L)
+{
+	ManualMapVoxelManipulator *vm = checkvmanip(L, 1);
+	v3s16 p = read_v3s16(L, 2);
+	MapNode n(CONTENT_IGNORE);
+	if(vm->m_area.contains(p))
+		n = vm->m_data[vm->m_area.index(p)];
+	pushnode(L, n, get_mapgen_ndef(L));
+	return 1;
+}
+
+// set_node_at(pos, node) -> true if pos is inside of the vmanip
+int LuaVoxelManip::l_set_node_at(lua_State *L)
+{
+	ManualMapVoxelManipulator *vm = checkvmanip(L, 1);
+	v3s16 p = read_v3s16(L, 2);
+	MapNode n = readnode(L, 3, get_mapgen_ndef(L));
+	if(!vm->m_area.contains(p)){
+		lua_pushboolean(L, false);
+		return 1;
+	}
+	checkvmanip_write(L, 1);
+	vm->m_data[vm->m_area.index(p)] = n;
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+ManualMapVoxelManipulator* LuaVoxelManip::checkvmanip(lua_State *L, int narg)
+{
+	LuaVoxelManip *o = checkobject(L, narg);
+	if(o->m_vmanip == NULL)
+		luaL_error(L, "VoxelManip used outside of the callback it was given to");
+	return o->m_vmanip;
+}
+
+ManualMapVoxelManipulator* LuaVoxelManip::checkvmanip_write(lua_State *L,
+		int narg)
+{
+	ManualMapVoxelManipulator *vm = checkvmanip(L, narg);
+	LuaVoxelManip *o = checkobject(L, narg);
+	if(!o->m_changed){
+		// Saved so that the changes can be undone if the callback is
+		// aborted
+		o->m_saved_data.assign(vm->m_data,
+				vm->m_data + vm->m_area.getVolume());
+		o->m_changed = true;
+	}
+	return vm;
+}
+
+LuaVoxelManip::LuaVoxelManip(ManualMapVoxelManipulator *vmanip):
+	m_vmanip(vmanip),
+	m_modified(false),
+	m_changed(false)
+{
+}
+
+LuaVoxelManip::~LuaVoxelManip()
+{
+}
+
+LuaVoxelManip* LuaVoxelManip::create(lua_State *L,
+		ManualMapVoxelManipulator *vmanip)
+{
+	LuaVoxelManip *o = new LuaVoxelManip(vmanip);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, className);
+	lua_setmetatable(L, -2);
+	return o;
+}
+
+LuaVoxelManip* LuaVoxelManip::checkobject(lua_State *L, int narg)
+{
+	luaL_checktype(L, narg, LUA_TUSERDATA);
+	void *ud = luaL_checkudata(L, narg, className);
+	if(!ud) luaL_typerror(L, narg, className);
+	return *(LuaVoxelManip**)ud;  // unbox pointer
+}
+
+void LuaVoxelManip::commitCallback()
+{
+	m_modified |= m_changed;
+	m_changed = false;
+	m_saved_data.clear();
+}
+
+void LuaVoxelManip::revertCallback()
+{
+	if(m_changed && m_vmanip)
+		std::copy(m_saved_data.begin(), m_saved_data.end(),
+				m_vmanip->m_data);
+	m_changed = false;
+	m_saved_data.clear();
+}
+
+bool LuaVoxelManip::invalidate()
+{
+	commitCallback();
+	m_vmanip = NULL;
+	return m_modified;
+}
+
+void LuaVoxelManip::Register(lua_State *L)
+{
+	lua_newtable(L);
+	int methodtable = lua_gettop(L);
+	luaL_newmetatable(L, className);
+	int metatable = lua_gettop(L);
+
+	lua_pushliteral(L, "__metatable");
+	lua_pushvalue(L, methodtable);
+	lua_settable(L, metatable);  // hide metatable from Lua getmetatable()
+
+	lua_pushliteral(L, "__index");
+	lua_pushvalue(L, methodtable);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__gc");
+	lua_pushcfunction(L, gc_object);
+	lua_settable(L, metatable);
+
+	lua_pop(L, 1);  // drop metatable
+
+	luaL_openlib(L, 0, methods, 0);  // fill methodtable
+	lua_pop(L, 1);  // drop methodtable
+
+	// Cannot be created from Lua
+}
+
+const char LuaVoxelManip::className[] = "VoxelManip";
+const luaL_reg LuaVoxelManip::methods[] = {
+	luamethod(LuaVoxelManip, get_emerged_area),
+	luamethod(LuaVoxelManip, index),
+	luamethod(LuaVoxelManip, get_data),
+	luamethod(LuaVoxelManip, set_data),
+	luamethod(LuaVoxelManip, get_param2_data),
+	luamethod(LuaVoxelManip, set_param2_data),
+	luamethod(LuaVoxelManip, get_node_at),
+	luamethod(LuaVoxelManip, set_node_at),
+	{0,0}
+};
+
+/*
+	Api functions of the mapgen state
+*/
+
+// log([level,] text)
+static int l_mapgen_log(lua_State *L)
+{
+	std::string text;
+	LogMessageLevel level = LMT_INFO;
+	if(lua_isnone(L, 2))
+	{
+		text = luaL_checkstring(L, 1);
+	}
+	else
+	{
+		std::string levelname = luaL_checkstring(L, 1);
+		text = luaL_checkstring(L, 2);
+		if(levelname == "error")
+			level = LMT_ERROR;
+		else if(levelname == "action")
+			level = LMT_ACTION;
+		else if(levelname == "verbose")
+			level = LMT_VERBOSE;
+	}
+	log_printline(level, text);
+	return 0;
+}
+
+// get_current_modname() -> name of the mod whose script is being loaded
+static int l_mapgen_get_current_modname(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "minetest_current_modname");
+	return 1;
+}
+
+// register_on_generated(func(vm, minp, maxp, blockseed))
+static int l_mapgen_register_on_generated(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_getglobal(L, "minetest");
+	int minetest = lua_gettop(L);
+
+	lua_getfield(L, minetest, "registered_on_generateds");
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+	lua_pop(L, 1);
+
+	// For the messages of ScriptCallBudget
+	lua_getfield(L, minetest, "callback_origins");
+	lua_pushvalue(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, "minetest_current_modname");
+	lua_rawset(L, -3);
+	return 0;
+}
+
+// get_content_id(name) -> content id
+static int l_mapgen_get_content_id(lua_State *L)
+{
+	std::string name = luaL_checkstring(L, 1);
+	content_t c;
+	if(!get_mapgen_ndef(L)->getId(name, c))
+		return luaL_error(L, "get_content_id(): Unknown node \"%s\"",
+				name.c_str());
+	lua_pushinteger(L, c);
+	return 1;
+}
+
+// get_name_from_content_id(id) -> name
+static int l_mapgen_get_name_from_content_id(lua_State *L)
+{
+	int c = luaL_checkint(L, 1);
+	if(c < 0 || c > MAX_CONTENT)
+		return luaL_error(L, "get_name_from_content_id(): Invalid content"
+				" id %d", c);
+	lua_pushstring(L, get_mapgen_ndef(L)->get(c).name.c_str());
+	return 1;
+}
+
+// get_perlin(seeddiff, octaves, persistence, scale)
+// -> PerlinNoise seeded like minetest.env:get_perlin()
+static int l_mapgen_get_perlin(lua_State *L)
+{
+	int seeddiff = luaL_checkint(L, 1);
+	int octaves = luaL_checkint(L, 2);
+	float persistence = luaL_checknumber(L, 3);
+	float scale = luaL_checknumber(L, 4);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "minetest_mapgen_seed");
+	int seed = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	LuaPerlinNoise *n = new LuaPerlinNoise(seeddiff + seed, octaves,
+			persistence, scale);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = n;
+	luaL_getmetatable(L, "PerlinNoise");
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static const struct luaL_Reg minetest_mapgen_f [] = {
+	{"log", l_mapgen_log},
+	{"get_current_modname", l_mapgen_get_current_modname},
+	{"register_on_generated", l_mapgen_register_on_generated},
+	{"get_content_id", l_mapgen_get_content_id},
+	{"get_name_from_content_id", l_mapgen_get_name_from_content_id},
+	{"get_perlin", l_mapgen_get_perlin},
+	{"serialize", l_serialize},
+	{"serialize_binary", l_serialize_binary},
+	{"deserialize", l_deserialize},
+	{NULL, NULL}
+};
+
+lua_State* scriptapi_mapgen_init(INodeDefManager *ndef, u64 seed,
+		const std::vector<MapgenScript> &scripts)
+{
+	lua_State *L = luaL_newstate();
+	assert(L);
+
+	// No io, os or debug; the scripts only get to see their chunk
+	const luaL_Reg libs[] = {
+		{"", luaopen_base},
+		{LUA_TABLIBNAME, luaopen_table},
+		{LUA_STRLIBNAME, luaopen_string},
+		{LUA_MATHLIBNAME, luaopen_math},
+		{NULL, NULL}
+	};
+	for(const luaL_Reg *lib = libs; lib->func; lib++){
+		lua_pushcfunction(L, lib->func);
+		lua_pushstring(L, lib->name);
+		lua_call(L, 1, 0);
+	}
+	// Loading code from files is left to the server
+	lua_pushnil(L);
+	lua_setglobal(L, "dofile");
+	lua_pushnil(L);
+	lua_setglobal(L, "loadfile");
+
+	lua_pushlightuserdata(L, ndef);
+	lua_setfield(L, LUA_REGISTRYINDEX, "minetest_mapgen_ndef");
+	lua_pushinteger(L, (int)seed);
+	lua_setfield(L, LUA_REGISTRYINDEX, "minetest_mapgen_seed");
+
+	lua_newtable(L);
+	luaL_register(L, NULL, minetest_mapgen_f);
+	lua_newtable(L);
+	lua_setfield(L, -2, "registered_on_generateds");
+	lua_newtable(L);
+	lua_setfield(L, -2, "callback_origins");
+	lua_setglobal(L, "minetest");
+
+	LuaVoxelManip::Register(L);
+	LuaPseudoRandom::Register(L);
+	LuaPerlinNoise::Register(L);
+	LuaPerlinNoiseMap::Register(L);
+
+	for(u32 i=0; i<scripts.size(); i++){
+		lua_pushstring(L, scripts[i].modname.c_str());
+		lua_setfield(L, LUA_REGISTRYINDEX, "minetest_current_modname");
+		bool success = script_load(L, scripts[i].path.c_str());
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "minetest_current_modname");
+		if(!success){
+			errorstream<<"Failed to load mapgen script of mod \""
+					<<scripts[i].modname<<"\""<<std::endl;
+			lua_close(L);
+			return NULL;
+		}
+	}
+	return L;
+}
+
+bool scriptapi_mapgen_on_generated(lua_State *L,
+		ManualMapVoxelManipulator *vmanip, v3s16 minp, v3s16 maxp,
+		u32 blockseed)
+{
+	realitycheck(L);
+	assert(lua_checkstack(L, 20));
+	StackUnroller stack_unroller(L);
+
+	lua_getglobal(L, "minetest");
+	int minetest = lua_gettop(L);
+	lua_getfield(L, minetest, "registered_on_generateds");
+	int callbacks = lua_gettop(L);
+	int count = lua_objlen(L, callbacks);
+	if(count == 0)
+		return false;
+
+	LuaVoxelManip *o = LuaVoxelManip::create(L, vmanip);
+	int vm = lua_gettop(L);
+	try{
+		for(int i = 1; i <= count; i++){
+			lua_rawgeti(L, callbacks, i);
+			luaL_checktype(L, -1, LUA_TFUNCTION);
+			lua_pushvalue(L, vm);
+			push_v3s16(L, minp);
+			push_v3s16(L, maxp);
+			lua_pushnumber(L, blockseed);
+			// Encloses the budget of script_pcall() to see if it aborted
+			ScriptCallBudget budget(L, "callback");
+			if(script_pcall(L, 4, 0, "callback"))
+				script_error(L, "error: %s", lua_tostring(L, -1));
+			if(!budget.aborted()){
+				o->commitCallback();
+				continue;
+			}
+			// Half-done changes would be written into the map
+			o->revertCallback();
+			lua_getfield(L, minetest, "callback_origins");
+			lua_rawgeti(L, callbacks, i);
+			lua_rawget(L, -2);
+			const char *modname = lua_tostring(L, -1);
+			errorstream<<"Discarded the changes of the aborted on_generated"
+					<<" callback of mod \""<<(modname ? modname : "??")
+					<<"\" at ("<<minp.X<<","<<minp.Y<<","<<minp.Z<<")"
+					<<std::endl;
+			lua_pop(L, 2);
+		}
+	}
+	catch(LuaError &e){
+		o->invalidate();
+		throw;
+	}
+	return o->invalidate();
+}
@@ -0,0 +1,119 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef LUA_MAPGEN_H_
+#define LUA_MAPGEN_H_
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+
+#include "irr_v3d.h"
+#include "mapnode.h"
+
+class INodeDefManager;
+class ManualMapVoxelManipulator;
+
+/*
+	Mapgen scripts run in a Lua state of their own in every emerge
+	thread. They only see the chunk that is being generated, through a
+	VoxelManip, and a small API that doesn't touch anything shared with
+	the server thread.
+*/
+
+struct MapgenScript
+{
+	std::string modname;
+	std::string path;
+
+	MapgenScript(const std::string &modname_, const std::string &path_):
+		modname(modname_),
+		path(path_)
+	{}
+};
+
+/*
+	VoxelManip: the vmanip of the chunk being generated.
+	Only valid during the callback it was passed to.
+*/
+class LuaVoxelManip
+{
+private:
+	ManualMapVoxelManipulator *m_vmanip;
+	// Nodes were set by a callback that has returned
+	bool m_modified;
+	// Nodes were set by the running callback
+	bool m_changed;
+	// Data of the vmanip before the running callback first changed it
+	std::vector<MapNode> m_saved_data;
+	static const char className[];
+	static const luaL_reg methods[];
+
+	static int gc_object(lua_State *L);
+
+	static int l_get_emerged_area(lua_State *L);
+	static int l_index(lua_State *L);
+	static int l_get_data(lua_State *L);
+	static int l_set_data(lua_State *L);
+	static int l_get_param2_data(lua_State *L);
+	static int l_set_param2_data(lua_State *L);
+	static int l_get_node_at(lua_State *L);
+	static int l_set_node_at(lua_State *L);
+
+	static ManualMapVoxelManipulator* checkvmanip(lua_State *L, int narg);
+	// Like checkvmanip, for methods that change the nodes
+	static ManualMapVoxelManipulator* checkvmanip_write(lua_State *L,
+			int narg);
+
+public:
+	LuaVoxelManip(ManualMapVoxelManipulator *vmanip);
+	~LuaVoxelManip();
+
+	// Creates a LuaVoxelManip and leaves it on top of stack
+	static LuaVoxelManip* create(lua_State *L,
+			ManualMapVoxelManipulator *vmanip);
+	static LuaVoxelManip* checkobject(lua_State *L, int narg);
+	static void Register(lua_State *L);
+
+	// Keeps the changes of the callback that has just returned
+	void commitCallback();
+	// Undoes the changes of the callback that has just returned
+	void revertCallback();
+	// Detaches the object from the vmanip; returns whether nodes were set
+	bool invalidate();
+};
+
+// Creates the Lua state of an emerge thread and runs the scripts in it.
+// ndef is used from the emerge thread, so it must not change while the
+// state exists (see NodeDefSnapshot). Returns NULL if a script fails to load.
+lua_State* scriptapi_mapgen_init(INodeDefManager *ndef, u64 seed,
+		const std::vector<MapgenScript> &scripts);
+
+// Runs the on_generated callbacks of the mapgen scripts on a chunk.
+// The changes of a callback that is aborted for running too long are
+// undone. Returns true if they changed any nodes.
+bool scriptapi_mapgen_on_generated(lua_State *L,
+		ManualMapVoxelManipulator *vmanip, v3s16 minp, v3s16 maxp,
+		u32 blockseed);
+
+#endif
@@ -193,7 +193,7 @@ bool scriptapi_node_on_timer(lua_State *L, v3s16 p, MapNode node, f32 dtime)
 	// Call function
 	push_v3s16(L, p);
 	lua_pushnumber(L,dtime);
-	if(lua_pcall(L, 2, 1, 0))
+	if(script_pcall(L, 2, 1, "node timer"))
 		script_error(L, "error: %s", lua_tostring(L, -1));
 	if((bool)lua_isboolean(L,-1) && (bool)lua_toboolean(L,-1) == true)
 		return true;
@@ -0,0 +1,1044 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "scriptapi.h"
+#include "scriptapi_serialize.h"
+#include "exceptions.h"
+#include "log.h"
+#include "util/serialize.h"
+#include "util/string.h"
+#include <map>
+#include <set>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// Limits recursion on deeply nested (or malicious) data
+#define SERIALIZE_MAX_DEPTH 1000
+
+static inline bool has_identity(int type)
+{
+	// Same as "not no_identity[type(x)]" in the original Lua code
+	return (type != LUA_TNIL && type != LUA_TBOOLEAN
+			&& type != LUA_TNUMBER && type != LUA_TSTRING);
+}
+
+static void check_depth(lua_State *L, int depth)
+{
+	if(depth > SERIALIZE_MAX_DEPTH || !lua_checkstack(L, 4))
+		throw SerializationError("data nested too deeply");
+}
+
+/*
+	Text format
+
+	This is a port of the metalua serializer that used to live in
+	builtin/serialize.lua. It walks tables in the same order and
+	numbers shared and recursive tables the same way, so it produces
+	exactly the same strings as before. Strings are escaped like
+	LuaJIT's string.format("%q").
+*/
+
+class LuaTextSerializer
+{
+public:
+	LuaTextSerializer(lua_State *L):
+		m_lua(L),
+		m_patches(0),
+		m_patch_count(0),
+		m_gensym_max(0)
+	{
+	}
+
+	// Serializes the value at (absolute) stack index
+	std::string serialize(int index)
+	{
+		lua_State *L = m_lua;
+		lua_newtable(L);
+		m_patches = lua_gettop(L);
+
+		markOccurrences(index, 0);
+		std::string toplevel;
+		dumpOrRef(index, toplevel, 0);
+		dumpNestPatches();
+
+		lua_remove(L, m_patches);
+
+		if(m_localdefs.empty())
+			return "return " + toplevel;
+		std::string result = "local _={ }\n";
+		for(std::vector<std::string>::iterator
+				i = m_localdefs.begin(); i != m_localdefs.end(); i++)
+			result += *i + "\n";
+		result += "return " + toplevel;
+		return result;
+	}
+
+private:
+	const void * identity(int index)
+	{
+		if(!has_identity(lua_type(m_lua, index)))
+			return NULL;
+		return lua_topointer(m_lua, index);
+	}
+
+	bool isNested(int index)
+	{
+		const void *p = identity(index);
+		return p != NULL && m_nested.count(p) != 0;
+	}
+
+	/*
+		First pass: find the tables which appear more than once and the
+		places where a table appears within itself (nest points)
+	*/
+	void markOccurrences(int index, int depth)
+	{
+		lua_State *L = m_lua;
+		const void *p = identity(index);
+		if(p == NULL)
+			return;
+		check_depth(L, depth);
+		if(m_seen_once.count(p)){
+			m_seen_once.erase(p);
+			m_multiple.insert(p);
+		} else if(m_multiple.count(p) == 0){
+			m_seen_once.insert(p);
+		}
+		if(lua_type(L, index) != LUA_TTABLE)
+			return;
+		m_nested.insert(p);
+		lua_pushnil(L);
+		while(lua_next(L, index) != 0){
+			int k = lua_gettop(L) - 1;
+			int v = lua_gettop(L);
+			if(isNested(k) || isNested(v)){
+				markNestPoint(index, k, v);
+			} else {
+				markOccurrences(k, depth + 1);
+				markOccurrences(v, depth + 1);
+			}
+			lua_pop(L, 1);
+		}
+		m_nested.erase(p);
+	}
+
+	void markNestPoint(int parent, int k, int v)
+	{
+		lua_State *L = m_lua;
+		const void *pp = identity(parent);
+		std::set<const void*> &np = m_nest_points[pp];
+		// "parent_np[k], parent_np[v] = nk, nv" assigns right to left
+		setNestPoint(np, v);
+		setNestPoint(np, k);
+		lua_pushvalue(L, parent);
+		lua_rawseti(L, m_patches, ++m_patch_count);
+		lua_pushvalue(L, k);
+		lua_rawseti(L, m_patches, ++m_patch_count);
+		lua_pushvalue(L, v);
+		lua_rawseti(L, m_patches, ++m_patch_count);
+		m_seen_once.erase(pp);
+		m_multiple.insert(pp);
+	}
+
+	void setNestPoint(std::set<const void*> &np, int index)
+	{
+		const void *p = identity(index);
+		if(p == NULL)
+			return;
+		if(m_nested.count(p))
+			np.insert(p);
+		else
+			np.erase(p);
+	}
+
+	/*
+		Second pass: dump the value. Values occurring multiple times are
+		stored in local variables which are then referenced.
+	*/
+	void dumpOrRef(int index, std::string &out, int depth)
+	{
+		const void *p = identity(index);
+		if(p == NULL || m_multiple.count(p) == 0){
+			dumpVal(index, out, depth);
+			return;
+		}
+		std::map<const void*, int>::iterator i = m_dumped.find(p);
+		if(i != m_dumped.end()){
+			out += "_[" + itos(i->second) + "]";
+			return;
+		}
+		std::string val;
+		dumpVal(index, val, depth);
+		int var = ++m_gensym_max;
+		m_localdefs.push_back("_[" + itos(var) + "]=" + val);
+		m_dumped[p] = var;
+		out += "_[" + itos(var) + "]";
+	}
+
+	void dumpVal(int index, std::string &out, int depth)
+	{
+		lua_State *L = m_lua;
+		switch(lua_type(L, index)){
+		case LUA_TNIL:
+			out += "nil";
+			break;
+		case LUA_TBOOLEAN:
+			out += lua_toboolean(L, index) ? "true" : "false";
+			break;
+		case LUA_TNUMBER: {
+			// Format exactly like tostring()
+			size_t len;
+			lua_pushvalue(L, index);
+			const char *s = lua_tolstring(L, -1, &len);
+			out.append(s, len);
+			lua_pop(L, 1);
+			break;
+		}
+		case LUA_TSTRING: {
+			size_t len;
+			const char *s = lua_tolstring(L, index, &len);
+			appendQuoted(out, s, len);
+			break;
+		}
+		case LUA_TTABLE:
+			dumpTable(index, out, depth);
+			break;
+		default:
+			// Kept in a member as the exception only holds a pointer
+			m_error = "Can't serialize data of type ";
+			m_error += luaL_typename(L, index);
+			throw SerializationError(m_error.c_str());
+		}
+	}
+
+	void dumpTable(int index, std::string &out, int depth)
+	{
+		lua_State *L = m_lua;
+		check_depth(L, depth);
+		std::set<const void*> *np = NULL;
+		std::map<const void*, std::set<const void*> >::iterator
+				npi = m_nest_points.find(lua_topointer(L, index));
+		if(npi != m_nest_points.end())
+			np = &npi->second;
+
+		out += "{ ";
+		bool first = true;
+		// Array part, like ipairs()
+		int n = 0;
+		for(;;){
+			lua_rawgeti(L, index, n + 1);
+			if(lua_isnil(L, -1)){
+				lua_pop(L, 1);
+				break;
+			}
+			n++;
+			if(!first)
+				out += ", ";
+			first = false;
+			if(np && isIn(*np, lua_gettop(L)))
+				out += "false"; // placeholder
+			else
+				dumpOrRef(lua_gettop(L), out, depth + 1);
+			lua_pop(L, 1);
+		}
+		// Everything else, like pairs()
+		lua_pushnil(L);
+		while(lua_next(L, index) != 0){
+			int k = lua_gettop(L) - 1;
+			int v = lua_gettop(L);
+			if(np && (isIn(*np, k) || isIn(*np, v))){
+				// Patched in after the other definitions
+			} else if(!isArrayIndex(k, n)){
+				if(!first)
+					out += ", ";
+				first = false;
+				out += "[";
+				dumpOrRef(k, out, depth + 1);
+				out += "] = ";
+				dumpOrRef(v, out, depth + 1);
+			}
+			lua_pop(L, 1);
+		}
+		out += " }";
+	}
+
+	void dumpNestPatches()
+	{
+		lua_State *L = m_lua;
+		for(int i = 1; i <= m_patch_count; i += 3){
+			lua_rawgeti(L, m_patches, i);
+			lua_rawgeti(L, m_patches, i + 1);
+			lua_rawgeti(L, m_patches, i + 2);
+			int top = lua_gettop(L);
+			std::string set;
+			dumpOrRef(top - 2, set, 0);
+			set += "[";
+			dumpOrRef(top - 1, set, 0);
+			set += "] = ";
+			dumpOrRef(top, set, 0);
+			set += " -- rec ";
+			m_localdefs.push_back(set);
+			lua_pop(L, 3);
+		}
+	}
+
+	bool isIn(const std::set<const void*> &np, int index)
+	{
+		const void *p = identity(index);
+		return p != NULL && np.count(p) != 0;
+	}
+
+	bool isArrayIndex(int index, int n)
+	{
+		if(lua_type(m_lua, index) != LUA_TNUMBER)
+			return false;
+		lua_Number d = lua_tonumber(m_lua, index);
+		return d >= 1 && d <= n && d == floor(d);
+	}
+
+	static void appendQuoted(std::string &out, const char *s, size_t len)
+	{
+		out += '"';
+		for(size_t i = 0; i < len; i++){
+			unsigned char c = s[i];
+			if(c == '"' || c == '\\' || c == '\n'){
+				out += '\\';
+				out += c;
+			} else if(c < 32 || c == 127){
+				// Decimal escape, padded to three digits if a digit follows
+				bool digit_follows = (i + 1 < len
+						&& s[i + 1] >= '0' && s[i + 1] <= '9');
+				out += '\\';
+				if(c >= 100 || digit_follows){
+					out += (char)('0' + c / 100);
+					out += (char)('0' + (c / 10) % 10);
+				} else if(c >= 10){
+					out += (char)('0' + c / 10);
+				}
+				out += (char)('0' + c % 10);
+			} else {
+				out += c;
+			}
+		}
+		out += '"';
+	}
+
+	lua_State *m_lua;
+	// Stack index of a table holding (parent, key, value) of nest points
+	int m_patches;
+	int m_patch_count;
+	int m_gensym_max;
+	std::set<const void*> m_seen_once;
+	std::set<const void*> m_multiple;
+	std::set<const void*> m_nested;
+	std::map<const void*, std::set<const void*> > m_nest_points;
+	std::map<const void*, int> m_dumped;
+	std::vector<std::string> m_localdefs;
+	std::string m_error;
+};
+
+/*
+	Reads back what LuaTextSerializer writes without going through the
+	Lua compiler. Anything outside of that subset of Lua makes it give
+	up, and the caller then loads the string as Lua code like before.
+*/
+
+class LuaTextDeserializer
+{
+public:
+	LuaTextDeserializer(lua_State *L, const char *data, size_t len):
+		m_lua(L),
+		m_data(data),
+		m_len(len),
+		m_pos(0),
+		m_refs(0)
+	{
+	}
+
+	// Pushes the value and returns true on success.
+	// Returns false with the stack unchanged if the data can't be handled.
+	bool deserialize()
+	{
+		lua_State *L = m_lua;
+		int base = lua_gettop(L);
+		if(!lua_checkstack(L, 10))
+			return false;
+		// The "_" local holding shared tables
+		lua_newtable(L);
+		m_refs = lua_gettop(L);
+		if(parseChunk()){
+			lua_remove(L, m_refs);
+			return true;
+		}
+		lua_settop(L, base);
+		return false;
+	}
+
+private:
+	bool parseChunk()
+	{
+		lua_State *L = m_lua;
+		if(acceptWord("local")){
+			if(!acceptWord("_") || !accept('=') || !accept('{')
+					|| !accept('}'))
+				return false;
+			for(;;){
+				if(acceptWord("return"))
+					break;
+				int id;
+				if(!parseRefIndex(id))
+					return false;
+				if(accept('=')){
+					// _[id]=value
+					if(!parseValue(0))
+						return false;
+					lua_rawseti(L, m_refs, id);
+				} else if(accept('[')){
+					// _[id][key] = value -- rec
+					lua_rawgeti(L, m_refs, id);
+					if(!lua_istable(L, -1))
+						return false;
+					if(!parseKeyValue())
+						return false;
+					lua_pop(L, 1);
+				} else {
+					return false;
+				}
+				accept(';');
+			}
+		} else if(!acceptWord("return")){
+			return false;
+		}
+		if(!parseValue(0))
+			return false;
+		accept(';');
+		if(!skipSpace())
+			return false;
+		return m_pos == m_len;
+	}
+
+	// Skips whitespace and line comments
+	bool skipSpace()
+	{
+		while(m_pos < m_len){
+			char c = m_data[m_pos];
+			if(c == ' ' || c == '\t' || c == '\n' || c == '\r'
+					|| c == '\v' || c == '\f'){
+				m_pos++;
+			} else if(c == '-' && m_pos + 1 < m_len
+					&& m_data[m_pos + 1] == '-'){
+				// Long comments are not supported
+				if(m_pos + 2 < m_len && m_data[m_pos + 2] == '[')
+					return false;
+				while(m_pos < m_len && m_data[m_pos] != '\n')
+					m_pos++;
+			} else {
+				break;
+			}
+		}
+		return true;
+	}
+
+	bool accept(char c)
+	{
+		if(!skipSpace())
+			return false;
+		if(m_pos < m_len && m_data[m_pos] == c){
+			m_pos++;
+			return true;
+		}
+		return false;
+	}
+
+	static bool isNameChar(char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+				|| (c >= '0' && c <= '9') || c == '_';
+	}
+
+	bool acceptWord(const char *word)
+	{
+		if(!skipSpace())
+			return false;
+		size_t len = strlen(word);
+		if(m_len - m_pos < len || strncmp(&m_data[m_pos], word, len) != 0)
+			return false;
+		if(m_pos + len < m_len && isNameChar(m_data[m_pos + len]))
+			return false;
+		m_pos += len;
+		return true;
+	}
+
+	// _[id]
+	bool parseRefIndex(int &id)
+	{
+		if(!acceptWord("_") || !accept('['))
+			return false;
+		if(!skipSpace())
+			return false;
+		size_t start = m_pos;
+		id = 0;
+		while(m_pos < m_len && m_data[m_pos] >= '0' && m_data[m_pos] <= '9'
+				&& m_pos - start < 9){
+			id = id * 10 + (m_data[m_pos] - '0');
+			m_pos++;
+		}
+		if(m_pos == start)
+			return false;
+		return accept(']');
+	}
+
+	// [key] = value, with the '[' already consumed; sets it into the
+	// table on top of the stack
+	bool parseKeyValue()
+	{
+		lua_State *L = m_lua;
+		if(!parseValue(0))
+			return false;
+		if(!accept(']') || !accept('='))
+			return false;
+		if(!parseValue(0))
+			return false;
+		// Let Lua raise the error for invalid keys
+		if(lua_isnil(L, -2) || (lua_isnumber(L, -2)
+				&& lua_tonumber(L, -2) != lua_tonumber(L, -2)))
+			return false;
+		lua_rawset(L, -3);
+		return true;
+	}
+
+	bool parseValue(int depth)
+	{
+		lua_State *L = m_lua;
+		if(depth > SERIALIZE_MAX_DEPTH || !lua_checkstack(L, 4))
+			return false;
+		if(!skipSpace() || m_pos >= m_len)
+			return false;
+		char c = m_data[m_pos];
+		if(c == '{')
+			return parseTable(depth);
+		if(c == '"' || c == '\'')
+			return parseString();
+		if((c >= '0' && c <= '9') || c == '.')
+			return parseNumber(false);
+		if(c == '-'){
+			m_pos++;
+			if(!skipSpace() || m_pos >= m_len)
+				return false;
+			c = m_data[m_pos];
+			if(!((c >= '0' && c <= '9') || c == '.'))
+				return false;
+			return parseNumber(true);
+		}
+		if(acceptWord("nil")){
+			lua_pushnil(L);
+			return true;
+		}
+		if(acceptWord("true")){
+			lua_pushboolean(L, 1);
+			return true;
+		}
+		if(acceptWord("false")){
+			lua_pushboolean(L, 0);
+			return true;
+		}
+		int id;
+		if(parseRefIndex(id)){
+			lua_rawgeti(L, m_refs, id);
+			return true;
+		}
+		return false;
+	}
+
+	bool parseTable(int depth)
+	{
+		lua_State *L = m_lua;
+		// Positional items are set in batches of 50 like the
+		// Lua compiler does, so that clashing keys end up the same
+		const int flush_count = 50;
+		if(!lua_checkstack(L, flush_count + 10))
+			return false;
+		m_pos++; // '{'
+		lua_newtable(L);
+		int table = lua_gettop(L);
+		int pending = 0;
+		int stored = 0;
+		for(;;){
+			if(accept('}'))
+				break;
+			if(pending == flush_count){
+				flushItems(table, stored, pending);
+				stored += pending;
+				pending = 0;
+			}
+			if(m_pos < m_len && m_data[m_pos] == '['){
+				// Long strings are not supported
+				if(m_pos + 1 < m_len && (m_data[m_pos + 1] == '['
+						|| m_data[m_pos + 1] == '='))
+					return false;
+				m_pos++;
+				lua_pushvalue(L, table);
+				if(!parseKeyValue())
+					return false;
+				lua_pop(L, 1);
+			} else {
+				if(!parseValue(depth + 1))
+					return false;
+				pending++;
+			}
+			if(accept(',') || accept(';'))
+				continue;
+			if(!accept('}'))
+				return false;
+			break;
+		}
+		flushItems(table, stored, pending);
+		return true;
+	}
+
+	void flushItems(int table, int stored, int pending)
+	{
+		for(int i = pending; i >= 1; i--)
+			lua_rawseti(m_lua, table, stored + i);
+	}
+
+	bool parseNumber(bool negative)
+	{
+		// Same characters as the Lua lexer reads for a numeral
+		size_t start = m_pos;
+		while(m_pos < m_len && ((m_data[m_pos] >= '0' && m_data[m_pos] <= '9')
+				|| m_data[m_pos] == '.'))
+			m_pos++;
+		if(m_pos < m_len && (m_data[m_pos] == 'e' || m_data[m_pos] == 'E')){
+			m_pos++;
+			if(m_pos < m_len && (m_data[m_pos] == '+' || m_data[m_pos] == '-'))
+				m_pos++;
+		}
+		while(m_pos < m_len && isNameChar(m_data[m_pos]))
+			m_pos++;
+		std::string s(&m_data[start], m_pos - start);
+		// Leave hexadecimal numbers to Lua
+		if(s.find_first_of("xX") != std::string::npos)
+			return false;
+		char *end;
+		lua_Number d = strtod(s.c_str(), &end);
+		if(end == s.c_str() || *end != 0)
+			return false;
+		lua_pushnumber(m_lua, negative ? -d : d);
+		return true;
+	}
+
+	bool parseString()
+	{
+		char quote = m_data[m_pos++];
+		m_buf.clear();
+		while(m_pos < m_len){
+			char c = m_data[m_pos++];
+			if(c == quote){
+				lua_pushlstring(m_lua, m_buf.c_str(), m_buf.size());
+				return true;
+			}
+			if(c == '\n' || c == '\r')
+				return false; // unfinished string
+			if(c != '\\'){
+				m_buf += c;
+				continue;
+			}
+			if(m_pos >= m_len)
+				return false;
+			c = m_data[m_pos++];
+			switch(c){
+			case 'a': m_buf += '\a'; break;
+			case 'b': m_buf += '\b'; break;
+			case 'f': m_buf += '\f'; break;
+			case 'n': m_buf += '\n'; break;
+			case 'r': m_buf += '\r'; break;
+			case 't': m_buf += '\t'; break;
+			case 'v': m_buf += '\v'; break;
+			case '\\': case '"': case '\'':
+				m_buf += c;
+				break;
+			case '\n': case '\r': {
+				// Escaped line break; \r\n and \n\r count as one
+				m_buf += '\n';
+				char next = m_pos < m_len ? m_data[m_pos] : 0;
+				if((next == '\n' || next == '\r') && next != c)
+					m_pos++;
+				break;
+			}
+			default: {
+				if(c < '0' || c > '9')
+					return false;
+				int value = c - '0';
+				for(int i = 0; i < 2 && m_pos < m_len
+						&& m_data[m_pos] >= '0' && m_data[m_pos] <= '9'; i++)
+					value = value * 10 + (m_data[m_pos++] - '0');
+				if(value > 255)
+					return false;
+				m_buf += (char)value;
+			}
+			}
+		}
+		return false;
+	}
+
+	lua_State *m_lua;
+	const char *m_data;
+	size_t m_len;
+	size_t m_pos;
+	// Stack index of the "_" table
+	int m_refs;
+	std::string m_buf;
+};
+
+/*
+	Binary format
+
+	u8 0 (never the first byte of Lua source)
+	u8 version (1)
+	value:
+		u8 type, then depending on it:
+		BINARY_INT: s32
+		BINARY_NUMBER: u64 holding the bits of the double
+		BINARY_STRING: u32 length, data
+		BINARY_TABLE: (key value, value value)*, BINARY_END
+			Tables are numbered from 1 in the order they begin.
+		BINARY_REF: u32 number of an earlier (possibly enclosing) table
+*/
+
+#define BINARY_SERIALIZE_VERSION 1
+
+enum BinaryValueType
+{
+	BINARY_NIL = 0,
+	BINARY_FALSE,
+	BINARY_TRUE,
+	BINARY_INT,
+	BINARY_NUMBER,
+	BINARY_STRING,
+	BINARY_TABLE,
+	BINARY_REF,
+	BINARY_END,
+};
+
+class LuaBinarySerializer
+{
+public:
+	LuaBinarySerializer(lua_State *L):
+		m_lua(L),
+		m_table_count(0)
+	{
+	}
+
+	std::string serialize(int index)
+	{
+		m_out += (char)0;
+		m_out += (char)BINARY_SERIALIZE_VERSION;
+		writeValue(index, 0);
+		return m_out;
+	}
+
+private:
+	void writeValue(int index, int depth)
+	{
+		lua_State *L = m_lua;
+		u8 buf[8];
+		switch(lua_type(L, index)){
+		case LUA_TNIL:
+			m_out += (char)BINARY_NIL;
+			break;
+		case LUA_TBOOLEAN:
+			m_out += (char)(lua_toboolean(L, index) ? BINARY_TRUE : BINARY_FALSE);
+			break;
+		case LUA_TNUMBER: {
+			lua_Number d = lua_tonumber(L, index);
+			double dd = d;
+			u64 bits;
+			memcpy(&bits, &dd, sizeof(bits));
+			// Small integers are common; -0 has to keep its sign
+			if(d >= -2147483648.0 && d <= 2147483647.0 && d == (s32)d
+					&& (d != 0 || bits == 0)){
+				m_out += (char)BINARY_INT;
+				writeS32(buf, (s32)d);
+				m_out.append((char*)buf, 4);
+			} else {
+				m_out += (char)BINARY_NUMBER;
+				writeU64(buf, bits);
+				m_out.append((char*)buf, 8);
+			}
+			break;
+		}
+		case LUA_TSTRING: {
+			size_t len;
+			const char *s = lua_tolstring(L, index, &len);
+			m_out += (char)BINARY_STRING;
+			writeU32(buf, len);
+			m_out.append((char*)buf, 4);
+			m_out.append(s, len);
+			break;
+		}
+		case LUA_TTABLE: {
+			const void *p = lua_topointer(L, index);
+			std::map<const void*, u32>::iterator i = m_tables.find(p);
+			if(i != m_tables.end()){
+				m_out += (char)BINARY_REF;
+				writeU32(buf, i->second);
+				m_out.append((char*)buf, 4);
+				break;
+			}
+			check_depth(L, depth);
+			m_tables[p] = ++m_table_count;
+			m_out += (char)BINARY_TABLE;
+			lua_pushnil(L);
+			while(lua_next(L, index) != 0){
+				writeValue(lua_gettop(L) - 1, depth + 1);
+				writeValue(lua_gettop(L), depth + 1);
+				lua_pop(L, 1);
+			}
+			m_out += (char)BINARY_END;
+			break;
+		}
+		default:
+			// Kept in a member as the exception only holds a pointer
+			m_error = "Can't serialize data of type ";
+			m_error += luaL_typename(L, index);
+			throw SerializationError(m_error.c_str());
+		}
+	}
+
+	lua_State *m_lua;
+	std::string m_out;
+	std::map<const void*, u32> m_tables;
+	u32 m_table_count;
+	std::string m_error;
+};
+
+class LuaBinaryDeserializer
+{
+public:
+	LuaBinaryDeserializer(lua_State *L, const char *data, size_t len):
+		m_lua(L),
+		m_data((const u8*)data),
+		m_len(len),
+		m_pos(0),
+		m_refs(0),
+		m_table_count(0)
+	{
+	}
+
+	// Pushes the value. Throws SerializationError on invalid data.
+	void deserialize()
+	{
+		lua_State *L = m_lua;
+		need(2);
+		m_pos++; // format marker
+		if(m_data[m_pos++] != BINARY_SERIALIZE_VERSION)
+			throw SerializationError("deserialize: unsupported binary version");
+		lua_newtable(L);
+		m_refs = lua_gettop(L);
+		readValue(0);
+		if(m_pos != m_len)
+			throw SerializationError("deserialize: trailing data");
+		lua_remove(L, m_refs);
+	}
+
+private:
+	void need(size_t n)
+	{
+		if(m_len - m_pos < n)
+			throw SerializationError("deserialize: unexpected end of data");
+	}
+
+	void readValue(int depth)
+	{
+		lua_State *L = m_lua;
+		check_depth(L, depth);
+		need(1);
+		u8 type = m_data[m_pos++];
+		switch(type){
+		case BINARY_NIL:
+			lua_pushnil(L);
+			break;
+		case BINARY_FALSE:
+			lua_pushboolean(L, 0);
+			break;
+		case BINARY_TRUE:
+			lua_pushboolean(L, 1);
+			break;
+		case BINARY_INT:
+			need(4);
+			lua_pushnumber(L, readS32(&m_data[m_pos]));
+			m_pos += 4;
+			break;
+		case BINARY_NUMBER: {
+			need(8);
+			u64 bits = readU64(&m_data[m_pos]);
+			m_pos += 8;
+			double d;
+			memcpy(&d, &bits, sizeof(d));
+			lua_pushnumber(L, d);
+			break;
+		}
+		case BINARY_STRING: {
+			need(4);
+			u32 len = readU32(&m_data[m_pos]);
+			m_pos += 4;
+			need(len);
+			lua_pushlstring(L, (const char*)&m_data[m_pos], len);
+			m_pos += len;
+			break;
+		}
+		case BINARY_TABLE:
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, m_refs, ++m_table_count);
+			for(;;){
+				need(1);
+				if(m_data[m_pos] == BINARY_END){
+					m_pos++;
+					break;
+				}
+				readValue(depth + 1);
+				readValue(depth + 1);
+				if(lua_isnil(L, -2) || (lua_isnumber(L, -2)
+						&& lua_tonumber(L, -2) != lua_tonumber(L, -2)))
+					throw SerializationError("deserialize: invalid table key");
+				lua_rawset(L, -3);
+			}
+			break;
+		case BINARY_REF: {
+			need(4);
+			u32 id = readU32(&m_data[m_pos]);
+			m_pos += 4;
+			if(id == 0 || id > m_table_count)
+				throw SerializationError("deserialize: invalid table reference");
+			lua_rawgeti(L, m_refs, id);
+			break;
+		}
+		default:
+			throw SerializationError("deserialize: invalid value type");
+		}
+	}
+
+	lua_State *m_lua;
+	const u8 *m_data;
+	size_t m_len;
+	size_t m_pos;
+	// Stack index of a table holding the tables by number
+	int m_refs;
+	u32 m_table_count;
+};
+
+// serialize(value) -> string
+int l_serialize(lua_State *L)
+{
+	lua_settop(L, 1);
+	bool failed = false;
+	{
+		LuaTextSerializer serializer(L);
+		std::string s;
+		try{
+			s = serializer.serialize(1);
+		}
+		catch(SerializationError &e){
+			failed = true;
+			s = e.what();
+		}
+		lua_settop(L, 1);
+		lua_pushlstring(L, s.c_str(), s.size());
+	}
+	if(failed)
+		return lua_error(L);
+	return 1;
+}
+
+// serialize_binary(value) -> string
+int l_serialize_binary(lua_State *L)
+{
+	lua_settop(L, 1);
+	bool failed = false;
+	{
+		LuaBinarySerializer serializer(L);
+		std::string s;
+		try{
+			s = serializer.serialize(1);
+		}
+		catch(SerializationError &e){
+			failed = true;
+			s = e.what();
+		}
+		lua_settop(L, 1);
+		lua_pushlstring(L, s.c_str(), s.size());
+	}
+	if(failed)
+		return lua_error(L);
+	return 1;
+}
+
+// deserialize(string) -> value
+// Reads the output of both serialize and serialize_binary.
+int l_deserialize(lua_State *L)
+{
+	size_t len;
+	const char *data = luaL_checklstring(L, 1, &len);
+	lua_settop(L, 1);
+
+	if(len >= 1 && data[0] == 0){
+		try{
+			LuaBinaryDeserializer deserializer(L, data, len);
+			deserializer.deserialize();
+			return 1;
+		}
+		catch(SerializationError &e){
+			errorstream<<"minetest.deserialize: "<<e.what()<<std::endl;
+			lua_settop(L, 1);
+			lua_pushnil(L);
+			return 1;
+		}
+	}
+
+	LuaTextDeserializer deserializer(L, data, len);
+	if(deserializer.deserialize())
+		return 1;
+
+	/*
+		Not in the format written by serialize; load it as Lua code in an
+		environment holding only the table library, like it was done
+		before serialize was implemented in C++.
+	*/
+	if(len >= 1 && data[0] == 27){
+		// Binary bytecode prohibited
+		lua_pushnil(L);
+		return 1;
+	}
+	int err = luaL_loadbuffer(L, data, len, data);
+	if(err == 0){
+		lua_getglobal(L, "table");
+		lua_setfenv(L, -2);
+		err = lua_pcall(L, 0, 1, 0);
+	}
+	if(err != 0){
+		errorstream<<"minetest.deserialize: "<<lua_tostring(L, -1)<<std::endl;
+		lua_settop(L, 1);
+		lua_pushnil(L);
+	}
+	return 1;
+}
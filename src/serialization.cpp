@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serialization.h"
 
 #include "util/serialize.h"
+#include <cstring> // memcpy, memset
 #ifdef _WIN32
 	#define ZLIB_WINAPI
 #endif
@@ -55,52 +56,16 @@ void zerr(int ret)
 
 void compressZlib(SharedBuffer<u8> data, std::ostream &os)
 {
-	z_stream z;
-	const s32 bufsize = 16384;
-	char output_buffer[bufsize];
-	int status = 0;
-	int ret;
-
-	z.zalloc = Z_NULL;
-	z.zfree = Z_NULL;
-	z.opaque = Z_NULL;
-
-	ret = deflateInit(&z, -1);
-	if(ret != Z_OK)
-		throw SerializationError("compressZlib: deflateInit failed");
-	
-	// Point zlib to our input buffer
-	z.next_in = (Bytef*)&data[0];
-	z.avail_in = data.getSize();
-	// And get all output
-	for(;;)
-	{
-		z.next_out = (Bytef*)output_buffer;
-		z.avail_out = bufsize;
-		
-		status = deflate(&z, Z_FINISH);
-		if(status == Z_NEED_DICT || status == Z_DATA_ERROR
-				|| status == Z_MEM_ERROR)
-		{
-			zerr(status);
-			throw SerializationError("compressZlib: deflate failed");
-		}
-		int count = bufsize - z.avail_out;
-		if(count)
-			os.write(output_buffer, count);
-		// This determines zlib has given all output
-		if(status == Z_STREAM_END)
-			break;
-	}
-
-	deflateEnd(&z);
-
+	BufferWriter buf;
+	compressZlib(*data, data.getSize(), buf);
+	os.write((const char*)buf.data(), buf.size());
 }
 
 void compressZlib(const std::string &data, std::ostream &os)
 {
-	SharedBuffer<u8> databuf((u8*)data.c_str(), data.size());
-	compressZlib(databuf, os);
+	BufferWriter buf;
+	compressZlib((const u8*)data.c_str(), data.size(), buf);
+	os.write((const char*)buf.data(), buf.size());
 }
 
 void decompressZlib(std::istream &is, std::ostream &os)
@@ -185,27 +150,337 @@ void decompressZlib(std::istream &is, std::ostream &os)
 	inflateEnd(&z);
 }
 
-void compress(SharedBuffer<u8> data, std::ostream &os, u8 version)
+void compressZlib(const u8 *data, u32 size, BufferWriter &os)
 {
+	z_stream z;
+	int status = 0;
+	int ret;
+
+	z.zalloc = Z_NULL;
+	z.zfree = Z_NULL;
+	z.opaque = Z_NULL;
+
+	ret = deflateInit(&z, -1);
+	if(ret != Z_OK)
+		throw SerializationError("compressZlib: deflateInit failed");
+
+	// deflateBound() is enough room to finish in a single call
+	u32 start = os.size();
+	u32 bound = deflateBound(&z, size);
+	z.next_in = (Bytef*)data;
+	z.avail_in = size;
+	z.next_out = (Bytef*)os.grow(bound);
+	z.avail_out = bound;
+
+	status = deflate(&z, Z_FINISH);
+	deflateEnd(&z);
+	if(status != Z_STREAM_END)
+	{
+		zerr(status);
+		os.truncate(start);
+		throw SerializationError("compressZlib: deflate failed");
+	}
+	os.truncate(start + bound - z.avail_out);
+}
+
+void decompressZlib(BufferReader &is, BufferWriter &os)
+{
+	z_stream z;
+	const u32 chunksize = 16384;
+	int status = 0;
+	int ret;
+
+	z.zalloc = Z_NULL;
+	z.zfree = Z_NULL;
+	z.opaque = Z_NULL;
+
+	ret = inflateInit(&z);
+	if(ret != Z_OK)
+		throw SerializationError("decompressZlib: inflateInit failed");
+
+	// Inflate straight from the input into the output buffer
+	z.next_in = (Bytef*)is.current();
+	z.avail_in = is.remaining();
+
+	for(;;)
+	{
+		u32 start = os.size();
+		z.next_out = (Bytef*)os.grow(chunksize);
+		z.avail_out = chunksize;
+
+		status = inflate(&z, Z_NO_FLUSH);
+		os.truncate(start + chunksize - z.avail_out);
+
+		if(status == Z_STREAM_END)
+			break;
+		if(status != Z_OK)
+		{
+			inflateEnd(&z);
+			if(status == Z_BUF_ERROR)
+				throw SerializationError("decompressZlib: truncated data");
+			zerr(status);
+			throw SerializationError("decompressZlib: inflate failed");
+		}
+	}
+
+	// Leave the input right after the compressed data
+	is.skip(is.remaining() - z.avail_in);
+	inflateEnd(&z);
+}
+
+/*
+	Fast codec.
+
+	The compressed data is a series of sequences:
+	  u8 token: literal count (high 4 bits), match length - 4 (low 4 bits)
+	  [varint]: literal count - 15 (if the 4 bit field is 15)
+	  literals
+	  u16 match offset (little-endian), absent in the last sequence
+	  [varint]: match length - 19 (if the 4 bit field is 15)
+	varints are 7 bits per byte, low bits first, high bit set if more
+	bytes follow.
+*/
+
+#define FAST_MIN_MATCH 4
+#define FAST_HASH_BITS 12
+#define FAST_MAX_OFFSET 65535
+// Sanity limit for the uncompressed size when reading
+#define FAST_MAX_SIZE (64*1024*1024)
+
+static inline u32 fastRead32(const u8 *p)
+{
+	return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static inline u8* fastWriteLength(u8 *op, u32 len)
+{
+	while(len >= 0x80){
+		*op++ = 0x80 | (len & 0x7f);
+		len >>= 7;
+	}
+	*op++ = len;
+	return op;
+}
+
+static void fastWriteSequence(BufferWriter &os, const u8 *literals,
+		u32 literal_count, u32 offset, u32 match_len)
+{
+	// token + two lengths of at most 5 bytes + offset
+	u32 start = os.size();
+	u8 *op = os.grow(1 + 5 + literal_count + 2 + 5);
+	u8 *begin = op;
+
+	u32 ml = match_len ? match_len - FAST_MIN_MATCH : 0;
+	*op++ = ((literal_count < 15 ? literal_count : 15) << 4)
+			| (ml < 15 ? ml : 15);
+	if(literal_count >= 15)
+		op = fastWriteLength(op, literal_count - 15);
+	if(literal_count != 0)
+		memcpy(op, literals, literal_count);
+	op += literal_count;
+	if(match_len != 0){
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		if(ml >= 15)
+			op = fastWriteLength(op, ml - 15);
+	}
+	os.truncate(start + (op - begin));
+}
+
+void compressFast(const u8 *src, u32 size, BufferWriter &os)
+{
+	// Header is filled in at the end
+	u32 header = os.size();
+	os.reserve(header + 8 + size + size / 128 + 32);
+	os.grow(8);
+
+	u32 table[1 << FAST_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	u32 anchor = 0;
+	u32 i = 0;
+	while(i + FAST_MIN_MATCH <= size)
+	{
+		u32 seq = fastRead32(&src[i]);
+		u32 h = (seq * 2654435761U) >> (32 - FAST_HASH_BITS);
+		u32 candidate = table[h];
+		table[h] = i;
+
+		if(candidate >= i || i - candidate > FAST_MAX_OFFSET
+				|| fastRead32(&src[candidate]) != seq)
+		{
+			// Step faster through data that doesn't compress
+			i += 1 + ((i - anchor) >> 6);
+			continue;
+		}
+
+		u32 len = FAST_MIN_MATCH;
+		while(i + len < size && src[candidate + len] == src[i + len])
+			len++;
+
+		fastWriteSequence(os, &src[anchor], i - anchor, i - candidate, len);
+		i += len;
+		anchor = i;
+	}
+	// The rest as literals
+	fastWriteSequence(os, src + anchor, size - anchor, 0, 0);
+
+	writeU32(os.data() + header, size);
+	writeU32(os.data() + header + 4, os.size() - header - 8);
+}
+
+void compressFast(SharedBuffer<u8> data, std::ostream &os)
+{
+	BufferWriter buf;
+	compressFast(*data, data.getSize(), buf);
+	os.write((const char*)buf.data(), buf.size());
+}
+
+void compressFast(const std::string &data, std::ostream &os)
+{
+	BufferWriter buf;
+	compressFast((const u8*)data.c_str(), data.size(), buf);
+	os.write((const char*)buf.data(), buf.size());
+}
+
+static inline u32 fastReadLength(const u8 *&ip, const u8 *end)
+{
+	u32 len = 0;
+	for(u32 shift=0; shift<32; shift+=7){
+		if(ip == end)
+			throw SerializationError("decompressFast: truncated length");
+		u8 b = *ip++;
+		len |= (u32)(b & 0x7f) << shift;
+		if((b & 0x80) == 0)
+			return len;
+	}
+	throw SerializationError("decompressFast: invalid length");
+}
+
+void decompressFast(BufferReader &is, BufferWriter &os)
+{
+	if(is.remaining() < 8)
+		throw SerializationError("decompressFast: truncated header");
+	const u8 *header = is.read(8);
+	u32 size = readU32(&header[0]);
+	u32 compressed_size = readU32(&header[4]);
+	if(size > FAST_MAX_SIZE || compressed_size > FAST_MAX_SIZE)
+		throw SerializationError("decompressFast: invalid size");
+	if(compressed_size > is.remaining())
+		throw SerializationError("decompressFast: truncated data");
+
+	const u8 *ip = is.read(compressed_size);
+	const u8 *iend = ip + compressed_size;
+	u32 start = os.size();
+	u8 *dst = os.grow(size);
+	u32 op = 0;
+
+	try{
+		while(ip < iend)
+		{
+			u8 token = *ip++;
+
+			u32 literal_count = token >> 4;
+			if(literal_count == 15)
+				literal_count += fastReadLength(ip, iend);
+			if(literal_count > (u32)(iend - ip) || literal_count > size - op)
+				throw SerializationError("decompressFast: literals overflow");
+			memcpy(&dst[op], ip, literal_count);
+			ip += literal_count;
+			op += literal_count;
+
+			// The last sequence has no match
+			if(ip == iend)
+				break;
+
+			if(iend - ip < 2)
+				throw SerializationError("decompressFast: truncated offset");
+			u32 offset = ip[0] | (ip[1] << 8);
+			ip += 2;
+			u32 match_len = (token & 0x0f);
+			if(match_len == 15)
+				match_len += fastReadLength(ip, iend);
+			match_len += FAST_MIN_MATCH;
+			if(offset == 0 || offset > op || match_len > size - op)
+				throw SerializationError("decompressFast: invalid match");
+
+			/*
+				The source may overlap the destination. Copy in pieces
+				no longer than the distance, which doubles every time.
+			*/
+			const u8 *match = &dst[op - offset];
+			u8 *d = &dst[op];
+			u32 left = match_len;
+			while(left > 0){
+				u32 n = d - match;
+				if(n > left)
+					n = left;
+				memcpy(d, match, n);
+				d += n;
+				left -= n;
+			}
+			op += match_len;
+		}
+
+		if(op != size)
+			throw SerializationError("decompressFast: size mismatch");
+	}
+	catch(SerializationError &)
+	{
+		os.truncate(start);
+		throw;
+	}
+}
+
+void decompressFast(std::istream &is, std::ostream &os)
+{
+	// The header tells how much to take from the stream
+	char header[8];
+	is.read(header, 8);
+	if(is.gcount() != 8)
+		throw SerializationError("decompressFast: truncated header");
+	u32 compressed_size = readU32((u8*)&header[4]);
+	if(compressed_size > FAST_MAX_SIZE)
+		throw SerializationError("decompressFast: invalid size");
+
+	std::string in(8 + compressed_size, '\0');
+	memcpy(&in[0], header, 8);
+	if(compressed_size != 0){
+		is.read(&in[8], compressed_size);
+		if((u32)is.gcount() != compressed_size)
+			throw SerializationError("decompressFast: truncated data");
+	}
+
+	BufferReader reader((const u8*)in.data(), in.size());
+	BufferWriter buf;
+	decompressFast(reader, buf);
+	os.write((const char*)buf.data(), buf.size());
+}
+
+void compress(const u8 *data, u32 size, BufferWriter &os, u8 version)
+{
+	if(version >= 26)
+	{
+		compressFast(data, size, os);
+		return;
+	}
+
 	if(version >= 11)
 	{
-		compressZlib(data, os);
+		compressZlib(data, size, os);
 		return;
 	}
 
-	if(data.getSize() == 0)
+	if(size == 0)
 		return;
 	
 	// Write length (u32)
-
-	u8 tmp[4];
-	writeU32(tmp, data.getSize());
-	os.write((char*)tmp, 4);
+	writeU32(os, size);
 	
 	// We will be writing 8-bit pairs of more_count and byte
 	u8 more_count = 0;
 	u8 current_byte = data[0];
-	for(u32 i=1; i<data.getSize(); i++)
+	for(u32 i=1; i<size; i++)
 	{
 		if(
 			data[i] != current_byte
@@ -213,8 +488,8 @@ void compress(SharedBuffer<u8> data, std::ostream &os, u8 version)
 		)
 		{
 			// write count and byte
-			os.write((char*)&more_count, 1);
-			os.write((char*)&current_byte, 1);
+			writeU8(os, more_count);
+			writeU8(os, current_byte);
 			more_count = 0;
 			current_byte = data[i];
 		}
@@ -224,12 +499,32 @@ void compress(SharedBuffer<u8> data, std::ostream &os, u8 version)
 		}
 	}
 	// write count and byte
-	os.write((char*)&more_count, 1);
-	os.write((char*)&current_byte, 1);
+	writeU8(os, more_count);
+	writeU8(os, current_byte);
+}
+
+void compress(SharedBuffer<u8> data, std::ostream &os, u8 version)
+{
+	BufferWriter buf;
+	compress(*data, data.getSize(), buf, version);
+	os.write((const char*)buf.data(), buf.size());
+}
+
+void compress(const std::string &data, std::ostream &os, u8 version)
+{
+	BufferWriter buf;
+	compress((const u8*)data.c_str(), data.size(), buf, version);
+	os.write((const char*)buf.data(), buf.size());
 }
 
 void decompress(std::istream &is, std::ostream &os, u8 version)
 {
+	if(version >= 26)
+	{
+		decompressFast(is, os);
+		return;
+	}
+
 	if(version >= 11)
 	{
 		decompressZlib(is, os);
@@ -266,4 +561,30 @@ void decompress(std::istream &is, std::ostream &os, u8 version)
 	}
 }
 
+void decompress(BufferReader &is, BufferWriter &os, u8 version)
+{
+	if(version >= 26)
+	{
+		decompressFast(is, os);
+		return;
+	}
 
+	if(version >= 11)
+	{
+		decompressZlib(is, os);
+		return;
+	}
+
+	// Read length (u32)
+	u32 len = readU32(is);
+	
+	// We will be reading 8-bit pairs of more_count and byte
+	u32 count = 0;
+	while(count < len)
+	{
+		const u8 *pair = is.read(2);
+		u32 n = (u32)pair[0] + 1;
+		memset(os.grow(n), pair[1], n);
+		count += n;
+	}
+}
@@ -40,6 +40,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "itemdef.h"
 #include "craftdef.h"
 #include "emerge.h"
+#include "mappregen.h"
 #include "mapgen.h"
 #include "biome.h"
 #include "content_mapnode.h"
@@ -276,10 +277,10 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 			Get the border/face dot coordinates of a "d-radiused"
 			box
 		*/
-		std::list<v3s16> list;
+		std::vector<v3s16> list;
 		getFacePositions(list, d);
 
-		std::list<v3s16>::iterator li;
+		std::vector<v3s16>::iterator li;
 		for(li=list.begin(); li!=list.end(); ++li)
 		{
 			v3s16 p = *li + center;
@@ -554,6 +555,90 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 		infostream<<"GetNextBlocks timeout: "<<timer_result<<" (!=0)"<<std::endl;*/
 }
 
+void RemoteClient::PrefetchBlocks(Server *server, float dtime)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	float prefetch_time = g_settings->getFloat("block_prefetch_time");
+	if(prefetch_time <= 0)
+		return;
+
+	m_prefetch_timer += dtime;
+	if(m_prefetch_timer < 0.5)
+		return;
+	float interval = m_prefetch_timer;
+	m_prefetch_timer = 0;
+
+	m_blocks_prefetched_reset_timer += interval;
+	if(m_blocks_prefetched_reset_timer > 20.0)
+	{
+		m_blocks_prefetched_reset_timer = 0;
+		m_blocks_prefetched.clear();
+	}
+
+	Player *player = server->m_env->getPlayer(peer_id);
+	if(player == NULL)
+		return;
+
+	/*
+		The speed is measured from the position, because the speed
+		reported by the client doesn't include carts and other things
+		the player is attached to.
+	*/
+	v3f playerpos = player->getPosition();
+	v3f lastpos = m_prefetch_last_pos;
+	bool lastpos_valid = m_prefetch_last_pos_valid;
+	m_prefetch_last_pos = playerpos;
+	m_prefetch_last_pos_valid = true;
+	if(!lastpos_valid)
+		return;
+
+	s16 d_max = g_settings->getS16("max_block_send_distance");
+	f32 d_max_f = d_max * MAP_BLOCKSIZE * BS;
+
+	v3f playerspeed = (playerpos - lastpos) / interval;
+	f32 speed = playerspeed.getLength();
+	// Walking is slow enough for GetNextBlocks to keep up with
+	if(speed < g_settings->getFloat("movement_speed_walk") * 1.5 * BS)
+		return;
+	// Teleported
+	if(speed * interval > d_max_f)
+		return;
+
+	v3f dir = playerspeed / speed;
+	f32 distance = MYMIN(speed * prefetch_time, d_max_f);
+	v3s16 last_center(-32768,-32768,-32768);
+
+	/*
+		Walk along the predicted path one block at a time, queueing the
+		blocks around it that are not in memory
+	*/
+	for(f32 s = MAP_BLOCKSIZE * BS; s <= distance; s += MAP_BLOCKSIZE * BS)
+	{
+		v3s16 center = getNodeBlockPos(floatToInt(playerpos + dir * s, BS));
+		if(center == last_center)
+			continue;
+		last_center = center;
+
+		for(s16 z=-1; z<=1; z++)
+		for(s16 y=-1; y<=1; y++)
+		for(s16 x=-1; x<=1; x++)
+		{
+			v3s16 p = center + v3s16(x,y,z);
+			if(blockpos_over_limit(p))
+				continue;
+			if(m_blocks_prefetched.find(p) != m_blocks_prefetched.end())
+				continue;
+			if(server->m_env->getMap().getBlockNoCreateNoEx(p) != NULL)
+				continue;
+			// Stop when the prefetch queue of the client is full
+			if(!server->m_emerge->enqueueBlockPrefetch(peer_id, p))
+				return;
+			m_blocks_prefetched.insert(p);
+		}
+	}
+}
+
 void RemoteClient::GotBlock(v3s16 p)
 {
 	if(m_blocks_sending.find(p) != m_blocks_sending.end())
@@ -666,6 +751,7 @@ Server::Server(
 	m_objectdata_timer = 0.0;
 	m_emergethread_trigger_timer = 0.0;
 	m_savemap_timer = 0.0;
+	m_pregen = NULL;
 	m_clients_number = 0;
 
 	m_env_mutex.Init();
@@ -709,6 +795,10 @@ Server::Server(
 	if(!initializeWorld(m_path_world, m_gamespec.id))
 		throw ServerError("Failed to initialize world");
 
+	// Keep map migration and other servers off the world
+	if(!m_world_lock.lock(m_path_world + DIR_DELIM + WORLD_LOCK_FILE))
+		throw ServerError("World is in use by another process");
+
 	ModConfiguration modconf(m_path_world);
 	m_mods = modconf.getMods();
 	std::list<ModSpec> unsatisfied_mods = modconf.getUnsatisfiedMods();
@@ -773,6 +863,9 @@ Server::Server(
 	infostream<<"Server: Initializing Lua"<<std::endl;
 	m_lua = script_init();
 	assert(m_lua);
+	script_set_call_budget(
+			g_settings->getFloat("lua_callback_warn_time") * 1000,
+			g_settings->getFloat("lua_callback_abort_time") * 1000);
 	// Export API
 	scriptapi_export(m_lua, this);
 	// Load and run builtin.lua
@@ -820,7 +913,7 @@ Server::Server(
 	ServerMap *servermap = new ServerMap(path_world, this, m_emerge);
 	m_env = new ServerEnvironment(servermap, m_lua, this, this);
 	
-	m_emerge->initMapgens(servermap->getMapgenParams());
+	m_emerge->initMapgens(servermap->getMapgenParams(), m_nodedef);
 
 	// Give environment reference to scripting api
 	scriptapi_add_environment(m_lua, m_env);
@@ -928,6 +1021,7 @@ Server::~Server()
 	}
 
 	// Delete things in the reverse order of creation
+	delete m_pregen;
 	delete m_env;
 	delete m_rollback;
 	delete m_emerge;
@@ -1102,13 +1196,12 @@ void Server::AsyncRunStep()
 		m_env->step(dtime);
 	}
 
-	const float map_timer_and_unload_dtime = 2.92;
-	if(m_map_timer_and_unload_interval.step(dtime, map_timer_and_unload_dtime))
 	{
 		JMutexAutoLock lock(m_env_mutex);
-		// Run Map's timers and unload unused data
+		// Run Map's timers and unload unused data. This is bounded by
+		// map_unload_time_budget, so it is spread over every step.
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
-		m_env->getMap().timerUpdate(map_timer_and_unload_dtime,
+		m_env->getMap().timerUpdate(dtime,
 				g_settings->getFloat("server_unload_unused_data_timeout"));
 	}
 
@@ -1170,7 +1263,11 @@ void Server::AsyncRunStep()
 		ScopeProfiler sp(g_profiler, "Server: liquid transform");
 
 		std::map<v3s16, MapBlock*> modified_blocks;
-		m_env->getMap().transformLiquids(modified_blocks);
+		u32 liquid_processed = m_env->getMap().transformLiquids(modified_blocks);
+		g_profiler->avg("Server: liquid queue length",
+				m_env->getMap().transforming_liquid_size());
+		g_profiler->avg("Server: liquid nodes/s",
+				liquid_processed / m_liquid_transform_every);
 #if 0
 		/*
 			Update lighting
@@ -1667,6 +1764,20 @@ void Server::AsyncRunStep()
 		}
 	}
 
+	/*
+		Generate an area ahead of time
+	*/
+	if(m_pregen)
+	{
+		JMutexAutoLock lock(m_env_mutex);
+		ScopeProfiler sp(g_profiler, "Server: pregeneration");
+		m_pregen->step(dtime);
+		if(m_pregen->isDone()){
+			delete m_pregen;
+			m_pregen = NULL;
+		}
+	}
+
 	// Save map, players and auth stuff
 	{
 		float &counter = m_savemap_timer;
@@ -3940,18 +4051,16 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 		Create a packet with the block in the right format
 	*/
 
-	std::ostringstream os(std::ios_base::binary);
+	BufferWriter os;
+	u8 *header = os.grow(8);
+	writeU16(&header[0], TOCLIENT_BLOCKDATA);
+	writeS16(&header[2], p.X);
+	writeS16(&header[4], p.Y);
+	writeS16(&header[6], p.Z);
 	block->serialize(os, ver, false);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
 
-	u32 replysize = 8 + blockdata.getSize();
-	SharedBuffer<u8> reply(replysize);
-	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
-	writeS16(&reply[2], p.X);
-	writeS16(&reply[4], p.Y);
-	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+	u32 replysize = os.size();
+	SharedBuffer<u8> reply(os.data(), replysize);
 
 	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
 			<<":  \tpacket size: "<<replysize<<std::endl;*/
@@ -3995,6 +4104,13 @@ void Server::SendBlocks(float dtime)
 			if(client->serialization_version == SER_FMT_VER_INVALID)
 				continue;
 
+			// For ordering the emerge queues by distance
+			Player *player = m_env->getPlayer(client->peer_id);
+			if(player)
+				m_emerge->setPeerPosition(client->peer_id, getNodeBlockPos(
+						floatToInt(player->getPosition(), BS)));
+
+			client->PrefetchBlocks(this, dtime);
 			client->GetNextBlocks(this, dtime, queue);
 		}
 	}
@@ -4033,12 +4149,96 @@ void Server::SendBlocks(float dtime)
 	}
 }
 
+/*
+	The media hash cache stores the checksum of each media file together
+	with the size and modification time it had when hashed, so that
+	unchanged files need not be read and hashed at every startup.
+
+	Format, one file per line:
+	<sha1 in base64> <size> <mtime> <path>
+*/
+struct MediaHashCacheEntry
+{
+	u64 size;
+	u64 mtime;
+	std::string sha1_digest;
+};
+
+static void readMediaHashCache(const std::string &cachepath,
+		std::map<std::string, MediaHashCacheEntry> &cache)
+{
+	std::ifstream is(cachepath.c_str(), std::ios_base::binary);
+	if(!is.good())
+		return;
+	std::string line;
+	while(std::getline(is, line)){
+		if(line.empty() || line[0] == '#')
+			continue;
+		std::istringstream ls(line, std::ios_base::binary);
+		MediaHashCacheEntry entry;
+		std::string path;
+		ls>>entry.sha1_digest>>entry.size>>entry.mtime;
+		if(ls.fail() || ls.get() != ' ')
+			continue;
+		std::getline(ls, path);
+		if(path.empty())
+			continue;
+		cache[path] = entry;
+	}
+}
+
+static void writeMediaHashCache(const std::string &cachepath,
+		const std::map<std::string, MediaHashCacheEntry> &cache)
+{
+	std::ofstream os(cachepath.c_str(), std::ios_base::binary);
+	if(!os.good()){
+		errorstream<<"Server: Could not write media hash cache \""
+				<<cachepath<<"\""<<std::endl;
+		return;
+	}
+	os<<"# Media checksum cache; safe to delete"<<std::endl;
+	for(std::map<std::string, MediaHashCacheEntry>::const_iterator
+			i = cache.begin(); i != cache.end(); i++){
+		const MediaHashCacheEntry &entry = i->second;
+		os<<entry.sha1_digest<<" "<<entry.size<<" "<<entry.mtime
+				<<" "<<i->first<<"\n";
+	}
+}
+
+// Media files of up to this size are kept in memory. Larger ones are
+// read from disk whenever they are sent, so that a server with lots of
+// big sound files doesn't hold them all.
+#define MEDIA_CACHE_FILE_MAX 65536
+
+// Reads exactly size bytes of the file at path into data
+static bool readMediaFile(const std::string &path, u32 size,
+		std::string &data)
+{
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	if(!is.good())
+		return false;
+	data.resize(size);
+	is.read(&data[0], size);
+	if((u32)is.gcount() != size){
+		data.clear();
+		return false;
+	}
+	return true;
+}
+
 void Server::fillMediaCache()
 {
 	DSTACK(__FUNCTION_NAME);
 
 	infostream<<"Server: Calculating media file checksums"<<std::endl;
 
+	// Load checksums calculated by earlier runs
+	std::string cachepath = m_path_world + DIR_DELIM + "media_hashes.txt";
+	std::map<std::string, MediaHashCacheEntry> hashcache;
+	readMediaHashCache(cachepath, hashcache);
+	std::map<std::string, MediaHashCacheEntry> new_hashcache;
+	u32 num_hashed = 0;
+
 	// Collect all media file paths
 	std::list<std::string> paths;
 	for(std::vector<ModSpec>::iterator i = m_mods.begin();
@@ -4081,53 +4281,70 @@ void Server::fillMediaCache()
 						<<filename<<"\""<<std::endl;
 				continue;
 			}
-			// Ok, attempt to load the file and add to cache
+			// Ok, attempt to read the file and add to cache
 			std::string filepath = mediapath + DIR_DELIM + filename;
-			// Read data
-			std::ifstream fis(filepath.c_str(), std::ios_base::binary);
-			if(fis.good() == false){
+			u64 filesize = 0;
+			u64 filemtime = 0;
+			if(!fs::GetFileInfo(filepath, filesize, filemtime)){
 				errorstream<<"Server::fillMediaCache(): Could not open \""
 						<<filename<<"\" for reading"<<std::endl;
 				continue;
 			}
-			std::ostringstream tmp_os(std::ios_base::binary);
-			bool bad = false;
-			for(;;){
-				char buf[1024];
-				fis.read(buf, 1024);
-				std::streamsize len = fis.gcount();
-				tmp_os.write(buf, len);
-				if(fis.eof())
-					break;
-				if(!fis.good()){
-					bad = true;
-					break;
-				}
-			}
-			if(bad){
-				errorstream<<"Server::fillMediaCache(): Failed to read \""
-						<<filename<<"\""<<std::endl;
+			if(filesize == 0 || filesize > 0xffffffff){
+				errorstream<<"Server::fillMediaCache(): Empty or too large "
+						<<"file \""<<filepath<<"\""<<std::endl;
 				continue;
 			}
-			if(tmp_os.str().length() == 0){
-				errorstream<<"Server::fillMediaCache(): Empty file \""
-						<<filepath<<"\""<<std::endl;
-				continue;
-			}
-
-			SHA1 sha1;
-			sha1.addBytes(tmp_os.str().c_str(), tmp_os.str().length());
-
-			unsigned char *digest = sha1.getDigest();
-			std::string sha1_base64 = base64_encode(digest, 20);
-			std::string sha1_hex = hex_encode((char*)digest, 20);
-			free(digest);
 
-			// Put in list
-			this->m_media[filename] = MediaInfo(filepath, sha1_base64);
-			verbosestream<<"Server: "<<sha1_hex<<" is "<<filename<<std::endl;
+			// Use the cached checksum if the file has not changed
+			MediaHashCacheEntry entry;
+			std::map<std::string, MediaHashCacheEntry>::iterator
+					cached = hashcache.find(filepath);
+			bool hashed = (cached != hashcache.end() &&
+					cached->second.size == filesize &&
+					cached->second.mtime == filemtime);
+			std::string filedata;
+			if(!hashed || filesize <= MEDIA_CACHE_FILE_MAX){
+				if(!readMediaFile(filepath, filesize, filedata)){
+					errorstream<<"Server::fillMediaCache(): Failed to read \""
+							<<filename<<"\""<<std::endl;
+					continue;
+				}
+			}
+			if(hashed){
+				entry = cached->second;
+			} else {
+				SHA1 sha1;
+				sha1.addBytes(filedata.c_str(), filedata.size());
+				unsigned char *digest = sha1.getDigest();
+				entry.sha1_digest = base64_encode(digest, 20);
+				free(digest);
+				entry.size = filesize;
+				entry.mtime = filemtime;
+				num_hashed++;
+			}
+			new_hashcache[filepath] = entry;
+
+			// Put in list; a file of the same name found later replaces
+			// the earlier one
+			MediaInfo &info = this->m_media[filename];
+			info = MediaInfo(filepath, entry.sha1_digest,
+					filesize, filemtime);
+			if(filesize <= MEDIA_CACHE_FILE_MAX)
+				info.data.swap(filedata);
+			verbosestream<<"Server: "<<entry.sha1_digest<<" is "
+					<<filename<<std::endl;
 		}
 	}
+
+	infostream<<"Server: "<<m_media.size()<<" media files, "
+			<<num_hashed<<" hashed"<<std::endl;
+
+	// Only rewrite the cache if something changed
+	bool cache_changed = (num_hashed != 0 ||
+			new_hashcache.size() != hashcache.size());
+	if(cache_changed)
+		writeMediaHashCache(cachepath, new_hashcache);
 }
 
 struct SendableMediaAnnouncement
@@ -4191,20 +4408,6 @@ void Server::sendMediaAnnouncement(u16 peer_id)
 	m_con.Send(peer_id, 0, data, true);
 }
 
-struct SendableMedia
-{
-	std::string name;
-	std::string path;
-	std::string data;
-
-	SendableMedia(const std::string &name_="", const std::string path_="",
-			const std::string &data_=""):
-		name(name_),
-		path(path_),
-		data(data_)
-	{}
-};
-
 void Server::sendRequestedMedia(u16 peer_id,
 		const std::list<MediaRequest> &tosend)
 {
@@ -4213,67 +4416,36 @@ void Server::sendRequestedMedia(u16 peer_id,
 	verbosestream<<"Server::sendRequestedMedia(): "
 			<<"Sending files to client"<<std::endl;
 
-	/* Read files */
+	/* Split files into bunches */
 
 	// Put 5kB in one bunch (this is not accurate)
 	u32 bytes_per_bunch = 5000;
 
-	std::vector< std::list<SendableMedia> > file_bunches;
-	file_bunches.push_back(std::list<SendableMedia>());
+	typedef std::map<std::string, MediaInfo>::const_iterator MediaIter;
+	std::vector< std::list<MediaIter> > file_bunches;
+	file_bunches.push_back(std::list<MediaIter>());
 
 	u32 file_size_bunch_total = 0;
 
 	for(std::list<MediaRequest>::const_iterator i = tosend.begin();
 			i != tosend.end(); ++i)
 	{
-		if(m_media.find(i->name) == m_media.end()){
+		MediaIter n = m_media.find(i->name);
+		if(n == m_media.end()){
 			errorstream<<"Server::sendRequestedMedia(): Client asked for "
 					<<"unknown file \""<<(i->name)<<"\""<<std::endl;
 			continue;
 		}
 
-		//TODO get path + name
-		std::string tpath = m_media[(*i).name].path;
-
-		// Read data
-		std::ifstream fis(tpath.c_str(), std::ios_base::binary);
-		if(fis.good() == false){
-			errorstream<<"Server::sendRequestedMedia(): Could not open \""
-					<<tpath<<"\" for reading"<<std::endl;
-			continue;
-		}
-		std::ostringstream tmp_os(std::ios_base::binary);
-		bool bad = false;
-		for(;;){
-			char buf[1024];
-			fis.read(buf, 1024);
-			std::streamsize len = fis.gcount();
-			tmp_os.write(buf, len);
-			file_size_bunch_total += len;
-			if(fis.eof())
-				break;
-			if(!fis.good()){
-				bad = true;
-				break;
-			}
-		}
-		if(bad){
-			errorstream<<"Server::sendRequestedMedia(): Failed to read \""
-					<<(*i).name<<"\""<<std::endl;
-			continue;
-		}
-		/*infostream<<"Server::sendRequestedMedia(): Loaded \""
-				<<tname<<"\""<<std::endl;*/
 		// Put in list
-		file_bunches[file_bunches.size()-1].push_back(
-				SendableMedia((*i).name, tpath, tmp_os.str()));
+		file_bunches.back().push_back(n);
+		file_size_bunch_total += n->second.size;
 
 		// Start next bunch if got enough data
 		if(file_size_bunch_total >= bytes_per_bunch){
-			file_bunches.push_back(std::list<SendableMedia>());
+			file_bunches.push_back(std::list<MediaIter>());
 			file_size_bunch_total = 0;
 		}
-
 	}
 
 	/* Create and send packets */
@@ -4281,7 +4453,41 @@ void Server::sendRequestedMedia(u16 peer_id,
 	u32 num_bunches = file_bunches.size();
 	for(u32 i=0; i<num_bunches; i++)
 	{
-		std::ostringstream os(std::ios_base::binary);
+		/*
+			Get the contents of the files of the bunch. Files that are
+			not kept in memory are read now; if one has changed on disk
+			since it was hashed, it is left out, as its contents would
+			not match the announced checksum.
+		*/
+		std::list<std::string> read_data;
+		std::vector< std::pair<std::string, const std::string*> > files;
+		u32 bunch_size = 0;
+		for(std::list<MediaIter>::iterator
+				j = file_bunches[i].begin();
+				j != file_bunches[i].end(); ++j){
+			const std::string &name = (*j)->first;
+			const MediaInfo &info = (*j)->second;
+			const std::string *filedata = &info.data;
+			if(filedata->empty()){
+				u64 size = 0;
+				u64 mtime = 0;
+				read_data.push_back(std::string());
+				if(!fs::GetFileInfo(info.path, size, mtime) ||
+						size != info.size || mtime != info.mtime ||
+						!readMediaFile(info.path, info.size,
+								read_data.back())){
+					errorstream<<"Server::sendRequestedMedia(): \""<<name
+							<<"\" has changed on disk; not sending it"
+							<<std::endl;
+					read_data.pop_back();
+					continue;
+				}
+				filedata = &read_data.back();
+			}
+			files.push_back(std::make_pair(name, filedata));
+			// u16 name length, name, u32 data length, data
+			bunch_size += 2 + name.size() + 4 + filedata->size();
+		}
 
 		/*
 			u16 command
@@ -4296,25 +4502,28 @@ void Server::sendRequestedMedia(u16 peer_id,
 			}
 		*/
 
-		writeU16(os, TOCLIENT_MEDIA);
-		writeU16(os, num_bunches);
-		writeU16(os, i);
-		writeU32(os, file_bunches[i].size());
-
-		for(std::list<SendableMedia>::iterator
-				j = file_bunches[i].begin();
-				j != file_bunches[i].end(); ++j){
-			os<<serializeString(j->name);
-			os<<serializeLongString(j->data);
+		// Write the packet directly into its final buffer
+		SharedBuffer<u8> data(2 + 2 + 2 + 4 + bunch_size);
+		u8 *p = *data;
+		writeU16(p, TOCLIENT_MEDIA); p += 2;
+		writeU16(p, num_bunches); p += 2;
+		writeU16(p, i); p += 2;
+		writeU32(p, files.size()); p += 4;
+
+		for(u32 j=0; j<files.size(); j++){
+			const std::string &name = files[j].first;
+			const std::string &filedata = *files[j].second;
+			writeU16(p, name.size()); p += 2;
+			memcpy(p, name.c_str(), name.size()); p += name.size();
+			writeU32(p, filedata.size()); p += 4;
+			memcpy(p, filedata.c_str(), filedata.size());
+			p += filedata.size();
 		}
 
-		// Make data buffer
-		std::string s = os.str();
 		verbosestream<<"Server::sendRequestedMedia(): bunch "
 				<<i<<"/"<<num_bunches
-				<<" files="<<file_bunches[i].size()
-				<<" size=" <<s.size()<<std::endl;
-		SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+				<<" files="<<files.size()
+				<<" size=" <<data.getSize()<<std::endl;
 		// Send as reliable
 		m_con.Send(peer_id, 0, data, true);
 	}
@@ -4668,6 +4877,17 @@ void Server::queueBlockEmerge(v3s16 blockpos, bool allow_generate)
 	m_emerge->enqueueBlockEmerge(PEER_ID_INEXISTENT, blockpos, allow_generate);
 }
 
+bool Server::startPregeneration(v3s16 minp, v3s16 maxp)
+{
+	if(m_pregen)
+		return false;
+	v3s16 p1(MYMIN(minp.X, maxp.X), MYMIN(minp.Y, maxp.Y), MYMIN(minp.Z, maxp.Z));
+	v3s16 p2(MYMAX(minp.X, maxp.X), MYMAX(minp.Y, maxp.Y), MYMAX(minp.Z, maxp.Z));
+	m_pregen = new MapPregenerator(m_emerge, &m_env->getServerMap(),
+			getNodeBlockPos(p1), getNodeBlockPos(p2));
+	return true;
+}
+
 Inventory* Server::createDetachedInventory(const std::string &name)
 {
 	if(m_detached_inventories.count(name) > 0){
@@ -5087,6 +5307,7 @@ void Server::handlePeerChange(PeerChange &c)
 		// Delete client
 		delete m_clients[c.peer_id];
 		m_clients.erase(c.peer_id);
+		m_emerge->removePeer(c.peer_id);
 
 		// Send player info to all remaining clients
 		//SendPlayerInfos();
@@ -5162,4 +5383,27 @@ void dedicated_server_loop(Server &server, bool &kill)
 	}
 }
 
+void pregeneration_loop(Server &server, bool &kill)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	verbosestream<<"pregeneration_loop()"<<std::endl;
+
+	while(server.isPregenerating())
+	{
+		float steplen = g_settings->getFloat("dedicated_server_step");
+		sleep_ms((int)(steplen*1000.0));
+		// Throws if an emerge thread has failed
+		server.step(steplen);
+		// Nobody can connect, so the server thread isn't needed
+		server.AsyncRunStep();
+
+		if(server.getShutdownRequested() || kill)
+		{
+			infostream<<"Pregeneration interrupted"<<std::endl;
+			break;
+		}
+	}
+}
+
 
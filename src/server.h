@@ -36,6 +36,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "sound.h"
 #include "util/thread.h"
 #include "util/string.h"
+#include "filesys.h" // FileLock
 #include "rollback_interface.h" // Needed for rollbackRevertActions()
 #include <list> // Needed for rollbackRevertActions()
 #include <algorithm>
@@ -51,6 +52,7 @@ class EventManager;
 class PlayerSAO;
 class IRollbackManager;
 class EmergeManager;
+class MapPregenerator;
 
 class ServerError : public std::exception
 {
@@ -189,11 +191,19 @@ struct MediaInfo
 {
 	std::string path;
 	std::string sha1_digest;
+	// Size and modification time of the file when it was hashed
+	u32 size;
+	u64 mtime;
+	// Contents of small files; larger files are read from disk when sent
+	std::string data;
 
 	MediaInfo(const std::string path_="",
-			const std::string sha1_digest_=""):
+			const std::string sha1_digest_="",
+			u32 size_=0, u64 mtime_=0):
 		path(path_),
-		sha1_digest(sha1_digest_)
+		sha1_digest(sha1_digest_),
+		size(size_),
+		mtime(mtime_)
 	{
 	}
 };
@@ -261,6 +271,9 @@ class RemoteClient
 		m_nearest_unsent_reset_timer = 0.0;
 		m_nothing_to_send_counter = 0;
 		m_nothing_to_send_pause_timer = 0;
+		m_prefetch_timer = 0.0;
+		m_prefetch_last_pos_valid = false;
+		m_blocks_prefetched_reset_timer = 0.0;
 	}
 	~RemoteClient()
 	{
@@ -274,6 +287,13 @@ class RemoteClient
 	void GetNextBlocks(Server *server, float dtime,
 			std::vector<PrioritySortedBlockTransfer> &dest);
 
+	/*
+		Queues blocks ahead of a fast moving player to be loaded from
+		disk, so that they are in memory when GetNextBlocks gets to them.
+		Environment should be locked when this is called.
+	*/
+	void PrefetchBlocks(Server *server, float dtime);
+
 	void GotBlock(v3s16 p);
 
 	void SentBlock(v3s16 p);
@@ -354,6 +374,18 @@ class RemoteClient
 	// CPU usage optimization
 	u32 m_nothing_to_send_counter;
 	float m_nothing_to_send_pause_timer;
+
+	/*
+		Movement of the player is sampled at a slow interval for
+		prefetching. Blocks that have been queued for prefetching are
+		remembered for a while so that the ones that don't exist on
+		disk are not asked for over and over again.
+	*/
+	float m_prefetch_timer;
+	v3f m_prefetch_last_pos;
+	bool m_prefetch_last_pos_valid;
+	std::set<v3s16> m_blocks_prefetched;
+	float m_blocks_prefetched_reset_timer;
 };
 
 class Server : public con::PeerHandler, public MapEventReceiver,
@@ -488,6 +520,12 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	void queueBlockEmerge(v3s16 blockpos, bool allow_generate);
 
+	// Starts generating an area, in nodes. False if already generating one.
+	// Environment must be locked when called, if the server is running
+	bool startPregeneration(v3s16 minp, v3s16 maxp);
+	bool isPregenerating()
+	{ return m_pregen != NULL; }
+
 	// Creates or resets inventory
 	Inventory* createDetachedInventory(const std::string &name);
 
@@ -688,6 +726,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// World directory
 	std::string m_path_world;
+	// Held while the server runs; see WORLD_LOCK_FILE
+	fs::FileLock m_world_lock;
 	// Path to user's configuration file ("" = no configuration file)
 	std::string m_path_config;
 	// Subgame specification
@@ -707,7 +747,6 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	float m_objectdata_timer;
 	float m_emergethread_trigger_timer;
 	float m_savemap_timer;
-	IntervalLimiter m_map_timer_and_unload_interval;
 
 	// NOTE: If connection and environment are both to be locked,
 	// environment shall be locked first.
@@ -733,6 +772,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// Emerge manager
 	EmergeManager *m_emerge;
+	// Area being generated ahead of time, or NULL
+	MapPregenerator *m_pregen;
 
 	// Biome Definition Manager
 	BiomeDefManager *m_biomedef;
@@ -868,5 +909,11 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 */
 void dedicated_server_loop(Server &server, bool &run);
 
+/*
+	Runs the server without a network connection until the area given to
+	startPregeneration() has been generated
+*/
+void pregeneration_loop(Server &server, bool &kill);
+
 #endif
 
@@ -20,17 +20,26 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "staticobject.h"
 #include "util/serialize.h"
 
-void StaticObject::serialize(std::ostream &os)
+void StaticObject::serialize(BufferWriter &os)
 {
-	char buf[12];
 	// type
-	buf[0] = type;
-	os.write(buf, 1);
+	writeU8(os, type);
 	// pos
-	writeV3S32((u8*)buf, v3s32(pos.X*1000,pos.Y*1000,pos.Z*1000));
-	os.write(buf, 12);
+	writeV3S32(os, v3s32(pos.X*1000,pos.Y*1000,pos.Z*1000));
 	// data
-	os<<serializeString(data);
+	serializeString(os, data);
+}
+void StaticObject::deSerialize(BufferReader &is, u8 version)
+{
+	// type
+	type = readU8(is);
+	// pos
+	v3s32 intp = readV3S32(is);
+	pos.X = (f32)intp.X/1000;
+	pos.Y = (f32)intp.Y/1000;
+	pos.Z = (f32)intp.Z/1000;
+	// data
+	data = deSerializeString(is);
 }
 void StaticObject::deSerialize(std::istream &is, u8 version)
 {
@@ -48,16 +57,13 @@ void StaticObject::deSerialize(std::istream &is, u8 version)
 	data = deSerializeString(is);
 }
 
-void StaticObjectList::serialize(std::ostream &os)
+void StaticObjectList::serialize(BufferWriter &os)
 {
-	char buf[12];
 	// version
-	buf[0] = 0;
-	os.write(buf, 1);
+	writeU8(os, 0);
 	// count
 	u16 count = m_stored.size() + m_active.size();
-	writeU16((u8*)buf, count);
-	os.write(buf, 2);
+	writeU16(os, count);
 	for(std::list<StaticObject>::iterator
 			i = m_stored.begin();
 			i != m_stored.end(); ++i)
@@ -69,10 +75,23 @@ void StaticObjectList::serialize(std::ostream &os)
 			i = m_active.begin();
 			i != m_active.end(); ++i)
 	{
-		StaticObject s_obj = i->second;
+		StaticObject &s_obj = i->second;
 		s_obj.serialize(os);
 	}
 }
+void StaticObjectList::deSerialize(BufferReader &is)
+{
+	// version
+	u8 version = readU8(is);
+	// count
+	u16 count = readU16(is);
+	for(u16 i=0; i<count; i++)
+	{
+		StaticObject s_obj;
+		s_obj.deSerialize(is, version);
+		m_stored.push_back(s_obj);
+	}
+}
 void StaticObjectList::deSerialize(std::istream &is)
 {
 	char buf[12];
@@ -27,6 +27,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <map>
 #include "debug.h"
 
+class BufferWriter;
+class BufferReader;
+
 struct StaticObject
 {
 	u8 type;
@@ -45,7 +48,8 @@ struct StaticObject
 	{
 	}
 
-	void serialize(std::ostream &os);
+	void serialize(BufferWriter &os);
+	void deSerialize(BufferReader &is, u8 version);
 	void deSerialize(std::istream &is, u8 version);
 };
 
@@ -87,7 +91,9 @@ class StaticObjectList
 		m_active.erase(id);
 	}
 
-	void serialize(std::ostream &os);
+	void serialize(BufferWriter &os);
+	void deSerialize(BufferReader &is);
+	// For the pre-22 MapBlock format, which is read from a stream
 	void deSerialize(std::istream &is);
 	
 	/*
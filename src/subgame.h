@@ -98,5 +98,8 @@ std::vector<WorldSpec> getAvailableWorlds();
 // Create world directory and world.mt if they don't exist
 bool initializeWorld(const std::string &path, const std::string &gameid);
 
+// Locked (fs::FileLock) by the process that works on a world
+#define WORLD_LOCK_FILE "world.lock"
+
 #endif
 
@@ -33,6 +33,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h"
 #include "nodedef.h"
 #include "mapsector.h"
+#include "gamedef.h"
+#include "mapblock.h"
+#include "mapblockindex.h"
 #include "settings.h"
 #include "log.h"
 #include "util/string.h"
@@ -40,8 +43,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "inventory.h"
 #include "util/numeric.h"
 #include "util/serialize.h"
+#include "util/container.h"
 #include "noise.h" // PseudoRandom used for random data for compression
 #include "clientserver.h" // LATEST_PROTOCOL_VERSION
+#include "emerge.h"
 #include <algorithm>
 
 /*
@@ -171,6 +176,47 @@ struct TestUtilities: public TestBase
 	}
 };
 
+struct TestUniqueQueue: public TestBase
+{
+	void Run()
+	{
+		UniqueQueue<v3s16> q;
+		UASSERT(q.empty());
+		UASSERT(q.push_back(v3s16(1,2,3)) == true);
+		UASSERT(q.push_back(v3s16(1,2,3)) == false);
+		UASSERT(q.push_back(v3s16(-1,2,3)) == true);
+		UASSERT(q.size() == 2);
+		UASSERT(q.pop_front() == v3s16(1,2,3));
+		// Popped values can be queued again
+		UASSERT(q.push_back(v3s16(1,2,3)) == true);
+		UASSERT(q.pop_front() == v3s16(-1,2,3));
+		UASSERT(q.pop_front() == v3s16(1,2,3));
+		UASSERT(q.empty());
+
+		// Interleave pushes and pops so that both the ring buffer
+		// and the hash set wrap around and grow
+		u32 next_push = 0;
+		u32 next_pop = 0;
+		for(u32 round = 0; round < 50; round++){
+			for(u32 i = 0; i < 100; i++, next_push++){
+				v3s16 p(next_push % 37, next_push / 37, -(s16)(next_push % 5));
+				UASSERT(q.push_back(p) == true);
+				UASSERT(q.push_back(p) == false);
+			}
+			for(u32 i = 0; i < 60; i++, next_pop++){
+				v3s16 p(next_pop % 37, next_pop / 37, -(s16)(next_pop % 5));
+				UASSERT(q.pop_front() == p);
+			}
+		}
+		UASSERT(q.size() == next_push - next_pop);
+
+		q.clear();
+		UASSERT(q.empty());
+		UASSERT(q.push_back(v3s16(0,0,0)) == true);
+		UASSERT(q.size() == 1);
+	}
+};
+
 struct TestSettings: public TestBase
 {
 	void Run()
@@ -471,6 +517,77 @@ struct TestCompress: public TestBase
 						i, str_decompressed[i], i, data_in[i]);
 			}
 		}
+
+		// Test the fast codec with runs, repeats and noise, followed
+		// by other data that must be left in the stream
+		{
+			std::string data_in;
+			PseudoRandom pseudorandom(1234);
+			for(u32 i=0; i<20000; i++){
+				if(i % 5000 < 2000)
+					data_in += (char)(i / 5000);
+				else if(i % 5000 < 3000)
+					data_in += (char)pseudorandom.range(0,255);
+				else
+					data_in += data_in[i - 700];
+			}
+			std::ostringstream os_compressed(std::ios::binary);
+			compressFast(data_in, os_compressed);
+			UASSERT(os_compressed.str().size() < data_in.size() / 2);
+			os_compressed<<"tail";
+			std::istringstream is_compressed(os_compressed.str(), std::ios::binary);
+			std::ostringstream os_decompressed(std::ios::binary);
+			decompressFast(is_compressed, os_decompressed);
+			UASSERT(os_decompressed.str() == data_in);
+			std::string tail;
+			is_compressed>>tail;
+			UASSERT(tail == "tail");
+
+			// Empty input
+			std::ostringstream os_empty(std::ios::binary);
+			compressFast(std::string(), os_empty);
+			std::istringstream is_empty(os_empty.str(), std::ios::binary);
+			std::ostringstream os_empty2(std::ios::binary);
+			decompressFast(is_empty, os_empty2);
+			UASSERT(os_empty2.str().empty());
+		}
+
+		// Test compressing into and out of memory buffers with every
+		// codec; each must stop exactly at the end of its own data
+		{
+			std::string data_in;
+			for(u32 i=0; i<5000; i++)
+				data_in += (char)((i * i) % 23);
+			u8 versions[3] = {10, 25, SER_FMT_VER_HIGHEST};
+			for(u32 k=0; k<3; k++)
+			{
+				BufferWriter os;
+				writeU16(os, 0x1234);
+				compress((const u8*)data_in.c_str(), data_in.size(),
+						os, versions[k]);
+				serializeString(os, "tail");
+				BufferReader is(os.data(), os.size());
+				UASSERT(readU16(is) == 0x1234);
+				BufferWriter decompressed;
+				decompress(is, decompressed, versions[k]);
+				UASSERT(decompressed.str() == data_in);
+				UASSERT(deSerializeString(is) == "tail");
+				UASSERT(is.remaining() == 0);
+				// Reading more throws instead of reading past the end
+				bool thrown = false;
+				try{
+					readU8(is);
+				}catch(SerializationError &e){
+					thrown = true;
+				}
+				UASSERT(thrown);
+				// The streaming versions produce the same data
+				std::ostringstream os_stream(std::ios::binary);
+				compress(data_in, os_stream, versions[k]);
+				UASSERT(os.str().substr(2, os_stream.str().size())
+						== os_stream.str());
+			}
+		}
 	}
 };
 
@@ -1141,6 +1258,293 @@ struct TestMapSector: public TestBase
 };
 #endif
 
+struct TestMapBlockIndex: public TestBase
+{
+	static MapBlock* fakeBlock(v3s16 p)
+	{
+		// Never dereferenced; only needs to be unique and non-NULL
+		return (MapBlock*)(size_t)(1 + (p.X + 100) +
+				(p.Y + 100) * 200 + (p.Z + 100) * 40000);
+	}
+
+	void Run()
+	{
+		MapBlockIndex index;
+		v3s16 p;
+		// Enough to grow the table several times
+		for(p.X=-10; p.X<10; p.X++)
+		for(p.Y=-3; p.Y<3; p.Y++)
+		for(p.Z=-10; p.Z<10; p.Z++)
+			index.insert(p, fakeBlock(p));
+		UASSERT(index.size() == 20*6*20);
+		UASSERT(index.get(v3s16(-10,-3,-10)) == fakeBlock(v3s16(-10,-3,-10)));
+		UASSERT(index.get(v3s16(9,2,9)) == fakeBlock(v3s16(9,2,9)));
+		UASSERT(index.get(v3s16(10,0,0)) == NULL);
+		UASSERT(index.get(v3s16(-32768,-32768,-32768)) == NULL);
+
+		// Remove every other block, including ones in the thread cache
+		for(p.X=-10; p.X<10; p.X++)
+		for(p.Y=-3; p.Y<3; p.Y++)
+		for(p.Z=-10; p.Z<10; p.Z++)
+			if((p.X + p.Y + p.Z) & 1)
+				index.remove(p);
+		UASSERT(index.size() == 20*6*20/2);
+		for(p.X=-10; p.X<10; p.X++)
+		for(p.Y=-3; p.Y<3; p.Y++)
+		for(p.Z=-10; p.Z<10; p.Z++){
+			MapBlock *expected = ((p.X + p.Y + p.Z) & 1) ?
+					NULL : fakeBlock(p);
+			UASSERT(index.get(p) == expected);
+		}
+
+		index.clear();
+		UASSERT(index.size() == 0);
+		UASSERT(index.get(v3s16(0,0,0)) == NULL);
+	}
+};
+
+struct TestMapBlockStorage: public TestBase
+{
+	// Writes n distinct nodes (repeating) into both b and ref
+	static void fill(MapBlock &b, MapNode *ref, u32 n)
+	{
+		u32 i = 0;
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++, i++){
+			MapNode node((i * 7) % n, i % 3, 0);
+			b.setNodeNoCheck(x, y, z, node);
+			ref[i] = node;
+		}
+	}
+
+	static bool matches(MapBlock &b, MapNode *ref)
+	{
+		u32 i = 0;
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++, i++){
+			MapNode node = b.getNodeNoCheck(x, y, z);
+			if(!(node == ref[i]))
+				return false;
+		}
+		return true;
+	}
+
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(0,0,0), NULL);
+		MapNode ref[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+
+		// New blocks are a single value
+		UASSERT(b.isCompact());
+		UASSERT(b.getNodeStorageSize() == sizeof(MapNode));
+		UASSERT(b.getNode(v3s16(1,2,3)).getContent() == CONTENT_IGNORE);
+
+		// Promoted to 4 and then 8 bit indexes by setNode
+		fill(b, ref, 5);
+		UASSERT(b.isCompact());
+		UASSERT(b.getNodeStorageSize() < 4096);
+		UASSERT(matches(b, ref));
+		fill(b, ref, 80);
+		UASSERT(b.isCompact());
+		UASSERT(matches(b, ref));
+
+		// Too many distinct nodes for a palette
+		fill(b, ref, 1000);
+		UASSERT(!b.isCompact());
+		UASSERT(matches(b, ref));
+		UASSERT(!b.compact());
+
+		// Compacting again once there are few
+		fill(b, ref, 2);
+		UASSERT(b.compact());
+		UASSERT(b.getNodeStorageSize() < 4096);
+		UASSERT(matches(b, ref));
+
+		// Copying to a VoxelManipulator doesn't expand it
+		fill(b, ref, 5);
+		UASSERT(b.compact());
+		VoxelManipulator v;
+		v.addArea(VoxelArea(v3s16(-1,-1,-1), v3s16(MAP_BLOCKSIZE,
+				MAP_BLOCKSIZE, MAP_BLOCKSIZE)));
+		b.copyTo(v);
+		UASSERT(b.isCompact());
+		u32 i = 0;
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++, i++)
+			UASSERT(v.getNode(v3s16(x,y,z)) == ref[i]);
+
+		// Raw access switches to a full array with the same nodes
+		MapNode *data = b.getData();
+		UASSERT(data != NULL);
+		UASSERT(!b.isCompact());
+		for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+			UASSERT(data[i] == ref[i]);
+	}
+};
+
+/*
+	Game definitions of a few test nodes, for tests that need an IGameDef
+*/
+class TestGameDef : public IGameDef
+{
+public:
+	TestGameDef()
+	{
+		m_nodedef = createNodeDefManager();
+		ContentFeatures f;
+		f.name = "test:stone";
+		m_nodedef->set(f.name, f);
+
+		f = ContentFeatures();
+		f.name = "test:water_source";
+		f.walkable = false;
+		f.liquid_type = LIQUID_SOURCE;
+		f.liquid_alternative_flowing = "test:water_flowing";
+		f.liquid_alternative_source = "test:water_source";
+		m_nodedef->set(f.name, f);
+
+		f.name = "test:water_flowing";
+		f.liquid_type = LIQUID_FLOWING;
+		f.param_type_2 = CPT2_FLOWINGLIQUID;
+		m_nodedef->set(f.name, f);
+	}
+	~TestGameDef()
+	{
+		delete m_nodedef;
+	}
+
+	IItemDefManager* getItemDefManager(){ return NULL; }
+	INodeDefManager* getNodeDefManager(){ return m_nodedef; }
+	ICraftDefManager* getCraftDefManager(){ return NULL; }
+	ITextureSource* getTextureSource(){ return NULL; }
+	IShaderSource* getShaderSource(){ return NULL; }
+	u16 allocateUnknownNodeId(const std::string &name)
+	{ return m_nodedef->allocateDummy(name); }
+	ISoundManager* getSoundManager(){ return NULL; }
+	MtEventManager* getEventManager(){ return NULL; }
+
+private:
+	IWritableNodeDefManager *m_nodedef;
+};
+
+/*
+	Checks how far liquids flow in one run of Map::transformLiquids
+*/
+struct TestLiquidFlow: public TestBase
+{
+	// A map of one block of air on a floor of stone
+	class LiquidMap : public Map
+	{
+	public:
+		LiquidMap(IGameDef *gamedef):
+			Map(dstream, gamedef)
+		{
+			ServerMapSector *sector = new ServerMapSector(this,
+					v2s16(0,0), gamedef);
+			m_sectors[v2s16(0,0)] = sector;
+			sector->createBlankBlock(0);
+
+			MapNode air(CONTENT_AIR);
+			MapNode stone(gamedef->ndef()->getId("test:stone"));
+			v3s16 p;
+			for(p.Z=0; p.Z<MAP_BLOCKSIZE; p.Z++)
+			for(p.Y=0; p.Y<MAP_BLOCKSIZE; p.Y++)
+			for(p.X=0; p.X<MAP_BLOCKSIZE; p.X++)
+				setNode(p, p.Y == 0 ? stone : air);
+		}
+	};
+
+	void Run()
+	{
+		TestGameDef gamedef;
+		INodeDefManager *ndef = gamedef.ndef();
+		content_t c_source = ndef->getId("test:water_source");
+		content_t c_flowing = ndef->getId("test:water_flowing");
+		LiquidMap map(&gamedef);
+		std::map<v3s16, MapBlock*> modified_blocks;
+
+		MapNode source(c_source);
+		map.setNode(v3s16(1,1,1), source);
+		map.transforming_liquid_add(v3s16(2,1,1));
+		map.transforming_liquid_add(v3s16(3,1,1));
+
+		/*
+			The nodes are updated in queue order, so (3,1,1) already
+			sees the flowing liquid (2,1,1) turned into in the same run
+		*/
+		UASSERT(map.transformLiquids(modified_blocks) == 2);
+		MapNode n = map.getNodeNoEx(v3s16(2,1,1));
+		UASSERT(n.getContent() == c_flowing);
+		UASSERT((n.param2 & LIQUID_LEVEL_MASK) == LIQUID_LEVEL_MAX);
+		n = map.getNodeNoEx(v3s16(3,1,1));
+		UASSERT(n.getContent() == c_flowing);
+		UASSERT((n.param2 & LIQUID_LEVEL_MASK) == LIQUID_LEVEL_MAX - 1);
+		UASSERT(map.getNodeNoEx(v3s16(4,1,1)).getContent() == CONTENT_AIR);
+		UASSERT(!modified_blocks.empty());
+
+		// The next run goes on from the new edge of the flow
+		map.transformLiquids(modified_blocks);
+		n = map.getNodeNoEx(v3s16(4,1,1));
+		UASSERT(n.getContent() == c_flowing);
+		UASSERT((n.param2 & LIQUID_LEVEL_MASK) == LIQUID_LEVEL_MAX - 2);
+	}
+};
+
+/*
+	Checks the order in which an emerge thread takes the requests out of
+	its queue
+*/
+struct TestEmergeQueue: public TestBase
+{
+	void add(EmergeManager &emerge, std::list<v3s16> &queue, v3s16 p,
+			u16 peer_id, u8 flags)
+	{
+		BlockEmergeData *bedata = new BlockEmergeData;
+		bedata->peer_requested = peer_id;
+		bedata->flags = flags;
+		emerge.blocks_enqueued[p] = bedata;
+		if(flags & BLOCK_EMERGE_PREFETCH)
+			emerge.peer_prefetch_count[peer_id]++;
+		else
+			emerge.peer_queue_count[peer_id]++;
+		queue.push_back(p);
+	}
+
+	void Run()
+	{
+		TestGameDef gamedef;
+		EmergeManager emerge(&gamedef, NULL);
+		std::list<v3s16> queue;
+		emerge.setPeerPosition(1, v3s16(0,0,0));
+
+		// Pregenerated, prefetched and asked for by a player
+		add(emerge, queue, v3s16(0,0,0), PEER_ID_INEXISTENT,
+				BLOCK_EMERGE_ALLOWGEN);
+		add(emerge, queue, v3s16(2,0,0), 1, BLOCK_EMERGE_PREFETCH);
+		add(emerge, queue, v3s16(5,0,0), 1, BLOCK_EMERGE_ALLOWGEN);
+		add(emerge, queue, v3s16(0,1,0), PEER_ID_INEXISTENT,
+				BLOCK_EMERGE_ALLOWGEN);
+		add(emerge, queue, v3s16(1,0,0), 1, BLOCK_EMERGE_ALLOWGEN);
+
+		v3s16 order[] = {
+			v3s16(1,0,0), v3s16(5,0,0), v3s16(2,0,0),
+			v3s16(0,0,0), v3s16(0,1,0)
+		};
+		for(u32 i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+		{
+			v3s16 p;
+			u8 flags;
+			UASSERT(emerge.popBlockEmerge(queue, &p, &flags));
+			UTEST(p == order[i], "request %u: (%d,%d,%d)", i, p.X, p.Y, p.Z);
+		}
+		UASSERT(queue.empty());
+		UASSERT(emerge.blocks_enqueued.empty());
+	}
+};
+
 struct TestCollision: public TestBase
 {
 	void Run()
@@ -1755,6 +2159,7 @@ void run_tests()
 
 	infostream<<"run_tests() started"<<std::endl;
 	TEST(TestUtilities);
+	TEST(TestUniqueQueue);
 	TEST(TestSettings);
 	TEST(TestCompress);
 	TEST(TestSerialization);
@@ -1765,6 +2170,10 @@ void run_tests()
 	TESTPARAMS(TestInventory, idef);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
+	TEST(TestMapBlockIndex);
+	TEST(TestMapBlockStorage);
+	TEST(TestLiquidFlow);
+	TEST(TestEmergeQueue);
 	TEST(TestCollision);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
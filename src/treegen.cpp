@@ -19,12 +19,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irr_v3d.h"
 #include <stack>
+#include <sstream>
 #include "util/numeric.h"
 #include "util/mathconstants.h"
 #include "map.h"
 #include "environment.h"
 #include "nodedef.h"
 #include "treegen.h"
+#include "log.h"
+#include "debug.h"
+#include "jmutexautolock.h"
 
 namespace treegen
 {
@@ -111,16 +115,12 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
 	}
 }
 
-// L-System tree LUA spawner
-void spawn_ltree(ServerEnvironment *env, v3s16 p0, INodeDefManager *ndef, TreeDef tree_definition)
+// Updates the lighting of the blocks trees were placed in and sends them
+static void finish_ltree_placement(ServerMap *map,
+		std::map<v3s16, MapBlock*> &modified_blocks)
 {
-	ServerMap *map = &env->getServerMap();
-	std::map<v3s16, MapBlock*> modified_blocks;
-	ManualMapVoxelManipulator vmanip(map);
-	v3s16 tree_blockp = getNodeBlockPos(p0);
-	vmanip.initialEmerge(tree_blockp - v3s16(1,1,1), tree_blockp + v3s16(1,3,1));
-	make_ltree (vmanip, p0, ndef, tree_definition);
-	vmanip.blitBackAll(&modified_blocks);
+	if (modified_blocks.empty())
+		return;
 
 	// update lighting
 	std::map<v3s16, MapBlock*> lighting_modified_blocks;
@@ -138,42 +138,104 @@ void spawn_ltree(ServerEnvironment *env, v3s16 p0, INodeDefManager *ndef, TreeDe
 	map->dispatchEvent(&event);
 }
 
+// L-System tree LUA spawner
+void spawn_ltree(ServerEnvironment *env, v3s16 p0, INodeDefManager *ndef, TreeDef tree_definition)
+{
+	ServerMap *map = &env->getServerMap();
+	std::map<v3s16, MapBlock*> modified_blocks;
+	std::vector<TreeNodePlacement> nodes;
+	make_ltree_nodes(nodes, p0, MapNode(ndef->getId("mapgen_dirt")),
+			tree_definition, NULL);
+	place_ltree_nodes(map, p0, nodes, modified_blocks);
+	finish_ltree_placement(map, modified_blocks);
+}
+
+void place_ltree_nodes(ServerMap *map, v3s16 p0,
+		const std::vector<TreeNodePlacement> &nodes,
+		std::map<v3s16, MapBlock*> &modified_blocks)
+{
+	if (nodes.empty())
+		return;
+
+	// Only emerge the blocks the tree is in, of the ones around p0 it
+	// may grow into
+	v3s16 tree_blockp = getNodeBlockPos(p0);
+	v3s16 area_min = tree_blockp - v3s16(1,1,1);
+	v3s16 area_max = tree_blockp + v3s16(1,3,1);
+	v3s16 nodes_min = nodes[0].p;
+	v3s16 nodes_max = nodes[0].p;
+	for(u32 i=1; i<nodes.size(); i++)
+	{
+		const v3s16 &p = nodes[i].p;
+		nodes_min.X = MYMIN(nodes_min.X, p.X);
+		nodes_min.Y = MYMIN(nodes_min.Y, p.Y);
+		nodes_min.Z = MYMIN(nodes_min.Z, p.Z);
+		nodes_max.X = MYMAX(nodes_max.X, p.X);
+		nodes_max.Y = MYMAX(nodes_max.Y, p.Y);
+		nodes_max.Z = MYMAX(nodes_max.Z, p.Z);
+	}
+	v3s16 blockp_min = getNodeBlockPos(nodes_min);
+	v3s16 blockp_max = getNodeBlockPos(nodes_max);
+	blockp_min.X = MYMAX(blockp_min.X, area_min.X);
+	blockp_min.Y = MYMAX(blockp_min.Y, area_min.Y);
+	blockp_min.Z = MYMAX(blockp_min.Z, area_min.Z);
+	blockp_max.X = MYMIN(blockp_max.X, area_max.X);
+	blockp_max.Y = MYMIN(blockp_max.Y, area_max.Y);
+	blockp_max.Z = MYMIN(blockp_max.Z, area_max.Z);
+	if (blockp_min.X > blockp_max.X || blockp_min.Y > blockp_max.Y ||
+			blockp_min.Z > blockp_max.Z)
+		return;
+
+	ManualMapVoxelManipulator vmanip(map);
+	vmanip.initialEmerge(blockp_min, blockp_max);
+	place_ltree_nodes(vmanip, nodes);
+	vmanip.blitBackAll(&modified_blocks);
+}
+
+void place_ltree_nodes(ManualMapVoxelManipulator &vmanip,
+		const std::vector<TreeNodePlacement> &nodes)
+{
+	for(u32 i=0; i<nodes.size(); i++)
+	{
+		const TreeNodePlacement &node = nodes[i];
+		if(vmanip.m_area.contains(node.p) == false)
+			continue;
+		u32 vi = vmanip.m_area.index(node.p);
+		if(vmanip.m_data[vi].getContent() != CONTENT_AIR
+				&& vmanip.m_data[vi].getContent() != CONTENT_IGNORE)
+			continue;
+		vmanip.m_data[vi] = node.n;
+	}
+}
+
 //L-System tree generator
 void make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefManager *ndef,
 		TreeDef tree_definition)
 {
-	MapNode dirtnode(ndef->getId("mapgen_dirt"));
+	std::vector<TreeNodePlacement> nodes;
+	make_ltree_nodes(nodes, p0, MapNode(ndef->getId("mapgen_dirt")),
+			tree_definition, NULL);
+	place_ltree_nodes(vmanip, nodes);
+}
 
-	PseudoRandom ps(tree_definition.seed+14002);
+static bool has_random_rules(const std::string &rules)
+{
+	for(u32 i=0; i<rules.size(); i++)
+		if(rules[i] >= 'a' && rules[i] <= 'd')
+			return true;
+	return false;
+}
+
+static void expand_axiom(std::string &axiom, TreeDef &tree_definition,
+		s16 iterations, PseudoRandom &ps)
+{
 	// chance of inserting abcd rules
 	double prop_a = 9;
 	double prop_b = 8;
 	double prop_c = 7;
 	double prop_d = 6;
 
-	//randomize tree growth level, minimum=2
-	s16 iterations = tree_definition.iterations;
-	if (tree_definition.iterations_random_level>0)
-		iterations -= ps.range(0,tree_definition.iterations_random_level);
-	if (iterations<2)
-		iterations=2;
-
-	s16 MAX_ANGLE_OFFSET = 5;
-	double angle_in_radians = (double)tree_definition.angle*M_PI/180;
-	double angleOffset_in_radians = (s16)(ps.range(0,1)%MAX_ANGLE_OFFSET)*M_PI/180;
-
-	//initialize rotation matrix, position and stacks for branches
-	core::matrix4 rotation;
-	rotation = setRotationAxisRadians(rotation, M_PI/2,v3f(0,0,1));
-	v3f position;
-	position.X = p0.X;
-	position.Y = p0.Y;
-	position.Z = p0.Z;
-	std::stack <core::matrix4> stack_orientation;
-	std::stack <v3f> stack_position;
-
-	//generate axiom
-	std::string axiom = tree_definition.initial_axiom;
+	axiom = tree_definition.initial_axiom;
 	for(s16 i=0; i<iterations; i++)
 	{
 		std::string temp = "";
@@ -217,20 +279,93 @@ void make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefManager *nd
 		}
 		axiom=temp;
 	}
+}
+
+// Up to this many expanded axioms are kept
+#define AXIOM_CACHE_SIZE 64
+
+const std::string &AxiomCache::expand(TreeDef &tree_definition,
+		s16 iterations, PseudoRandom &ps)
+{
+	// Random rules draw from ps, the others expand the same every time
+	if (has_random_rules(tree_definition.initial_axiom) ||
+			has_random_rules(tree_definition.rules_a) ||
+			has_random_rules(tree_definition.rules_b) ||
+			has_random_rules(tree_definition.rules_c) ||
+			has_random_rules(tree_definition.rules_d))
+	{
+		expand_axiom(m_uncached, tree_definition, iterations, ps);
+		return m_uncached;
+	}
+
+	std::ostringstream os(std::ios_base::binary);
+	os<<iterations;
+	const std::string *parts[] = {&tree_definition.initial_axiom,
+		&tree_definition.rules_a, &tree_definition.rules_b,
+		&tree_definition.rules_c, &tree_definition.rules_d};
+	for(u32 i=0; i<5; i++)
+		os<<" "<<parts[i]->size()<<":"<<*parts[i];
+	std::string key = os.str();
+
+	std::map<std::string, std::string>::iterator it = m_axioms.find(key);
+	if (it != m_axioms.end())
+		return it->second;
+
+	if (m_axioms.size() >= AXIOM_CACHE_SIZE)
+		m_axioms.clear();
+	std::string &axiom = m_axioms[key];
+	expand_axiom(axiom, tree_definition, iterations, ps);
+	return axiom;
+}
+
+void make_ltree_nodes(std::vector<TreeNodePlacement> &nodes, v3s16 p0,
+		MapNode dirtnode, TreeDef &tree_definition, AxiomCache *cache)
+{
+	PseudoRandom ps(tree_definition.seed+14002);
+
+	//randomize tree growth level, minimum=2
+	s16 iterations = tree_definition.iterations;
+	if (tree_definition.iterations_random_level>0)
+		iterations -= ps.range(0,tree_definition.iterations_random_level);
+	if (iterations<2)
+		iterations=2;
+
+	s16 MAX_ANGLE_OFFSET = 5;
+	double angle_in_radians = (double)tree_definition.angle*M_PI/180;
+	double angleOffset_in_radians = (s16)(ps.range(0,1)%MAX_ANGLE_OFFSET)*M_PI/180;
+
+	//initialize rotation matrix, position and stacks for branches
+	core::matrix4 rotation;
+	rotation = setRotationAxisRadians(rotation, M_PI/2,v3f(0,0,1));
+	v3f position;
+	position.X = p0.X;
+	position.Y = p0.Y;
+	position.Z = p0.Z;
+	std::stack <core::matrix4> stack_orientation;
+	std::stack <v3f> stack_position;
+
+	//generate axiom
+	std::string expanded;
+	const std::string *axiom_p = &expanded;
+	if (cache)
+		axiom_p = &cache->expand(tree_definition, iterations, ps);
+	else
+		expand_axiom(expanded, tree_definition, iterations, ps);
+	const std::string &axiom = *axiom_p;
 
 	//make sure tree is not floating in the air
 	if (tree_definition.trunk_type == "double")
 	{
-		tree_node_placement(vmanip,v3f(position.X+1,position.Y-1,position.Z),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X,position.Y-1,position.Z+1),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X+1,position.Y-1,position.Z+1),dirtnode);
+		tree_node_placement(nodes,v3f(position.X+1,position.Y-1,position.Z),dirtnode);
+		tree_node_placement(nodes,v3f(position.X,position.Y-1,position.Z+1),dirtnode);
+		tree_node_placement(nodes,v3f(position.X+1,position.Y-1,position.Z+1),dirtnode);
 	}
 	if (tree_definition.trunk_type == "crossed")
 	{
-		tree_node_placement(vmanip,v3f(position.X+1,position.Y-1,position.Z),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X-1,position.Y-1,position.Z),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X,position.Y-1,position.Z+1),dirtnode);
-		tree_node_placement(vmanip,v3f(position.X,position.Y-1,position.Z-1),dirtnode);
+		tree_node_placement(nodes,v3f(position.X+1,position.Y-1,position.Z),dirtnode);
+		tree_node_placement(nodes,v3f(position.X-1,position.Y-1,position.Z),dirtnode);
+		tree_node_placement(nodes,v3f(position.X,position.Y-1,position.Z+1),dirtnode);
+		tree_node_placement(nodes,v3f(position.X,position.Y-1,position.Z-1),dirtnode);
 	}
 
 	/* build tree out of generated axiom
@@ -276,40 +411,40 @@ void make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefManager *nd
 			position+=dir;
 			break;
 		case 'T':
-			tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z),tree_definition);
+			tree_trunk_placement(nodes,v3f(position.X,position.Y,position.Z),tree_definition);
 			if (tree_definition.trunk_type == "double" && !tree_definition.thin_branches)
 			{
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z+1),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z+1),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X+1,position.Y,position.Z),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X,position.Y,position.Z+1),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X+1,position.Y,position.Z+1),tree_definition);
 			}
 			if (tree_definition.trunk_type == "crossed" && !tree_definition.thin_branches)
 			{
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X-1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z+1),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z-1),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X+1,position.Y,position.Z),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X-1,position.Y,position.Z),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X,position.Y,position.Z+1),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X,position.Y,position.Z-1),tree_definition);
 			}
 			dir = v3f(1,0,0);
 			dir = transposeMatrix(rotation,dir);
 			position+=dir;
 			break;
 		case 'F':
-			tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z),tree_definition);
+			tree_trunk_placement(nodes,v3f(position.X,position.Y,position.Z),tree_definition);
 			if ((stack_orientation.empty() && tree_definition.trunk_type == "double") ||
 				(!stack_orientation.empty() && tree_definition.trunk_type == "double" && !tree_definition.thin_branches))
 			{
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z+1),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z+1),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X+1,position.Y,position.Z),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X,position.Y,position.Z+1),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X+1,position.Y,position.Z+1),tree_definition);
 			}
 			if ((stack_orientation.empty() && tree_definition.trunk_type == "crossed") ||
 				(!stack_orientation.empty() && tree_definition.trunk_type == "crossed" && !tree_definition.thin_branches))
 			{
-				tree_trunk_placement(vmanip,v3f(position.X+1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X-1,position.Y,position.Z),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z+1),tree_definition);
-				tree_trunk_placement(vmanip,v3f(position.X,position.Y,position.Z-1),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X+1,position.Y,position.Z),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X-1,position.Y,position.Z),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X,position.Y,position.Z+1),tree_definition);
+				tree_trunk_placement(nodes,v3f(position.X,position.Y,position.Z-1),tree_definition);
 			}
 			if (stack_orientation.empty() == false)
 			{
@@ -319,10 +454,10 @@ void make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefManager *nd
 						for(z=-size; z<=size; z++)
 							if (abs(x) == size && abs(y) == size && abs(z) == size)
 							{
-								tree_leaves_placement(vmanip,v3f(position.X+x+1,position.Y+y,position.Z+z),ps.next(), tree_definition);
-								tree_leaves_placement(vmanip,v3f(position.X+x-1,position.Y+y,position.Z+z),ps.next(), tree_definition);
-								tree_leaves_placement(vmanip,v3f(position.X+x,position.Y+y,position.Z+z+1),ps.next(), tree_definition);
-								tree_leaves_placement(vmanip,v3f(position.X+x,position.Y+y,position.Z+z-1),ps.next(), tree_definition);
+								tree_leaves_placement(nodes,v3f(position.X+x+1,position.Y+y,position.Z+z),ps.next(), tree_definition);
+								tree_leaves_placement(nodes,v3f(position.X+x-1,position.Y+y,position.Z+z),ps.next(), tree_definition);
+								tree_leaves_placement(nodes,v3f(position.X+x,position.Y+y,position.Z+z+1),ps.next(), tree_definition);
+								tree_leaves_placement(nodes,v3f(position.X+x,position.Y+y,position.Z+z-1),ps.next(), tree_definition);
 							}
 			}
 			dir = v3f(1,0,0);
@@ -330,13 +465,13 @@ void make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefManager *nd
 			position+=dir;
 			break;
 		case 'f':
-			tree_single_leaves_placement(vmanip,v3f(position.X,position.Y,position.Z),ps.next() ,tree_definition);
+			tree_single_leaves_placement(nodes,v3f(position.X,position.Y,position.Z),ps.next() ,tree_definition);
 			dir = v3f(1,0,0);
 			dir = transposeMatrix(rotation,dir);
 			position+=dir;
 			break;
 		case 'R':
-			tree_fruit_placement(vmanip,v3f(position.X,position.Y,position.Z),tree_definition);
+			tree_fruit_placement(nodes,v3f(position.X,position.Y,position.Z),tree_definition);
 			dir = v3f(1,0,0);
 			dir = transposeMatrix(rotation,dir);
 			position+=dir;
@@ -389,83 +524,53 @@ void make_ltree(ManualMapVoxelManipulator &vmanip, v3s16 p0, INodeDefManager *nd
 	}
 }
 
-void tree_node_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+void tree_node_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		MapNode node)
 {
 	v3s16 p1 = v3s16(myround(p0.X),myround(p0.Y),myround(p0.Z));
-	if(vmanip.m_area.contains(p1) == false)
-		return;
-	u32 vi = vmanip.m_area.index(p1);
-	if(vmanip.m_data[vi].getContent() != CONTENT_AIR
-			&& vmanip.m_data[vi].getContent() != CONTENT_IGNORE)
-		return;
-	vmanip.m_data[vmanip.m_area.index(p1)] = node;
+	nodes.push_back(TreeNodePlacement(p1, node));
 }
 
-void tree_trunk_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+void tree_trunk_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		TreeDef &tree_definition)
 {
 	v3s16 p1 = v3s16(myround(p0.X),myround(p0.Y),myround(p0.Z));
-	if(vmanip.m_area.contains(p1) == false)
-		return;
-	u32 vi = vmanip.m_area.index(p1);
-	if(vmanip.m_data[vi].getContent() != CONTENT_AIR
-			&& vmanip.m_data[vi].getContent() != CONTENT_IGNORE)
-		return;
-	vmanip.m_data[vmanip.m_area.index(p1)] = tree_definition.trunknode;
+	nodes.push_back(TreeNodePlacement(p1, tree_definition.trunknode));
 }
 
-void tree_leaves_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+void tree_leaves_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		PseudoRandom ps ,TreeDef &tree_definition)
 {
 	MapNode leavesnode=tree_definition.leavesnode;
 	if (ps.range(1,100) > 100-tree_definition.leaves2_chance)
 		leavesnode=tree_definition.leaves2node;
 	v3s16 p1 = v3s16(myround(p0.X),myround(p0.Y),myround(p0.Z));
-	if(vmanip.m_area.contains(p1) == false)
-		return;
-	u32 vi = vmanip.m_area.index(p1);
-	if(vmanip.m_data[vi].getContent() != CONTENT_AIR
-			&& vmanip.m_data[vi].getContent() != CONTENT_IGNORE)
-		return;	
 	if (tree_definition.fruit_chance>0)
 	{
 		if (ps.range(1,100) > 100-tree_definition.fruit_chance)
-			vmanip.m_data[vmanip.m_area.index(p1)] = tree_definition.fruitnode;
+			nodes.push_back(TreeNodePlacement(p1, tree_definition.fruitnode));
 		else
-			vmanip.m_data[vmanip.m_area.index(p1)] = leavesnode;
+			nodes.push_back(TreeNodePlacement(p1, leavesnode));
 	}
 	else if (ps.range(1,100) > 20)
-		vmanip.m_data[vmanip.m_area.index(p1)] = leavesnode;
+		nodes.push_back(TreeNodePlacement(p1, leavesnode));
 }
 
-void tree_single_leaves_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+void tree_single_leaves_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		PseudoRandom ps, TreeDef &tree_definition)
 {
 	MapNode leavesnode=tree_definition.leavesnode;
 	if (ps.range(1,100) > 100-tree_definition.leaves2_chance)
 		leavesnode=tree_definition.leaves2node;
 	v3s16 p1 = v3s16(myround(p0.X),myround(p0.Y),myround(p0.Z));
-	if(vmanip.m_area.contains(p1) == false)
-		return;
-	u32 vi = vmanip.m_area.index(p1);
-	if(vmanip.m_data[vi].getContent() != CONTENT_AIR
-		&& vmanip.m_data[vi].getContent() != CONTENT_IGNORE)
-		return;
-	vmanip.m_data[vmanip.m_area.index(p1)] = leavesnode;
+	nodes.push_back(TreeNodePlacement(p1, leavesnode));
 }
 
-void tree_fruit_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+void tree_fruit_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		TreeDef &tree_definition)
 {
 	v3s16 p1 = v3s16(myround(p0.X),myround(p0.Y),myround(p0.Z));
-	if(vmanip.m_area.contains(p1) == false)
-		return;
-	u32 vi = vmanip.m_area.index(p1);
-	if(vmanip.m_data[vi].getContent() != CONTENT_AIR
-		&& vmanip.m_data[vi].getContent() != CONTENT_IGNORE)
-		return;
-	vmanip.m_data[vmanip.m_area.index(p1)] = tree_definition.fruitnode;
+	nodes.push_back(TreeNodePlacement(p1, tree_definition.fruitnode));
 }
 
 irr::core::matrix4 setRotationAxisRadians(irr::core::matrix4 M, double angle, v3f axis)
@@ -610,4 +715,97 @@ void make_jungletree(VoxelManipulator &vmanip, v3s16 p0,
 	}
 }
 
+/*
+	TreeSpawner
+*/
+
+TreeSpawner::TreeSpawner():
+	SimpleThread()
+{
+	m_mutex.Init();
+}
+
+TreeSpawner::~TreeSpawner()
+{
+	setRun(false);
+	m_event.signal();
+	stop();
+
+	for(std::list<Job *>::iterator i = m_queued.begin();
+			i != m_queued.end(); ++i)
+		delete *i;
+	for(std::list<Job *>::iterator i = m_ready.begin();
+			i != m_ready.end(); ++i)
+		delete *i;
+}
+
+void TreeSpawner::queue(v3s16 p0, const TreeDef &tree_definition,
+		MapNode dirtnode)
+{
+	Job *job = new Job;
+	job->p0 = p0;
+	job->tree_definition = tree_definition;
+	job->dirtnode = dirtnode;
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_queued.push_back(job);
+	}
+	m_event.signal();
+}
+
+void TreeSpawner::placeReady(ServerMap *map)
+{
+	std::list<Job *> ready;
+	{
+		JMutexAutoLock lock(m_mutex);
+		ready.swap(m_ready);
+	}
+	if (ready.empty())
+		return;
+
+	std::map<v3s16, MapBlock*> modified_blocks;
+	for(std::list<Job *>::iterator i = ready.begin();
+			i != ready.end(); ++i)
+	{
+		Job *job = *i;
+		place_ltree_nodes(map, job->p0, job->nodes, modified_blocks);
+		delete job;
+	}
+	finish_ltree_placement(map, modified_blocks);
+}
+
+void *TreeSpawner::Thread()
+{
+	ThreadStarted();
+	log_register_thread("TreeSpawner");
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		Job *job = NULL;
+		{
+			JMutexAutoLock lock(m_mutex);
+			if (!m_queued.empty()) {
+				job = m_queued.front();
+				m_queued.pop_front();
+			}
+		}
+		if (job == NULL) {
+			m_event.wait();
+			continue;
+		}
+
+		make_ltree_nodes(job->nodes, job->p0, job->dirtnode,
+				job->tree_definition, &m_axiom_cache);
+
+		JMutexAutoLock lock(m_mutex);
+		m_ready.push_back(job);
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+	log_deregister_thread();
+	return NULL;
+}
+
 }; // namespace treegen
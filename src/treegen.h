@@ -21,10 +21,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define TREEGEN_HEADER
 
 #include <matrix4.h>
+#include <vector>
+#include <list>
+#include <map>
 #include "noise.h"
+#include "util/thread.h"
 
 class ManualMapVoxelManipulator;
 class INodeDefManager;
+class ServerMap;
+class MapBlock;
 
 
 namespace treegen {
@@ -51,6 +57,35 @@ namespace treegen {
 		int seed;
 	};
 
+	// A node of an L-system tree; it only replaces air and ignore
+	struct TreeNodePlacement {
+		v3s16 p;
+		MapNode n;
+
+		TreeNodePlacement(v3s16 p_, MapNode n_):
+			p(p_),
+			n(n_)
+		{}
+	};
+
+	/*
+		Expanded axioms of the trees whose rules have no random parts
+		(a, b, c and d), by the rules and the number of iterations.
+		Not thread-safe.
+	*/
+	class AxiomCache {
+	public:
+		// Returns the expanded axiom of the tree; only valid until the
+		// next call
+		const std::string &expand(TreeDef &tree_definition,
+			s16 iterations, PseudoRandom &ps);
+
+	private:
+		std::map<std::string, std::string> m_axioms;
+		// Result of the last tree that couldn't be cached
+		std::string m_uncached;
+	};
+
 	// Add default tree
 	void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
 		bool is_apple_tree, INodeDefManager *ndef, int seed);
@@ -65,16 +100,63 @@ namespace treegen {
 	void spawn_ltree (ServerEnvironment *env, v3s16 p0, INodeDefManager *ndef,
 		TreeDef tree_definition);
 
+	// Compute the nodes of an L-systems tree, in the order they are placed,
+	// without looking at the map. cache may be NULL.
+	void make_ltree_nodes(std::vector<TreeNodePlacement> &nodes, v3s16 p0,
+		MapNode dirtnode, TreeDef &tree_definition, AxiomCache *cache);
+	// Place the nodes of an L-systems tree into vmanip
+	void place_ltree_nodes(ManualMapVoxelManipulator &vmanip,
+		const std::vector<TreeNodePlacement> &nodes);
+	// Place the nodes of an L-systems tree grown at p0 on the map; the
+	// changed blocks are added to modified_blocks, without updating
+	// their lighting
+	void place_ltree_nodes(ServerMap *map, v3s16 p0,
+		const std::vector<TreeNodePlacement> &nodes,
+		std::map<v3s16, MapBlock*> &modified_blocks);
+
+	/*
+		Grows L-systems trees on a thread of its own (spawn_tree_async).
+		The thread only computes the nodes of the trees; they are placed
+		on the map by placeReady(), all the trees that are done at once.
+	*/
+	class TreeSpawner : public SimpleThread {
+	public:
+		TreeSpawner();
+		~TreeSpawner();
+
+		// dirtnode is put under the trunk, like make_ltree() does
+		void queue(v3s16 p0, const TreeDef &tree_definition, MapNode dirtnode);
+		// Call with the environment locked
+		void placeReady(ServerMap *map);
+
+		void *Thread();
+
+	private:
+		struct Job {
+			v3s16 p0;
+			TreeDef tree_definition;
+			MapNode dirtnode;
+			std::vector<TreeNodePlacement> nodes;
+		};
+
+		JMutex m_mutex;
+		std::list<Job *> m_queued;
+		std::list<Job *> m_ready;
+		Event m_event;
+		// Only used by the thread
+		AxiomCache m_axiom_cache;
+	};
+
 	// L-System tree gen helper functions
-	void tree_node_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+	void tree_node_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		MapNode node);
-	void tree_trunk_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+	void tree_trunk_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		TreeDef &tree_definition);
-	void tree_leaves_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+	void tree_leaves_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		PseudoRandom ps, TreeDef &tree_definition);
-	void tree_single_leaves_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+	void tree_single_leaves_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		PseudoRandom ps, TreeDef &tree_definition);
-	void tree_fruit_placement(ManualMapVoxelManipulator &vmanip, v3f p0,
+	void tree_fruit_placement(std::vector<TreeNodePlacement> &nodes, v3f p0,
 		TreeDef &tree_definition);
 	irr::core::matrix4 setRotationAxisRadians(irr::core::matrix4 M, double angle, v3f axis);
 
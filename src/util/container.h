@@ -20,58 +20,205 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef UTIL_CONTAINER_HEADER
 #define UTIL_CONTAINER_HEADER
 
-#include "../irrlichttypes.h"
+#include "../irrlichttypes_bloated.h"
 #include <jmutex.h>
 #include <jmutexautolock.h>
 #include "../porting.h" // For sleep_ms
 #include <list>
 #include <vector>
+#include <algorithm>
 
 /*
-	Queue with unique values with fast checking of value existence
+	Hash functions for the hashed containers below
 */
 
 template<typename Value>
+struct ContainerHash;
+
+template<>
+struct ContainerHash<v3s16>
+{
+	u32 operator()(const v3s16 &p) const
+	{
+		u32 h = (u16)p.X | ((u32)(u16)p.Y << 16);
+		h ^= (u32)(u16)p.Z * 0x9E3779B1;
+		h *= 0x85EBCA6B;
+		return h ^ (h >> 16);
+	}
+};
+
+template<>
+struct ContainerHash<v2s16>
+{
+	u32 operator()(const v2s16 &p) const
+	{
+		u32 h = ((u32)(u16)p.X | ((u32)(u16)p.Y << 16)) * 0x9E3779B1;
+		return h ^ (h >> 16);
+	}
+};
+
+template<>
+struct ContainerHash<u32>
+{
+	u32 operator()(const u32 &v) const
+	{
+		u32 h = v * 0x9E3779B1;
+		return h ^ (h >> 16);
+	}
+};
+
+/*
+	Queue with unique values with fast checking of value existence
+
+	Values are kept in a ring buffer in queue order and in an
+	open-addressing hash set for the existence checks. Neither allocates
+	per value; storage only grows, and clear() keeps it for reuse.
+*/
+
+template<typename Value, typename Hash = ContainerHash<Value> >
 class UniqueQueue
 {
 public:
-	
+	UniqueQueue():
+		m_head(0),
+		m_count(0)
+	{
+		reserve(16);
+	}
+
 	/*
 		Does nothing if value is already queued.
 		Return value:
 			true: value added
 			false: value already exists
 	*/
-	bool push_back(Value value)
+	bool push_back(const Value &value)
 	{
+		if((m_count + 1) * 2 > m_slots.size())
+			growSet(m_slots.size() * 2);
+
 		// Check if already exists
-		if(m_map.find(value) != m_map.end())
-			return false;
+		u32 mask = m_slots.size() - 1;
+		u32 i = m_hash(value) & mask;
+		while(m_used[i]){
+			if(m_slots[i] == value)
+				return false;
+			i = (i + 1) & mask;
+		}
 
 		// Add
-		m_map[value] = 0;
-		m_list.push_back(value);
-		
+		m_slots[i] = value;
+		m_used[i] = 1;
+		if(m_count == m_ring.size())
+			growRing(m_ring.size() * 2);
+		m_ring[(m_head + m_count) & (m_ring.size() - 1)] = value;
+		m_count++;
+
 		return true;
 	}
 
 	Value pop_front()
 	{
-		typename std::list<Value>::iterator i = m_list.begin();
-		Value value = *i;
-		m_map.erase(value);
-		m_list.erase(i);
+		assert(m_count != 0);
+		Value value = m_ring[m_head];
+		m_head = (m_head + 1) & (m_ring.size() - 1);
+		m_count--;
+		eraseFromSet(value);
 		return value;
 	}
 
-	u32 size()
+	u32 size() const
+	{
+		return m_count;
+	}
+
+	bool empty() const
+	{
+		return m_count == 0;
+	}
+
+	// Makes room for n values without further allocations
+	void reserve(u32 n)
+	{
+		u32 ring_size = 1;
+		while(ring_size < n)
+			ring_size *= 2;
+		if(ring_size > m_ring.size())
+			growRing(ring_size);
+		if(ring_size * 2 > m_slots.size())
+			growSet(ring_size * 2);
+	}
+
+	// Removes all values but keeps the allocated storage
+	void clear()
 	{
-		return m_map.size();
+		std::fill(m_used.begin(), m_used.end(), 0);
+		m_head = 0;
+		m_count = 0;
 	}
 
 private:
-	std::map<Value, u8> m_map;
-	std::list<Value> m_list;
+	void growRing(u32 size)
+	{
+		std::vector<Value> ring(size);
+		for(u32 i = 0; i < m_count; i++)
+			ring[i] = m_ring[(m_head + i) & (m_ring.size() - 1)];
+		m_ring.swap(ring);
+		m_head = 0;
+	}
+
+	void growSet(u32 size)
+	{
+		std::vector<Value> slots(size);
+		std::vector<u8> used(size, 0);
+		u32 mask = size - 1;
+		for(u32 j = 0; j < m_slots.size(); j++){
+			if(!m_used[j])
+				continue;
+			u32 i = m_hash(m_slots[j]) & mask;
+			while(used[i])
+				i = (i + 1) & mask;
+			slots[i] = m_slots[j];
+			used[i] = 1;
+		}
+		m_slots.swap(slots);
+		m_used.swap(used);
+	}
+
+	void eraseFromSet(const Value &value)
+	{
+		u32 mask = m_slots.size() - 1;
+		u32 i = m_hash(value) & mask;
+		while(!(m_used[i] && m_slots[i] == value))
+			i = (i + 1) & mask;
+		m_used[i] = 0;
+
+		// Shift the rest of the probe chain back over the hole
+		u32 j = i;
+		for(;;){
+			j = (j + 1) & mask;
+			if(!m_used[j])
+				break;
+			u32 home = m_hash(m_slots[j]) & mask;
+			bool in_range = (i < j) ? (home > i && home <= j) :
+					(home > i || home <= j);
+			if(in_range)
+				continue;
+			m_slots[i] = m_slots[j];
+			m_used[i] = 1;
+			m_used[j] = 0;
+			i = j;
+		}
+	}
+
+	Hash m_hash;
+	// Queue order; size is a power of two
+	std::vector<Value> m_ring;
+	u32 m_head;
+	u32 m_count;
+	// Hash set of queued values; size is a power of two
+	std::vector<Value> m_slots;
+	std::vector<u8> m_used;
 };
 
 #if 1
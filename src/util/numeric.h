@@ -26,9 +26,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "../irr_aabb3d.h"
 #include <irrList.h>
 #include <list>
+#include <vector>
 
 // Calculate the borders of a "d-radius" cube
-void getFacePositions(std::list<v3s16> &list, u16 d);
+void getFacePositions(std::vector<v3s16> &list, u16 d);
 
 class IndentationRaiser
 {
@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "../irr_v3d.h"
 #include <iostream>
 #include <string>
+#include <cstring> // memcpy
 #include "../exceptions.h"
 #include "pointer.h"
 
@@ -378,6 +379,247 @@ inline video::SColor readARGB8(std::istream &is)
 	return readARGB8((u8*)buf);
 }
 
+/*
+	Memory buffer serialization
+
+	BufferWriter is a growable byte array that data is serialized into
+	directly, without std::ostringstream and the copies made by its
+	str(). clear() keeps the allocation, so a long-lived instance can
+	be reused for every block that is saved or sent.
+
+	BufferReader reads from memory owned by someone else (a database
+	row, a packet) and throws SerializationError instead of reading
+	past the end.
+*/
+
+class BufferWriter
+{
+public:
+	BufferWriter(u32 capacity=0):
+		m_data(NULL),
+		m_size(0),
+		m_capacity(0)
+	{
+		reserve(capacity);
+	}
+	~BufferWriter()
+	{
+		delete[] m_data;
+	}
+	void reserve(u32 capacity)
+	{
+		if(capacity <= m_capacity)
+			return;
+		u8 *data = new u8[capacity];
+		if(m_size != 0)
+			memcpy(data, m_data, m_size);
+		delete[] m_data;
+		m_data = data;
+		m_capacity = capacity;
+	}
+	// Appends n bytes and returns a pointer to them for filling in.
+	// The pointer is valid until the next call that can grow the buffer.
+	u8* grow(u32 n)
+	{
+		if(n > m_capacity - m_size){
+			u32 capacity = m_capacity * 2;
+			if(capacity < m_size + n)
+				capacity = m_size + n;
+			if(capacity < 256)
+				capacity = 256;
+			reserve(capacity);
+		}
+		u8 *p = m_data + m_size;
+		m_size += n;
+		return p;
+	}
+	// Drops data from the end, eg. the part of grow() that wasn't used
+	void truncate(u32 size)
+	{
+		assert(size <= m_size);
+		m_size = size;
+	}
+	void write(const void *data, u32 n)
+	{
+		if(n != 0)
+			memcpy(grow(n), data, n);
+	}
+	void clear()
+	{
+		m_size = 0;
+	}
+	u8* data()
+	{
+		return m_data;
+	}
+	const u8* data() const
+	{
+		return m_data;
+	}
+	u32 size() const
+	{
+		return m_size;
+	}
+	std::string str() const
+	{
+		return std::string((const char*)m_data, m_size);
+	}
+private:
+	// Not copyable
+	BufferWriter(const BufferWriter &);
+	BufferWriter& operator=(const BufferWriter &);
+
+	u8 *m_data;
+	u32 m_size;
+	u32 m_capacity;
+};
+
+class BufferReader
+{
+public:
+	BufferReader(const u8 *data, u32 size):
+		m_data(data),
+		m_size(size),
+		m_pos(0)
+	{
+	}
+	// Returns a pointer to the next n bytes and moves past them
+	const u8* read(u32 n)
+	{
+		if(n > m_size - m_pos)
+			throw SerializationError("BufferReader: unexpected end of data");
+		const u8 *p = m_data + m_pos;
+		m_pos += n;
+		return p;
+	}
+	void skip(u32 n)
+	{
+		read(n);
+	}
+	// The unread data
+	const u8* current() const
+	{
+		return m_data + m_pos;
+	}
+	u32 remaining() const
+	{
+		return m_size - m_pos;
+	}
+private:
+	const u8 *m_data;
+	u32 m_size;
+	u32 m_pos;
+};
+
+inline void writeU8(BufferWriter &os, u8 p)
+{
+	writeU8(os.grow(1), p);
+}
+
+inline u8 readU8(BufferReader &is)
+{
+	return readU8(is.read(1));
+}
+
+inline void writeU16(BufferWriter &os, u16 p)
+{
+	writeU16(os.grow(2), p);
+}
+
+inline u16 readU16(BufferReader &is)
+{
+	return readU16(is.read(2));
+}
+
+inline void writeU32(BufferWriter &os, u32 p)
+{
+	writeU32(os.grow(4), p);
+}
+
+inline u32 readU32(BufferReader &is)
+{
+	return readU32(is.read(4));
+}
+
+inline void writeS32(BufferWriter &os, s32 p)
+{
+	writeS32(os.grow(4), p);
+}
+
+inline s32 readS32(BufferReader &is)
+{
+	return readS32(is.read(4));
+}
+
+inline void writeF1000(BufferWriter &os, f32 p)
+{
+	writeF1000(os.grow(4), p);
+}
+
+inline f32 readF1000(BufferReader &is)
+{
+	return readF1000(is.read(4));
+}
+
+inline void writeV3S32(BufferWriter &os, v3s32 p)
+{
+	writeV3S32(os.grow(12), p);
+}
+
+inline v3s32 readV3S32(BufferReader &is)
+{
+	return readV3S32(is.read(12));
+}
+
+/*
+	Adapters for code that only knows how to serialize to and from
+	streams (eg. Inventory). They work on the buffers in place.
+*/
+
+// Appends everything written to the stream to a BufferWriter
+class BufferWriterStreamBuf : public std::streambuf
+{
+public:
+	BufferWriterStreamBuf(BufferWriter &os):
+		m_os(os)
+	{
+	}
+protected:
+	int_type overflow(int_type c)
+	{
+		if(c != traits_type::eof())
+			writeU8(m_os, (u8)c);
+		return traits_type::not_eof(c);
+	}
+	std::streamsize xsputn(const char *s, std::streamsize n)
+	{
+		m_os.write(s, n);
+		return n;
+	}
+private:
+	BufferWriter &m_os;
+};
+
+// Reads the unread part of a BufferReader; finish() moves the reader
+// past what was consumed through the stream
+class BufferReaderStreamBuf : public std::streambuf
+{
+public:
+	BufferReaderStreamBuf(BufferReader &is):
+		m_is(is)
+	{
+		char *p = (char*)is.current();
+		setg(p, p, p + is.remaining());
+	}
+	void finish()
+	{
+		m_is.skip(gptr() - eback());
+		setg(gptr(), gptr(), gptr());
+	}
+private:
+	BufferReader &m_is;
+};
+
 /*
 	More serialization stuff
 */
@@ -482,6 +724,36 @@ inline std::string deSerializeLongString(std::istream &is)
 	return s;
 }
 
+// Writes a string with the length as the first two bytes
+inline void serializeString(BufferWriter &os, const std::string &plain)
+{
+	if(plain.size() > 65535)
+		throw SerializationError("String too long for serializeString");
+	writeU16(os, plain.size());
+	os.write(plain.c_str(), plain.size());
+}
+
+// Reads a string with the length as the first two bytes
+inline std::string deSerializeString(BufferReader &is)
+{
+	u16 s_size = readU16(is);
+	return std::string((const char*)is.read(s_size), s_size);
+}
+
+// Writes a string with the length as the first four bytes
+inline void serializeLongString(BufferWriter &os, const std::string &plain)
+{
+	writeU32(os, plain.size());
+	os.write(plain.c_str(), plain.size());
+}
+
+// Reads a string with the length as the first four bytes
+inline std::string deSerializeLongString(BufferReader &is)
+{
+	u32 s_size = readU32(is);
+	return std::string((const char*)is.read(s_size), s_size);
+}
+
 // Creates a string encoded in JSON format (almost equivalent to a C string literal)
 std::string serializeJsonString(const std::string &plain);
 
@@ -19,6 +19,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "voxelalgorithms.h"
 #include "nodedef.h"
+#include "map.h"
+#include "mapblock.h"
+
+#if MAP_BLOCKSIZE != 16
+#error BlockLightSpreader assumes MAP_BLOCKSIZE == 16
+#endif
 
 namespace voxalgo
 {
@@ -153,5 +159,259 @@ SunlightPropagateResult propagateSunlight(VoxelManipulator &v, VoxelArea a,
 	return SunlightPropagateResult(bottom_sunlight_valid);
 }
 
+/*
+	BlockLightSpreader
+*/
+
+// Same order as the dirs[] arrays in Map
+static const v3s16 g_light_dirs[6] = {
+	v3s16(0,0,1), // back
+	v3s16(0,1,0), // top
+	v3s16(1,0,0), // right
+	v3s16(0,0,-1), // front
+	v3s16(0,-1,0), // bottom
+	v3s16(-1,0,0), // left
+};
+// Node index offset and coordinate bit shift of each direction
+static const s32 g_light_dir_offsets[6] = {256, 16, 1, -256, -16, -1};
+static const u8 g_light_dir_shifts[6] = {8, 4, 0, 8, 4, 0};
+
+BlockLightSpreader::BlockLightSpreader(Map *map, INodeDefManager *ndef,
+		enum LightBank bank):
+	m_map(map),
+	m_ndef(ndef),
+	m_bank(bank),
+	m_last_slot(-1)
+{
+}
+
+s32 BlockLightSpreader::getSlot(v3s16 blockpos)
+{
+	if(m_last_slot >= 0 && blockpos == m_last_blockpos)
+		return m_last_slot;
+
+	s32 slot;
+	std::map<v3s16, s32>::iterator i = m_slot_index.find(blockpos);
+	if(i != m_slot_index.end()){
+		slot = i->second;
+	} else {
+		slot = -1;
+		MapBlock *block = m_map->getBlockNoCreateNoEx(blockpos);
+		if(block != NULL && !block->isDummy()){
+			slot = m_slots.size();
+			m_slots.push_back(Slot());
+			Slot &s = m_slots.back();
+			s.block = block;
+			s.data = block->isCompact() ? NULL : block->getData();
+			s.pos = blockpos;
+			for(u16 d=0; d<6; d++)
+				s.neighbors[d] = -2;
+			s.modified = false;
+		}
+		m_slot_index[blockpos] = slot;
+	}
+
+	if(slot >= 0){
+		m_last_blockpos = blockpos;
+		m_last_slot = slot;
+	}
+	return slot;
+}
+
+bool BlockLightSpreader::getRef(v3s16 p, u32 &ref)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	s32 slot = getSlot(blockpos);
+	if(slot < 0)
+		return false;
+	v3s16 rel = p - blockpos * MAP_BLOCKSIZE;
+	ref = ((u32)slot << NODE_BITS) | (rel.Z << 8) | (rel.Y << 4) | rel.X;
+	return true;
+}
+
+bool BlockLightSpreader::getNeighbor(u32 ref, u16 dir, u32 &result)
+{
+	s32 slot = ref >> NODE_BITS;
+	s32 index = ref & NODE_MASK;
+	s32 offset = g_light_dir_offsets[dir];
+	s32 coord = (index >> g_light_dir_shifts[dir]) & (MAP_BLOCKSIZE - 1);
+	bool crosses = offset > 0 ? coord == MAP_BLOCKSIZE - 1 : coord == 0;
+	if(!crosses){
+		result = ref + offset;
+		return true;
+	}
+
+	s32 nslot = m_slots[slot].neighbors[dir];
+	if(nslot == -2){
+		nslot = getSlot(m_slots[slot].pos + g_light_dirs[dir]);
+		m_slots[slot].neighbors[dir] = nslot;
+	}
+	if(nslot < 0)
+		return false;
+	// Wrap around to the opposite face of the neighbor
+	index -= offset * (MAP_BLOCKSIZE - 1);
+	result = ((u32)nslot << NODE_BITS) | index;
+	return true;
+}
+
+v3s16 BlockLightSpreader::getPos(u32 ref)
+{
+	u32 index = ref & NODE_MASK;
+	return m_slots[ref >> NODE_BITS].pos * MAP_BLOCKSIZE
+			+ v3s16(index & 15, (index >> 4) & 15, index >> 8);
+}
+
+MapNode BlockLightSpreader::getNode(u32 ref)
+{
+	Slot &s = m_slots[ref >> NODE_BITS];
+	u32 i = ref & NODE_MASK;
+	if(s.data != NULL)
+		return s.data[i];
+	return s.block->getNodeNoCheck(i & 15, (i >> 4) & 15, i >> 8);
+}
+
+void BlockLightSpreader::setLight(u32 ref, u8 light)
+{
+	Slot &s = m_slots[ref >> NODE_BITS];
+	if(s.data == NULL)
+		s.data = s.block->getData();
+	s.data[ref & NODE_MASK].setLight(m_bank, light, m_ndef);
+	s.modified = true;
+}
+
+void BlockLightSpreader::addUnlight(v3s16 p, u8 oldlight)
+{
+	u32 ref;
+	if(!getRef(p, ref))
+		return;
+	m_unlight.push_back(ref);
+	m_unlight_from.push_back(oldlight);
+}
+
+void BlockLightSpreader::addSource(v3s16 p)
+{
+	u32 ref;
+	if(!getRef(p, ref))
+		return;
+	m_sources.push_back(ref);
+}
+
+void BlockLightSpreader::unspread()
+{
+	for(u32 head=0; head<m_unlight.size(); head++)
+	{
+		u32 ref = m_unlight[head];
+		u8 oldlight = m_unlight_from[head];
+
+		for(u16 dir=0; dir<6; dir++)
+		{
+			u32 ref2;
+			if(!getNeighbor(ref, dir, ref2))
+				continue;
+			MapNode n2 = getNode(ref2);
+			u8 light2 = n2.getLight(m_bank, m_ndef);
+
+			/*
+				If the neighbor is dimmer than this node was and it
+				has some light, it was lit by this node: darken it and
+				carry on from there. Otherwise it may light this area
+				back up.
+			*/
+			if(light2 < oldlight)
+			{
+				if(light2 != 0 && m_ndef->get(n2).light_propagates)
+				{
+					setLight(ref2, 0);
+					m_unlight.push_back(ref2);
+					m_unlight_from.push_back(light2);
+				}
+			}
+			else
+			{
+				m_sources.push_back(ref2);
+			}
+		}
+	}
+	m_unlight.clear();
+	m_unlight_from.clear();
+}
+
+void BlockLightSpreader::spread()
+{
+	std::vector<u32> queue;
+	queue.reserve(m_sources.size());
+	for(u32 i=0; i<m_sources.size(); i++)
+	{
+		u32 ref = m_sources[i];
+		Slot &s = m_slots[ref >> NODE_BITS];
+		if(s.queued[ref & NODE_MASK])
+			continue;
+		s.queued[ref & NODE_MASK] = true;
+		queue.push_back(ref);
+	}
+	m_sources.clear();
+
+	for(u32 head=0; head<queue.size(); head++)
+	{
+		u32 ref = queue[head];
+		m_slots[ref >> NODE_BITS].queued[ref & NODE_MASK] = false;
+
+		u8 oldlight = getNode(ref).getLight(m_bank, m_ndef);
+		u8 newlight = diminish_light(oldlight);
+
+		for(u16 dir=0; dir<6; dir++)
+		{
+			u32 ref2;
+			if(!getNeighbor(ref, dir, ref2))
+				continue;
+			MapNode n2 = getNode(ref2);
+			u8 light2 = n2.getLight(m_bank, m_ndef);
+			Slot &s2 = m_slots[ref2 >> NODE_BITS];
+
+			bool changed = false;
+			/*
+				If the neighbor is brighter than the current node,
+				it will light up this node on its turn
+			*/
+			if(light2 > undiminish_light(oldlight))
+				changed = true;
+			/*
+				If the neighbor is dimmer than how much light this
+				node would spread on it, light it up
+			*/
+			if(light2 < newlight && m_ndef->get(n2).light_propagates)
+			{
+				setLight(ref2, newlight);
+				changed = true;
+			}
+
+			if(changed && !s2.queued[ref2 & NODE_MASK])
+			{
+				s2.queued[ref2 & NODE_MASK] = true;
+				queue.push_back(ref2);
+			}
+		}
+	}
+}
+
+void BlockLightSpreader::getSources(std::set<v3s16> &dst)
+{
+	for(u32 i=0; i<m_sources.size(); i++)
+		dst.insert(getPos(m_sources[i]));
+}
+
+void BlockLightSpreader::finish(std::map<v3s16, MapBlock*> &modified_blocks)
+{
+	for(u32 i=0; i<m_slots.size(); i++)
+	{
+		Slot &s = m_slots[i];
+		if(!s.modified)
+			continue;
+		s.block->raiseModified(MOD_STATE_WRITE_NEEDED, "lighting");
+		modified_blocks[s.pos] = s.block;
+		s.modified = false;
+	}
+}
+
 } // namespace voxalgo
 
@@ -22,8 +22,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "voxel.h"
 #include "mapnode.h"
+#include "constants.h"
 #include <set>
 #include <map>
+#include <vector>
+#include <bitset>
+
+class Map;
+class MapBlock;
 
 namespace voxalgo
 {
@@ -52,6 +58,85 @@ SunlightPropagateResult propagateSunlight(VoxelManipulator &v, VoxelArea a,
 		std::set<v3s16> & light_sources,
 		INodeDefManager *ndef);
 
+/*
+	Flood-fill lighting engine that works directly on the node arrays
+	of loaded MapBlocks.
+
+	All blocks touched by one operation are looked up once and linked
+	to their neighbors, and nodes are referred to by (block slot, node
+	index) pairs kept in plain integer queues. Unloaded and dummy
+	blocks act as walls.
+
+	Usage: add unlight positions and sources, call unspread() and/or
+	spread(), then finish() to flag the touched blocks.
+*/
+class BlockLightSpreader
+{
+public:
+	BlockLightSpreader(Map *map, INodeDefManager *ndef,
+			enum LightBank bank);
+
+	// Darkens the neighbors of p, which had the light value oldlight
+	void addUnlight(v3s16 p, u8 oldlight);
+	// Makes p spread its light to its neighbors
+	void addSource(v3s16 p);
+
+	/*
+		Sets the light of everything lit by the unlight positions to 0.
+		Nodes at the edge of the darkened area that may light it back
+		up become sources.
+	*/
+	void unspread();
+	// Spreads light from the sources until nothing changes
+	void spread();
+
+	// Inserts the positions of the pending sources into dst
+	void getSources(std::set<v3s16> &dst);
+	// Raises the modified state of changed blocks and collects them
+	void finish(std::map<v3s16, MapBlock*> &modified_blocks);
+
+private:
+	// A node reference is (slot << NODE_BITS) | node index
+	enum { NODE_BITS = 12, NODE_MASK = (1 << NODE_BITS) - 1 };
+
+	struct Slot
+	{
+		MapBlock *block;
+		// Node array of the block; NULL while it is compact, as the
+		// block is only switched to a full array when written to
+		MapNode *data;
+		v3s16 pos;
+		// -2 = not looked up yet, -1 = not available
+		s32 neighbors[6];
+		bool modified;
+		std::bitset<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE> queued;
+	};
+
+	// Returns -1 if the block is not available
+	s32 getSlot(v3s16 blockpos);
+	bool getRef(v3s16 p, u32 &ref);
+	// Returns false if the neighbor is not available
+	bool getNeighbor(u32 ref, u16 dir, u32 &result);
+	v3s16 getPos(u32 ref);
+
+	MapNode getNode(u32 ref);
+	// Switches a compact block to a full array
+	void setLight(u32 ref, u8 light);
+
+	Map *m_map;
+	INodeDefManager *m_ndef;
+	enum LightBank m_bank;
+
+	std::vector<Slot> m_slots;
+	std::map<v3s16, s32> m_slot_index;
+	v3s16 m_last_blockpos;
+	s32 m_last_slot;
+
+	std::vector<u32> m_unlight;
+	std::vector<u8> m_unlight_from;
+	std::vector<u32> m_sources;
+};
+
 } // namespace voxalgo
 
 #endif